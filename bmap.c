@@ -0,0 +1,202 @@
+#include <linux/compiler.h>
+#include <linux/err.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+
+#include "bmap.h"
+#include "super.h"
+#include "util.h"
+
+// Look up a block through the direct pointers & indirect block tree
+static int tree_lookup (struct super_block *sb, struct block *iblk, 
+                        __u32 iblock, wlfs_daddr_t *daddr, 
+                        __u32 *count);
+// Look up a block through the extent tree
+static int extent_lookup (struct super_block *sb, struct block *iblk,
+                          __u32 iblock, wlfs_daddr_t *daddr, 
+                          __u32 *count, struct extent *cluster);
+// Read an indirect or extent block belonging to an inode, checking that it
+// is one; returns NULL on failure.  Put the entry once done with it
+static struct meta_entry *read_indirect (struct super_block *sb, 
+                                         wlfs_daddr_t daddr, __u64 ino);
+// Number of pointers from the first on which point to consecutive addresses
+// (or are all 0)
+static __u32 count_run (wlfs_daddr_t const *ptrs, __u32 n);
+// Index of the first extent starting after a block
+static __u16 upper_bound (struct extent const *ext, __u16 n, __u32 iblock);
+
+int wlfs_bmap (struct super_block *sb, struct block *iblk, __u32 iblock,
+               wlfs_daddr_t *daddr, __u32 *count,
+               struct extent *cluster) {
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(iblk);
+
+    cluster->stored = 0;
+    if (inode->flags & WLFS_INODE_EXTENTS) {
+        return extent_lookup(sb, iblk, iblock, daddr, count, cluster);
+    }
+    return tree_lookup(sb, iblk, iblock, daddr, count);
+}
+
+/*
+ * Helper functions
+ */
+
+// The last <indirection> inode pointers are the roots of trees 1, 2, ...
+// levels deep, each covering the blocks after those of the shallower trees
+int tree_lookup (struct super_block *sb, struct block *iblk, __u32 iblock,
+                 wlfs_daddr_t *daddr, __u32 *count) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(iblk);
+    __u32 const direct = NBLOCK_PTR - meta->indirection;
+    __u64 const entries = get_daddr_entries(meta);
+
+    if (iblock < direct) {
+        *daddr = inode->blocks[iblock];
+        *count = count_run(&inode->blocks[iblock], direct - iblock);
+        return 0;
+    }
+
+    // Find the tree covering the block, & the blocks covered by each entry
+    // of its root
+    __u64 rel = iblock - direct;
+    __u64 span = 1;
+    unsigned level = 0;
+    while (rel >= span * entries) {
+        rel -= span * entries;
+        span *= entries;
+        if (++level == meta->indirection) {
+            return -EFBIG;
+        }
+    }
+
+    wlfs_daddr_t ptr = inode->blocks[direct + level];
+    span *= entries;
+    while (true) {
+        if (!ptr) {
+            *daddr = 0;
+            *count = (__u32) min_t(__u64, span - rel, U32_MAX);
+            return 0;
+        }
+        struct meta_entry *entry = read_indirect(sb, ptr, iblk->index);
+        if (unlikely(!entry)) {
+            return -EIO;
+        }
+        wlfs_daddr_t const *ptrs = 
+            (wlfs_daddr_t const *) get_block_data(entry->blk);
+        span /= entries;
+        __u32 const idx = rel / span;
+        rel %= span;
+        if (span == 1) {
+            *daddr = ptrs[idx];
+            *count = count_run(&ptrs[idx], entries - idx);
+            wlfs_mcache_put(sb, entry);
+            return 0;
+        }
+        ptr = ptrs[idx];
+        wlfs_mcache_put(sb, entry);
+    }
+}
+
+// Each level narrows the search to the entry covering the block, bounded by
+// the next entry's offset
+int extent_lookup (struct super_block *sb, struct block *iblk, __u32 iblock,
+                   wlfs_daddr_t *daddr, __u32 *count,
+                   struct extent *cluster) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(iblk);
+    __u16 const entries = get_extent_entries(&wlfs_sb->meta);
+    struct extent const *ext = inode->extents;
+    __u16 n = inode->nextents;
+    __u8 depth = inode->depth;
+    __u64 end = MAX_FILE_BLOCKS;
+    struct meta_entry *entry = NULL;
+    int ret = 0;
+
+    if (unlikely(n > get_inode_extents(&wlfs_sb->meta))) {
+        return -EIO;
+    }
+
+    struct extent found = {0, 0, 0, 0};
+    while (true) {
+        __u16 const i = upper_bound(ext, n, iblock);
+        if (i < n) {
+            end = min_t(__u64, end, ext[i].offset);
+        }
+        if (i == 0) {
+            break;
+        }
+        found = ext[i - 1];
+        if (depth == 0) {
+            break;
+        }
+
+        // Descend into the extent block covering the block
+        if (entry) {
+            wlfs_mcache_put(sb, entry);
+        }
+        entry = read_indirect(sb, found.daddr, iblk->index);
+        if (unlikely(!entry || found.length > entries)) {
+            ret = -EIO;
+            goto exit;
+        }
+        ext = (struct extent const *) get_block_data(entry->blk);
+        n = found.length;
+        found.length = 0;
+        --depth;
+    }
+
+    if (iblock - found.offset < found.length) {
+        *daddr = found.daddr;
+        if (found.stored) {
+            *cluster = found;
+        } else {
+            *daddr += iblock - found.offset;
+        }
+        *count = found.length - (iblock - found.offset);
+    } else {
+        *daddr = 0;
+        *count = (__u32) min_t(__u64, end - iblock, U32_MAX);
+    }
+
+exit:
+    if (entry) {
+        wlfs_mcache_put(sb, entry);
+    }
+    return ret;
+}
+
+struct meta_entry *read_indirect (struct super_block *sb, 
+                                  wlfs_daddr_t daddr, __u64 ino) {
+    struct meta_entry *entry = wlfs_mcache_get(sb, daddr, ino,
+                                               BLOCK_INDIRECT);
+    return IS_ERR(entry) ? NULL : entry;
+}
+
+__u32 count_run (wlfs_daddr_t const *ptrs, __u32 n) {
+    __u32 count = 1;
+    if (ptrs[0]) {
+        while (count < n && ptrs[count] == ptrs[0] + count) {
+            ++count;
+        }
+    } else {
+        while (count < n && !ptrs[count]) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+__u16 upper_bound (struct extent const *ext, __u16 n, __u32 iblock) {
+    __u16 lo = 0;
+    __u16 hi = n;
+    while (lo < hi) {
+        __u16 const mid = lo + (hi - lo) / 2;
+        if (ext[mid].offset <= iblock) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
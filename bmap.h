@@ -0,0 +1,22 @@
+/*
+ * File block mapping: the indirect block tree & extents
+ */
+
+#pragma once
+
+#include <linux/fs.h>
+#include <linux/types.h>
+
+#include "wlfs.h"
+
+// Find the disk address of a file block, given the block holding its inode;
+// *daddr is 0 if the block is a hole.  *count is the number of blocks from
+// it on which are stored at consecutive addresses (or are all holes), so a
+// run can be read with one request.  If the block is in a compressed
+// cluster, *cluster is the cluster's extent, *daddr its address & *count
+// the number of its blocks from the block on; otherwise cluster->stored is
+// 0.  Indirect & extent blocks are read through the metadata block cache,
+// so they must have been flushed from the segment buffer
+int wlfs_bmap (struct super_block *sb, struct block *iblk, __u32 iblock,
+               wlfs_daddr_t *daddr, __u32 *count,
+               struct extent *cluster);
@@ -0,0 +1,500 @@
+#include <linux/bitops.h>
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/time.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "checkpoint.h"
+#include "discard.h"
+#include "imap.h"
+#include "io.h"
+#include "segmap.h"
+#include "segment.h"
+#include "super.h"
+#include "trace.h"
+#include "util.h"
+
+// Check that every block of a checkpoint region was written by the same
+// checkpoint
+static bool region_valid (struct wlfs_super *wlfs_sb, struct page **pages,
+                          unsigned region);
+// Extract the map block addresses stored in a run of checkpoint blocks
+static void read_addresses (struct wlfs_super *wlfs_sb, struct page **pages,
+                            __u32 first, __u32 nblocks, 
+                            wlfs_daddr_t *daddrs);
+// Queue reads of the map blocks which have addresses
+static __u32 gather_reads (__u32 nblocks, wlfs_daddr_t *daddrs,
+                           struct block **blocks, struct block_read *reads);
+// Check that map blocks read from disk are what the checkpoint says they are
+static int check_map_blocks (struct block **blocks, __u32 nblocks, 
+                             enum block_type type);
+// Append every dirty map block to the log
+static int append_maps (struct wlfs_super *wlfs_sb);
+// Build a checkpoint region for the log heads & current map block addresses
+// in the checkpointer's pages
+static void fill_region (struct wlfs_super *wlfs_sb, struct checkpoint *cp);
+// Periodic checkpoint
+static void wlfs_checkpoint_work (struct work_struct *work);
+
+int wlfs_checkpoint_load (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    struct block **segmap_blocks = NULL;
+    wlfs_daddr_t *segmap_daddrs = NULL;
+    struct block_read *reads = NULL;
+
+    int ret = wlfs_imap_alloc(wlfs_sb);
+    if (unlikely(ret)) {
+        return ret;
+    }
+    ret = wlfs_segmap_alloc(wlfs_sb);
+    if (unlikely(ret)) {
+        goto fail_segmap;
+    }
+
+    // Read both checkpoint regions in one request; they hold the addresses
+    // needed to issue every other map block read at once
+    __u32 const npages = DIV_ROUND_UP(
+        CHECKPOINT_REGIONS * meta->checkpoint_blocks * meta->block_size, 
+        PAGE_SIZE);
+    struct page **pages = wlfs_alloc_pages(npages, meta->block_size);
+    if (unlikely(!pages)) {
+        ret = -ENOMEM;
+        goto fail_pages;
+    }
+    ret = wlfs_read_blocks(sb, get_checkpoint_daddr(meta, 0), pages,
+                           CHECKPOINT_REGIONS * meta->checkpoint_blocks);
+    if (unlikely(ret)) {
+        printk(KERN_ERR "Error reading the checkpoint regions\n");
+        goto fail;
+    }
+
+    // Use the most recent checkpoint which was completely written
+    int region = -1;
+    __u64 generation = 0;
+    unsigned i = 0;
+    for (; i < CHECKPOINT_REGIONS; ++i) {
+        if (!region_valid(wlfs_sb, pages, i)) {
+            continue;
+        }
+        struct checkpoint *cp = (struct checkpoint *) get_block_data(
+            wlfs_get_block(pages, meta->block_size, 
+                           i * meta->checkpoint_blocks));
+        if (region < 0 || cp->generation > generation) {
+            region = i;
+            generation = cp->generation;
+        }
+    }
+    if (region < 0) {
+        // Nothing has been checkpointed yet; start with an empty log, & write
+        // the first checkpoint into region 0
+        printk(KERN_INFO "No checkpoint found, starting with empty maps\n");
+        wlfs_sb->checkpointer.region = CHECKPOINT_REGIONS - 1;
+        wlfs_sb->checkpoint.generation = 0;
+        wlfs_sb->checkpoint.seq = 0;
+        wlfs_sb->checkpoint.mount = 0;
+        for (i = 0; i < LOG_STREAMS; ++i) {
+            wlfs_sb->checkpoint.heads[i].segment = NO_SEGMENT;
+            wlfs_sb->checkpoint.heads[i].offset = 0;
+            wlfs_sb->checkpoint.heads[i].next = NO_SEGMENT;
+        }
+        wlfs_sb->checkpointer.seq = 0;
+        goto exit;
+    }
+    wlfs_sb->checkpointer.region = region;
+    __u32 const first = region * meta->checkpoint_blocks;
+    memcpy(&wlfs_sb->checkpoint, 
+           get_block_data(wlfs_get_block(pages, meta->block_size, first)), 
+           sizeof(struct checkpoint));
+    // Recovery may move the log heads on; the on-disk checkpoint stays put
+    wlfs_sb->checkpointer.seq = wlfs_sb->checkpoint.seq;
+
+    // Gather pointers to the segmap blocks, so they can be read like
+    // imap blocks
+    struct segment_map *segmap = &wlfs_sb->segmap;
+    segmap_blocks = (struct block **) vmalloc(
+        segmap->nblocks * sizeof(struct block *));
+    segmap_daddrs = (wlfs_daddr_t *) vmalloc(
+        segmap->nblocks * sizeof(wlfs_daddr_t));
+    reads = (struct block_read *) vmalloc(
+        (wlfs_sb->imap.nblocks + segmap->nblocks) * sizeof(struct block_read));
+    if (unlikely(!segmap_blocks || !segmap_daddrs || !reads)) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+    for (i = 0; i < segmap->nblocks; ++i) {
+        segmap_blocks[i] = segmap->blocks[i].block;
+    }
+
+    __u32 const imap_cp_blocks = get_checkpoint_imap_blocks(meta);
+    read_addresses(wlfs_sb, pages, first + 1, wlfs_sb->imap.nblocks, 
+                   wlfs_sb->imap.daddrs);
+    read_addresses(wlfs_sb, pages, first + 1 + imap_cp_blocks, 
+                   segmap->nblocks, segmap_daddrs);
+    // Inode map blocks are only allocated if they were ever written
+    for (i = 0; i < wlfs_sb->imap.nblocks; ++i) {
+        if (wlfs_sb->imap.daddrs[i]) {
+            ret = wlfs_imap_populate(wlfs_sb, i);
+            if (unlikely(ret)) {
+                goto fail;
+            }
+        }
+    }
+
+    // Issue all map block reads together, so they overlap on the device
+    __u32 nreads = gather_reads(wlfs_sb->imap.nblocks, wlfs_sb->imap.daddrs, 
+                                wlfs_sb->imap.blocks, reads);
+    nreads += gather_reads(segmap->nblocks, segmap_daddrs, segmap_blocks,
+                           reads + nreads);
+#ifndef NDEBUG
+    printk(KERN_DEBUG "Reading %u map blocks\n", nreads);
+#endif
+    ret = wlfs_read_scattered(sb, reads, nreads);
+    if (unlikely(ret)) {
+        printk(KERN_ERR "Error reading inode & segment maps\n");
+        goto fail;
+    }
+    ret = check_map_blocks(wlfs_sb->imap.blocks, wlfs_sb->imap.nblocks,
+                           BLOCK_IMAP);
+    if (likely(!ret)) {
+        ret = check_map_blocks(segmap_blocks, segmap->nblocks, BLOCK_SEGMAP);
+    }
+    if (unlikely(ret)) {
+        goto fail;
+    }
+
+    // Count the live blocks & index the segments, then record where each
+    // segmap block lives.  Map blocks are copied into the log one after
+    // another, so a segmap block can't describe the map blocks written after
+    // it; their addresses come from the checkpoint
+    wlfs_segmap_recount(wlfs_sb);
+    for (i = 0; i < segmap->nblocks; ++i) {
+        segmap->blocks[i].daddr = segmap_daddrs[i];
+        wlfs_segmap_mark(wlfs_sb, segmap_daddrs[i], true);
+    }
+    for (i = 0; i < wlfs_sb->imap.nblocks; ++i) {
+        wlfs_segmap_mark(wlfs_sb, wlfs_sb->imap.daddrs[i], true);
+    }
+    printk(KERN_INFO "Loaded checkpoint %llu from region %d with %u clean "
+           "segments\n", wlfs_sb->checkpoint.generation, region,
+           wlfs_sb->clean_segments);
+
+exit:
+    vfree(reads);
+    vfree(segmap_daddrs);
+    vfree(segmap_blocks);
+    wlfs_free_pages(pages, npages);
+    return 0;
+fail:
+    vfree(reads);
+    vfree(segmap_daddrs);
+    vfree(segmap_blocks);
+    wlfs_free_pages(pages, npages);
+fail_pages:
+    wlfs_segmap_free(wlfs_sb);
+fail_segmap:
+    wlfs_imap_free(wlfs_sb);
+    return ret;
+}
+
+int wlfs_checkpoint_start (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct checkpointer *cpr = &wlfs_sb->checkpointer;
+
+    mutex_init(&cpr->lock);
+    cpr->sb = sb;
+    INIT_DELAYED_WORK(&cpr->work, wlfs_checkpoint_work);
+
+    cpr->npages = DIV_ROUND_UP(
+        wlfs_sb->meta.checkpoint_blocks * wlfs_sb->meta.block_size, PAGE_SIZE);
+    cpr->pages = wlfs_alloc_pages(cpr->npages, wlfs_sb->meta.block_size);
+    cpr->scratch = (struct block *) kmalloc(wlfs_sb->meta.block_size, 
+                                            GFP_KERNEL);
+    cpr->wq = alloc_workqueue("wlfs-checkpoint", 
+                              WQ_MEM_RECLAIM | WQ_FREEZABLE, 1);
+    if (unlikely(!cpr->pages || !cpr->scratch || !cpr->wq)) {
+        if (cpr->pages) {
+            wlfs_free_pages(cpr->pages, cpr->npages);
+        }
+        kfree(cpr->scratch);
+        if (cpr->wq) {
+            destroy_workqueue(cpr->wq);
+        }
+        return -ENOMEM;
+    }
+
+    queue_delayed_work(cpr->wq, &cpr->work, 
+                       READ_ONCE(wlfs_sb->opts.checkpoint_period) * HZ);
+    return 0;
+}
+
+void wlfs_checkpoint_stop (struct super_block *sb) {
+    if (unlikely(wlfs_checkpoint_write(sb))) {
+        printk(KERN_ERR "Failed to write the final checkpoint\n");
+    }
+    wlfs_checkpoint_cancel(sb);
+}
+
+void wlfs_checkpoint_cancel (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct checkpointer *cpr = &wlfs_sb->checkpointer;
+
+    cancel_delayed_work_sync(&cpr->work);
+    destroy_workqueue(cpr->wq);
+    wlfs_free_pages(cpr->pages, cpr->npages);
+    kfree(cpr->scratch);
+}
+
+int wlfs_checkpoint_write (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    struct checkpointer *cpr = &wlfs_sb->checkpointer;
+    struct checkpoint cp;
+    int ret = 0;
+
+    mutex_lock(&cpr->lock);
+    ktime_t const start = ktime_get();
+    // Appends continue throughout.  Blocks appended before the cut are
+    // reflected in the map blocks copied after it; those appended after it
+    // are replayed from the log, whether the copies reflect them or not
+    wlfs_segbuf_cut(sb, &cp);
+    if (cp.seq == cpr->seq && cp.mount == wlfs_sb->checkpoint.mount) {
+        goto exit;
+    }
+    cp.generation = wlfs_sb->checkpoint.generation + 1;
+    // Segments emptied from now on may be referenced by this checkpoint
+    __u8 const epoch = wlfs_segmap_pin_epoch(wlfs_sb);
+
+    ret = append_maps(wlfs_sb);
+    if (unlikely(ret)) {
+        printk(KERN_ERR "Failed to append map blocks for checkpoint\n");
+        goto exit;
+    }
+    // The map blocks & every block they point to must be submitted, so the
+    // checkpoint only points at blocks which are stable once waited for
+    wlfs_segbuf_flush(sb);
+    __u64 const seq = atomic64_read(&wlfs_sb->segbuf.seq);
+    fill_region(wlfs_sb, &cp);
+    ret = wlfs_segbuf_wait(sb);
+    if (likely(!ret)) {
+        ret = wlfs_write_blocks(sb, WRITE_FUA, 
+                                get_checkpoint_daddr(meta, !cpr->region),
+                                cpr->pages, meta->checkpoint_blocks);
+    }
+    if (unlikely(ret)) {
+        printk(KERN_ERR "Failed to write checkpoint %llu\n", cp.generation);
+        goto exit;
+    }
+    // The copies of the map blocks are on disk, so the blocks can be evicted
+    wlfs_imap_settle(wlfs_sb);
+
+    wlfs_sb->checkpoint = cp;
+    cpr->region = !cpr->region;
+    // If nothing but the map blocks was written since the cut, the log
+    // hasn't moved by the next checkpoint
+    cpr->seq = seq;
+    // Nothing refers to the segments emptied before this checkpoint anymore
+    wlfs_segmap_unpin(wlfs_sb, epoch);
+    wlfs_discard_kick(sb);
+
+    __s64 const ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    wlfs_stat_add(wlfs_sb, STAT_CHECKPOINTS, 1);
+    wlfs_stat_add(wlfs_sb, STAT_CHECKPOINT_NS, ns);
+    wlfs_stat_add(wlfs_sb, STAT_BLOCKS_WRITTEN, meta->checkpoint_blocks);
+    trace_wlfs_checkpoint(sb, cp.generation, cpr->region, cp.seq, ns);
+#ifndef NDEBUG
+    printk(KERN_DEBUG "Wrote checkpoint %llu to region %u\n", 
+           cp.generation, cpr->region);
+#endif
+
+exit:
+    mutex_unlock(&cpr->lock);
+    return ret;
+}
+
+void wlfs_checkpoint_kick (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct checkpointer *cpr = &wlfs_sb->checkpointer;
+
+    mod_delayed_work(cpr->wq, &cpr->work, 0);
+}
+
+void wlfs_checkpoint_reschedule (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct checkpointer *cpr = &wlfs_sb->checkpointer;
+
+    mod_delayed_work(cpr->wq, &cpr->work,
+                     READ_ONCE(wlfs_sb->opts.checkpoint_period) * HZ);
+}
+
+/*
+ * Helper functions
+ */
+
+// Both headers of every block are stamped with the same wtime & the low bits
+// of the generation, so a torn write or a mix of blocks from two checkpoints
+// shows up as a mismatch, as does a corrupt block as a failed checksum
+bool region_valid (struct wlfs_super *wlfs_sb, struct page **pages,
+                   unsigned region) {
+    __u32 const block_size = wlfs_sb->meta.block_size;
+    __u32 const nblocks = wlfs_sb->meta.checkpoint_blocks;
+    struct block *head = wlfs_get_block(pages, block_size, region * nblocks);
+
+    __u32 i = 0;
+    for (; i < nblocks; ++i) {
+        struct block *blk = 
+            wlfs_get_block(pages, block_size, region * nblocks + i);
+        if (blk->type != BLOCK_CHECKPOINT || blk->index != i ||
+            blk->h0.wtime != head->h0.wtime || 
+            blk->h1.wtime != head->h0.wtime ||
+            blk->h0.version != head->h0.version ||
+            blk->h1.version != head->h0.version ||
+            !check_block_csum(&wlfs_sb->meta, blk)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void read_addresses (struct wlfs_super *wlfs_sb, struct page **pages,
+                     __u32 first, __u32 nblocks, wlfs_daddr_t *daddrs) {
+    __u16 const entries = get_daddr_entries(&wlfs_sb->meta);
+
+    __u32 i = 0;
+    for (; i < nblocks; ++i) {
+        struct block *cp = wlfs_get_block(pages, wlfs_sb->meta.block_size,
+                                          first + i / entries);
+        daddrs[i] = ((wlfs_daddr_t *) get_block_data(cp))[i % entries];
+    }
+}
+
+__u32 gather_reads (__u32 nblocks, wlfs_daddr_t *daddrs,
+                    struct block **blocks, struct block_read *reads) {
+    __u32 nreads = 0;
+
+    __u32 i = 0;
+    for (; i < nblocks; ++i) {
+        // Map blocks which were never written stay zeroed
+        if (daddrs[i]) {
+            reads[nreads].daddr = daddrs[i];
+            reads[nreads].buf = blocks[i];
+            ++nreads;
+        }
+    }
+
+    return nreads;
+}
+
+int check_map_blocks (struct block **blocks, __u32 nblocks, 
+                      enum block_type type) {
+    __u32 i = 0;
+    for (; i < nblocks; ++i) {
+        // Inode map blocks which were never written aren't allocated
+        if (!blocks[i]) {
+            continue;
+        }
+        if (unlikely(blocks[i]->type != type || blocks[i]->index != i)) {
+            printk(KERN_ERR "Map block %u of type %u is corrupt\n", i, type);
+            return -EUCLEAN;
+        }
+    }
+    return 0;
+}
+
+// Only blocks dirtied since the last checkpoint are written, so checkpoint
+// I/O follows the rate of change rather than the size of the maps.  No log
+// head lock is held: the copies go through wlfs_segbuf_append like any other
+// block, so foreground appends never wait for them
+int append_maps (struct wlfs_super *wlfs_sb) {
+    struct checkpointer *cpr = &wlfs_sb->checkpointer;
+    struct super_block *sb = cpr->sb;
+    struct inode_map *imap = &wlfs_sb->imap;
+    struct segment_map *segmap = &wlfs_sb->segmap;
+    int ret;
+
+    __u32 i = find_first_bit(wlfs_sb->imap_dirty, imap->nblocks);
+    for (; i < imap->nblocks; 
+         i = find_next_bit(wlfs_sb->imap_dirty, imap->nblocks, i + 1)) {
+        if (!wlfs_imap_copy(wlfs_sb, i, cpr->scratch)) {
+            continue;
+        }
+        ret = wlfs_segbuf_append(sb, cpr->scratch, &imap->daddrs[i]);
+        if (unlikely(ret)) {
+            wlfs_imap_mark_dirty(wlfs_sb, (__u64) i * imap->entries);
+            return ret;
+        }
+    }
+
+    // The usage updates of the imap copies reach the segmap when they're
+    // sealed, after it's copied; the loader marks the current copies live &
+    // the cleaner drops the stale ones
+    i = find_first_bit(wlfs_sb->segmap_dirty, segmap->nblocks);
+    for (; i < segmap->nblocks; 
+         i = find_next_bit(wlfs_sb->segmap_dirty, segmap->nblocks, i + 1)) {
+        if (!wlfs_segmap_copy(wlfs_sb, i, cpr->scratch)) {
+            continue;
+        }
+        ret = wlfs_segbuf_append(sb, cpr->scratch, 
+                                 wlfs_segmap_daddr(wlfs_sb, i));
+        if (unlikely(ret)) {
+            wlfs_segmap_mark_dirty(wlfs_sb, i);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+void fill_region (struct wlfs_super *wlfs_sb, struct checkpoint *cp) {
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    struct checkpointer *cpr = &wlfs_sb->checkpointer;
+    __u16 const entries = get_daddr_entries(meta);
+    __u32 const imap_cp_blocks = get_checkpoint_imap_blocks(meta);
+    __kernel_time_t const now = get_seconds();
+
+    __u32 i = 0;
+    for (; i < meta->checkpoint_blocks; ++i) {
+        struct block *blk = wlfs_get_block(cpr->pages, meta->block_size, i);
+        memset(blk, 0, meta->block_size);
+        blk->h0.wtime = blk->h1.wtime = now;
+        blk->h0.version = blk->h1.version = (__u8) cp->generation;
+        blk->index = i;
+        blk->type = BLOCK_CHECKPOINT;
+    }
+    memcpy(get_block_data(wlfs_get_block(cpr->pages, meta->block_size, 0)),
+           cp, sizeof(struct checkpoint));
+
+    for (i = 0; i < wlfs_sb->imap.nblocks; ++i) {
+        struct block *blk = wlfs_get_block(cpr->pages, meta->block_size,
+                                           1 + i / entries);
+        ((wlfs_daddr_t *) get_block_data(blk))[i % entries] =
+            wlfs_sb->imap.daddrs[i];
+    }
+    for (i = 0; i < wlfs_sb->segmap.nblocks; ++i) {
+        struct block *blk = wlfs_get_block(
+            cpr->pages, meta->block_size, 1 + imap_cp_blocks + i / entries);
+        ((wlfs_daddr_t *) get_block_data(blk))[i % entries] = 
+            wlfs_sb->segmap.blocks[i].daddr;
+    }
+    for (i = 0; i < meta->checkpoint_blocks; ++i) {
+        set_block_csum(meta, wlfs_get_block(cpr->pages, meta->block_size, i));
+    }
+}
+
+void wlfs_checkpoint_work (struct work_struct *work) {
+    struct checkpointer *cpr = container_of(
+        to_delayed_work(work), struct checkpointer, work);
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) cpr->sb->s_fs_info;
+
+    if (unlikely(wlfs_checkpoint_write(cpr->sb))) {
+        printk(KERN_ERR "Periodic checkpoint failed\n");
+    }
+    queue_delayed_work(cpr->wq, &cpr->work, 
+                       READ_ONCE(wlfs_sb->opts.checkpoint_period) * HZ);
+}
@@ -0,0 +1,54 @@
+/*
+ * Checkpoint regions: loading the inode & segment maps at mount time, and
+ * periodically writing back the map blocks dirtied since
+ */
+
+#pragma once
+
+#include <linux/fs.h>
+#include <linux/mm_types.h>
+#include <linux/mutex.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#include "wlfs.h"
+
+struct checkpointer {
+    // Serializes checkpoints
+    struct mutex lock;
+    struct super_block *sb;
+    // Writes a checkpoint every checkpoint_period seconds
+    struct workqueue_struct *wq;
+    struct delayed_work work;
+    // Pages holding the checkpoint region being written
+    struct page **pages;
+    __u32 npages;
+    // Staging buffer for copying one map block into the log
+    struct block *scratch;
+    // Region holding the most recent checkpoint; the next one goes into the
+    // other region
+    unsigned region;
+    // Log sequence number right after the last checkpoint's own blocks; if
+    // the log hasn't moved since, there's nothing to checkpoint
+    __u64 seq;
+};
+
+// Read the checkpoint region, then the imap & segmap blocks it points to; an
+// empty checkpoint region yields empty maps
+int wlfs_checkpoint_load (struct super_block *sb);
+
+// Start writing periodic checkpoints
+int wlfs_checkpoint_start (struct super_block *sb);
+// Stop the periodic checkpoints & write a final one
+void wlfs_checkpoint_stop (struct super_block *sb);
+// Stop the periodic checkpoints without writing a final one; for a mount
+// which fails
+void wlfs_checkpoint_cancel (struct super_block *sb);
+// Write a checkpoint now: append the dirty map blocks to the log, wait for
+// the log to be stable, then commit the log heads & map block addresses to
+// the older checkpoint region
+int wlfs_checkpoint_write (struct super_block *sb);
+// Schedule a checkpoint without waiting for it
+void wlfs_checkpoint_kick (struct super_block *sb);
+// Restart the periodic checkpoint timer after checkpoint_period changed
+void wlfs_checkpoint_reschedule (struct super_block *sb);
@@ -0,0 +1,380 @@
+#include <linux/buffer_head.h>
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/freezer.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/printk.h>
+#include <linux/sort.h>
+#include <linux/time.h>
+
+#include "checkpoint.h"
+#include "cleaner.h"
+#include "imap.h"
+#include "io.h"
+#include "segmap.h"
+#include "segment.h"
+#include "super.h"
+#include "trace.h"
+#include "util.h"
+
+// Candidates gathered per victim slot, before they are scored by age
+#define CANDIDATE_FACTOR 4
+
+struct victim {
+    __u32 segment;
+    __u32 live;
+    __u64 score;
+};
+
+// Main loop of the cleaner thread
+static int wlfs_cleaner_thread (void *data);
+// Check if the clean segment count has dropped below min_clean_segs
+static bool needs_cleaning (struct wlfs_super *wlfs_sb);
+// Clean segments until target_clean_segs is reached or no progress is made
+static void clean_pass (struct super_block *sb);
+// Choose up to n victims with the highest cost-benefit score, best first
+static unsigned pick_victims (struct super_block *sb, struct victim *victims,
+                              unsigned n);
+// Order victims by descending score
+static int compare_victims (void const *a, void const *b);
+// Time at which a segment was last written, read from its first summary
+// block if it hasn't been written since mount
+static __kernel_time_t get_segment_wtime (struct super_block *sb,
+                                          __u32 segment);
+// Copy the live blocks of a segment to the cold stream, adding the number
+// copied to *copied; map blocks are left for the next checkpoint to move, in
+// which case *deferred is set.  Blocks which can't be moved are skipped, &
+// the first error they gave is returned once the rest are copied
+static int clean_segment (struct super_block *sb, __u32 segment, 
+                          bool *deferred, __u64 *copied);
+// Find the reference to a block held by its owner, or NULL if blocks of its
+// type can't be relocated
+static wlfs_daddr_t *get_owner (struct wlfs_super *wlfs_sb,
+                                struct block *blk);
+// Check whether a block is an inode or segment map block
+static bool is_map_block (struct block *blk);
+
+int wlfs_cleaner_start (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct cleaner *cleaner = &wlfs_sb->cleaner;
+
+    init_waitqueue_head(&cleaner->wait);
+
+    cleaner->npages = DIV_ROUND_UP(wlfs_sb->meta.segment_size, PAGE_SIZE);
+    cleaner->pages = wlfs_alloc_pages(cleaner->npages,
+                                      wlfs_sb->meta.block_size);
+    if (unlikely(!cleaner->pages)) {
+        return -ENOMEM;
+    }
+
+    cleaner->task = kthread_run(wlfs_cleaner_thread, sb, "wlfs_cleaner/%s",
+                                sb->s_id);
+    if (unlikely(IS_ERR(cleaner->task))) {
+        wlfs_free_pages(cleaner->pages, cleaner->npages);
+        return PTR_ERR(cleaner->task);
+    }
+
+    return 0;
+}
+
+void wlfs_cleaner_stop (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct cleaner *cleaner = &wlfs_sb->cleaner;
+
+    kthread_stop(cleaner->task);
+    wlfs_free_pages(cleaner->pages, cleaner->npages);
+    printk(KERN_INFO "wlfs cleaner copied %lld blocks & freed %lld segments "
+           "in %lld ms\n",
+           (long long) wlfs_stat_read(wlfs_sb, STAT_BLOCKS_RELOCATED),
+           (long long) wlfs_stat_read(wlfs_sb, STAT_SEGMENTS_CLEANED),
+           (long long) wlfs_stat_read(wlfs_sb, STAT_CLEANER_NS) /
+           NSEC_PER_MSEC);
+}
+
+void wlfs_cleaner_kick (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+
+    if (needs_cleaning(wlfs_sb)) {
+        wake_up(&wlfs_sb->cleaner.wait);
+    }
+}
+
+/*
+ * Helper functions
+ */
+
+int wlfs_cleaner_thread (void *data) {
+    struct super_block *sb = (struct super_block *) data;
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct cleaner *cleaner = &wlfs_sb->cleaner;
+
+    set_freezable();
+    while (!kthread_should_stop()) {
+        wait_event_freezable_timeout(
+            cleaner->wait, kthread_should_stop() || needs_cleaning(wlfs_sb),
+            CLEANER_PERIOD * HZ);
+        if (!kthread_should_stop() && needs_cleaning(wlfs_sb)) {
+            clean_pass(sb);
+        }
+    }
+
+    return 0;
+}
+
+bool needs_cleaning (struct wlfs_super *wlfs_sb) {
+    return ACCESS_ONCE(wlfs_sb->clean_segments) <
+        READ_ONCE(wlfs_sb->opts.min_clean_segs);
+}
+
+// The cleaner has a thread of its own, so the CPU time it has run for is
+// the time spent cleaning
+void clean_pass (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct victim victims[CLEANER_BATCH];
+    ktime_t const start = ktime_get();
+    __u64 const cpu_start = current->se.sum_exec_runtime;
+    bool deferred = false;
+    __u64 copied = 0;
+    __u32 cleaned = 0;
+#ifndef NDEBUG
+    printk(KERN_DEBUG "Cleaning with %u clean segments\n",
+           wlfs_sb->clean_segments);
+#endif
+
+    while (!kthread_should_stop() &&
+           ACCESS_ONCE(wlfs_sb->clean_segments) <
+           READ_ONCE(wlfs_sb->opts.target_clean_segs)) {
+        __u32 const before = ACCESS_ONCE(wlfs_sb->clean_segments);
+        bool skipped = false;
+        unsigned const n = pick_victims(sb, victims, CLEANER_BATCH);
+        if (n == 0) {
+            break;
+        }
+
+        unsigned i = 0;
+        for (; i < n; ++i) {
+            int ret = clean_segment(sb, victims[i].segment, &deferred,
+                                    &copied);
+            cleaned += wlfs_segmap_live(wlfs_sb, victims[i].segment) == 0;
+            if (unlikely(ret == -ENOSPC)) {
+                printk(KERN_ERR "Cleaner ran out of space in the log\n");
+                goto exit;
+            }
+            // A corrupt block, or one without an owner to point at its copy
+            // (data, indirect & commit blocks), stays live, so picking its
+            // segment again would only reread it & copy nothing.  Keep the
+            // segment out of the index until the next mount rebuilds it, so
+            // the next pass moves on to other victims
+            if (unlikely(ret == -EIO || ret == -EAGAIN)) {
+                wlfs_segmap_reserve(wlfs_sb, victims[i].segment);
+                skipped = true;
+            }
+        }
+        // Stop if cleaning this batch didn't gain any clean segments, unless
+        // victims were set aside & the next batch will be different ones
+        if (ACCESS_ONCE(wlfs_sb->clean_segments) <= before && !skipped) {
+            break;
+        }
+    }
+
+exit:
+    // Copies must be stable before the segments they came from are reused
+    if (unlikely(wlfs_segbuf_sync(sb))) {
+        printk(KERN_ERR "Failed to sync relocated blocks\n");
+    }
+    // Segments holding live map blocks only become clean once a checkpoint
+    // has written the maps elsewhere
+    if (deferred) {
+        wlfs_checkpoint_kick(sb);
+    }
+    __s64 const ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    wlfs_stat_add(wlfs_sb, STAT_CLEANER_PASSES, 1);
+    wlfs_stat_add(wlfs_sb, STAT_CLEANER_NS, ns);
+    wlfs_stat_add(wlfs_sb, STAT_CLEANER_CPU_NS,
+                  current->se.sum_exec_runtime - cpu_start);
+    wlfs_stat_add(wlfs_sb, STAT_BLOCKS_RELOCATED, copied);
+    wlfs_stat_add(wlfs_sb, STAT_SEGMENTS_CLEANED, cleaned);
+    trace_wlfs_cleaner_pass(sb, cleaned, copied,
+                            ACCESS_ONCE(wlfs_sb->clean_segments), ns);
+#ifndef NDEBUG
+    printk(KERN_DEBUG "Cleaning pass done with %u clean segments\n",
+           wlfs_sb->clean_segments);
+#endif
+}
+
+unsigned pick_victims (struct super_block *sb, struct victim *victims,
+                       unsigned n) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    __u32 const blocks = get_segmap_bits(&wlfs_sb->meta);
+    __u32 segments[CLEANER_BATCH * CANDIDATE_FACTOR];
+    struct victim candidates[CLEANER_BATCH * CANDIDATE_FACTOR];
+
+    // The segment index yields the least utilized segments directly, least
+    // recently changed first; the log heads are never among them
+    __u32 const count = wlfs_segmap_least_used(
+        wlfs_sb, segments,
+        min_t(unsigned, n * CANDIDATE_FACTOR, ARRAY_SIZE(segments)));
+
+    __kernel_time_t const now = get_seconds();
+    unsigned i = 0;
+    for (; i < count; ++i) {
+        __kernel_time_t const wtime = get_segment_wtime(sb, segments[i]);
+        candidates[i].segment = segments[i];
+        candidates[i].live = wlfs_segmap_live(wlfs_sb, segments[i]);
+        candidates[i].score = get_clean_score(
+            candidates[i].live, blocks, wtime < now ? now - wtime : 0);
+    }
+    sort(candidates, count, sizeof(struct victim), compare_victims, NULL);
+
+    n = min(n, count);
+    memcpy(victims, candidates, n * sizeof(struct victim));
+    return n;
+}
+
+int compare_victims (void const *a, void const *b) {
+    __u64 const lhs = ((struct victim const *) a)->score;
+    __u64 const rhs = ((struct victim const *) b)->score;
+    return lhs < rhs ? 1 : lhs > rhs ? -1 : 0;
+}
+
+__kernel_time_t get_segment_wtime (struct super_block *sb, __u32 segment) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    __kernel_time_t wtime = wlfs_segmap_wtime(wlfs_sb, segment);
+    if (wtime) {
+        return wtime;
+    }
+
+    // Every segment starts with a summary block, stamped when first flushed;
+    // its header lies in the first buffer of the block, which may span
+    // several if blocks are larger than a page
+    unsigned const shift =
+        ilog2(wlfs_sb->meta.block_size) - sb->s_blocksize_bits;
+    struct buffer_head *bh =
+        sb_bread(sb, get_segment_daddr(&wlfs_sb->meta, segment) << shift);
+    if (unlikely(!bh)) {
+        return 0;
+    }
+    wtime = ((struct block *) bh->b_data)->h0.wtime;
+    brelse(bh);
+    wlfs_segmap_set_wtime(wlfs_sb, segment, wtime);
+
+    return wtime;
+}
+
+int clean_segment (struct super_block *sb, __u32 segment, bool *deferred,
+                   __u64 *copied) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    struct cleaner *cleaner = &wlfs_sb->cleaner;
+    __u64 const base = get_segment_daddr(meta, segment);
+    __u32 const blocks = get_segmap_bits(meta);
+
+    // Read the whole segment with one large request
+    int ret = wlfs_read_blocks(sb, base, cleaner->pages, blocks);
+    if (unlikely(ret)) {
+        return ret;
+    }
+
+    int err = 0;
+    __u32 i = 0;
+    for (; i < blocks; ++i) {
+        if (!wlfs_segmap_test(wlfs_sb, base + i)) {
+            continue;
+        }
+
+        struct block *blk = wlfs_get_block(cleaner->pages, meta->block_size, i);
+        // Relocating a corrupt block would stamp it with a valid checksum
+        if (unlikely(!check_block_csum(meta, blk))) {
+            printk(KERN_ERR "Block %llu failed its checksum\n", base + i);
+            if (!err) {
+                err = -EIO;
+            }
+            continue;
+        }
+        // An inode's map entry is only held in memory under its shard lock
+        bool const is_inode = blk->type == BLOCK_INODE;
+        if (is_inode) {
+            wlfs_imap_lock(wlfs_sb, blk->index);
+        }
+        wlfs_daddr_t *owner = get_owner(wlfs_sb, blk);
+        if (unlikely(!owner)) {
+            if (is_inode) {
+                wlfs_imap_unlock(wlfs_sb, blk->index);
+            }
+#ifndef NDEBUG
+            printk(KERN_DEBUG "Can't relocate block %llu of type %u\n",
+                   base + i, blk->type);
+#endif
+            if (!err) {
+                err = -EAGAIN;
+            }
+            continue;
+        }
+
+        if (is_map_block(blk)) {
+            // The in-memory map block is newer than this copy; rewriting it
+            // is the checkpoint's job.  Copies the owner no longer points at
+            // were left live by the checkpoint which superseded them
+            if (ACCESS_ONCE(*owner) != base + i) {
+                wlfs_segmap_mark(wlfs_sb, base + i, false);
+            } else if (blk->type == BLOCK_IMAP) {
+                wlfs_imap_mark_dirty(wlfs_sb, 
+                                     blk->index * wlfs_sb->imap.entries);
+                *deferred = true;
+            } else {
+                wlfs_segmap_mark_dirty(wlfs_sb, blk->index);
+                *deferred = true;
+            }
+            continue;
+        }
+
+        if (is_inode) {
+            wlfs_imap_mark_dirty(wlfs_sb, blk->index);
+            ret = wlfs_segbuf_relocate(sb, blk, owner, base + i);
+            wlfs_imap_unlock(wlfs_sb, blk->index);
+        } else {
+            ret = wlfs_segbuf_relocate(sb, blk, owner, base + i);
+        }
+        if (ret == -ESTALE) {
+            // The owner rewrote the block since it was found live
+            wlfs_segmap_mark(wlfs_sb, base + i, false);
+            ret = 0;
+            continue;
+        }
+        if (unlikely(ret)) {
+            break;
+        }
+        ++*copied;
+    }
+
+    return ret ? ret : err;
+}
+
+wlfs_daddr_t *get_owner (struct wlfs_super *wlfs_sb, struct block *blk) {
+    switch (blk->type) {
+    case BLOCK_INODE:
+        // Inode blocks are referenced by their inode map entry; the caller
+        // holds its shard lock
+        return wlfs_imap_entry(wlfs_sb, blk->index);
+
+    case BLOCK_IMAP:
+        // Map blocks are referenced by the checkpoint
+        if (unlikely(blk->index >= wlfs_sb->imap.nblocks)) {
+            return NULL;
+        }
+        return &wlfs_sb->imap.daddrs[blk->index];
+
+    case BLOCK_SEGMAP:
+        return wlfs_segmap_daddr(wlfs_sb, blk->index);
+
+    default:
+        return NULL;
+    }
+}
+
+bool is_map_block (struct block *blk) {
+    return blk->type == BLOCK_IMAP || blk->type == BLOCK_SEGMAP;
+}
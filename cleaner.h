@@ -0,0 +1,31 @@
+/*
+ * Background segment cleaner
+ */
+
+#pragma once
+
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+
+// Seconds between checks of the clean segment count
+#define CLEANER_PERIOD 5
+// Number of victim segments chosen per scan of the segment map
+#define CLEANER_BATCH 8
+
+struct cleaner {
+    struct task_struct *task;
+    // Woken when the clean segment count drops below min_clean_segs
+    wait_queue_head_t wait;
+    // Holds the contents of the victim segment being cleaned
+    struct page **pages;
+    __u32 npages;
+};
+
+// Start the cleaner thread
+int wlfs_cleaner_start (struct super_block *sb);
+// Stop the cleaner thread & free its buffer
+void wlfs_cleaner_stop (struct super_block *sb);
+// Wake the cleaner if there are too few clean segments
+void wlfs_cleaner_kick (struct super_block *sb);
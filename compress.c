@@ -0,0 +1,206 @@
+#ifdef __KERNEL__
+#include <linux/string.h>
+#else
+#include <string.h>
+#endif
+
+#include "compress.h"
+
+// LZ4 block format: a sequence of tokens, each followed by a run of
+// literals & a match copied from earlier output.  Matches are at least this
+// long, the last this many bytes are always literals, & no match starts in
+// the last LZ4_MFLIMIT bytes
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_MAX_OFFSET 0xffff
+// A token's 4-bit lengths at this value continue in the bytes after it
+#define LZ4_RUN_MASK 15
+
+// Greedy LZ4 compressor, finding matches through a hash table of the last
+// position each 4-byte sequence was seen at
+static __u32 compress_lz4 (__u8 const *src, __u32 len, __u8 *dst, __u32 cap,
+                           __u32 *table);
+// Bounds-checked LZ4 decompressor
+static bool decompress_lz4 (__u8 const *src, __u32 len, __u8 *dst,
+                            __u32 out);
+// Append a sequence: literals, then a match unless it is the last sequence
+// (mlen 0); returns the new output length, or 0 if it doesn't fit
+static __u32 put_sequence (__u8 *dst, __u32 op, __u32 cap, __u8 const *lit,
+                           __u32 nlit, __u16 offset, __u32 mlen);
+// Append the part of a length beyond its token's 4 bits
+static __u32 put_length (__u8 *dst, __u32 op, __u32 len);
+// Read the part of a length beyond its token's 4 bits; returns false if
+// the input ends first
+static bool get_length (__u8 const *src, __u32 len, __u32 *ip, __u32 *value);
+// Load 4 bytes from any alignment
+static __u32 load32 (__u8 const *p);
+// Hash table slot of a 4-byte sequence
+static __u32 hash32 (__u32 seq);
+
+__u32 wlfs_compress (__u8 codec, void const *src, __u32 len, void *dst,
+                     __u32 cap, void *work) {
+    switch (codec) {
+    case COMPRESS_LZ4:
+        return compress_lz4((__u8 const *) src, len, (__u8 *) dst, cap,
+                            (__u32 *) work);
+    default:
+        return 0;
+    }
+}
+
+bool wlfs_decompress (__u8 codec, void const *src, __u32 len, void *dst,
+                      __u32 out) {
+    switch (codec) {
+    case COMPRESS_LZ4:
+        return decompress_lz4((__u8 const *) src, len, (__u8 *) dst, out);
+    default:
+        return false;
+    }
+}
+
+/*
+ * Helper functions
+ */
+
+// Candidate matches are checked against the data, so stale or colliding
+// table entries only cost a missed match
+__u32 compress_lz4 (__u8 const *src, __u32 len, __u8 *dst, __u32 cap,
+                    __u32 *table) {
+    __u32 anchor = 0;
+    __u32 op = 0;
+    __u32 ip = 0;
+
+    memset(table, 0, COMPRESS_WORK_BYTES);
+    while (len > LZ4_MFLIMIT && ip < len - LZ4_MFLIMIT) {
+        __u32 const seq = load32(src + ip);
+        __u32 const h = hash32(seq);
+        __u32 const ref = table[h];
+        table[h] = ip;
+        if (ref >= ip || ip - ref > LZ4_MAX_OFFSET ||
+            load32(src + ref) != seq) {
+            ++ip;
+            continue;
+        }
+
+        __u32 mlen = LZ4_MIN_MATCH;
+        while (ip + mlen < len - LZ4_LAST_LITERALS &&
+               src[ref + mlen] == src[ip + mlen]) {
+            ++mlen;
+        }
+        op = put_sequence(dst, op, cap, src + anchor, ip - anchor,
+                          (__u16) (ip - ref), mlen);
+        if (!op) {
+            return 0;
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+    return put_sequence(dst, op, cap, src + anchor, len - anchor, 0, 0);
+}
+
+// Every length & offset is checked against what is left of the input &
+// output, so corrupt data can't overrun either buffer
+bool decompress_lz4 (__u8 const *src, __u32 len, __u8 *dst, __u32 out) {
+    __u32 ip = 0;
+    __u32 op = 0;
+
+    while (ip < len) {
+        __u8 const token = src[ip++];
+        __u32 nlit = token >> 4;
+        if (nlit == LZ4_RUN_MASK && !get_length(src, len, &ip, &nlit)) {
+            return false;
+        }
+        if (nlit > len - ip || nlit > out - op) {
+            return false;
+        }
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        // The last sequence has no match
+        if (ip == len) {
+            return op == out;
+        }
+
+        if (len - ip < 2) {
+            return false;
+        }
+        __u32 const offset = src[ip] | (__u32) src[ip + 1] << 8;
+        ip += 2;
+        __u32 mlen = token & LZ4_RUN_MASK;
+        if (mlen == LZ4_RUN_MASK && !get_length(src, len, &ip, &mlen)) {
+            return false;
+        }
+        mlen += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > op || mlen > out - op) {
+            return false;
+        }
+        // Matches may overlap their own output, so copy a byte at a time
+        for (; mlen > 0; --mlen, ++op) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return false;
+}
+
+__u32 put_sequence (__u8 *dst, __u32 op, __u32 cap, __u8 const *lit,
+                    __u32 nlit, __u16 offset, __u32 mlen) {
+    // Worst case: token, literal length bytes, literals, offset & match
+    // length bytes
+    __u64 const need = 1 + (nlit / 255 + 1) + nlit +
+        (mlen ? 2 + (mlen / 255 + 1) : 0);
+    if (op + need > cap) {
+        return 0;
+    }
+
+    __u32 const mcode = mlen ? mlen - LZ4_MIN_MATCH : 0;
+    __u8 *token = &dst[op++];
+    *token = (nlit < LZ4_RUN_MASK ? nlit : LZ4_RUN_MASK) << 4;
+    if (nlit >= LZ4_RUN_MASK) {
+        op = put_length(dst, op, nlit - LZ4_RUN_MASK);
+    }
+    memcpy(dst + op, lit, nlit);
+    op += nlit;
+    if (!mlen) {
+        return op;
+    }
+
+    dst[op++] = offset & 0xff;
+    dst[op++] = offset >> 8;
+    *token |= mcode < LZ4_RUN_MASK ? mcode : LZ4_RUN_MASK;
+    if (mcode >= LZ4_RUN_MASK) {
+        op = put_length(dst, op, mcode - LZ4_RUN_MASK);
+    }
+    return op;
+}
+
+__u32 put_length (__u8 *dst, __u32 op, __u32 len) {
+    for (; len >= 255; len -= 255) {
+        dst[op++] = 255;
+    }
+    dst[op++] = len;
+    return op;
+}
+
+bool get_length (__u8 const *src, __u32 len, __u32 *ip, __u32 *value) {
+    __u8 byte;
+    do {
+        if (*ip >= len) {
+            return false;
+        }
+        byte = src[(*ip)++];
+        *value += byte;
+    } while (byte == 255);
+    return true;
+}
+
+__u32 load32 (__u8 const *p) {
+    __u32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Knuth's multiplicative hash
+__u32 hash32 (__u32 seq) {
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
@@ -0,0 +1,28 @@
+/*
+ * Compression codecs for cold file data, shared by the kernel & userspace
+ */
+
+#pragma once
+
+#ifndef __KERNEL__
+#include <stdbool.h>
+#endif
+
+#include "wlfs.h"
+
+// Log2 of the number of entries in the compressor's match table
+#define LZ4_HASH_BITS 12
+// Bytes of scratch space the compressor needs
+#define COMPRESS_WORK_BYTES (sizeof(__u32) << LZ4_HASH_BITS)
+
+// Compress len bytes at src into at most cap bytes at dst, given
+// COMPRESS_WORK_BYTES of scratch space; returns the compressed length, or 0
+// if the data doesn't fit or the codec is unknown
+__u32 wlfs_compress (__u8 codec, void const *src, __u32 len, void *dst,
+                     __u32 cap, void *work);
+
+// Decompress len bytes at src into exactly out bytes at dst; returns false
+// if the data is corrupt, doesn't decompress to out bytes, or the codec is
+// unknown
+bool wlfs_decompress (__u8 codec, void const *src, __u32 len, void *dst,
+                      __u32 out);
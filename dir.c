@@ -0,0 +1,272 @@
+#include <linux/capability.h>
+#include <linux/compiler.h>
+#include <linux/dcache.h>
+#include <linux/err.h>
+#include <linux/errno.h>
+#include <linux/printk.h>
+#include <linux/uaccess.h>
+
+#include "bmap.h"
+#include "dir.h"
+#include "discard.h"
+#include "inode.h"
+#include "mcache.h"
+#include "super.h"
+#include "util.h"
+
+// Directory positions after "." & ".." hold a bucket number above these
+// bits & the byte offset of the next entry within the bucket below them;
+// inline entries count as bucket 0
+#define DIR_POS_SHIFT 16
+
+// Look a name up, leaving a negative dentry if it isn't there
+static struct dentry *wlfs_lookup (struct inode *dir, struct dentry *dentry,
+                                   unsigned flags);
+// List a directory's entries from the file position on
+static int wlfs_readdir (struct file *file, struct dir_context *ctx);
+// Filesystem-wide ioctls, issued on any directory of the mount: FITRIM
+static long wlfs_dir_ioctl (struct file *file, unsigned cmd,
+                            unsigned long arg);
+// Find the inode a name refers to; returns -ENOENT if it isn't there
+static int find_name (struct inode *dir, struct qstr const *name,
+                      __u64 *ino);
+// Get a file block of a directory through the metadata cache
+static struct meta_entry *get_dir_block (struct inode *dir, __u32 iblock);
+// Emit packed entries from the offset the position holds on, moving the
+// position past each; returns false once the caller has no more room
+static bool emit_entries (struct dir_context *ctx, __u32 nr,
+                          void *entries, __u32 bytes);
+
+struct inode_operations const wlfs_dir_inode_ops = {
+    .lookup = wlfs_lookup,
+};
+
+struct file_operations const wlfs_dir_ops = {
+    .llseek = generic_file_llseek,
+    .read = generic_read_dir,
+    .iterate = wlfs_readdir,
+    .unlocked_ioctl = wlfs_dir_ioctl,
+};
+
+struct dentry *wlfs_lookup (struct inode *dir, struct dentry *dentry,
+                            unsigned flags) {
+    struct inode *inode = NULL;
+    __u64 ino;
+
+    if (dentry->d_name.len > WLFS_NAME_LEN) {
+        return ERR_PTR(-ENAMETOOLONG);
+    }
+    int const ret = find_name(dir, &dentry->d_name, &ino);
+    if (!ret) {
+        inode = wlfs_iget(dir->i_sb, ino);
+        if (IS_ERR(inode)) {
+            return ERR_CAST(inode);
+        }
+    } else if (ret != -ENOENT) {
+        return ERR_PTR(ret);
+    }
+    return d_splice_alias(inode, dentry);
+}
+
+// Buckets are listed in the order they were created, so every entry is
+// listed once however many index slots point at its bucket
+int wlfs_readdir (struct file *file, struct dir_context *ctx) {
+    struct inode *dir = file_inode(file);
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) dir->i_sb->s_fs_info;
+    struct block *iblk = WLFS_I(dir)->iblk;
+
+    if (!dir_emit_dots(file, ctx)) {
+        return 0;
+    }
+    // The root has no block until one is written for it
+    if (!iblk) {
+        return 0;
+    }
+    struct wlfs_inode *winode = (struct wlfs_inode *) get_block_data(iblk);
+    if (winode->flags & WLFS_INODE_INLINE) {
+        emit_entries(ctx, 0, winode->data, winode->size);
+        return 0;
+    }
+
+    struct meta_entry *head = get_dir_block(dir, 0);
+    if (IS_ERR(head)) {
+        return PTR_ERR(head);
+    }
+    __u32 const nbuckets =
+        ((struct dir_header *) get_block_data(head->blk))->nbuckets;
+    wlfs_mcache_put(dir->i_sb, head);
+
+    int ret = 0;
+    __u32 nr = (ctx->pos - 2) >> DIR_POS_SHIFT;
+    for (; nr < nbuckets; ++nr) {
+        struct meta_entry *entry = get_dir_block(dir, DIR_INDEX_BLOCKS + nr);
+        if (IS_ERR(entry)) {
+            ret = PTR_ERR(entry);
+            break;
+        }
+        struct dir_bucket *bucket =
+            (struct dir_bucket *) get_block_data(entry->blk);
+        bool const more = bucket->bytes <=
+            get_block_bytes(&wlfs_sb->meta) - sizeof(struct dir_bucket) &&
+            emit_entries(ctx, nr, bucket + 1, bucket->bytes);
+        wlfs_mcache_put(dir->i_sb, entry);
+        if (!more) {
+            break;
+        }
+        ctx->pos = 2 + ((loff_t) (nr + 1) << DIR_POS_SHIFT);
+    }
+    return ret;
+}
+
+long wlfs_dir_ioctl (struct file *file, unsigned cmd, unsigned long arg) {
+    struct fstrim_range __user *user = (struct fstrim_range __user *) arg;
+    struct fstrim_range range;
+
+    switch (cmd) {
+    case FITRIM:
+        if (!capable(CAP_SYS_ADMIN)) {
+            return -EPERM;
+        }
+        if (copy_from_user(&range, user, sizeof(range))) {
+            return -EFAULT;
+        }
+        int const ret = wlfs_discard_trim(file_inode(file)->i_sb, &range);
+        if (ret) {
+            return ret;
+        }
+        if (copy_to_user(user, &range, sizeof(range))) {
+            return -EFAULT;
+        }
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ * Helper functions
+ */
+
+// A lookup gets the header, the index block holding the name's slot if the
+// header's block doesn't, & the bucket; all of them stay cached
+int find_name (struct inode *dir, struct qstr const *name, __u64 *ino) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) dir->i_sb->s_fs_info;
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    struct block *iblk = WLFS_I(dir)->iblk;
+    char const *str = (char const *) name->name;
+    __u32 const hash = get_dir_hash(str, name->len);
+    struct dir_entry *found;
+    int ret = 0;
+
+    if (!iblk) {
+        return -ENOENT;
+    }
+    struct wlfs_inode *winode = (struct wlfs_inode *) get_block_data(iblk);
+    if (winode->flags & WLFS_INODE_INLINE) {
+        found = find_dir_entry(winode->data, winode->size, hash, str,
+                               name->len);
+        if (!found) {
+            return -ENOENT;
+        }
+        *ino = found->ino;
+        return 0;
+    }
+
+    struct meta_entry *entry = get_dir_block(dir, 0);
+    if (IS_ERR(entry)) {
+        return PTR_ERR(entry);
+    }
+    struct dir_header *head = (struct dir_header *) get_block_data(entry->blk);
+    __u32 const nbuckets = head->nbuckets;
+    if (unlikely(head->depth > get_dir_max_depth(meta))) {
+        ret = -EIO;
+        goto exit;
+    }
+    __u32 iblock;
+    __u16 offset;
+    get_dir_slot(meta, hash & ((1U << head->depth) - 1), &iblock, &offset);
+    if (iblock) {
+        wlfs_mcache_put(dir->i_sb, entry);
+        entry = get_dir_block(dir, iblock);
+        if (IS_ERR(entry)) {
+            return PTR_ERR(entry);
+        }
+    }
+    __u32 const nr =
+        *(__u32 *) ((__u8 *) get_block_data(entry->blk) + offset);
+    wlfs_mcache_put(dir->i_sb, entry);
+    if (unlikely(nr >= nbuckets)) {
+        printk(KERN_ERR "Directory %lu points past its last bucket\n",
+               dir->i_ino);
+        return -EIO;
+    }
+
+    entry = get_dir_block(dir, DIR_INDEX_BLOCKS + nr);
+    if (IS_ERR(entry)) {
+        return PTR_ERR(entry);
+    }
+    struct dir_bucket *bucket =
+        (struct dir_bucket *) get_block_data(entry->blk);
+    if (unlikely(bucket->bytes >
+                 get_block_bytes(meta) - sizeof(struct dir_bucket))) {
+        ret = -EIO;
+        goto exit;
+    }
+    found = find_dir_entry(bucket + 1, bucket->bytes, hash, str, name->len);
+    if (found) {
+        *ino = found->ino;
+    } else {
+        ret = -ENOENT;
+    }
+
+exit:
+    wlfs_mcache_put(dir->i_sb, entry);
+    return ret;
+}
+
+// Every block a lookup or listing reaches was written, so a hole means the
+// directory is corrupt; directories are never compressed
+struct meta_entry *get_dir_block (struct inode *dir, __u32 iblock) {
+    wlfs_daddr_t daddr;
+    struct extent cluster;
+    __u32 count;
+
+    int const ret = wlfs_bmap(dir->i_sb, WLFS_I(dir)->iblk, iblock, &daddr,
+                              &count, &cluster);
+    if (unlikely(ret)) {
+        return ERR_PTR(ret);
+    }
+    if (unlikely(!daddr || cluster.stored)) {
+        printk(KERN_ERR "Block %u of directory %lu can't be read\n", iblock,
+               dir->i_ino);
+        return ERR_PTR(-EIO);
+    }
+    struct meta_entry *entry =
+        wlfs_mcache_get(dir->i_sb, daddr, dir->i_ino, BLOCK_DATA);
+    if (!IS_ERR(entry) && unlikely(entry->blk->offset != iblock)) {
+        printk(KERN_ERR "Block %llu is not block %u of directory %lu\n",
+               daddr, iblock, dir->i_ino);
+        wlfs_mcache_put(dir->i_sb, entry);
+        return ERR_PTR(-EIO);
+    }
+    return entry;
+}
+
+bool emit_entries (struct dir_context *ctx, __u32 nr, void *entries,
+                   __u32 bytes) {
+    __u32 pos = (ctx->pos - 2) & ((1 << DIR_POS_SHIFT) - 1);
+
+    while (pos < bytes) {
+        struct dir_entry *entry = (struct dir_entry *) ((__u8 *) entries + pos);
+        __u32 const size = DIR_ENTRY_SIZE(entry->len);
+        if (unlikely(size > bytes - pos)) {
+            break;
+        }
+        if (!dir_emit(ctx, entry->name, entry->len, entry->ino, entry->type)) {
+            return false;
+        }
+        pos += size;
+        ctx->pos = 2 + ((loff_t) nr << DIR_POS_SHIFT | pos);
+    }
+    return true;
+}
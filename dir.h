@@ -0,0 +1,11 @@
+/*
+ * Directory operations: looking names up & listing entries, whether they
+ * are inline in the directory's inode or behind its hash index
+ */
+
+#pragma once
+
+#include <linux/fs.h>
+
+extern struct inode_operations const wlfs_dir_inode_ops;
+extern struct file_operations const wlfs_dir_ops;
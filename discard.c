@@ -0,0 +1,216 @@
+#include <linux/bitops.h>
+#include <linux/blkdev.h>
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/printk.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "discard.h"
+#include "segmap.h"
+#include "super.h"
+#include "util.h"
+
+// Most segments discarded in the background per DISCARD_PERIOD, so discards
+// don't crowd out the log's own writes; 0 leaves freed segments for FITRIM
+static unsigned discard_max_segments = 256;
+module_param(discard_max_segments, uint, 0644);
+MODULE_PARM_DESC(discard_max_segments,
+                 "Segments discarded in the background per second (0: off)");
+
+// Discard the segments freed since the last batch, up to the rate limit
+static void wlfs_discard_work (struct work_struct *work);
+// Check whether a batch can be withheld from the log heads without leaving
+// them short of clean segments
+static bool has_spare_segments (struct wlfs_super *wlfs_sb);
+// Issue one discard per run of consecutive segments in an ascending batch,
+// skipping runs shorter than minlen blocks; adds the blocks discarded to
+// *discarded if given
+static int issue_discards (struct super_block *sb, __u32 const *segments,
+                           __u32 n, __u64 minlen, __u64 *discarded);
+
+int wlfs_discard_start (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct discarder *d = &wlfs_sb->discard;
+
+    mutex_init(&d->lock);
+    d->sb = sb;
+    INIT_DELAYED_WORK(&d->work, wlfs_discard_work);
+    if (!blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+        return 0;
+    }
+
+    d->pending = (unsigned long *) kcalloc(
+        BITS_TO_LONGS(wlfs_sb->meta.segments), sizeof(unsigned long),
+        GFP_KERNEL);
+    d->batch = (__u32 *) kmalloc(DISCARD_BATCH * sizeof(__u32), GFP_KERNEL);
+    d->wq = alloc_workqueue("wlfs-discard", WQ_FREEZABLE, 1);
+    if (unlikely(!d->pending || !d->batch || !d->wq)) {
+        kfree(d->pending);
+        kfree(d->batch);
+        if (d->wq) {
+            destroy_workqueue(d->wq);
+        }
+        d->pending = NULL;
+        d->batch = NULL;
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void wlfs_discard_stop (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct discarder *d = &wlfs_sb->discard;
+
+    if (!d->pending) {
+        return;
+    }
+    cancel_delayed_work_sync(&d->work);
+    destroy_workqueue(d->wq);
+    spin_lock(&wlfs_sb->segmap_lock);
+    kfree(d->pending);
+    d->pending = NULL;
+    spin_unlock(&wlfs_sb->segmap_lock);
+    kfree(d->batch);
+    printk(KERN_INFO "wlfs discarded %lld segments in %lld ranges\n",
+           (long long) wlfs_stat_read(wlfs_sb, STAT_SEGMENTS_DISCARDED),
+           (long long) wlfs_stat_read(wlfs_sb, STAT_DISCARD_RANGES));
+}
+
+void wlfs_discard_kick (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct discarder *d = &wlfs_sb->discard;
+
+    // A batch already scheduled picks up the newly released segments too
+    if (d->pending && discard_max_segments) {
+        queue_delayed_work(d->wq, &d->work, DISCARD_PERIOD * HZ);
+    }
+}
+
+// Only segments lying wholly within the range are discarded: a partial
+// segment would leave the rest of its erase blocks in use anyway
+int wlfs_discard_trim (struct super_block *sb, struct fstrim_range *range) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    struct discarder *d = &wlfs_sb->discard;
+    struct request_queue *q = bdev_get_queue(sb->s_bdev);
+    unsigned const shift = ilog2(meta->block_size);
+    __u32 const bits = get_segmap_bits(meta);
+    __u64 const first = get_segment_daddr(meta, 0);
+    __u64 discarded = 0;
+    int ret = 0;
+
+    if (!d->pending || !blk_queue_discard(q)) {
+        return -EOPNOTSUPP;
+    }
+    if (range->len < meta->block_size) {
+        return -EINVAL;
+    }
+    __u64 const start = range->start >> shift;
+    __u64 const end = (range->len > ULLONG_MAX - range->start ?
+                       ULLONG_MAX : range->start + range->len) >> shift;
+    __u64 const minlen =
+        max_t(__u64, range->minlen, q->limits.discard_granularity) >> shift;
+    __u32 next = start <= first ? 0 :
+        min_t(__u64, DIV_ROUND_UP(start - first, bits), meta->segments);
+    __u32 const last = end <= first ? 0 :
+        min_t(__u64, (end - first) / bits, meta->segments);
+
+    mutex_lock(&d->lock);
+    while (next < last && has_spare_segments(wlfs_sb)) {
+        if (fatal_signal_pending(current)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        __u32 const n = wlfs_segmap_take_unused(wlfs_sb, false, &next, last,
+                                                d->batch, DISCARD_BATCH);
+        ret = issue_discards(sb, d->batch, n, minlen, &discarded);
+        wlfs_segmap_put_unused(wlfs_sb, d->batch, n);
+        if (unlikely(ret)) {
+            break;
+        }
+        cond_resched();
+    }
+    mutex_unlock(&d->lock);
+
+    range->len = discarded << shift;
+    return ret;
+}
+
+/*
+ * Helper functions
+ */
+
+// Each pass walks the pending bitmap in address order, so segments freed
+// next to each other go out as one range however far apart in time they
+// were freed
+void wlfs_discard_work (struct work_struct *work) {
+    struct discarder *d =
+        container_of(to_delayed_work(work), struct discarder, work);
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) d->sb->s_fs_info;
+    __u32 const segments = wlfs_sb->meta.segments;
+    __u32 budget = discard_max_segments;
+    __u32 next = 0;
+
+    mutex_lock(&d->lock);
+    while (next < segments && budget > 0 && has_spare_segments(wlfs_sb)) {
+        __u32 const n = wlfs_segmap_take_unused(
+            wlfs_sb, true, &next, segments, d->batch,
+            min_t(__u32, budget, DISCARD_BATCH));
+        int const ret = issue_discards(d->sb, d->batch, n, 0, NULL);
+        wlfs_segmap_put_unused(wlfs_sb, d->batch, n);
+        if (unlikely(ret)) {
+            // The segments stay clean; only the device misses out
+            printk(KERN_ERR "Failed to discard freed segments: %d\n", ret);
+            next = segments;
+            break;
+        }
+        budget -= n;
+    }
+    mutex_unlock(&d->lock);
+
+    // Whatever is left over waits for the next period
+    if (next < segments) {
+        queue_delayed_work(d->wq, &d->work, DISCARD_PERIOD * HZ);
+    }
+}
+
+bool has_spare_segments (struct wlfs_super *wlfs_sb) {
+    return ACCESS_ONCE(wlfs_sb->clean_segments) >
+        READ_ONCE(wlfs_sb->opts.min_clean_segs) + DISCARD_BATCH;
+}
+
+int issue_discards (struct super_block *sb, __u32 const *segments, __u32 n,
+                    __u64 minlen, __u64 *discarded) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    unsigned const shift = ilog2(meta->block_size) - 9;
+    __u32 const bits = get_segmap_bits(meta);
+
+    __u32 i = 0;
+    while (i < n) {
+        __u32 j = i + 1;
+        for (; j < n && segments[j] == segments[j - 1] + 1; ++j);
+        sector_t const blocks = (sector_t) (j - i) * bits;
+        if (blocks >= minlen) {
+            int const ret = blkdev_issue_discard(
+                sb->s_bdev, get_segment_daddr(meta, segments[i]) << shift,
+                blocks << shift, GFP_NOFS, 0);
+            if (unlikely(ret)) {
+                return ret;
+            }
+            wlfs_stat_add(wlfs_sb, STAT_SEGMENTS_DISCARDED, j - i);
+            wlfs_stat_add(wlfs_sb, STAT_DISCARD_RANGES, 1);
+            if (discarded) {
+                *discarded += blocks;
+            }
+        }
+        i = j;
+    }
+    return 0;
+}
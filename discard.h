@@ -0,0 +1,42 @@
+/*
+ * Discarding freed segments: in the background as checkpoints release them,
+ * & on demand for FITRIM
+ */
+
+#pragma once
+
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+// Seconds freed segments wait before they are discarded, so neighbours freed
+// soon after are merged into the same range
+#define DISCARD_PERIOD 1
+// Segments taken off the index per batch of discards; a log head can't take
+// them until the batch is issued
+#define DISCARD_BATCH 32
+
+struct discarder {
+    struct super_block *sb;
+    // Serializes background batches & FITRIM
+    struct mutex lock;
+    struct workqueue_struct *wq;
+    struct delayed_work work;
+    // Segments freed since they were last discarded, protected by the
+    // segmap lock; NULL if the device can't discard
+    unsigned long *pending;
+    // Segments of the batch being discarded
+    __u32 *batch;
+};
+
+// Start discarding freed segments, if the device supports it
+int wlfs_discard_start (struct super_block *sb);
+// Stop discarding; segments still pending are left for FITRIM
+void wlfs_discard_stop (struct super_block *sb);
+// Schedule discards for segments released by a checkpoint
+void wlfs_discard_kick (struct super_block *sb);
+// Discard the clean segments lying wholly within a FITRIM range, in runs of
+// at least its minimum length; sets the range's length to the bytes
+// discarded
+int wlfs_discard_trim (struct super_block *sb, struct fstrim_range *range);
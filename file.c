@@ -0,0 +1,536 @@
+#include <linux/backing-dev.h>
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "bmap.h"
+#include "compress.h"
+#include "file.h"
+#include "inode.h"
+#include "io.h"
+#include "super.h"
+#include "trace.h"
+#include "util.h"
+
+// Largest gap on disk, in blocks, bridged to merge two runs into one read
+#define RA_MAX_GAP 32
+// Readahead windows widen up to this many times the device's default
+#define RA_MAX_SCALE 4
+
+// A run of a file's blocks contiguous on disk, part of a compressed
+// cluster, or a hole
+struct file_run {
+    __u64 daddr;
+    // Offset of the first block within the range being read
+    __u32 offset;
+    __u32 nblocks;
+    // Block slot the first block is read into, in the page-cache pages if
+    // the run is read straight into them, or in the scratch pages
+    __u32 slot;
+    bool direct;
+    // The whole cluster, if the run is part of one; cluster.stored is 0
+    // otherwise
+    struct extent cluster;
+};
+
+// Read a single page
+static int wlfs_readpage (struct file *file, struct page *page);
+// Read the pages of a readahead window, a range of consecutive pages at a
+// time
+static int wlfs_readpages (struct file *file, struct address_space *mapping,
+                           struct list_head *pages, unsigned nr_pages);
+// Fill locked page-cache pages with consecutive indices from the blocks
+// behind them, then unlock them; file may be NULL
+static void read_range (struct file *file, struct inode *inode,
+                        struct page **pages, unsigned n);
+// Widen or narrow an inode's read merging gap & a file's readahead window
+// by the hit rate of a read: wanted of read blocks, in nreads requests
+static void adapt_window (struct file *file, struct inode *inode,
+                          __u32 wanted, __u32 read, __u32 nreads);
+// Read an uncompressed run straight into the page-cache pages if it fits in
+// their block slots from *next on, below slots, trimming it to the blocks
+// which do; blocks only partly in [start, end) are left to the scratch pages
+static void place_direct (struct wlfs_super_meta *meta, struct file_run *run,
+                          loff_t start, loff_t end, __u32 first,
+                          __u32 slots, __u32 *next);
+// Check that a block read holds a given block of an inode's data
+static bool check_data_block (struct inode *inode, struct block *blk,
+                              __u32 iblock, __u64 daddr);
+// Order file runs by ascending disk address
+static int compare_runs (void const *a, void const *b);
+// Number of blocks a run takes on disk
+static __u32 get_run_blocks (struct file_run const *run);
+// Check the blocks a compressed cluster was read into & decompress it into
+// buf, after gathering its compressed data into the second half of buf
+static int unpack_cluster (struct inode *inode, struct page **scratch,
+                           struct file_run const *run, __u8 *buf);
+// Make the log blocks of a file stable, without a checkpoint
+static int wlfs_fsync (struct file *file, loff_t start, loff_t end,
+                       int datasync);
+// Copy len bytes into a range of pages starting at file position start, at
+// file position pos; zero them if src is NULL
+static void copy_to_pages (struct page **pages, loff_t start, loff_t pos,
+                           void const *src, size_t len);
+
+struct address_space_operations const wlfs_aops = {
+    .readpage = wlfs_readpage,
+    .readpages = wlfs_readpages,
+};
+
+struct file_operations const wlfs_file_ops = {
+    .llseek = generic_file_llseek,
+    .read_iter = generic_file_read_iter,
+    .mmap = generic_file_readonly_mmap,
+    .splice_read = generic_file_splice_read,
+    .fsync = wlfs_fsync,
+};
+
+int wlfs_readpage (struct file *file, struct page *page) {
+    read_range(file, page->mapping->host, &page, 1);
+    return 0;
+}
+
+int wlfs_readpages (struct file *file, struct address_space *mapping,
+                    struct list_head *pages, unsigned nr_pages) {
+    gfp_t const gfp = GFP_KERNEL & mapping_gfp_mask(mapping);
+    struct page **range = (struct page **) kmalloc_array(
+        nr_pages, sizeof(struct page *), GFP_NOFS);
+    if (unlikely(!range)) {
+        return -ENOMEM;
+    }
+
+    // Pages come off the tail of the list, lowest index first; pages which
+    // are already cached split the window into ranges
+    unsigned n = 0;
+    unsigned i = 0;
+    for (; i < nr_pages; ++i) {
+        struct page *page = lru_to_page(pages);
+        list_del(&page->lru);
+        if (add_to_page_cache_lru(page, mapping, page->index, gfp)) {
+            page_cache_release(page);
+            continue;
+        }
+        if (n && page->index != range[n - 1]->index + 1) {
+            read_range(file, mapping->host, range, n);
+            for (; n > 0; --n) {
+                page_cache_release(range[n - 1]);
+            }
+        }
+        range[n++] = page;
+    }
+    if (n) {
+        read_range(file, mapping->host, range, n);
+        for (; n > 0; --n) {
+            page_cache_release(range[n - 1]);
+        }
+    }
+
+    kfree(range);
+    return 0;
+}
+
+// File data is only written to the log, so there are no dirty pages to
+// write back.  Whatever of the file is buffered, such as blocks the cleaner
+// relocated, is committed by writing the open partial segments, which
+// recovery rolls forward; the device cache flush is shared with concurrent
+// syncs
+int wlfs_fsync (struct file *file, loff_t start, loff_t end, int datasync) {
+    struct inode *inode = file_inode(file);
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) inode->i_sb->s_fs_info;
+    ktime_t const begin = ktime_get();
+
+    int const ret = wlfs_segbuf_sync(inode->i_sb);
+    __s64 const ns = ktime_to_ns(ktime_sub(ktime_get(), begin));
+    wlfs_stat_add(wlfs_sb, STAT_FSYNCS, 1);
+    wlfs_stat_add(wlfs_sb, STAT_FSYNC_NS, ns);
+    trace_wlfs_fsync(inode->i_sb, inode->i_ino, ret, ns);
+    return ret;
+}
+
+/*
+ * Helper functions
+ */
+
+// The blocks behind the range are mapped into runs contiguous on disk &
+// read with as few multi-page bios as possible, all under one plug.  Every
+// block starts with a header, which leaves its data off sector alignment, so
+// no bio can land the data in place.  Instead, whole uncompressed blocks are
+// read straight into the page-cache pages, each at or above where its data
+// goes, & once checked their data is moved down into place in file order;
+// data never moves over a block yet to be moved.  The rest, i.e., partial
+// blocks, compressed clusters & blocks past the room left in the pages, go
+// through scratch pages laid out in disk order & are copied out.  After
+// overwrites & cleaning a file's blocks follow the order they were written
+// in rather than file order, so scratch runs close together on disk are
+// merged into one read, bridging the gap between them.  A compressed
+// cluster is read whole & decompressed, however few of its blocks are wanted
+void read_range (struct file *file, struct inode *inode, struct page **pages,
+                 unsigned n) {
+    struct super_block *sb = inode->i_sb;
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    struct wlfs_inode_info *info = WLFS_I(inode);
+    __u16 const bytes = get_block_bytes(meta);
+    loff_t const start = page_offset(pages[0]);
+    loff_t const limit = start + (loff_t) n * PAGE_SIZE;
+    loff_t const end = min_t(loff_t, limit, i_size_read(inode));
+    struct file_run *runs = NULL;
+    struct file_run **order = NULL;
+    struct block_run *reads = NULL;
+    struct page **scratch = NULL;
+    __u8 *unpacked = NULL;
+    char *base = NULL;
+    __u32 npages = 0;
+    int ret = 0;
+
+    if (end <= start || !info->iblk) {
+        copy_to_pages(pages, start, start, NULL, limit - start);
+        goto exit;
+    }
+    // Past the end of the file, pages read as zeros
+    copy_to_pages(pages, start, end, NULL, limit - end);
+    // Inline data came in with the inode's block
+    struct wlfs_inode *winode = 
+        (struct wlfs_inode *) get_block_data(info->iblk);
+    if (winode->flags & WLFS_INODE_INLINE) {
+        if (unlikely(end > get_inline_bytes(meta))) {
+            ret = -EIO;
+        } else {
+            copy_to_pages(pages, start, start, winode->data + start,
+                          end - start);
+        }
+        goto exit;
+    }
+
+    __u32 const first = start / bytes;
+    __u32 const nblocks = (end - 1) / bytes - first + 1;
+    runs = (struct file_run *) kmalloc_array(
+        nblocks, sizeof(struct file_run), GFP_NOFS);
+    order = (struct file_run **) kmalloc_array(
+        nblocks, sizeof(struct file_run *), GFP_NOFS);
+    reads = (struct block_run *) kmalloc_array(
+        nblocks, sizeof(struct block_run), GFP_NOFS);
+    if (unlikely(!runs || !order || !reads)) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+
+    // Blocks read into the page-cache pages stay clear of the zeros past
+    // the end of the file.  If the pages can't be mapped, everything goes
+    // through the scratch pages
+    __u32 const dslots = (end - start) / meta->block_size;
+    if (dslots) {
+        base = (char *) vmap(pages, n, VM_MAP, PAGE_KERNEL);
+    }
+
+    __u32 nruns = 0;
+    __u32 ndata = 0;
+    __u32 dnext = 0;
+    __u32 offset = 0;
+    while (offset < nblocks) {
+        struct file_run *run = &runs[nruns++];
+        wlfs_daddr_t daddr;
+        __u32 count;
+        ret = wlfs_bmap(sb, info->iblk, first + offset, &daddr, &count,
+                        &run->cluster);
+        if (unlikely(ret)) {
+            goto exit;
+        }
+        run->daddr = daddr;
+        run->offset = offset;
+        run->nblocks = min(count, nblocks - offset);
+        run->direct = false;
+        if (daddr) {
+            if (base && !run->cluster.stored) {
+                place_direct(meta, run, start, end, first, dslots, &dnext);
+            }
+            order[ndata++] = run;
+        }
+        offset += run->nblocks;
+    }
+
+    // Plan reads in disk order, extending a scratch read over a gap of up to
+    // the inode's current limit to take in the next run
+    sort(order, ndata, sizeof(struct file_run *), compare_runs, NULL);
+    __u32 const gap = ACCESS_ONCE(info->ra_gap);
+    struct block_run *last = NULL;
+    __u32 nreads = 0;
+    __u32 slots = 0;
+    __u32 direct = 0;
+    __u32 i = 0;
+    for (; i < ndata; ++i) {
+        struct file_run *run = order[i];
+        __u32 const blocks = get_run_blocks(run);
+        if (run->direct) {
+            struct block_run *read = &reads[nreads++];
+            read->pages = pages;
+            read->daddr = run->daddr;
+            read->slot = run->slot;
+            read->nblocks = blocks;
+            direct += blocks;
+            continue;
+        }
+        __u64 const last_end = last ? last->daddr + last->nblocks : 0;
+        if (last && run->daddr >= last_end && run->daddr - last_end <= gap) {
+            last->nblocks = run->daddr + blocks - last->daddr;
+        } else {
+            last = &reads[nreads++];
+            last->pages = NULL;
+            last->daddr = run->daddr;
+            last->slot = slots;
+            last->nblocks = blocks;
+        }
+        run->slot = last->slot + (run->daddr - last->daddr);
+        slots = last->slot + last->nblocks;
+    }
+
+    if (slots) {
+        npages = DIV_ROUND_UP((unsigned long) slots * meta->block_size,
+                              PAGE_SIZE);
+        scratch = wlfs_alloc_pages(npages, meta->block_size);
+        if (unlikely(!scratch)) {
+            ret = -ENOMEM;
+            goto exit;
+        }
+        for (i = 0; i < nreads; ++i) {
+            if (!reads[i].pages) {
+                reads[i].pages = scratch;
+            }
+        }
+    }
+    ret = wlfs_read_runs(sb, reads, nreads);
+    if (unlikely(ret)) {
+        goto exit;
+    }
+    if (base) {
+        invalidate_kernel_vmap_range(base, n * PAGE_SIZE);
+    }
+
+    __u32 wanted = 0;
+    for (i = 0; i < nruns; ++i) {
+        struct extent const *cluster = &runs[i].cluster;
+        __u32 const skip = first + runs[i].offset - cluster->offset;
+        if (cluster->stored) {
+            if (!unpacked) {
+                unpacked = (__u8 *) vmalloc(2 * COMPRESS_CLUSTER * bytes);
+                if (unlikely(!unpacked)) {
+                    ret = -ENOMEM;
+                    goto exit;
+                }
+            }
+            ret = unpack_cluster(inode, scratch, &runs[i], unpacked);
+            if (unlikely(ret)) {
+                goto exit;
+            }
+            wanted += cluster->stored;
+        }
+
+        __u32 j = 0;
+        for (; j < runs[i].nblocks; ++j) {
+            __u32 const iblock = first + runs[i].offset + j;
+            loff_t const pos = (loff_t) iblock * bytes;
+            loff_t const from = max(pos, start);
+            loff_t const to = min_t(loff_t, pos + bytes, end);
+            void const *src = NULL;
+            if (cluster->stored) {
+                src = unpacked + (skip + j) * bytes + (from - pos);
+            } else if (runs[i].daddr) {
+                struct block *blk = runs[i].direct ?
+                    (struct block *) (base + (unsigned long)
+                                      (runs[i].slot + j) * meta->block_size) :
+                    wlfs_get_block(scratch, meta->block_size,
+                                   runs[i].slot + j);
+                if (unlikely(!check_data_block(inode, blk, iblock,
+                                               runs[i].daddr + j))) {
+                    ret = -EIO;
+                    goto exit;
+                }
+                src = (char *) get_block_data(blk) + (from - pos);
+                ++wanted;
+                if (runs[i].direct) {
+                    memmove(base + (from - start), src, to - from);
+                    continue;
+                }
+            }
+            copy_to_pages(pages, start, from, src, to - from);
+        }
+    }
+    if (base) {
+        flush_kernel_vmap_range(base, n * PAGE_SIZE);
+    }
+    adapt_window(file, inode, wanted, slots + direct, nreads);
+
+exit:
+    if (unlikely(ret)) {
+        printk(KERN_ERR "Error %d reading inode %lu\n", ret, inode->i_ino);
+    }
+    unsigned p = 0;
+    for (; p < n; ++p) {
+        if (likely(!ret)) {
+            flush_dcache_page(pages[p]);
+            SetPageUptodate(pages[p]);
+        } else {
+            SetPageError(pages[p]);
+        }
+        unlock_page(pages[p]);
+    }
+    if (base) {
+        vunmap(base);
+    }
+    if (scratch) {
+        wlfs_free_pages(scratch, npages);
+    }
+    vfree(unpacked);
+    kfree(reads);
+    kfree(order);
+    kfree(runs);
+}
+
+// The hit rate is the share of blocks read which were wanted.  While nearly
+// every block read is wanted, bridging wider gaps is cheap, & if the window
+// still took several requests, a wider window gives reads more runs to
+// merge; once too many unwanted blocks are read, both back off
+void adapt_window (struct file *file, struct inode *inode, __u32 wanted,
+                   __u32 read, __u32 nreads) {
+    struct wlfs_inode_info *info = WLFS_I(inode);
+    __u32 const gap = ACCESS_ONCE(info->ra_gap);
+
+    if (read == 0) {
+        return;
+    }
+    if (wanted * 4 >= read * 3) {
+        WRITE_ONCE(info->ra_gap, min_t(__u32, gap ? gap * 2 : 1, RA_MAX_GAP));
+        if (file && nreads > 1) {
+            unsigned long const max_pages =
+                inode_to_bdi(inode)->ra_pages * RA_MAX_SCALE;
+            file->f_ra.ra_pages = min_t(unsigned long,
+                                        max(file->f_ra.ra_pages * 2, 1U),
+                                        max_pages);
+        }
+    } else if (wanted * 2 < read) {
+        WRITE_ONCE(info->ra_gap, gap / 2);
+        if (file) {
+            file->f_ra.ra_pages = max_t(unsigned long,
+                                        file->f_ra.ra_pages / 2,
+                                        inode_to_bdi(inode)->ra_pages);
+        }
+    }
+}
+
+// A block's data is moved down to where it goes, so its raw copy must start
+// at or above that, & each run's slots follow the last's: data moved in file
+// order then only lands on blocks already moved
+void place_direct (struct wlfs_super_meta *meta, struct file_run *run,
+                   loff_t start, loff_t end, __u32 first, __u32 slots,
+                   __u32 *next) {
+    __u16 const bytes = get_block_bytes(meta);
+    loff_t const pos = (loff_t) (first + run->offset) * bytes;
+
+    if (pos < start) {
+        run->nblocks = 1;
+        return;
+    }
+    __u32 const whole = (end - pos) / bytes;
+    __u32 const slot = max_t(__u32, *next,
+                             DIV_ROUND_UP(pos - start, meta->block_size));
+    if (whole == 0 || slot >= slots) {
+        return;
+    }
+    run->nblocks = min3(run->nblocks, whole, slots - slot);
+    run->slot = slot;
+    run->direct = true;
+    *next = slot + run->nblocks;
+}
+
+bool check_data_block (struct inode *inode, struct block *blk, __u32 iblock,
+                       __u64 daddr) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) inode->i_sb->s_fs_info;
+
+    if (unlikely(blk->type != BLOCK_DATA ||
+                 blk->index != inode->i_ino ||
+                 blk->offset != iblock ||
+                 !check_block_csum(&wlfs_sb->meta, blk))) {
+        printk(KERN_ERR "Block %llu doesn't hold block %u of inode %lu\n",
+               daddr, iblock, inode->i_ino);
+        return false;
+    }
+    return true;
+}
+
+int compare_runs (void const *a, void const *b) {
+    __u64 const lhs = (*(struct file_run *const *) a)->daddr;
+    __u64 const rhs = (*(struct file_run *const *) b)->daddr;
+    return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+
+__u32 get_run_blocks (struct file_run const *run) {
+    return run->cluster.stored ? run->cluster.stored : run->nblocks;
+}
+
+int unpack_cluster (struct inode *inode, struct page **scratch,
+                    struct file_run const *run, __u8 *buf) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) inode->i_sb->s_fs_info;
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    struct extent const *cluster = &run->cluster;
+    __u16 const bytes = get_block_bytes(meta);
+    __u8 *packed = buf + COMPRESS_CLUSTER * bytes;
+
+    if (unlikely(cluster->length > COMPRESS_CLUSTER ||
+                 cluster->stored > COMPRESS_CLUSTER)) {
+        return -EIO;
+    }
+    __u32 i = 0;
+    for (; i < cluster->stored; ++i) {
+        struct block *blk = wlfs_get_block(scratch, meta->block_size,
+                                           run->slot + i);
+        if (unlikely(blk->type != BLOCK_DATA ||
+                     blk->index != inode->i_ino ||
+                     blk->offset != cluster->offset ||
+                     !check_block_csum(meta, blk))) {
+            printk(KERN_ERR "Block %llu doesn't hold cluster %u of inode "
+                   "%lu\n", run->daddr + i, cluster->offset, inode->i_ino);
+            return -EIO;
+        }
+        memcpy(packed + i * bytes, get_block_data(blk), bytes);
+    }
+
+    struct compressed_cluster *header = (struct compressed_cluster *) packed;
+    if (unlikely(header->bytes > cluster->stored * bytes -
+                 sizeof(struct compressed_cluster) ||
+                 !wlfs_decompress(meta->compression, header->data,
+                                  header->bytes, buf,
+                                  cluster->length * bytes))) {
+        printk(KERN_ERR "Cluster %u of inode %lu is corrupt\n",
+               cluster->offset, inode->i_ino);
+        return -EIO;
+    }
+    return 0;
+}
+
+void copy_to_pages (struct page **pages, loff_t start, loff_t pos,
+                    void const *src, size_t len) {
+    while (len > 0) {
+        unsigned long const off = pos - start;
+        unsigned const in = off % PAGE_SIZE;
+        size_t const chunk = min_t(size_t, len, PAGE_SIZE - in);
+        char *addr = (char *) kmap_atomic(pages[off / PAGE_SIZE]);
+        if (src) {
+            memcpy(addr + in, src, chunk);
+            src = (char const *) src + chunk;
+        } else {
+            memset(addr + in, 0, chunk);
+        }
+        kunmap_atomic(addr);
+        pos += chunk;
+        len -= chunk;
+    }
+}
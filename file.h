@@ -0,0 +1,10 @@
+/*
+ * Regular file operations: reading file data from the log into the page cache
+ */
+
+#pragma once
+
+#include <linux/fs.h>
+
+extern struct address_space_operations const wlfs_aops;
+extern struct file_operations const wlfs_file_ops;
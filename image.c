@@ -0,0 +1,3745 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "image.h"
+#include "util.h"
+
+// As in the kernel: log2 of the number of write counters for classifying
+// data blocks, & the writes within the decay window after which one is hot
+#define HEAT_BITS 12
+#define HOT_WRITES 2
+// Segments the cleaner relocates between checkpoints, & how many of the
+// least utilized segments it weighs for each
+#define CLEANER_BATCH 8
+#define CANDIDATE_FACTOR 4
+
+// A file's data block addresses, in file order, as they're appended, laid
+// out like an image_file's map
+struct daddr_list {
+    wlfs_daddr_t *daddrs;
+    __u16 *stored;
+    __u32 n;
+    __u32 cap;
+};
+
+// Files whose mappings were written back, waiting for their inodes to be
+// appended, & the blocks all of their mappings changed
+struct commit_batch {
+    struct image_file **files;
+    __u32 nfiles;
+    struct daddr_list born;
+    struct daddr_list died;
+};
+
+// State of comparing a file's old mapping with its new one
+struct diff_state {
+    struct image_file *file;
+    // Bitmap of the offsets both map to the same blocks
+    __u8 *same;
+    struct daddr_list *died;
+};
+
+// Replay state of one log stream
+struct stream_cursor {
+    // Position being scanned, & the position after the last partial segment
+    // replayed from the stream
+    struct log_position pos;
+    struct log_position head;
+    // The next partial segment in the stream, summary first, if valid
+    struct block *blocks;
+    bool valid;
+};
+
+// Stamps of the newest copy replayed so far of each inode & map block
+struct replay_stamps {
+    __u64 *inodes;
+    __u64 *imap;
+    __u64 *segmap;
+};
+
+// Segment picked for cleaning
+struct victim {
+    __u32 segment;
+    __u64 score;
+};
+
+// State of copying a file's data out
+struct read_state {
+    int fd;
+    __u64 ino;
+    __u64 size;
+    __u64 pos;
+    struct block *blk;
+    // Decompressed cluster, allocated when the first one is read
+    __u8 *cluster;
+};
+
+// An indexed directory's index, read & written a block at a time: the
+// header block is held throughout, & one other index block at a time
+struct dir_index {
+    __u64 dir;
+    struct dir_header *head;
+    __u8 *buf;
+    // File block held in buf, 0 if none
+    __u32 iblock;
+    // Whether the header block & the block held changed since read
+    bool head_dirty;
+    bool dirty;
+};
+
+// Allocate empty maps sized by the superblock
+static int alloc_maps (struct wlfs_image *img);
+// Free the maps & log buffers
+static void free_maps (struct wlfs_image *img);
+// Read the most recent valid checkpoint region & the map blocks it points to
+static int load_checkpoint (struct wlfs_image *img);
+// Check that every block of a checkpoint region was written by the same
+// checkpoint
+static bool region_valid (struct wlfs_image *img, struct block *region);
+// Read map blocks from their addresses, checking they are what they claim
+static int load_map_blocks (struct wlfs_image *img, struct block **blocks,
+                            wlfs_daddr_t *daddrs, __u32 nblocks,
+                            enum block_type type);
+// Position each log head where the checkpoint left it, or on a clean segment
+static int open_log (struct wlfs_image *img);
+// Roll forward through the partial segments written after the checkpoint,
+// as recovery does at mount
+static int recover (struct wlfs_image *img);
+// Read the next partial segment of a stream, checking that it is complete,
+// was written by the checkpoint's mount & has a sequence number of at
+// least seq
+static int peek_partial (struct wlfs_image *img, struct stream_cursor *cur,
+                         unsigned stream, __u64 seq);
+// Point the maps at a block found in the log, unless a newer copy of it was
+// already replayed
+static void replay_block (struct wlfs_image *img,
+                          struct replay_stamps *stamps, struct block *blk,
+                          wlfs_daddr_t daddr);
+// Apply the segment usage changes a commit block lists
+static void apply_commit (struct wlfs_image *img, struct block *blk);
+// Inode map entry of an inode, allocating its map block if needed; NULL if
+// the inode number is out of range or allocation fails
+static wlfs_daddr_t *imap_entry (struct wlfs_image *img, __u64 ino);
+// Mark the block at a disk address as live or dead
+static void mark (struct wlfs_image *img, __u64 daddr, bool live);
+// Usage bitmap of a segment
+static __u8 *get_bitmap (struct wlfs_image *img, __u32 segment);
+// Check whether a segment is the one a log head fills or has reserved
+static bool is_reserved (struct wlfs_image *img, __u32 segment);
+// Take a clean, unpinned & unreserved segment; NO_SEGMENT if there is none
+static __u32 take_clean (struct wlfs_image *img);
+// Address of the n-th block slot in a log head's buffer
+static struct block *get_slot (struct wlfs_image *img,
+                               struct image_head *head, __u32 n);
+// Write the open partial segment of a log head, headed by its summary
+static int seal (struct wlfs_image *img, enum log_stream stream);
+// Move a log head into its reserved next segment
+static int advance (struct wlfs_image *img, enum log_stream stream);
+// Check whether any map block changed since the last checkpoint
+static bool maps_dirty (struct wlfs_image *img);
+// Append every dirty map block to the log
+static int append_maps (struct wlfs_image *img);
+// Build & write a checkpoint region for the log heads & map addresses
+static int write_region (struct wlfs_image *img, struct checkpoint *cp);
+// pread/pwrite whole blocks, treating short transfers as I/O errors
+static int read_blocks (struct wlfs_image *img, __u64 daddr, void *buf,
+                        __u32 n);
+static int write_blocks (struct wlfs_image *img, __u64 daddr,
+                         void const *buf, __u32 n);
+// Report the runs of nonzero pointers in an array of block pointers
+static int walk_ptrs (struct wlfs_image *img, wlfs_daddr_t const *ptrs,
+                      __u32 n, __u32 first, wlfs_run_fn fn, void *arg);
+// Walk an indirect block <depth> levels above the data blocks
+static int walk_tree (struct wlfs_image *img, __u64 ino,
+                      wlfs_daddr_t daddr, unsigned depth, __u32 first,
+                      wlfs_run_fn fn, void *arg);
+// Walk an array of extents <depth> levels above the data blocks
+static int walk_extents (struct wlfs_image *img, __u64 ino,
+                         struct extent const *ext, __u16 n, unsigned depth,
+                         wlfs_run_fn fn, void *arg);
+// Read a mapping block of an inode, checking that it is one
+static int read_indirect (struct wlfs_image *img, __u64 ino,
+                          wlfs_daddr_t daddr, struct block *blk);
+// Walk callbacks: copy data out, & free every block
+static int read_run (struct wlfs_image *img, __u32 iblock,
+                     wlfs_daddr_t daddr, __u32 count, __u16 stored,
+                     enum block_type type, void *arg);
+static int free_run (struct wlfs_image *img, __u32 iblock,
+                     wlfs_daddr_t daddr, __u32 count, __u16 stored,
+                     enum block_type type, void *arg);
+// Mark the data blocks a list points at dead, each compressed cluster once
+static void free_blocks (struct wlfs_image *img,
+                         struct daddr_list const *list);
+// Write zeros for a hole
+static int write_zeros (int fd, __u64 len);
+// Add an address to a list, growing it as needed
+static int push_daddr (struct daddr_list *list, wlfs_daddr_t daddr,
+                       __u16 stored);
+// Append a file's data, read from a file descriptor, to the log; data
+// small enough to be stored inline is copied to inline_data instead
+static int append_data (struct wlfs_image *img, __u64 ino, int fd,
+                        __u64 max_blocks, bool compress, __u8 *inline_data,
+                        struct daddr_list *list, __u64 *size);
+// Check whether the image compresses data & an inode maps its blocks with
+// extents, which can describe compressed clusters; only regular files are
+// compressed, as directory blocks are read one at a time
+static bool may_compress (struct wlfs_image *img, struct block *iblk);
+// Start a new segment for a log head unless n more blocks fit in the one it
+// fills, so they're written at consecutive addresses
+static int reserve (struct wlfs_image *img, enum log_stream stream,
+                    __u32 n);
+// Compress n blocks of a file's data, starting with file block first, &
+// append them to the cold stream as one cluster; *stored is the number of
+// blocks written, 0 if compressing wouldn't save a block
+static int write_cluster (struct wlfs_image *img, __u64 ino, __u32 first,
+                          __u8 const *data, __u32 n,
+                          wlfs_daddr_t *daddr, __u16 *stored);
+// Read a compressed cluster of a file, decompressing its blocks into data
+static int read_cluster (struct wlfs_image *img, __u64 ino,
+                         struct extent const *cluster, __u8 *data);
+// Compressed cluster holding a block of an in-memory file
+static void find_cluster (struct image_file *file, __u32 iblock,
+                          struct extent *cluster);
+// Rewrite the blocks of the compressed cluster holding a file block
+// uncompressed, except for that block, which is left a hole to be written
+static int split_cluster (struct wlfs_image *img, __u64 ino,
+                          struct image_file *file, __u32 iblock);
+// Move the compressed cluster holding a file block to the cold stream as is
+static int move_cluster (struct wlfs_image *img, __u64 ino,
+                         struct image_file *file, __u32 iblock);
+// Compress the cluster a file block falls in into the cold stream; returns
+// 0 if it can't be compressed or wouldn't shrink, & 1 if it was
+static int pack_cluster (struct wlfs_image *img, __u64 ino,
+                         struct image_file *file, __u32 iblock);
+// Point an inode at its data blocks through the indirect block tree,
+// listing the indirect blocks written
+static int build_tree (struct wlfs_image *img, struct block *iblk,
+                       struct daddr_list *list, struct daddr_list *mapping);
+// Write an indirect block <depth> levels above the data blocks
+static int build_indirect (struct wlfs_image *img, __u64 ino,
+                           wlfs_daddr_t const *ptrs, __u32 n,
+                           unsigned depth, __u32 first,
+                           struct daddr_list *mapping,
+                           wlfs_daddr_t *daddr);
+// Point an inode at its data blocks through extents, listing the extent
+// blocks written
+static int build_extents (struct wlfs_image *img, struct block *iblk,
+                          struct daddr_list *list, 
+                          struct daddr_list *mapping);
+// Set up a new inode block
+static void init_inode (struct wlfs_image *img, __u64 ino,
+                        struct block *blk);
+// Monotonic time (ns), ordering copies of a block like the kernel's stamps
+static __u64 get_stamp (void);
+// In-memory file of an inode, loading its mapping, or creating the inode if
+// asked to
+static int get_file (struct wlfs_image *img, __u64 ino, bool create,
+                     struct image_file **file);
+// Drop an in-memory file without writing it back
+static void put_file (struct wlfs_image *img, __u64 ino);
+// Make room for at least n data block addresses
+static int grow_map (struct image_file *file, __u64 n);
+// Move a file's inline data out to its first data block
+static int uninline_file (struct wlfs_image *img, __u64 ino,
+                          struct image_file *file);
+// Queue a file to be written back by the next sync
+static int dirty_file (struct wlfs_image *img, __u64 ino,
+                       struct image_file *file);
+// Write back a file's mapping & inode
+static int flush_file (struct wlfs_image *img, struct image_file *file);
+// Write back the mappings & inodes of changed files, in batches each
+// followed by commit blocks listing the blocks their mappings changed
+static int write_back (struct wlfs_image *img, struct image_file **files,
+                       __u32 n);
+// Write a file's mapping, freeing the old one, & list the blocks it changed
+static int rebuild_mapping (struct wlfs_image *img, struct image_file *file,
+                            struct daddr_list *born,
+                            struct daddr_list *died);
+// Blocks only a file's new mapping uses, & those only its old one did,
+// given the mapping blocks just written
+static int diff_mappings (struct wlfs_image *img, struct block *old,
+                          struct image_file *file,
+                          struct daddr_list const *mapping,
+                          struct daddr_list *born, struct daddr_list *died);
+// Append the inodes of a batch & the commit blocks following them, then
+// empty it
+static int commit_batch (struct wlfs_image *img, struct commit_batch *batch);
+// Add the addresses of one list to the end of another
+static int append_list (struct daddr_list *list,
+                        struct daddr_list const *src);
+// Seal the data streams, so the inodes written back next follow their data
+// in log order
+static int seal_data (struct wlfs_image *img);
+// Compare a run of a file's old mapping with the new one, noting the
+// offsets mapped the same way & listing the blocks which died
+static int diff_run (struct wlfs_image *img, __u32 iblock,
+                     wlfs_daddr_t daddr, __u32 count, __u16 stored,
+                     enum block_type type, void *arg);
+// Walk callbacks: record data block addresses, & free only mapping blocks
+static int map_run (struct wlfs_image *img, __u32 iblock,
+                    wlfs_daddr_t daddr, __u32 count, __u16 stored,
+                    enum block_type type, void *arg);
+static int free_mapping (struct wlfs_image *img, __u32 iblock,
+                         wlfs_daddr_t daddr, __u32 count, __u16 stored,
+                         enum block_type type, void *arg);
+// Log stream for a data block, counting the write
+static enum log_stream classify (struct wlfs_image *img, struct block *blk);
+// Pick up to n segments most worth cleaning, best first
+static unsigned pick_victims (struct wlfs_image *img, struct victim *victims,
+                              unsigned n);
+// Order victims by score, best first
+static int compare_victims (void const *a, void const *b);
+// Move or queue for rewriting every live block of a segment
+static int clean_segment (struct wlfs_image *img, __u32 segment,
+                          struct block *buf);
+// Move or queue for rewriting a live block found by the cleaner
+static int relocate (struct wlfs_image *img, struct block *blk,
+                     wlfs_daddr_t daddr);
+// In-memory file of a directory; returns -ENOTDIR if the inode isn't one
+static int get_dir (struct wlfs_image *img, __u64 dir,
+                    struct image_file **file);
+// Check that a name can be a directory entry, & get its length
+static int check_name (char const *name, __u8 *len);
+// File type of an inode, as a directory entry records it
+static int get_type (struct wlfs_image *img, __u64 ino, __u8 *type);
+// Append an entry to packed entries
+static void put_entry (__u8 *entries, __u32 *bytes, __u32 hash,
+                       char const *name, __u8 len, __u64 ino, __u8 type);
+// Remove an entry from packed entries, closing the gap
+static void drop_entry (__u8 *entries, __u32 *bytes, struct dir_entry *entry);
+// Move an inline directory's entries into the first bucket of a new index
+static int index_dir (struct wlfs_image *img, __u64 dir,
+                      struct image_file *file);
+// Add an entry to an indexed directory, splitting buckets until it fits
+static int add_indexed (struct wlfs_image *img, __u64 dir, __u32 hash,
+                        char const *name, __u8 len, __u64 ino, __u8 type);
+// Read an indexed directory's header block
+static int open_index (struct wlfs_image *img, __u64 dir,
+                       struct dir_index *idx);
+static void close_index (struct dir_index *idx);
+// Write the index block held if it changed, & the header block if asked to
+// & it changed
+static int flush_index (struct wlfs_image *img, struct dir_index *idx,
+                        bool head);
+// Get an index slot, reading the block holding it; if write, the block is
+// written by the next flush
+static int get_index_slot (struct wlfs_image *img, struct dir_index *idx,
+                           __u32 slot, bool write, __u32 **entry);
+// Read the bucket a hash falls in, & the slot & bucket number it was found
+// through
+static int read_bucket (struct wlfs_image *img, struct dir_index *idx,
+                        __u32 hash, __u32 *slot, __u32 *nr,
+                        struct dir_bucket *bucket);
+// Split a full bucket, moving the entries whose hashes have the next bit
+// set to a new bucket
+static int split_bucket (struct wlfs_image *img, struct dir_index *idx,
+                         __u32 slot, __u32 nr, struct dir_bucket *bucket);
+// Double the index, each new slot pointing where its twin does
+static int double_index (struct wlfs_image *img, struct dir_index *idx);
+
+int wlfs_image_open (struct wlfs_image *img, char const *path,
+                     bool writable) {
+    memset(img, 0, sizeof(struct wlfs_image));
+    img->writable = writable;
+    img->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (img->fd < 0) {
+        return -errno;
+    }
+
+    int ret = -EIO;
+    if (pread(img->fd, &img->meta, sizeof(struct wlfs_super_meta),
+              WLFS_OFFSET) != sizeof(struct wlfs_super_meta)) {
+        goto fail;
+    }
+    if (img->meta.magic != (__u32) WLFS_MAGIC ||
+        !check_segment_blocks(&img->meta)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    ret = alloc_maps(img);
+    if (ret) {
+        goto fail;
+    }
+    ret = load_checkpoint(img);
+    if (!ret) {
+        ret = recover(img);
+    }
+    if (ret) {
+        goto fail;
+    }
+    // Like a mount, commit the recovered state under a new mount number
+    // before writing anything
+    if (writable) {
+        ret = open_log(img);
+        if (!ret) {
+            ret = wlfs_image_checkpoint(img);
+        }
+        if (ret) {
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    free_maps(img);
+    close(img->fd);
+    return ret;
+}
+
+int wlfs_image_close (struct wlfs_image *img) {
+    int ret = 0;
+    if (img->writable) {
+        ret = wlfs_image_checkpoint(img);
+    }
+    free_maps(img);
+    if (close(img->fd) < 0 && !ret) {
+        ret = -errno;
+    }
+    return ret;
+}
+
+// Mirrors the kernel's checkpoint: cut the log, append the dirty map blocks,
+// make the log stable, then commit to the older region
+int wlfs_image_checkpoint (struct wlfs_image *img) {
+    struct checkpoint cp;
+    int ret;
+
+    if (!img->writable) {
+        return -EROFS;
+    }
+    ret = wlfs_image_sync(img);
+    if (ret) {
+        return ret;
+    }
+    unsigned s = 0;
+    for (; s < LOG_STREAMS; ++s) {
+        ret = seal(img, s);
+        if (ret) {
+            return ret;
+        }
+    }
+    if (img->seq == img->synced && img->checkpoint.mount == img->mount &&
+        !maps_dirty(img)) {
+        return 0;
+    }
+    cp.generation = img->checkpoint.generation + 1;
+    cp.seq = img->seq;
+    cp.mount = img->mount;
+    for (s = 0; s < LOG_STREAMS; ++s) {
+        cp.heads[s].segment = img->heads[s].segment;
+        cp.heads[s].offset = img->heads[s].start;
+        cp.heads[s].next = img->heads[s].next;
+    }
+
+    ret = append_maps(img);
+    for (s = 0; s < LOG_STREAMS && !ret; ++s) {
+        ret = seal(img, s);
+    }
+    if (ret) {
+        return ret;
+    }
+    if (fsync(img->fd) < 0) {
+        return -errno;
+    }
+    ret = write_region(img, &cp);
+    if (ret) {
+        return ret;
+    }
+    if (fsync(img->fd) < 0) {
+        return -errno;
+    }
+
+    img->checkpoint = cp;
+    img->region = !img->region;
+    img->synced = img->seq;
+    img->uncommitted = false;
+    ++img->stats.checkpoints;
+    // Nothing refers to the segments emptied before this checkpoint anymore
+    memset(img->pinned, 0, img->meta.segments * sizeof(bool));
+    return 0;
+}
+
+int wlfs_image_read_block (struct wlfs_image *img, wlfs_daddr_t daddr,
+                           struct block *blk) {
+    unsigned s = 0;
+    for (; s < LOG_STREAMS; ++s) {
+        struct image_head *head = &img->heads[s];
+        if (!head->buf || head->segment == NO_SEGMENT) {
+            continue;
+        }
+        __u64 const base = get_segment_daddr(&img->meta, head->segment);
+        if (daddr >= base + head->start && daddr < base + head->fill) {
+            memcpy(blk, get_slot(img, head, daddr - base),
+                   img->meta.block_size);
+            return 0;
+        }
+    }
+    int const ret = read_blocks(img, daddr, blk, 1);
+    if (!ret && !check_block_csum(&img->meta, blk)) {
+        return -EUCLEAN;
+    }
+    return ret;
+}
+
+int wlfs_image_append (struct wlfs_image *img, enum log_stream stream,
+                       struct block *blk, wlfs_daddr_t *daddr) {
+    struct image_head *head = &img->heads[stream];
+    __u32 const blocks = get_segmap_bits(&img->meta);
+
+    if (!img->writable) {
+        return -EROFS;
+    }
+    if (head->fill >= blocks) {
+        int ret = advance(img, stream);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    __u32 const slot = head->fill++;
+    blk->h0.wtime = blk->h1.wtime = time(NULL);
+    blk->h1.version = blk->h0.version;
+    blk->stamp = get_stamp();
+    struct block *copy = get_slot(img, head, slot);
+    memcpy(copy, blk, img->meta.block_size);
+    set_block_csum(&img->meta, copy);
+
+    wlfs_daddr_t const old = *daddr;
+    *daddr = get_segment_daddr(&img->meta, head->segment) + slot;
+    mark(img, *daddr, true);
+    if (old) {
+        mark(img, old, false);
+    }
+
+    // Write the segment as soon as it fills
+    if (head->fill == blocks) {
+        return seal(img, stream);
+    }
+    return 0;
+}
+
+wlfs_daddr_t wlfs_image_lookup (struct wlfs_image *img, __u64 ino) {
+    __u16 const entries = get_imap_entries(&img->meta);
+
+    if (ino >= img->meta.inodes || !img->imap[ino / entries]) {
+        return 0;
+    }
+    return ((wlfs_daddr_t *)
+            get_block_data(img->imap[ino / entries]))[ino % entries];
+}
+
+int wlfs_image_read_inode (struct wlfs_image *img, __u64 ino,
+                           struct block *blk) {
+    wlfs_daddr_t const daddr = wlfs_image_lookup(img, ino);
+    if (!daddr) {
+        return -ENOENT;
+    }
+    int ret = wlfs_image_read_block(img, daddr, blk);
+    if (ret) {
+        return ret;
+    }
+    if (blk->type != BLOCK_INODE || blk->index != ino) {
+        return -EUCLEAN;
+    }
+    return 0;
+}
+
+int wlfs_image_write_inode (struct wlfs_image *img, struct block *blk) {
+    wlfs_daddr_t *entry = imap_entry(img, blk->index);
+    if (!entry) {
+        return blk->index >= img->meta.inodes ? -EINVAL : -ENOMEM;
+    }
+
+    img->imap_dirty[blk->index / get_imap_entries(&img->meta)] = true;
+    return wlfs_image_append(img, STREAM_META, blk, entry);
+}
+
+int wlfs_image_walk (struct wlfs_image *img, struct block *iblk,
+                     wlfs_run_fn fn, void *arg) {
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(iblk);
+    __u32 const direct = NBLOCK_PTR - img->meta.indirection;
+    __u64 const entries = get_daddr_entries(&img->meta);
+
+    // Inline data has no blocks to walk
+    if (inode->flags & WLFS_INODE_INLINE) {
+        return inode->size > get_inline_bytes(&img->meta) ? -EUCLEAN : 0;
+    }
+    if (inode->flags & WLFS_INODE_EXTENTS) {
+        if (inode->nextents > get_inode_extents(&img->meta)) {
+            return -EUCLEAN;
+        }
+        return walk_extents(img, iblk->index, inode->extents,
+                            inode->nextents, inode->depth, fn, arg);
+    }
+
+    int ret = walk_ptrs(img, inode->blocks, direct, 0, fn, arg);
+    __u64 first = direct;
+    __u64 span = entries;
+    unsigned level = 0;
+    for (; level < img->meta.indirection && !ret; ++level) {
+        if (inode->blocks[direct + level]) {
+            ret = walk_tree(img, iblk->index, inode->blocks[direct + level],
+                            level + 1, first, fn, arg);
+        }
+        first += span;
+        span *= entries;
+    }
+    return ret;
+}
+
+int wlfs_image_read_file (struct wlfs_image *img, __u64 ino, int fd) {
+    struct read_state state = {fd, ino, 0, 0, NULL, NULL};
+    struct block *iblk = (struct block *) malloc(img->meta.block_size);
+    state.blk = (struct block *) malloc(img->meta.block_size);
+    int ret = -ENOMEM;
+    if (!iblk || !state.blk) {
+        goto exit;
+    }
+
+    if (ino < img->meta.inodes && img->files[ino] &&
+        img->files[ino]->dirty) {
+        ret = flush_file(img, img->files[ino]);
+        if (ret) {
+            goto exit;
+        }
+    }
+    ret = wlfs_image_read_inode(img, ino, iblk);
+    if (ret) {
+        goto exit;
+    }
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(iblk);
+    state.size = inode->size;
+    if (inode->flags & WLFS_INODE_INLINE) {
+        if (state.size > get_inline_bytes(&img->meta)) {
+            ret = -EUCLEAN;
+        } else if (write(fd, inode->data, state.size) !=
+                   (ssize_t) state.size) {
+            ret = -EIO;
+        }
+        goto exit;
+    }
+    ret = wlfs_image_walk(img, iblk, read_run, &state);
+    // Trailing hole
+    if (!ret && state.pos < state.size) {
+        ret = write_zeros(fd, state.size - state.pos);
+    }
+
+exit:
+    free(state.cluster);
+    free(state.blk);
+    free(iblk);
+    return ret;
+}
+
+// The new data & mapping are written before the old blocks are freed, so a
+// failure leaves the old contents intact
+int wlfs_image_write_file (struct wlfs_image *img, __u64 ino, int fd) {
+    struct daddr_list list = {NULL, NULL, 0, 0};
+    struct daddr_list mapping = {NULL, NULL, 0, 0};
+    struct block *old = (struct block *) malloc(img->meta.block_size);
+    struct block *iblk = (struct block *) malloc(img->meta.block_size);
+    bool exists = false;
+    int ret = -ENOMEM;
+    if (!old || !iblk) {
+        goto exit;
+    }
+    if (ino >= img->meta.inodes) {
+        ret = -EINVAL;
+        goto exit;
+    }
+    // Replace the file as last written back
+    if (img->files[ino]) {
+        if (img->files[ino]->dirty) {
+            ret = flush_file(img, img->files[ino]);
+            if (ret) {
+                goto exit;
+            }
+        }
+        put_file(img, ino);
+    }
+
+    ret = wlfs_image_read_inode(img, ino, old);
+    if (!ret) {
+        exists = true;
+        memcpy(iblk, old, img->meta.block_size);
+    } else if (ret == -ENOENT) {
+        init_inode(img, ino, iblk);
+    } else {
+        goto exit;
+    }
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(iblk);
+    bool const extents = inode->flags & WLFS_INODE_EXTENTS;
+
+    // Only the mapping is rebuilt; the rest of the inode carries over.  A
+    // small file's data replaces the mapping, so the inode is its only block
+    __u8 *const data = (__u8 *) malloc(get_inline_bytes(&img->meta));
+    if (!data) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+    __u64 size = 0;
+    ret = append_data(img, ino, fd,
+                      extents ? get_extent_max_blocks(&img->meta) :
+                      get_tree_max_blocks(&img->meta),
+                      may_compress(img, iblk), data, &list, &size);
+    if (!ret) {
+        inode->flags &= ~WLFS_INODE_INLINE;
+        inode->depth = 0;
+        inode->nextents = 0;
+        memset(inode->data, 0, get_inline_bytes(&img->meta));
+        if (size && !list.n) {
+            inode->flags |= WLFS_INODE_INLINE;
+            memcpy(inode->data, data, size);
+        } else {
+            ret = extents ? build_extents(img, iblk, &list, &mapping) :
+                build_tree(img, iblk, &list, &mapping);
+        }
+    }
+    free(data);
+    if (ret) {
+        // Nothing points at the new blocks
+        free_blocks(img, &list);
+        __u32 i = 0;
+        for (; i < mapping.n; ++i) {
+            mark(img, mapping.daddrs[i], false);
+        }
+        goto exit;
+    }
+    if (exists) {
+        ret = wlfs_image_walk(img, old, free_run, NULL);
+        if (ret) {
+            goto exit;
+        }
+    }
+
+    inode->size = size;
+    inode->mtime = inode->ctime = time(NULL);
+    ret = wlfs_image_write_inode(img, iblk);
+
+exit:
+    free(mapping.stored);
+    free(mapping.daddrs);
+    free(list.stored);
+    free(list.daddrs);
+    free(iblk);
+    free(old);
+    return ret;
+}
+
+int wlfs_image_remove (struct wlfs_image *img, __u64 ino) {
+    struct image_file *file =
+        ino < img->meta.inodes ? img->files[ino] : NULL;
+    int ret;
+
+    if (file) {
+        // The data block addresses are in memory, & the mapping is the one
+        // last written back
+        struct daddr_list const list =
+            {file->map, file->stored, file->nblocks, file->cap};
+        free_blocks(img, &list);
+        ret = wlfs_image_walk(img, file->iblk, free_mapping, NULL);
+        put_file(img, ino);
+    } else {
+        struct block *iblk = (struct block *) malloc(img->meta.block_size);
+        if (!iblk) {
+            return -ENOMEM;
+        }
+        ret = wlfs_image_read_inode(img, ino, iblk);
+        if (!ret) {
+            ret = wlfs_image_walk(img, iblk, free_run, NULL);
+        }
+        free(iblk);
+    }
+    if (!ret && wlfs_image_lookup(img, ino)) {
+        wlfs_daddr_t *entry = imap_entry(img, ino);
+        mark(img, *entry, false);
+        *entry = 0;
+        img->imap_dirty[ino / get_imap_entries(&img->meta)] = true;
+    }
+    return ret;
+}
+
+int wlfs_image_write_data (struct wlfs_image *img, __u64 ino, __u32 iblock,
+                           void const *data) {
+    __u16 const bytes = get_block_bytes(&img->meta);
+    struct image_file *file;
+
+    if (!img->writable) {
+        return -EROFS;
+    }
+    int ret = get_file(img, ino, true, &file);
+    if (ret) {
+        return ret;
+    }
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(file->iblk);
+    if (inode->flags & WLFS_INODE_INLINE) {
+        ret = uninline_file(img, ino, file);
+        if (ret) {
+            return ret;
+        }
+    }
+    __u64 const max_blocks = inode->flags & WLFS_INODE_EXTENTS ?
+        get_extent_max_blocks(&img->meta) : get_tree_max_blocks(&img->meta);
+    if (iblock >= max_blocks) {
+        return -EFBIG;
+    }
+    ret = grow_map(file, (__u64) iblock + 1);
+    if (!ret && file->stored[iblock]) {
+        ret = split_cluster(img, ino, file, iblock);
+    }
+    if (ret) {
+        return ret;
+    }
+
+    struct block *blk = (struct block *) calloc(1, img->meta.block_size);
+    if (!blk) {
+        return -ENOMEM;
+    }
+    blk->index = ino;
+    blk->offset = iblock;
+    blk->type = BLOCK_DATA;
+    memcpy(get_block_data(blk), data, bytes);
+    ret = wlfs_image_append(img, classify(img, blk), blk,
+                            &file->map[iblock]);
+    free(blk);
+    if (ret) {
+        return ret;
+    }
+
+    if (inode->size < ((__u64) iblock + 1) * bytes) {
+        inode->size = ((__u64) iblock + 1) * bytes;
+    }
+    inode->mtime = inode->ctime = time(NULL);
+    return dirty_file(img, ino, file);
+}
+
+int wlfs_image_read_data (struct wlfs_image *img, __u64 ino, __u32 iblock,
+                          void *data) {
+    __u16 const bytes = get_block_bytes(&img->meta);
+    struct image_file *file;
+
+    int ret = get_file(img, ino, false, &file);
+    if (ret) {
+        return ret;
+    }
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(file->iblk);
+    if (inode->flags & WLFS_INODE_INLINE) {
+        memset(data, 0, bytes);
+        if (iblock == 0) {
+            memcpy(data, inode->data, inode->size);
+        }
+        return 0;
+    }
+    if (iblock >= file->nblocks || !file->map[iblock]) {
+        memset(data, 0, bytes);
+        return 0;
+    }
+    if (file->stored[iblock]) {
+        struct extent cluster;
+        find_cluster(file, iblock, &cluster);
+        __u8 *buf = (__u8 *) malloc((size_t) cluster.length * bytes);
+        if (!buf) {
+            return -ENOMEM;
+        }
+        ret = read_cluster(img, ino, &cluster, buf);
+        if (!ret) {
+            memcpy(data, buf + (size_t) (iblock - cluster.offset) * bytes,
+                   bytes);
+        }
+        free(buf);
+        return ret;
+    }
+
+    struct block *blk = (struct block *) malloc(img->meta.block_size);
+    if (!blk) {
+        return -ENOMEM;
+    }
+    ret = wlfs_image_read_block(img, file->map[iblock], blk);
+    if (!ret && (blk->type != BLOCK_DATA || blk->index != ino ||
+                 blk->offset != iblock)) {
+        ret = -EUCLEAN;
+    }
+    if (!ret) {
+        memcpy(data, get_block_data(blk), bytes);
+    }
+    free(blk);
+    return ret;
+}
+
+// Files which fail to write back stay queued.  A file may be queued more
+// than once, if it was written back by an fsync or replaced since; queued
+// marks the first entry
+int wlfs_image_sync (struct wlfs_image *img) {
+    if (img->ndirty == 0) {
+        return 0;
+    }
+    struct image_file **files = (struct image_file **)
+        malloc(img->ndirty * sizeof(struct image_file *));
+    if (!files) {
+        return -ENOMEM;
+    }
+
+    __u32 n = 0;
+    __u32 i = 0;
+    for (; i < img->ndirty; ++i) {
+        struct image_file *file = img->files[img->dirty[i]];
+        if (file && file->queued) {
+            file->queued = false;
+            if (file->dirty) {
+                files[n++] = file;
+            }
+        }
+    }
+    int const ret = write_back(img, files, n);
+    free(files);
+
+    n = 0;
+    for (i = 0; i < img->ndirty; ++i) {
+        struct image_file *file = img->files[img->dirty[i]];
+        if (file && file->dirty && !file->queued) {
+            file->queued = true;
+            img->dirty[n++] = img->dirty[i];
+        }
+    }
+    img->ndirty = n;
+    return ret;
+}
+
+// The open partial segments of every stream are written, not only the
+// blocks of the files synced, as their summaries chain the streams together
+// in log order.  Files written back by an earlier sync but not yet stable
+// need no write-back of their own
+int wlfs_image_fsync (struct wlfs_image *img, __u64 const *inos, __u32 n) {
+    if (!img->writable) {
+        return -EROFS;
+    }
+    struct image_file **files = (struct image_file **)
+        malloc((n ? n : 1) * sizeof(struct image_file *));
+    if (!files) {
+        return -ENOMEM;
+    }
+    __u32 nfiles = 0;
+    __u32 i = 0;
+    for (; i < n; ++i) {
+        struct image_file *file =
+            inos[i] < img->meta.inodes ? img->files[inos[i]] : NULL;
+        if (!file || !file->dirty) {
+            continue;
+        }
+        __u32 j = 0;
+        while (j < nfiles && files[j] != file) {
+            ++j;
+        }
+        if (j == nfiles) {
+            files[nfiles++] = file;
+        }
+    }
+    int ret = write_back(img, files, nfiles);
+    free(files);
+    if (ret) {
+        return ret;
+    }
+    if (img->uncommitted) {
+        return wlfs_image_checkpoint(img);
+    }
+
+    ret = seal(img, STREAM_META);
+    if (ret) {
+        return ret;
+    }
+    if (fdatasync(img->fd) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+int wlfs_image_mkdir (struct wlfs_image *img, __u64 ino) {
+    struct image_file *file;
+
+    if (!img->writable) {
+        return -EROFS;
+    }
+    if (ino >= img->meta.inodes) {
+        return -EINVAL;
+    }
+    if (img->files[ino] || wlfs_image_lookup(img, ino)) {
+        return -EEXIST;
+    }
+    int const ret = get_file(img, ino, true, &file);
+    if (ret) {
+        return ret;
+    }
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(file->iblk);
+    inode->mode = S_IFDIR | 0755;
+    inode->nlink = 2;
+    inode->flags |= WLFS_INODE_INLINE;
+    return 0;
+}
+
+int wlfs_image_dir_lookup (struct wlfs_image *img, __u64 dir,
+                           char const *name, __u64 *ino) {
+    struct image_file *file;
+    __u8 len;
+
+    int ret = check_name(name, &len);
+    if (!ret) {
+        ret = get_dir(img, dir, &file);
+    }
+    if (ret) {
+        return ret;
+    }
+    __u32 const hash = get_dir_hash(name, len);
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(file->iblk);
+    if (inode->flags & WLFS_INODE_INLINE) {
+        struct dir_entry *entry =
+            find_dir_entry(inode->data, inode->size, hash, name, len);
+        if (!entry) {
+            return -ENOENT;
+        }
+        *ino = entry->ino;
+        return 0;
+    }
+
+    struct dir_index idx;
+    ret = open_index(img, dir, &idx);
+    if (ret) {
+        return ret;
+    }
+    struct dir_bucket *bucket =
+        (struct dir_bucket *) malloc(get_block_bytes(&img->meta));
+    __u32 slot;
+    __u32 nr;
+    ret = bucket ? read_bucket(img, &idx, hash, &slot, &nr, bucket) : -ENOMEM;
+    if (!ret) {
+        struct dir_entry *entry = find_dir_entry(
+            bucket + 1, bucket->bytes, hash, name, len);
+        if (entry) {
+            *ino = entry->ino;
+        } else {
+            ret = -ENOENT;
+        }
+    }
+    free(bucket);
+    close_index(&idx);
+    return ret;
+}
+
+int wlfs_image_link (struct wlfs_image *img, __u64 dir, char const *name,
+                     __u64 ino) {
+    struct image_file *file;
+    __u8 len;
+    __u8 type;
+
+    if (!img->writable) {
+        return -EROFS;
+    }
+    int ret = check_name(name, &len);
+    if (!ret) {
+        ret = get_dir(img, dir, &file);
+    }
+    if (!ret) {
+        ret = get_type(img, ino, &type);
+    }
+    if (ret) {
+        return ret;
+    }
+    __u32 const hash = get_dir_hash(name, len);
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(file->iblk);
+    if (inode->flags & WLFS_INODE_INLINE) {
+        if (find_dir_entry(inode->data, inode->size, hash, name, len)) {
+            return -EEXIST;
+        }
+        if (inode->size + DIR_ENTRY_SIZE(len) <=
+            get_inline_bytes(&img->meta)) {
+            __u32 size = inode->size;
+            put_entry(inode->data, &size, hash, name, len, ino, type);
+            inode->size = size;
+            inode->mtime = inode->ctime = time(NULL);
+            return dirty_file(img, dir, file);
+        }
+        ret = index_dir(img, dir, file);
+        if (ret) {
+            return ret;
+        }
+    }
+    return add_indexed(img, dir, hash, name, len, ino, type);
+}
+
+int wlfs_image_unlink (struct wlfs_image *img, __u64 dir, char const *name) {
+    struct image_file *file;
+    __u8 len;
+
+    if (!img->writable) {
+        return -EROFS;
+    }
+    int ret = check_name(name, &len);
+    if (!ret) {
+        ret = get_dir(img, dir, &file);
+    }
+    if (ret) {
+        return ret;
+    }
+    __u32 const hash = get_dir_hash(name, len);
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(file->iblk);
+    if (inode->flags & WLFS_INODE_INLINE) {
+        struct dir_entry *entry =
+            find_dir_entry(inode->data, inode->size, hash, name, len);
+        if (!entry) {
+            return -ENOENT;
+        }
+        __u32 size = inode->size;
+        drop_entry(inode->data, &size, entry);
+        inode->size = size;
+        inode->mtime = inode->ctime = time(NULL);
+        return dirty_file(img, dir, file);
+    }
+
+    // Emptied buckets are kept, as are the index's slots
+    struct dir_index idx;
+    ret = open_index(img, dir, &idx);
+    if (ret) {
+        return ret;
+    }
+    struct dir_bucket *bucket =
+        (struct dir_bucket *) malloc(get_block_bytes(&img->meta));
+    __u32 slot;
+    __u32 nr;
+    ret = bucket ? read_bucket(img, &idx, hash, &slot, &nr, bucket) : -ENOMEM;
+    if (!ret) {
+        struct dir_entry *entry = find_dir_entry(
+            bucket + 1, bucket->bytes, hash, name, len);
+        if (entry) {
+            drop_entry((__u8 *) (bucket + 1), &bucket->bytes, entry);
+            ret = wlfs_image_write_data(img, dir, DIR_INDEX_BLOCKS + nr,
+                                        bucket);
+        } else {
+            ret = -ENOENT;
+        }
+    }
+    free(bucket);
+    close_index(&idx);
+    return ret;
+}
+
+int wlfs_image_readdir (struct wlfs_image *img, __u64 dir,
+                        wlfs_dirent_fn fn, void *arg) {
+    __u16 const bytes = get_block_bytes(&img->meta);
+    struct image_file *file;
+
+    int ret = get_dir(img, dir, &file);
+    if (ret) {
+        return ret;
+    }
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(file->iblk);
+    if (inode->flags & WLFS_INODE_INLINE) {
+        __u32 pos = 0;
+        while (!ret && pos < inode->size) {
+            struct dir_entry *entry = (struct dir_entry *) (inode->data + pos);
+            ret = fn(img, entry, arg);
+            pos += DIR_ENTRY_SIZE(entry->len);
+        }
+        return ret;
+    }
+
+    struct dir_index idx;
+    ret = open_index(img, dir, &idx);
+    if (ret) {
+        return ret;
+    }
+    struct dir_bucket *bucket = (struct dir_bucket *) malloc(bytes);
+    if (!bucket) {
+        ret = -ENOMEM;
+    }
+    __u32 nr = 0;
+    for (; !ret && nr < idx.head->nbuckets; ++nr) {
+        ret = wlfs_image_read_data(img, dir, DIR_INDEX_BLOCKS + nr, bucket);
+        if (!ret && bucket->bytes > bytes - sizeof(struct dir_bucket)) {
+            ret = -EUCLEAN;
+        }
+        __u32 pos = 0;
+        while (!ret && pos < bucket->bytes) {
+            struct dir_entry *entry =
+                (struct dir_entry *) ((__u8 *) (bucket + 1) + pos);
+            ret = fn(img, entry, arg);
+            pos += DIR_ENTRY_SIZE(entry->len);
+        }
+    }
+    free(bucket);
+    close_index(&idx);
+    return ret;
+}
+
+__u32 wlfs_image_clean_segments (struct wlfs_image *img) {
+    __u32 clean = 0;
+
+    __u32 segment = 0;
+    for (; segment < img->meta.segments; ++segment) {
+        clean += !img->live[segment] && !img->pinned[segment] &&
+            !is_reserved(img, segment);
+    }
+    return clean;
+}
+
+// Mirrors the kernel's cleaning pass, except that a segment's age counts
+// the partial segments written since it was, rather than seconds, so
+// replaying the same writes cleans the same segments.  Victims only empty
+// once the files & maps queued for rewriting are written back, & only
+// become clean once a checkpoint no longer refers to them
+int wlfs_image_clean (struct wlfs_image *img) {
+    struct victim victims[CLEANER_BATCH];
+    __u64 const start = get_stamp();
+    int cleaned = 0;
+    int ret = 0;
+
+    if (!img->writable) {
+        return -EROFS;
+    }
+    struct block *buf = (struct block *) malloc(img->meta.segment_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    while (wlfs_image_clean_segments(img) < img->meta.target_clean_segs) {
+        __u32 const before = wlfs_image_clean_segments(img);
+        unsigned const n = pick_victims(img, victims, CLEANER_BATCH);
+        if (n == 0) {
+            break;
+        }
+
+        unsigned i = 0;
+        for (; i < n && !ret; ++i) {
+            ret = clean_segment(img, victims[i].segment, buf);
+        }
+        if (!ret) {
+            ret = wlfs_image_checkpoint(img);
+        }
+        if (ret) {
+            break;
+        }
+        for (i = 0; i < n; ++i) {
+            cleaned += !img->live[victims[i].segment];
+        }
+        // Stop if the batch didn't gain any clean segments
+        if (wlfs_image_clean_segments(img) <= before) {
+            break;
+        }
+    }
+
+    free(buf);
+    img->stats.cleaned += cleaned;
+    img->stats.clean_ns += get_stamp() - start;
+    return ret ? ret : cleaned;
+}
+
+// Clean segments hold nothing a checkpoint refers to & aren't reserved for
+// a log head, so the whole of each can go
+int wlfs_image_trim (struct wlfs_image *img, __u64 *bytes) {
+    struct wlfs_super_meta *meta = &img->meta;
+    struct stat buf;
+
+    *bytes = 0;
+    if (!img->writable) {
+        return -EROFS;
+    }
+    if (fstat(img->fd, &buf) < 0) {
+        return -errno;
+    }
+
+    __u32 segment = 0;
+    while (segment < meta->segments) {
+        __u32 end = segment;
+        for (; end < meta->segments && !img->live[end] &&
+                 !img->pinned[end] && !is_reserved(img, end); ++end);
+        if (end == segment) {
+            ++segment;
+            continue;
+        }
+        __u64 range[2] = {
+            get_segment_daddr(meta, segment) * meta->block_size,
+            (__u64) (end - segment) * meta->segment_size,
+        };
+        int const ret = S_ISBLK(buf.st_mode) ?
+            ioctl(img->fd, BLKDISCARD, range) :
+            fallocate(img->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      range[0], range[1]);
+        if (ret < 0) {
+            return -errno;
+        }
+        *bytes += range[1];
+        segment = end;
+    }
+    return 0;
+}
+
+/*
+ * Helper functions
+ */
+
+int alloc_maps (struct wlfs_image *img) {
+    struct wlfs_super_meta *meta = &img->meta;
+    __u32 const nimap = get_imap_blocks(meta);
+    __u32 const nsegmap = get_segmap_blocks(meta);
+
+    img->imap = (struct block **) calloc(nimap, sizeof(struct block *));
+    img->imap_daddrs =
+        (wlfs_daddr_t *) calloc(nimap, sizeof(wlfs_daddr_t));
+    img->imap_dirty = (bool *) calloc(nimap, sizeof(bool));
+    img->segmap = (struct block **) calloc(nsegmap, sizeof(struct block *));
+    img->segmap_daddrs =
+        (wlfs_daddr_t *) calloc(nsegmap, sizeof(wlfs_daddr_t));
+    img->segmap_dirty = (bool *) calloc(nsegmap, sizeof(bool));
+    img->live = (__u16 *) calloc(meta->segments, sizeof(__u16));
+    img->pinned = (bool *) calloc(meta->segments, sizeof(bool));
+    img->wseq = (__u64 *) calloc(meta->segments, sizeof(__u64));
+    img->files = (struct image_file **)
+        calloc(meta->inodes, sizeof(struct image_file *));
+    img->heat = (__u8 *) calloc(1 << HEAT_BITS, sizeof(__u8));
+    if (!img->imap || !img->imap_daddrs || !img->imap_dirty ||
+        !img->segmap || !img->segmap_daddrs || !img->segmap_dirty ||
+        !img->live || !img->pinned || !img->wseq || !img->files ||
+        !img->heat) {
+        return -ENOMEM;
+    }
+
+    __u32 i = 0;
+    for (; i < nsegmap; ++i) {
+        img->segmap[i] = (struct block *) calloc(1, meta->block_size);
+        if (!img->segmap[i]) {
+            return -ENOMEM;
+        }
+        img->segmap[i]->index = i;
+        img->segmap[i]->type = BLOCK_SEGMAP;
+    }
+    return 0;
+}
+
+void free_maps (struct wlfs_image *img) {
+    __u32 i = 0;
+    if (img->imap) {
+        for (; i < get_imap_blocks(&img->meta); ++i) {
+            free(img->imap[i]);
+        }
+    }
+    if (img->segmap) {
+        for (i = 0; i < get_segmap_blocks(&img->meta); ++i) {
+            free(img->segmap[i]);
+        }
+    }
+    if (img->files) {
+        __u64 ino = 0;
+        for (; ino < img->meta.inodes; ++ino) {
+            if (img->files[ino]) {
+                put_file(img, ino);
+            }
+        }
+    }
+    unsigned s = 0;
+    for (; s < LOG_STREAMS; ++s) {
+        free(img->heads[s].buf);
+    }
+    free(img->imap);
+    free(img->imap_daddrs);
+    free(img->imap_dirty);
+    free(img->segmap);
+    free(img->segmap_daddrs);
+    free(img->segmap_dirty);
+    free(img->live);
+    free(img->pinned);
+    free(img->wseq);
+    free(img->files);
+    free(img->dirty);
+    free(img->heat);
+}
+
+int load_checkpoint (struct wlfs_image *img) {
+    struct wlfs_super_meta *meta = &img->meta;
+    __u32 const nblocks = meta->checkpoint_blocks;
+    __u16 const entries = get_daddr_entries(meta);
+    __u32 const imap_cp_blocks = get_checkpoint_imap_blocks(meta);
+    __u32 const nimap = get_imap_blocks(meta);
+    __u32 const nsegmap = get_segmap_blocks(meta);
+
+    // Both regions are read together, as at mount
+    __u8 *regions = (__u8 *) malloc(
+        (size_t) CHECKPOINT_REGIONS * nblocks * meta->block_size);
+    if (!regions) {
+        return -ENOMEM;
+    }
+    int ret = read_blocks(img, get_checkpoint_daddr(meta, 0), regions,
+                          CHECKPOINT_REGIONS * nblocks);
+    if (ret) {
+        goto exit;
+    }
+
+    int region = -1;
+    unsigned i = 0;
+    for (; i < CHECKPOINT_REGIONS; ++i) {
+        struct block *head = (struct block *)
+            (regions + (size_t) i * nblocks * meta->block_size);
+        struct checkpoint *cp = (struct checkpoint *) get_block_data(head);
+        if (region_valid(img, head) &&
+            (region < 0 || cp->generation > img->checkpoint.generation)) {
+            region = i;
+            img->checkpoint = *cp;
+        }
+    }
+    if (region < 0) {
+        // Nothing has been checkpointed yet
+        img->region = CHECKPOINT_REGIONS - 1;
+        memset(&img->checkpoint, 0, sizeof(struct checkpoint));
+        for (i = 0; i < LOG_STREAMS; ++i) {
+            img->checkpoint.heads[i].segment = NO_SEGMENT;
+            img->checkpoint.heads[i].next = NO_SEGMENT;
+        }
+        goto exit;
+    }
+    img->region = region;
+
+    __u8 *const first = regions +
+        ((size_t) region * nblocks + 1) * meta->block_size;
+    __u32 n = 0;
+    for (; n < nimap; ++n) {
+        img->imap_daddrs[n] = ((wlfs_daddr_t *) get_block_data(
+            first + (size_t) (n / entries) * meta->block_size))[n % entries];
+    }
+    for (n = 0; n < nsegmap; ++n) {
+        img->segmap_daddrs[n] = ((wlfs_daddr_t *) get_block_data(
+            first + (size_t) (imap_cp_blocks + n / entries) *
+            meta->block_size))[n % entries];
+    }
+    for (n = 0; n < nimap; ++n) {
+        if (img->imap_daddrs[n]) {
+            img->imap[n] = (struct block *) malloc(meta->block_size);
+            if (!img->imap[n]) {
+                ret = -ENOMEM;
+                goto exit;
+            }
+        }
+    }
+    ret = load_map_blocks(img, img->imap, img->imap_daddrs, nimap,
+                          BLOCK_IMAP);
+    if (!ret) {
+        ret = load_map_blocks(img, img->segmap, img->segmap_daddrs, nsegmap,
+                              BLOCK_SEGMAP);
+    }
+    if (ret) {
+        goto exit;
+    }
+
+    // Count the live blocks, then account for the map blocks written after
+    // the segmap blocks describing them
+    __u32 const bytes = get_segmap_bits(meta) >> 3;
+    __u16 const per_block = get_segmap_entries(meta);
+    for (n = 0; n < meta->segments; ++n) {
+        __u8 const *bitmap = (__u8 *) get_block_data(
+            img->segmap[n / per_block]) + (n % per_block) * bytes;
+        __u32 b = 0;
+        img->live[n] = 0;
+        for (; b < bytes; ++b) {
+            img->live[n] += __builtin_popcount(bitmap[b]);
+        }
+    }
+    for (n = 0; n < nsegmap; ++n) {
+        mark(img, img->segmap_daddrs[n], true);
+    }
+    for (n = 0; n < nimap; ++n) {
+        mark(img, img->imap_daddrs[n], true);
+    }
+
+exit:
+    free(regions);
+    return ret;
+}
+
+bool region_valid (struct wlfs_image *img, struct block *region) {
+    __u32 i = 0;
+    for (; i < img->meta.checkpoint_blocks; ++i) {
+        struct block *blk = (struct block *)
+            ((__u8 *) region + (size_t) i * img->meta.block_size);
+        if (blk->type != BLOCK_CHECKPOINT || blk->index != i ||
+            blk->h0.wtime != region->h0.wtime ||
+            blk->h1.wtime != region->h0.wtime ||
+            blk->h0.version != region->h0.version ||
+            blk->h1.version != region->h0.version ||
+            !check_block_csum(&img->meta, blk)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int load_map_blocks (struct wlfs_image *img, struct block **blocks,
+                     wlfs_daddr_t *daddrs, __u32 nblocks,
+                     enum block_type type) {
+    __u32 i = 0;
+    for (; i < nblocks; ++i) {
+        if (!daddrs[i]) {
+            continue;
+        }
+        int ret = read_blocks(img, daddrs[i], blocks[i], 1);
+        if (ret) {
+            return ret;
+        }
+        if (blocks[i]->type != type || blocks[i]->index != i ||
+            !check_block_csum(&img->meta, blocks[i])) {
+            return -EUCLEAN;
+        }
+    }
+    return 0;
+}
+
+int open_log (struct wlfs_image *img) {
+    struct checkpoint *cp = &img->checkpoint;
+    __u32 const blocks = get_segmap_bits(&img->meta);
+
+    img->seq = img->synced = cp->seq;
+    img->mount = cp->mount + 1;
+    unsigned s = 0;
+    for (; s < LOG_STREAMS; ++s) {
+        struct image_head *head = &img->heads[s];
+        head->buf = (struct block *) malloc(img->meta.segment_size);
+        if (!head->buf) {
+            return -ENOMEM;
+        }
+        head->segment = cp->heads[s].segment;
+        head->next = cp->heads[s].next;
+        head->start = cp->heads[s].offset;
+    }
+
+    // Streams without a segment are opened once every reserved one is known
+    for (s = 0; s < LOG_STREAMS; ++s) {
+        struct image_head *head = &img->heads[s];
+        if (head->segment == NO_SEGMENT) {
+            head->start = 0;
+            head->segment = take_clean(img);
+            head->next = take_clean(img);
+        }
+        if (head->segment == NO_SEGMENT || blocks - head->start < 2) {
+            head->start = blocks;
+        }
+        head->fill = head->start < blocks ? head->start + 1 : blocks;
+    }
+    return 0;
+}
+
+// Partial segments of different streams are merged by sequence number;
+// the first number missing from every stream ends the log
+int recover (struct wlfs_image *img) {
+    struct wlfs_super_meta *meta = &img->meta;
+    struct checkpoint *cp = &img->checkpoint;
+    struct stream_cursor cursors[LOG_STREAMS];
+    struct replay_stamps stamps;
+    int ret = 0;
+
+    // Every mount writes a checkpoint before anything else, so without one
+    // there is nothing to replay
+    if (cp->generation == 0) {
+        return 0;
+    }
+
+    memset(cursors, 0, sizeof(cursors));
+    stamps.inodes = (__u64 *) calloc(meta->inodes, sizeof(__u64));
+    stamps.imap = (__u64 *) calloc(get_imap_blocks(meta), sizeof(__u64));
+    stamps.segmap = (__u64 *) calloc(get_segmap_blocks(meta), sizeof(__u64));
+    if (!stamps.inodes || !stamps.imap || !stamps.segmap) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+    unsigned s = 0;
+    for (; s < LOG_STREAMS; ++s) {
+        cursors[s].blocks = (struct block *) malloc(meta->segment_size);
+        if (!cursors[s].blocks) {
+            ret = -ENOMEM;
+            goto exit;
+        }
+        cursors[s].pos = cursors[s].head = cp->heads[s];
+    }
+
+    __u64 seq = cp->seq;
+    for (s = 0; s < LOG_STREAMS && !ret; ++s) {
+        ret = peek_partial(img, &cursors[s], s, seq);
+    }
+    while (!ret) {
+        struct stream_cursor *cur = NULL;
+        for (s = 0; s < LOG_STREAMS; ++s) {
+            struct segment_summary *summary = (struct segment_summary *)
+                get_block_data(cursors[s].blocks);
+            if (cursors[s].valid && summary->seq == seq) {
+                cur = &cursors[s];
+                break;
+            }
+        }
+        if (!cur) {
+            break;
+        }
+
+        struct segment_summary *summary =
+            (struct segment_summary *) get_block_data(cur->blocks);
+        __u64 const base =
+            get_segment_daddr(meta, cur->pos.segment) + cur->pos.offset;
+        __u32 i = 1;
+        for (; i <= summary->nblocks; ++i) {
+            replay_block(img, &stamps,
+                         (struct block *) ((__u8 *) cur->blocks +
+                                           (size_t) i * meta->block_size),
+                         base + i);
+        }
+        cur->pos.offset += 1 + summary->nblocks;
+        cur->pos.next = summary->next;
+        cur->head = cur->pos;
+        ++seq;
+        ret = peek_partial(img, cur, s, seq);
+    }
+    if (ret) {
+        goto exit;
+    }
+
+    // Resume each stream after its last replayed partial segment
+    cp->seq = seq;
+    for (s = 0; s < LOG_STREAMS; ++s) {
+        cp->heads[s] = cursors[s].head;
+    }
+
+exit:
+    for (s = 0; s < LOG_STREAMS; ++s) {
+        free(cursors[s].blocks);
+    }
+    free(stamps.segmap);
+    free(stamps.imap);
+    free(stamps.inodes);
+    return ret;
+}
+
+// Same checks as recovery: torn headers, failed checksums, or a summary left
+// by an earlier mount or an earlier pass of the log over the segment, end
+// the stream
+int peek_partial (struct wlfs_image *img, struct stream_cursor *cur,
+                  unsigned stream, __u64 seq) {
+    struct wlfs_super_meta *meta = &img->meta;
+    __u32 const blocks = get_segmap_bits(meta);
+    struct block *head = cur->blocks;
+    struct segment_summary *summary =
+        (struct segment_summary *) get_block_data(head);
+
+    cur->valid = false;
+    if (cur->pos.segment == NO_SEGMENT) {
+        return 0;
+    }
+    if (blocks - cur->pos.offset < 2) {
+        if (cur->pos.next == NO_SEGMENT) {
+            return 0;
+        }
+        cur->pos.segment = cur->pos.next;
+        cur->pos.offset = 0;
+        cur->pos.next = NO_SEGMENT;
+    }
+
+    __u64 const base =
+        get_segment_daddr(meta, cur->pos.segment) + cur->pos.offset;
+    int ret = read_blocks(img, base, head, 1);
+    if (ret) {
+        return ret;
+    }
+    if (head->type != BLOCK_SUMMARY || head->h0.wtime != head->h1.wtime ||
+        summary->seq < seq || head->index != summary->seq ||
+        summary->mount != img->checkpoint.mount ||
+        summary->stream != stream || summary->nblocks == 0 ||
+        summary->nblocks > blocks - cur->pos.offset - 1 ||
+        !check_block_csum(meta, head)) {
+        return 0;
+    }
+    ret = read_blocks(img, base + 1,
+                      (__u8 *) head + meta->block_size, summary->nblocks);
+    if (ret) {
+        return ret;
+    }
+
+    __u32 csum = WLFS_CSUM_SEED;
+    __u32 i = 1;
+    for (; i <= summary->nblocks; ++i) {
+        struct block *blk = (struct block *)
+            ((__u8 *) head + (size_t) i * meta->block_size);
+        if (blk->h0.wtime != blk->h1.wtime ||
+            blk->h0.version != blk->h1.version ||
+            blk->h0.wtime > head->h0.wtime ||
+            blk->type == BLOCK_FREE || blk->type > BLOCK_COMMIT ||
+            !check_block_csum(meta, blk)) {
+            return 0;
+        }
+        csum = wlfs_crc32c(csum, &blk->h0.csum, sizeof(__u32));
+    }
+    if ((meta->flags & WLFS_FORMAT_CHECKSUMS) && csum != summary->csum) {
+        return 0;
+    }
+    cur->valid = true;
+    return 0;
+}
+
+// Copies of a block are ordered by their stamps; data & indirect blocks are
+// reached through their inode, & marked live by the commit blocks written
+// with it
+void replay_block (struct wlfs_image *img, struct replay_stamps *stamps,
+                   struct block *blk, wlfs_daddr_t daddr) {
+    wlfs_daddr_t *entry = NULL;
+    __u64 *stamp = NULL;
+
+    switch (blk->type) {
+    case BLOCK_COMMIT:
+        apply_commit(img, blk);
+        return;
+
+    case BLOCK_INODE:
+        entry = imap_entry(img, blk->index);
+        if (entry) {
+            stamp = &stamps->inodes[blk->index];
+        }
+        break;
+
+    case BLOCK_IMAP:
+        if (blk->index < get_imap_blocks(&img->meta)) {
+            entry = &img->imap_daddrs[blk->index];
+            stamp = &stamps->imap[blk->index];
+        }
+        break;
+
+    case BLOCK_SEGMAP:
+        if (blk->index < get_segmap_blocks(&img->meta)) {
+            entry = &img->segmap_daddrs[blk->index];
+            stamp = &stamps->segmap[blk->index];
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    if (!entry || blk->stamp < *stamp) {
+        return;
+    }
+    *stamp = blk->stamp;
+    if (blk->type == BLOCK_INODE) {
+        img->imap_dirty[blk->index / get_imap_entries(&img->meta)] = true;
+    }
+    wlfs_daddr_t const old = *entry;
+    *entry = daddr;
+    mark(img, daddr, true);
+    if (old && old != daddr) {
+        mark(img, old, false);
+    }
+}
+
+// As in the kernel, commit blocks are applied in log order
+void apply_commit (struct wlfs_image *img, struct block *blk) {
+    struct commit_record *record =
+        (struct commit_record *) get_block_data(blk);
+
+    if ((__u64) record->nlive + record->ndead >
+        get_commit_entries(&img->meta)) {
+        return;
+    }
+    __u32 i = 0;
+    for (; i < record->nlive + record->ndead; ++i) {
+        mark(img, record->daddrs[i], i < record->nlive);
+    }
+}
+
+wlfs_daddr_t *imap_entry (struct wlfs_image *img, __u64 ino) {
+    __u16 const entries = get_imap_entries(&img->meta);
+    __u32 const index = ino / entries;
+
+    if (ino >= img->meta.inodes) {
+        return NULL;
+    }
+    if (!img->imap[index]) {
+        img->imap[index] = (struct block *) calloc(1, img->meta.block_size);
+        if (!img->imap[index]) {
+            return NULL;
+        }
+        img->imap[index]->index = index;
+        img->imap[index]->type = BLOCK_IMAP;
+    }
+    return (wlfs_daddr_t *) get_block_data(img->imap[index]) +
+        ino % entries;
+}
+
+void mark (struct wlfs_image *img, __u64 daddr, bool live) {
+    struct wlfs_super_meta *meta = &img->meta;
+    __u16 const per_block = get_segmap_entries(meta);
+
+    if (daddr < get_segment_daddr(meta, 0) ||
+        daddr >= get_segment_daddr(meta, meta->segments)) {
+        return;
+    }
+    __u32 const segment = get_daddr_segment(meta, daddr);
+    __u32 const bit = daddr - get_segment_daddr(meta, segment);
+    __u8 *bitmap = get_bitmap(img, segment);
+    bool const was = bitmap[bit >> 3] & (1 << (bit & 7));
+
+    if (live && !was) {
+        bitmap[bit >> 3] |= 1 << (bit & 7);
+        ++img->live[segment];
+    } else if (!live && was) {
+        bitmap[bit >> 3] &= ~(1 << (bit & 7));
+        // The last checkpoint may still refer to the segment's blocks
+        if (--img->live[segment] == 0) {
+            img->pinned[segment] = true;
+        }
+    } else {
+        return;
+    }
+    img->segmap_dirty[segment / per_block] = true;
+}
+
+__u8 *get_bitmap (struct wlfs_image *img, __u32 segment) {
+    __u16 const per_block = get_segmap_entries(&img->meta);
+
+    return (__u8 *) get_block_data(img->segmap[segment / per_block]) +
+        (segment % per_block) * (get_segmap_bits(&img->meta) >> 3);
+}
+
+bool is_reserved (struct wlfs_image *img, __u32 segment) {
+    unsigned s = 0;
+    for (; s < LOG_STREAMS; ++s) {
+        if (img->heads[s].segment == segment ||
+            img->heads[s].next == segment) {
+            return true;
+        }
+    }
+    return false;
+}
+
+__u32 take_clean (struct wlfs_image *img) {
+    __u32 const segments = img->meta.segments;
+
+    __u32 i = 0;
+    for (; i < segments; ++i) {
+        __u32 const segment = (img->cursor + i) % segments;
+        if (!img->live[segment] && !img->pinned[segment] &&
+            !is_reserved(img, segment)) {
+            img->cursor = segment + 1;
+            return segment;
+        }
+    }
+    return NO_SEGMENT;
+}
+
+struct block *get_slot (struct wlfs_image *img, struct image_head *head,
+                        __u32 n) {
+    return (struct block *)
+        ((__u8 *) head->buf + (size_t) n * img->meta.block_size);
+}
+
+int seal (struct wlfs_image *img, enum log_stream stream) {
+    struct image_head *head = &img->heads[stream];
+    __u32 const blocks = get_segmap_bits(&img->meta);
+
+    if (!head->buf || head->fill <= head->start + 1) {
+        return 0;
+    }
+
+    struct block *blk = get_slot(img, head, head->start);
+    memset(blk, 0, img->meta.block_size);
+    blk->h0.wtime = blk->h1.wtime = time(NULL);
+    blk->index = img->seq;
+    blk->type = BLOCK_SUMMARY;
+    struct segment_summary *summary =
+        (struct segment_summary *) get_block_data(blk);
+    summary->seq = img->seq;
+    summary->mount = img->mount;
+    summary->next = head->next;
+    summary->nblocks = head->fill - head->start - 1;
+    summary->stream = stream;
+    __u32 csum = WLFS_CSUM_SEED;
+    __u32 i = head->start + 1;
+    for (; i < head->fill; ++i) {
+        csum = wlfs_crc32c(csum, &get_slot(img, head, i)->h0.csum,
+                           sizeof(__u32));
+    }
+    summary->csum = csum;
+    set_block_csum(&img->meta, blk);
+
+    int ret = write_blocks(
+        img, get_segment_daddr(&img->meta, head->segment) + head->start,
+        blk, head->fill - head->start);
+    if (ret) {
+        return ret;
+    }
+    for (i = head->start; i < head->fill; ++i) {
+        __u8 const type = get_slot(img, head, i)->type;
+        if (type <= BLOCK_COMMIT) {
+            ++img->stats.written[type];
+        }
+    }
+    img->wseq[head->segment] = img->seq;
+    ++img->seq;
+    // Reserve the summary slot of the next partial segment
+    head->start = head->fill;
+    if (head->fill < blocks) {
+        ++head->fill;
+    }
+    return 0;
+}
+
+int advance (struct wlfs_image *img, enum log_stream stream) {
+    struct image_head *head = &img->heads[stream];
+
+    int ret = seal(img, stream);
+    if (ret) {
+        return ret;
+    }
+    if (head->next == NO_SEGMENT) {
+        head->next = take_clean(img);
+        if (head->next == NO_SEGMENT) {
+            return -ENOSPC;
+        }
+    }
+    if (head->segment != NO_SEGMENT && !img->live[head->segment]) {
+        img->pinned[head->segment] = true;
+    }
+    head->segment = head->next;
+    head->next = take_clean(img);
+    head->start = 0;
+    head->fill = 1;
+
+    // Age the write counts, so data which stops being rewritten turns cold
+    if (stream != STREAM_META) {
+        __u32 i = 0;
+        for (; i < 1 << HEAT_BITS; ++i) {
+            img->heat[i] >>= 1;
+        }
+    }
+    return 0;
+}
+
+bool maps_dirty (struct wlfs_image *img) {
+    __u32 i = 0;
+    for (; i < get_imap_blocks(&img->meta); ++i) {
+        if (img->imap_dirty[i]) {
+            return true;
+        }
+    }
+    for (i = 0; i < get_segmap_blocks(&img->meta); ++i) {
+        if (img->segmap_dirty[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Appending the imap blocks updates the segmap, so it goes last
+int append_maps (struct wlfs_image *img) {
+    __u32 const nimap = get_imap_blocks(&img->meta);
+    __u32 const nsegmap = get_segmap_blocks(&img->meta);
+    int ret;
+
+    __u32 i = 0;
+    for (; i < nimap; ++i) {
+        if (!img->imap_dirty[i] || !img->imap[i]) {
+            continue;
+        }
+        img->imap_dirty[i] = false;
+        ret = wlfs_image_append(img, STREAM_META, img->imap[i],
+                                &img->imap_daddrs[i]);
+        if (ret) {
+            return ret;
+        }
+    }
+    for (i = 0; i < nsegmap; ++i) {
+        if (!img->segmap_dirty[i]) {
+            continue;
+        }
+        img->segmap_dirty[i] = false;
+        ret = wlfs_image_append(img, STREAM_META, img->segmap[i],
+                                &img->segmap_daddrs[i]);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int write_region (struct wlfs_image *img, struct checkpoint *cp) {
+    struct wlfs_super_meta *meta = &img->meta;
+    __u16 const entries = get_daddr_entries(meta);
+    __u32 const imap_cp_blocks = get_checkpoint_imap_blocks(meta);
+    __kernel_time_t const now = time(NULL);
+
+    __u8 *region = (__u8 *) calloc(meta->checkpoint_blocks,
+                                   meta->block_size);
+    if (!region) {
+        return -ENOMEM;
+    }
+    __u32 i = 0;
+    for (; i < meta->checkpoint_blocks; ++i) {
+        struct block *blk =
+            (struct block *) (region + (size_t) i * meta->block_size);
+        blk->h0.wtime = blk->h1.wtime = now;
+        blk->h0.version = blk->h1.version = (__u8) cp->generation;
+        blk->index = i;
+        blk->type = BLOCK_CHECKPOINT;
+    }
+    memcpy(get_block_data(region), cp, sizeof(struct checkpoint));
+
+    for (i = 0; i < get_imap_blocks(meta); ++i) {
+        ((wlfs_daddr_t *) get_block_data(
+            region + (size_t) (1 + i / entries) * meta->block_size))
+            [i % entries] = img->imap_daddrs[i];
+    }
+    for (i = 0; i < get_segmap_blocks(meta); ++i) {
+        ((wlfs_daddr_t *) get_block_data(
+            region + (size_t) (1 + imap_cp_blocks + i / entries) *
+            meta->block_size))[i % entries] = img->segmap_daddrs[i];
+    }
+    for (i = 0; i < meta->checkpoint_blocks; ++i) {
+        set_block_csum(meta, (struct block *)
+                       (region + (size_t) i * meta->block_size));
+    }
+
+    int const ret = write_blocks(img, get_checkpoint_daddr(meta, !img->region),
+                                 region, meta->checkpoint_blocks);
+    if (!ret) {
+        img->stats.written[BLOCK_CHECKPOINT] += meta->checkpoint_blocks;
+    }
+    free(region);
+    return ret;
+}
+
+int read_blocks (struct wlfs_image *img, __u64 daddr, void *buf, __u32 n) {
+    size_t const len = (size_t) n * img->meta.block_size;
+    ssize_t const ret =
+        pread(img->fd, buf, len, (off_t) daddr * img->meta.block_size);
+    if (ret < 0) {
+        return -errno;
+    }
+    if ((size_t) ret != len) {
+        return -EIO;
+    }
+    img->stats.read += n;
+    return 0;
+}
+
+int write_blocks (struct wlfs_image *img, __u64 daddr, void const *buf,
+                  __u32 n) {
+    size_t const len = (size_t) n * img->meta.block_size;
+    ssize_t const ret =
+        pwrite(img->fd, buf, len, (off_t) daddr * img->meta.block_size);
+    if (ret < 0) {
+        return -errno;
+    }
+    return (size_t) ret == len ? 0 : -EIO;
+}
+
+int walk_ptrs (struct wlfs_image *img, wlfs_daddr_t const *ptrs,
+               __u32 n, __u32 first, wlfs_run_fn fn, void *arg) {
+    __u32 i = 0;
+    while (i < n) {
+        if (!ptrs[i]) {
+            ++i;
+            continue;
+        }
+        __u32 count = 1;
+        while (i + count < n && ptrs[i + count] == ptrs[i] + count) {
+            ++count;
+        }
+        int ret = fn(img, first + i, ptrs[i], count, 0, BLOCK_DATA, arg);
+        if (ret) {
+            return ret;
+        }
+        i += count;
+    }
+    return 0;
+}
+
+int walk_tree (struct wlfs_image *img, __u64 ino, wlfs_daddr_t daddr,
+               unsigned depth, __u32 first, wlfs_run_fn fn, void *arg) {
+    __u32 const entries = get_daddr_entries(&img->meta);
+    struct block *blk = (struct block *) malloc(img->meta.block_size);
+    if (!blk) {
+        return -ENOMEM;
+    }
+
+    int ret = read_indirect(img, ino, daddr, blk);
+    if (ret) {
+        goto exit;
+    }
+    wlfs_daddr_t const *ptrs =
+        (wlfs_daddr_t const *) get_block_data(blk);
+    if (depth == 1) {
+        ret = walk_ptrs(img, ptrs, entries, first, fn, arg);
+    } else {
+        __u64 span = 1;
+        unsigned d = 1;
+        for (; d < depth; ++d) {
+            span *= entries;
+        }
+        __u32 i = 0;
+        for (; i < entries && !ret; ++i) {
+            if (ptrs[i]) {
+                ret = walk_tree(img, ino, ptrs[i], depth - 1,
+                                first + i * span, fn, arg);
+            }
+        }
+    }
+    if (!ret) {
+        ret = fn(img, first, daddr, 1, 0, BLOCK_INDIRECT, arg);
+    }
+
+exit:
+    free(blk);
+    return ret;
+}
+
+int walk_extents (struct wlfs_image *img, __u64 ino,
+                  struct extent const *ext, __u16 n, unsigned depth,
+                  wlfs_run_fn fn, void *arg) {
+    if (depth == 0) {
+        __u16 i = 0;
+        for (; i < n; ++i) {
+            if (ext[i].stored && (ext[i].length > COMPRESS_CLUSTER ||
+                                  ext[i].stored > COMPRESS_CLUSTER)) {
+                return -EUCLEAN;
+            }
+            int ret = fn(img, ext[i].offset, ext[i].daddr, ext[i].length,
+                         ext[i].stored, BLOCK_DATA, arg);
+            if (ret) {
+                return ret;
+            }
+        }
+        return 0;
+    }
+
+    struct block *blk = (struct block *) malloc(img->meta.block_size);
+    if (!blk) {
+        return -ENOMEM;
+    }
+    int ret = 0;
+    __u16 i = 0;
+    for (; i < n && !ret; ++i) {
+        ret = read_indirect(img, ino, ext[i].daddr, blk);
+        if (!ret && ext[i].length > get_extent_entries(&img->meta)) {
+            ret = -EUCLEAN;
+        }
+        if (!ret) {
+            ret = walk_extents(img, ino,
+                               (struct extent const *) get_block_data(blk),
+                               ext[i].length, depth - 1, fn, arg);
+        }
+        if (!ret) {
+            ret = fn(img, ext[i].offset, ext[i].daddr, 1, 0, BLOCK_INDIRECT,
+                     arg);
+        }
+    }
+    free(blk);
+    return ret;
+}
+
+int read_indirect (struct wlfs_image *img, __u64 ino,
+                   wlfs_daddr_t daddr, struct block *blk) {
+    int ret = wlfs_image_read_block(img, daddr, blk);
+    if (ret) {
+        return ret;
+    }
+    if (blk->type != BLOCK_INDIRECT || blk->index != ino) {
+        return -EUCLEAN;
+    }
+    return 0;
+}
+
+int read_run (struct wlfs_image *img, __u32 iblock, wlfs_daddr_t daddr,
+              __u32 count, __u16 stored, enum block_type type, void *arg) {
+    struct read_state *state = (struct read_state *) arg;
+    __u16 const bytes = get_block_bytes(&img->meta);
+
+    if (type != BLOCK_DATA) {
+        return 0;
+    }
+    __u64 const start = (__u64) iblock * bytes;
+    if (start >= state->size) {
+        return 0;
+    }
+    int ret = 0;
+    if (start > state->pos) {
+        ret = write_zeros(state->fd, start - state->pos);
+        state->pos = start;
+    }
+
+    if (stored && !ret) {
+        struct extent const cluster = {iblock, count, stored, daddr};
+        if (!state->cluster) {
+            state->cluster = (__u8 *) malloc(COMPRESS_CLUSTER * bytes);
+            if (!state->cluster) {
+                return -ENOMEM;
+            }
+        }
+        ret = read_cluster(img, state->ino, &cluster, state->cluster);
+    }
+
+    __u32 i = 0;
+    for (; i < count && !ret && state->pos < state->size; ++i) {
+        void const *data = state->cluster + (size_t) i * bytes;
+        if (!stored) {
+            ret = wlfs_image_read_block(img, daddr + i, state->blk);
+            if (ret) {
+                break;
+            }
+            if (state->blk->type != BLOCK_DATA ||
+                state->blk->index != state->ino ||
+                state->blk->offset != iblock + i) {
+                return -EUCLEAN;
+            }
+            data = get_block_data(state->blk);
+        }
+        size_t len = bytes;
+        if (state->size - state->pos < len) {
+            len = state->size - state->pos;
+        }
+        if (write(state->fd, data, len) != (ssize_t) len) {
+            return -EIO;
+        }
+        state->pos += len;
+    }
+    return ret;
+}
+
+int free_run (struct wlfs_image *img, __u32 iblock, wlfs_daddr_t daddr,
+              __u32 count, __u16 stored, enum block_type type, void *arg) {
+    if (stored) {
+        count = stored;
+    }
+    __u32 i = 0;
+    for (; i < count; ++i) {
+        mark(img, daddr + i, false);
+    }
+    return 0;
+}
+
+// The blocks of a cluster are consecutive entries with the same address
+void free_blocks (struct wlfs_image *img, struct daddr_list const *list) {
+    __u32 i = 0;
+    for (; i < list->n; ++i) {
+        if (!list->daddrs[i] || (list->stored[i] && i > 0 &&
+                                 list->daddrs[i - 1] == list->daddrs[i])) {
+            continue;
+        }
+        free_run(img, i, list->daddrs[i], 1, list->stored[i], BLOCK_DATA,
+                 NULL);
+    }
+}
+
+int push_daddr (struct daddr_list *list, wlfs_daddr_t daddr,
+                __u16 stored) {
+    if (list->n == list->cap) {
+        __u32 const cap = list->cap ? list->cap * 2 : 64;
+        wlfs_daddr_t *daddrs = (wlfs_daddr_t *) realloc(
+            list->daddrs, cap * sizeof(wlfs_daddr_t));
+        if (!daddrs) {
+            return -ENOMEM;
+        }
+        list->daddrs = daddrs;
+        __u16 *counts = (__u16 *) realloc(list->stored, cap * sizeof(__u16));
+        if (!counts) {
+            return -ENOMEM;
+        }
+        list->stored = counts;
+        list->cap = cap;
+    }
+    list->daddrs[list->n] = daddr;
+    list->stored[list->n++] = stored;
+    return 0;
+}
+
+int write_zeros (int fd, __u64 len) {
+    static char const zeros[4096];
+
+    while (len) {
+        size_t const n = len < sizeof(zeros) ? len : sizeof(zeros);
+        if (write(fd, zeros, n) != (ssize_t) n) {
+            return -EIO;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+// Offline writes are written once, so data goes to the cold stream.  When
+// compressing, data is read a cluster at a time, & a cluster which doesn't
+// shrink is written uncompressed
+int append_data (struct wlfs_image *img, __u64 ino, int fd,
+                 __u64 max_blocks, bool compress, __u8 *inline_data,
+                 struct daddr_list *list, __u64 *size) {
+    __u16 const bytes = get_block_bytes(&img->meta);
+    __u32 const chunk = compress ? COMPRESS_CLUSTER : 1;
+    struct block *blk = (struct block *) malloc(img->meta.block_size);
+    __u8 *buf = (__u8 *) malloc((size_t) chunk * bytes);
+    int ret = 0;
+    if (!blk || !buf) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+
+    bool eof = false;
+    while (!eof) {
+        // Fill a whole chunk unless the input ends
+        size_t len = 0;
+        while (len < (size_t) chunk * bytes) {
+            ssize_t const n = read(fd, buf + len, chunk * bytes - len);
+            if (n < 0) {
+                ret = -errno;
+                goto exit;
+            } else if (n == 0) {
+                eof = true;
+                break;
+            }
+            len += n;
+        }
+        if (len == 0) {
+            break;
+        }
+        if (eof && list->n == 0 && len <= get_inline_bytes(&img->meta)) {
+            memcpy(inline_data, buf, len);
+            *size = len;
+            break;
+        }
+        __u32 const n = (len + bytes - 1) / bytes;
+        if (list->n + n > max_blocks) {
+            ret = -EFBIG;
+            goto exit;
+        }
+        memset(buf + len, 0, (size_t) n * bytes - len);
+
+        wlfs_daddr_t daddr = 0;
+        __u16 stored = 0;
+        if (compress) {
+            ret = write_cluster(img, ino, list->n, buf, n, &daddr, &stored);
+        }
+        __u32 i = 0;
+        for (; i < n && !ret; ++i) {
+            if (!stored) {
+                memcpy(get_block_data(blk), buf + (size_t) i * bytes, bytes);
+                blk->h0.version = 0;
+                blk->index = ino;
+                blk->offset = list->n;
+                blk->type = BLOCK_DATA;
+                daddr = 0;
+                ret = wlfs_image_append(img, STREAM_COLD, blk, &daddr);
+            }
+            if (!ret) {
+                ret = push_daddr(list, daddr, stored);
+            }
+        }
+        if (ret) {
+            goto exit;
+        }
+        *size += len;
+    }
+
+exit:
+    free(buf);
+    free(blk);
+    return ret;
+}
+
+// The last <indirection> inode pointers are the roots of trees 1, 2, ...
+// levels deep, each covering the blocks after those of the shallower trees
+int build_tree (struct wlfs_image *img, struct block *iblk,
+                struct daddr_list *list, struct daddr_list *mapping) {
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(iblk);
+    __u32 const direct = NBLOCK_PTR - img->meta.indirection;
+    __u64 const entries = get_daddr_entries(&img->meta);
+
+    __u32 pos = list->n < direct ? list->n : direct;
+    memcpy(inode->blocks, list->daddrs, pos * sizeof(wlfs_daddr_t));
+    __u64 span = entries;
+    unsigned level = 0;
+    for (; level < img->meta.indirection && pos < list->n; ++level) {
+        __u32 const n = list->n - pos < span ? list->n - pos : span;
+        int ret = build_indirect(img, iblk->index, list->daddrs + pos, n,
+                                 level + 1, pos, mapping,
+                                 &inode->blocks[direct + level]);
+        if (ret) {
+            return ret;
+        }
+        pos += n;
+        span *= entries;
+    }
+    return 0;
+}
+
+// Children are written before their parents, so every pointer is final
+int build_indirect (struct wlfs_image *img, __u64 ino,
+                    wlfs_daddr_t const *ptrs, __u32 n, unsigned depth,
+                    __u32 first, struct daddr_list *mapping,
+                    wlfs_daddr_t *daddr) {
+    __u32 const entries = get_daddr_entries(&img->meta);
+    struct block *blk = (struct block *) calloc(1, img->meta.block_size);
+    if (!blk) {
+        return -ENOMEM;
+    }
+    blk->index = ino;
+    blk->offset = first;
+    blk->type = BLOCK_INDIRECT;
+    wlfs_daddr_t *children = (wlfs_daddr_t *) get_block_data(blk);
+
+    int ret = 0;
+    if (depth == 1) {
+        memcpy(children, ptrs, n * sizeof(wlfs_daddr_t));
+    } else {
+        __u64 span = 1;
+        unsigned d = 1;
+        for (; d < depth; ++d) {
+            span *= entries;
+        }
+        __u32 i = 0;
+        for (; i * span < n && !ret; ++i) {
+            __u32 const count = n - i * span < span ? n - i * span : span;
+            ret = build_indirect(img, ino, ptrs + i * span, count,
+                                 depth - 1, first + i * span, mapping,
+                                 &children[i]);
+        }
+    }
+    if (!ret) {
+        *daddr = 0;
+        ret = wlfs_image_append(img, STREAM_META, blk, daddr);
+    }
+    if (!ret) {
+        ret = push_daddr(mapping, *daddr, 0);
+    }
+    free(blk);
+    return ret;
+}
+
+// Consecutive addresses of consecutive blocks collapse into extents, as do
+// the blocks of a compressed cluster, & holes are left out; while they don't
+// fit in the inode, they're packed into extent blocks a level at a time
+int build_extents (struct wlfs_image *img, struct block *iblk,
+                   struct daddr_list *list, struct daddr_list *mapping) {
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(iblk);
+    __u16 const cap = get_inode_extents(&img->meta);
+    __u16 const entries = get_extent_entries(&img->meta);
+    struct extent *ext = (struct extent *)
+        malloc((list->n + 1) * sizeof(struct extent));
+    struct block *blk = (struct block *) calloc(1, img->meta.block_size);
+    int ret = 0;
+    if (!ext || !blk) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+
+    __u32 n = 0;
+    __u32 i = 0;
+    for (; i < list->n; ++i) {
+        __u16 const stored = list->stored[i];
+        if (!list->daddrs[i]) {
+            continue;
+        }
+        if (n && ext[n - 1].offset + ext[n - 1].length == i &&
+            ext[n - 1].length < MAX_EXTENT_LENGTH &&
+            ext[n - 1].stored == stored &&
+            ext[n - 1].daddr + (stored ? 0 : ext[n - 1].length) ==
+            list->daddrs[i]) {
+            ++ext[n - 1].length;
+        } else {
+            ext[n].offset = i;
+            ext[n].length = 1;
+            ext[n].stored = stored;
+            ext[n].daddr = list->daddrs[i];
+            ++n;
+        }
+    }
+
+    __u8 depth = 0;
+    while (n > cap) {
+        if (depth == img->meta.indirection) {
+            ret = -EFBIG;
+            goto exit;
+        }
+        __u32 packed = 0;
+        for (i = 0; i < n; i += entries) {
+            __u32 const count = n - i < entries ? n - i : entries;
+            memset(blk, 0, img->meta.block_size);
+            blk->index = iblk->index;
+            blk->offset = ext[i].offset;
+            blk->type = BLOCK_INDIRECT;
+            memcpy(get_block_data(blk), &ext[i],
+                   count * sizeof(struct extent));
+            wlfs_daddr_t daddr = 0;
+            ret = wlfs_image_append(img, STREAM_META, blk, &daddr);
+            if (!ret) {
+                ret = push_daddr(mapping, daddr, 0);
+            }
+            if (ret) {
+                goto exit;
+            }
+            ext[packed].offset = ext[i].offset;
+            ext[packed].length = count;
+            ext[packed].stored = 0;
+            ext[packed].daddr = daddr;
+            ++packed;
+        }
+        n = packed;
+        ++depth;
+    }
+
+    memcpy(inode->extents, ext, n * sizeof(struct extent));
+    inode->nextents = n;
+    inode->depth = depth;
+
+exit:
+    free(blk);
+    free(ext);
+    return ret;
+}
+
+void init_inode (struct wlfs_image *img, __u64 ino, struct block *blk) {
+    memset(blk, 0, img->meta.block_size);
+    blk->index = ino;
+    blk->type = BLOCK_INODE;
+
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(blk);
+    inode->atime = inode->mtime = inode->ctime = time(NULL);
+    inode->mode = S_IFREG | 0644;
+    inode->uid = getuid();
+    inode->gid = getgid();
+    inode->nlink = 1;
+    if (img->meta.flags & WLFS_FORMAT_EXTENTS) {
+        inode->flags |= WLFS_INODE_EXTENTS;
+    }
+}
+
+__u64 get_stamp (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int get_file (struct wlfs_image *img, __u64 ino, bool create,
+              struct image_file **file) {
+    if (ino >= img->meta.inodes) {
+        return -EINVAL;
+    }
+    if (img->files[ino]) {
+        *file = img->files[ino];
+        return 0;
+    }
+
+    struct image_file *f =
+        (struct image_file *) calloc(1, sizeof(struct image_file));
+    if (!f) {
+        return -ENOMEM;
+    }
+    int ret = -ENOMEM;
+    f->iblk = (struct block *) malloc(img->meta.block_size);
+    if (!f->iblk) {
+        goto fail;
+    }
+    ret = wlfs_image_read_inode(img, ino, f->iblk);
+    if (!ret) {
+        ret = wlfs_image_walk(img, f->iblk, map_run, f);
+    } else if (ret == -ENOENT && create) {
+        init_inode(img, ino, f->iblk);
+        ret = dirty_file(img, ino, f);
+    }
+    if (ret) {
+        goto fail;
+    }
+    img->files[ino] = *file = f;
+    return 0;
+
+fail:
+    free(f->stored);
+    free(f->map);
+    free(f->iblk);
+    free(f);
+    return ret;
+}
+
+void put_file (struct wlfs_image *img, __u64 ino) {
+    struct image_file *file = img->files[ino];
+
+    img->files[ino] = NULL;
+    free(file->stored);
+    free(file->map);
+    free(file->iblk);
+    free(file);
+}
+
+int grow_map (struct image_file *file, __u64 n) {
+    if (n <= file->nblocks) {
+        return 0;
+    }
+    if (n > (__u32) -1) {
+        return -EFBIG;
+    }
+    if (n > file->cap) {
+        __u64 cap = file->cap ? file->cap : 64;
+        while (cap < n) {
+            cap *= 2;
+        }
+        if (cap > (__u32) -1) {
+            cap = (__u32) -1;
+        }
+        wlfs_daddr_t *map = (wlfs_daddr_t *)
+            realloc(file->map, cap * sizeof(wlfs_daddr_t));
+        if (!map) {
+            return -ENOMEM;
+        }
+        file->map = map;
+        __u16 *stored = (__u16 *) realloc(file->stored, cap * sizeof(__u16));
+        if (!stored) {
+            return -ENOMEM;
+        }
+        file->stored = stored;
+        file->cap = cap;
+    }
+    memset(file->map + file->nblocks, 0,
+           (n - file->nblocks) * sizeof(wlfs_daddr_t));
+    memset(file->stored + file->nblocks, 0,
+           (n - file->nblocks) * sizeof(__u16));
+    file->nblocks = n;
+    return 0;
+}
+
+// The mapping is built from the new block's address by the next sync
+int uninline_file (struct wlfs_image *img, __u64 ino,
+                   struct image_file *file) {
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(file->iblk);
+    struct block *blk = (struct block *) calloc(1, img->meta.block_size);
+    if (!blk) {
+        return -ENOMEM;
+    }
+    int ret = grow_map(file, 1);
+    if (!ret) {
+        blk->index = ino;
+        blk->offset = 0;
+        blk->type = BLOCK_DATA;
+        memcpy(get_block_data(blk), inode->data, inode->size);
+        ret = wlfs_image_append(img, classify(img, blk), blk, &file->map[0]);
+    }
+    free(blk);
+    if (ret) {
+        return ret;
+    }
+
+    inode->flags &= ~WLFS_INODE_INLINE;
+    memset(inode->data, 0, get_inline_bytes(&img->meta));
+    return dirty_file(img, ino, file);
+}
+
+int dirty_file (struct wlfs_image *img, __u64 ino, struct image_file *file) {
+    if (file->queued) {
+        file->dirty = true;
+        return 0;
+    }
+    if (img->ndirty == img->dirty_cap) {
+        __u32 const cap = img->dirty_cap ? img->dirty_cap * 2 : 64;
+        __u64 *dirty = (__u64 *) realloc(img->dirty, cap * sizeof(__u64));
+        if (!dirty) {
+            return -ENOMEM;
+        }
+        img->dirty = dirty;
+        img->dirty_cap = cap;
+    }
+    img->dirty[img->ndirty++] = ino;
+    file->dirty = file->queued = true;
+    return 0;
+}
+
+int flush_file (struct wlfs_image *img, struct image_file *file) {
+    return write_back(img, &file, 1);
+}
+
+// Batches are cut so their inodes & commit blocks fit in one partial
+// segment, & recovery replays all of them or none; a file whose changes
+// alone are too many for a segment is left for the next checkpoint to
+// commit
+int write_back (struct wlfs_image *img, struct image_file **files,
+                __u32 n) {
+    __u32 const entries = get_commit_entries(&img->meta);
+    __u32 const blocks = get_segmap_bits(&img->meta);
+    struct commit_batch batch;
+    struct daddr_list born = {NULL, NULL, 0, 0};
+    struct daddr_list died = {NULL, NULL, 0, 0};
+    memset(&batch, 0, sizeof(struct commit_batch));
+    batch.files = (struct image_file **)
+        malloc((n ? n : 1) * sizeof(struct image_file *));
+    if (!batch.files) {
+        return -ENOMEM;
+    }
+
+    // Inodes must follow the data they map in log order
+    int ret = seal_data(img);
+    __u32 i = 0;
+    for (; i < n && !ret; ++i) {
+        born.n = died.n = 0;
+        ret = rebuild_mapping(img, files[i], &born, &died);
+        __u64 const changes =
+            batch.born.n + batch.died.n + born.n + died.n;
+        if (!ret && batch.nfiles &&
+            batch.nfiles + 1 + (changes + entries - 1) / entries >=
+            blocks) {
+            ret = commit_batch(img, &batch);
+        }
+        if (!ret) {
+            ret = append_list(&batch.born, &born);
+        }
+        if (!ret) {
+            ret = append_list(&batch.died, &died);
+        }
+        if (!ret) {
+            batch.files[batch.nfiles++] = files[i];
+        }
+    }
+    if (!ret) {
+        ret = commit_batch(img, &batch);
+    }
+
+    free(died.stored);
+    free(died.daddrs);
+    free(born.stored);
+    free(born.daddrs);
+    free(batch.died.stored);
+    free(batch.died.daddrs);
+    free(batch.born.stored);
+    free(batch.born.daddrs);
+    free(batch.files);
+    return ret;
+}
+
+// As in write_file, the new mapping is written before the old one is freed
+int rebuild_mapping (struct wlfs_image *img, struct image_file *file,
+                     struct daddr_list *born, struct daddr_list *died) {
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(file->iblk);
+    struct daddr_list list =
+        {file->map, file->stored, file->nblocks, file->cap};
+    // Inline data, e.g., a small directory's entries, takes the mapping's
+    // place, & only the inode is written back
+    if (inode->flags & WLFS_INODE_INLINE) {
+        return 0;
+    }
+    struct daddr_list mapping = {NULL, NULL, 0, 0};
+    struct block *old = (struct block *) malloc(img->meta.block_size);
+    if (!old) {
+        return -ENOMEM;
+    }
+    memcpy(old, file->iblk, img->meta.block_size);
+
+    bool const extents = inode->flags & WLFS_INODE_EXTENTS;
+    inode->depth = 0;
+    inode->nextents = 0;
+    memset(inode->blocks, 0, sizeof(inode->blocks));
+    int ret = extents ? build_extents(img, file->iblk, &list, &mapping) :
+        build_tree(img, file->iblk, &list, &mapping);
+    if (!ret) {
+        ret = diff_mappings(img, old, file, &mapping, born, died);
+    }
+    if (ret) {
+        __u32 i = 0;
+        for (; i < mapping.n; ++i) {
+            mark(img, mapping.daddrs[i], false);
+        }
+        memcpy(file->iblk, old, img->meta.block_size);
+        goto exit;
+    }
+    // Frees the old mapping blocks; data blocks died as they were replaced
+    __u32 i = 0;
+    for (; i < died->n; ++i) {
+        mark(img, died->daddrs[i], false);
+    }
+
+exit:
+    free(mapping.stored);
+    free(mapping.daddrs);
+    free(old);
+    return ret;
+}
+
+// A data block can only ever be mapped at its own offset, so comparing the
+// mappings offset by offset finds every change.  The mapping blocks are
+// always rewritten whole
+int diff_mappings (struct wlfs_image *img, struct block *old,
+                   struct image_file *file,
+                   struct daddr_list const *mapping,
+                   struct daddr_list *born, struct daddr_list *died) {
+    struct diff_state state = {file, NULL, died};
+    state.same = (__u8 *) calloc(file->nblocks / 8 + 1, 1);
+    if (!state.same) {
+        return -ENOMEM;
+    }
+
+    int ret = wlfs_image_walk(img, old, diff_run, &state);
+    __u32 i = 0;
+    for (; i < file->nblocks && !ret; ++i) {
+        if (!file->map[i] || (state.same[i >> 3] & (1 << (i & 7))) ||
+            (file->stored[i] && i > 0 && file->map[i - 1] == file->map[i])) {
+            continue;
+        }
+        __u32 const n = file->stored[i] ? file->stored[i] : 1;
+        __u32 j = 0;
+        for (; j < n && !ret; ++j) {
+            ret = push_daddr(born, file->map[i] + j, 0);
+        }
+    }
+    for (i = 0; i < mapping->n && !ret; ++i) {
+        ret = push_daddr(born, mapping->daddrs[i], 0);
+    }
+    free(state.same);
+    return ret;
+}
+
+// Commit blocks are marked dead as soon as they're appended, so the cleaner
+// never copies them, & the segments holding them stay pinned until a
+// checkpoint supersedes them
+int commit_batch (struct wlfs_image *img, struct commit_batch *batch) {
+    __u32 const entries = get_commit_entries(&img->meta);
+    __u32 const total = batch->born.n + batch->died.n;
+    __u32 const ncommit = (total + entries - 1) / entries;
+    int ret = 0;
+
+    if (batch->nfiles == 0) {
+        return 0;
+    }
+    if (batch->nfiles + ncommit < get_segmap_bits(&img->meta)) {
+        ret = reserve(img, STREAM_META, batch->nfiles + ncommit);
+    } else {
+        img->uncommitted = true;
+    }
+    __u32 i = 0;
+    for (; i < batch->nfiles && !ret; ++i) {
+        ret = wlfs_image_write_inode(img, batch->files[i]->iblk);
+        if (!ret) {
+            batch->files[i]->dirty = false;
+        }
+    }
+    struct block *blk = (struct block *) malloc(img->meta.block_size);
+    if (!ret && !blk) {
+        ret = -ENOMEM;
+    }
+    struct commit_record *record =
+        (struct commit_record *) get_block_data(blk);
+    __u32 first = 0;
+    __u32 n = 0;
+    for (; first < total && !ret; first += entries, ++n) {
+        memset(blk, 0, img->meta.block_size);
+        blk->offset = n;
+        blk->type = BLOCK_COMMIT;
+        __u32 const end = total - first < entries ? total : first + entries;
+        for (i = first; i < end; ++i) {
+            if (i < batch->born.n) {
+                record->daddrs[i - first] = batch->born.daddrs[i];
+                ++record->nlive;
+            } else {
+                record->daddrs[i - first] =
+                    batch->died.daddrs[i - batch->born.n];
+                ++record->ndead;
+            }
+        }
+        wlfs_daddr_t daddr = 0;
+        ret = wlfs_image_append(img, STREAM_META, blk, &daddr);
+        if (!ret) {
+            mark(img, daddr, false);
+        }
+    }
+    free(blk);
+    batch->nfiles = 0;
+    batch->born.n = batch->died.n = 0;
+    return ret;
+}
+
+int append_list (struct daddr_list *list, struct daddr_list const *src) {
+    __u32 i = 0;
+    for (; i < src->n; ++i) {
+        int ret = push_daddr(list, src->daddrs[i], 0);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int seal_data (struct wlfs_image *img) {
+    unsigned s = 0;
+    for (; s < LOG_STREAMS; ++s) {
+        if (s != STREAM_META) {
+            int ret = seal(img, s);
+            if (ret) {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+// The blocks of a cluster are unchanged only if the same cluster is mapped
+// at its first offset
+int diff_run (struct wlfs_image *img, __u32 iblock, wlfs_daddr_t daddr,
+              __u32 count, __u16 stored, enum block_type type, void *arg) {
+    struct diff_state *state = (struct diff_state *) arg;
+    struct image_file *file = state->file;
+
+    if (type == BLOCK_DATA && stored) {
+        if (iblock < file->nblocks && file->map[iblock] == daddr &&
+            file->stored[iblock] == stored) {
+            __u32 i = 0;
+            for (; i < count; ++i) {
+                state->same[(iblock + i) >> 3] |= 1 << ((iblock + i) & 7);
+            }
+            return 0;
+        }
+        count = stored;
+    }
+    __u32 i = 0;
+    for (; i < count; ++i) {
+        if (type == BLOCK_DATA && !stored && iblock + i < file->nblocks &&
+            file->map[iblock + i] == daddr + i &&
+            !file->stored[iblock + i]) {
+            state->same[(iblock + i) >> 3] |= 1 << ((iblock + i) & 7);
+            continue;
+        }
+        int ret = push_daddr(state->died, daddr + i, 0);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int map_run (struct wlfs_image *img, __u32 iblock, wlfs_daddr_t daddr,
+             __u32 count, __u16 stored, enum block_type type, void *arg) {
+    struct image_file *file = (struct image_file *) arg;
+
+    if (type != BLOCK_DATA) {
+        return 0;
+    }
+    int ret = grow_map(file, (__u64) iblock + count);
+    if (ret) {
+        return ret;
+    }
+    __u32 i = 0;
+    for (; i < count; ++i) {
+        file->map[iblock + i] = stored ? daddr : daddr + i;
+        file->stored[iblock + i] = stored;
+    }
+    return 0;
+}
+
+int free_mapping (struct wlfs_image *img, __u32 iblock,
+                  wlfs_daddr_t daddr, __u32 count, __u16 stored,
+                  enum block_type type, void *arg) {
+    if (type == BLOCK_DATA) {
+        return 0;
+    }
+    return free_run(img, iblock, daddr, count, stored, type, arg);
+}
+
+bool may_compress (struct wlfs_image *img, struct block *iblk) {
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(iblk);
+    return img->meta.compression != COMPRESS_NONE &&
+        (inode->flags & WLFS_INODE_EXTENTS) && S_ISREG(inode->mode);
+}
+
+// Advancing leaves the rest of the segment unwritten, for the cleaner to
+// reclaim
+int reserve (struct wlfs_image *img, enum log_stream stream, __u32 n) {
+    if (img->heads[stream].fill + n > get_segmap_bits(&img->meta)) {
+        return advance(img, stream);
+    }
+    return 0;
+}
+
+// The cluster must save at least one block, & fit in a segment after its
+// summary
+int write_cluster (struct wlfs_image *img, __u64 ino, __u32 first,
+                   __u8 const *data, __u32 n, wlfs_daddr_t *daddr,
+                   __u16 *stored) {
+    __u16 const bytes = get_block_bytes(&img->meta);
+    __u32 const segment_blocks = get_segmap_bits(&img->meta);
+    __u8 *packed = (__u8 *) calloc(n, bytes);
+    void *work = malloc(COMPRESS_WORK_BYTES);
+    struct block *blk = (struct block *) calloc(1, img->meta.block_size);
+    int ret = 0;
+
+    *stored = 0;
+    if (!packed || !work || !blk) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+    if (n < 2) {
+        goto exit;
+    }
+    struct compressed_cluster *header = (struct compressed_cluster *) packed;
+    header->bytes = wlfs_compress(
+        img->meta.compression, data, n * bytes, header->data,
+        (n - 1) * bytes - sizeof(struct compressed_cluster), work);
+    __u32 const count =
+        (sizeof(struct compressed_cluster) + header->bytes + bytes - 1) /
+        bytes;
+    if (!header->bytes || count + 1 > segment_blocks) {
+        goto exit;
+    }
+
+    ret = reserve(img, STREAM_COLD, count);
+    blk->index = ino;
+    blk->offset = first;
+    blk->type = BLOCK_DATA;
+    __u32 written = 0;
+    for (; written < count && !ret; ++written) {
+        memcpy(get_block_data(blk), packed + (size_t) written * bytes, bytes);
+        wlfs_daddr_t block = 0;
+        ret = wlfs_image_append(img, STREAM_COLD, blk, &block);
+        if (ret) {
+            break;
+        }
+        if (written == 0) {
+            *daddr = block;
+        }
+    }
+    if (ret) {
+        // Nothing points at the blocks written
+        for (; written > 0; --written) {
+            mark(img, *daddr + written - 1, false);
+        }
+        goto exit;
+    }
+    *stored = count;
+
+exit:
+    free(blk);
+    free(work);
+    free(packed);
+    return ret;
+}
+
+int read_cluster (struct wlfs_image *img, __u64 ino,
+                  struct extent const *cluster, __u8 *data) {
+    __u16 const bytes = get_block_bytes(&img->meta);
+    if (cluster->length > COMPRESS_CLUSTER ||
+        cluster->stored > COMPRESS_CLUSTER) {
+        return -EUCLEAN;
+    }
+    __u8 *packed = (__u8 *) malloc((size_t) cluster->stored * bytes);
+    struct block *blk = (struct block *) malloc(img->meta.block_size);
+    int ret = 0;
+    if (!packed || !blk) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+
+    __u32 i = 0;
+    for (; i < cluster->stored; ++i) {
+        ret = wlfs_image_read_block(img, cluster->daddr + i, blk);
+        if (ret) {
+            goto exit;
+        }
+        if (blk->type != BLOCK_DATA || blk->index != ino ||
+            blk->offset != cluster->offset) {
+            ret = -EUCLEAN;
+            goto exit;
+        }
+        memcpy(packed + (size_t) i * bytes, get_block_data(blk), bytes);
+    }
+    struct compressed_cluster *header = (struct compressed_cluster *) packed;
+    if (header->bytes > cluster->stored * bytes -
+        sizeof(struct compressed_cluster) ||
+        !wlfs_decompress(img->meta.compression, header->data, header->bytes,
+                         data, cluster->length * bytes)) {
+        ret = -EUCLEAN;
+    }
+    img->stats.read += cluster->stored;
+
+exit:
+    free(blk);
+    free(packed);
+    return ret;
+}
+
+// A disk address belongs to one cluster, so its blocks are the run of
+// entries with its address
+void find_cluster (struct image_file *file, __u32 iblock,
+                   struct extent *cluster) {
+    wlfs_daddr_t const daddr = file->map[iblock];
+    __u32 first = iblock;
+    while (first > 0 && file->map[first - 1] == daddr) {
+        --first;
+    }
+    __u32 end = iblock + 1;
+    while (end < file->nblocks && file->map[end] == daddr) {
+        ++end;
+    }
+    cluster->offset = first;
+    cluster->length = end - first;
+    cluster->stored = file->stored[iblock];
+    cluster->daddr = daddr;
+}
+
+// Blocks overwritten in place are hot, so the rest of the cluster isn't
+// recompressed; the cleaner may compress it again once it cools
+int split_cluster (struct wlfs_image *img, __u64 ino,
+                   struct image_file *file, __u32 iblock) {
+    __u16 const bytes = get_block_bytes(&img->meta);
+    struct extent cluster;
+    find_cluster(file, iblock, &cluster);
+    __u8 *data = (__u8 *) malloc((size_t) cluster.length * bytes);
+    struct block *blk = (struct block *) calloc(1, img->meta.block_size);
+    wlfs_daddr_t daddrs[COMPRESS_CLUSTER] = {0};
+    int ret = 0;
+    if (!data || !blk) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+
+    ret = read_cluster(img, ino, &cluster, data);
+    __u32 i = 0;
+    for (; i < cluster.length && !ret; ++i) {
+        if (cluster.offset + i == iblock) {
+            continue;
+        }
+        blk->index = ino;
+        blk->offset = cluster.offset + i;
+        blk->type = BLOCK_DATA;
+        memcpy(get_block_data(blk), data + (size_t) i * bytes, bytes);
+        ret = wlfs_image_append(img, STREAM_COLD, blk, &daddrs[i]);
+    }
+    if (ret) {
+        for (i = 0; i < cluster.length; ++i) {
+            if (daddrs[i]) {
+                mark(img, daddrs[i], false);
+            }
+        }
+        goto exit;
+    }
+
+    free_run(img, cluster.offset, cluster.daddr, cluster.length,
+             cluster.stored, BLOCK_DATA, NULL);
+    for (i = 0; i < cluster.length; ++i) {
+        file->map[cluster.offset + i] = daddrs[i];
+        file->stored[cluster.offset + i] = 0;
+    }
+
+exit:
+    free(blk);
+    free(data);
+    return ret;
+}
+
+// The blocks are copied whole, so the cluster isn't decompressed
+int move_cluster (struct wlfs_image *img, __u64 ino,
+                  struct image_file *file, __u32 iblock) {
+    struct extent cluster;
+    find_cluster(file, iblock, &cluster);
+    struct block *blk = (struct block *) malloc(img->meta.block_size);
+    if (!blk) {
+        return -ENOMEM;
+    }
+
+    int ret = reserve(img, STREAM_COLD, cluster.stored);
+    wlfs_daddr_t daddr = 0;
+    __u32 i = 0;
+    for (; i < cluster.stored && !ret; ++i) {
+        ret = wlfs_image_read_block(img, cluster.daddr + i, blk);
+        if (!ret) {
+            // Marks the old block dead
+            wlfs_daddr_t block = cluster.daddr + i;
+            ret = wlfs_image_append(img, STREAM_COLD, blk, &block);
+            if (i == 0) {
+                daddr = block;
+            }
+        }
+    }
+    free(blk);
+    if (ret) {
+        return ret;
+    }
+
+    for (i = 0; i < cluster.length; ++i) {
+        file->map[cluster.offset + i] = daddr;
+    }
+    img->stats.copied += cluster.stored;
+    return 0;
+}
+
+// Clusters are aligned to their size in the file, as the writer lays them
+// out; only a cluster whose blocks are all present & uncompressed is packed
+int pack_cluster (struct wlfs_image *img, __u64 ino,
+                  struct image_file *file, __u32 iblock) {
+    __u16 const bytes = get_block_bytes(&img->meta);
+    __u32 const first = iblock / COMPRESS_CLUSTER * COMPRESS_CLUSTER;
+    __u32 const n = file->nblocks - first < COMPRESS_CLUSTER ?
+        file->nblocks - first : COMPRESS_CLUSTER;
+
+    if (!may_compress(img, file->iblk) || n < 2) {
+        return 0;
+    }
+    __u32 i = 0;
+    for (; i < n; ++i) {
+        if (!file->map[first + i] || file->stored[first + i]) {
+            return 0;
+        }
+    }
+
+    __u8 *data = (__u8 *) malloc((size_t) n * bytes);
+    struct block *blk = (struct block *) malloc(img->meta.block_size);
+    int ret = 0;
+    if (!data || !blk) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+    for (i = 0; i < n; ++i) {
+        ret = wlfs_image_read_block(img, file->map[first + i], blk);
+        if (ret) {
+            goto exit;
+        }
+        if (blk->type != BLOCK_DATA || blk->index != ino ||
+            blk->offset != first + i) {
+            ret = -EUCLEAN;
+            goto exit;
+        }
+        memcpy(data + (size_t) i * bytes, get_block_data(blk), bytes);
+    }
+
+    wlfs_daddr_t daddr = 0;
+    __u16 stored = 0;
+    ret = write_cluster(img, ino, first, data, n, &daddr, &stored);
+    if (ret || !stored) {
+        goto exit;
+    }
+    for (i = 0; i < n; ++i) {
+        mark(img, file->map[first + i], false);
+        file->map[first + i] = daddr;
+        file->stored[first + i] = stored;
+    }
+    img->stats.copied += stored;
+    ret = 1;
+
+exit:
+    free(blk);
+    free(data);
+    return ret;
+}
+
+// A data block is hot once it has been rewritten within the decay window;
+// the hash is the kernel's hash_64
+enum log_stream classify (struct wlfs_image *img, struct block *blk) {
+    __u64 const key = blk->index << 32 | blk->offset;
+    __u8 *heat =
+        &img->heat[(key * 0x9e37fffffffc0001ULL) >> (64 - HEAT_BITS)];
+
+    if (*heat < 0xff) {
+        ++*heat;
+    }
+    return *heat >= HOT_WRITES ? STREAM_HOT : STREAM_COLD;
+}
+
+// As in the kernel, the least utilized segments are the candidates, least
+// recently written first, & the best scoring of them are picked
+unsigned pick_victims (struct wlfs_image *img, struct victim *victims,
+                       unsigned n) {
+    __u32 const blocks = get_segmap_bits(&img->meta);
+    struct victim candidates[CLEANER_BATCH * CANDIDATE_FACTOR];
+    unsigned const max = n * CANDIDATE_FACTOR;
+    unsigned count = 0;
+
+    __u32 segment = 0;
+    for (; segment < img->meta.segments; ++segment) {
+        __u16 const live = img->live[segment];
+        if (!live || img->pinned[segment] || is_reserved(img, segment)) {
+            continue;
+        }
+        unsigned i = count < max ? count++ : max;
+        for (; i > 0; --i) {
+            struct victim *prev = &candidates[i - 1];
+            if (img->live[prev->segment] < live ||
+                (img->live[prev->segment] == live &&
+                 img->wseq[prev->segment] <= img->wseq[segment])) {
+                break;
+            }
+            if (i < max) {
+                candidates[i] = *prev;
+            }
+        }
+        if (i < max) {
+            candidates[i].segment = segment;
+        }
+    }
+
+    unsigned i = 0;
+    for (; i < count; ++i) {
+        __u32 const segment = candidates[i].segment;
+        candidates[i].score = get_clean_score(img->live[segment], blocks,
+                                              img->seq - img->wseq[segment]);
+    }
+    qsort(candidates, count, sizeof(struct victim), compare_victims);
+
+    n = count < n ? count : n;
+    memcpy(victims, candidates, n * sizeof(struct victim));
+    return n;
+}
+
+// Best score first; ties go to the lower segment number
+int compare_victims (void const *a, void const *b) {
+    struct victim const *lhs = (struct victim const *) a;
+    struct victim const *rhs = (struct victim const *) b;
+    if (lhs->score != rhs->score) {
+        return lhs->score < rhs->score ? 1 : -1;
+    }
+    return lhs->segment < rhs->segment ? -1 : lhs->segment > rhs->segment;
+}
+
+int clean_segment (struct wlfs_image *img, __u32 segment, struct block *buf) {
+    __u32 const blocks = get_segmap_bits(&img->meta);
+    __u64 const base = get_segment_daddr(&img->meta, segment);
+    __u8 const *bitmap = get_bitmap(img, segment);
+
+    int ret = read_blocks(img, base, buf, blocks);
+    __u32 i = 0;
+    for (; i < blocks && !ret; ++i) {
+        struct block *blk = (struct block *)
+            ((__u8 *) buf + (size_t) i * img->meta.block_size);
+        if (!(bitmap[i >> 3] & (1 << (i & 7)))) {
+            continue;
+        }
+        // Relocating a corrupt block would stamp it with a valid checksum
+        if (!check_block_csum(&img->meta, blk)) {
+            return -EUCLEAN;
+        }
+        ret = relocate(img, blk, base + i);
+    }
+    return ret;
+}
+
+// Data blocks move to the cold stream right away, compressed along with the
+// rest of their cluster if the image compresses data; inodes & mapping
+// blocks are rewritten when their file is written back, & map blocks by the
+// next checkpoint.  Blocks nothing refers to are left for the walk that
+// frees them
+int relocate (struct wlfs_image *img, struct block *blk,
+              wlfs_daddr_t daddr) {
+    struct image_file *file;
+    int ret;
+
+    switch (blk->type) {
+    case BLOCK_DATA:
+        ret = get_file(img, blk->index, false, &file);
+        if (ret) {
+            return ret == -ENOENT ? 0 : ret;
+        }
+        if (blk->offset >= file->nblocks) {
+            return 0;
+        }
+        // Every block of a compressed cluster carries its first block's
+        // offset
+        wlfs_daddr_t const first = file->map[blk->offset];
+        if (file->stored[blk->offset]) {
+            if (daddr < first || daddr >= first + file->stored[blk->offset]) {
+                return 0;
+            }
+            ret = move_cluster(img, blk->index, file, blk->offset);
+        } else if (first != daddr) {
+            return 0;
+        } else {
+            ret = pack_cluster(img, blk->index, file, blk->offset);
+            if (ret == 0) {
+                ret = wlfs_image_append(img, STREAM_COLD, blk,
+                                        &file->map[blk->offset]);
+                ++img->stats.copied;
+            }
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        return dirty_file(img, blk->index, file);
+
+    case BLOCK_INODE:
+        if (wlfs_image_lookup(img, blk->index) != daddr) {
+            return 0;
+        }
+        // Fall through
+    case BLOCK_INDIRECT:
+        ret = get_file(img, blk->index, false, &file);
+        if (ret) {
+            return ret == -ENOENT ? 0 : ret;
+        }
+        ++img->stats.copied;
+        return dirty_file(img, blk->index, file);
+
+    case BLOCK_IMAP:
+        if (blk->index < get_imap_blocks(&img->meta) &&
+            img->imap_daddrs[blk->index] == daddr) {
+            img->imap_dirty[blk->index] = true;
+            ++img->stats.copied;
+        }
+        return 0;
+
+    case BLOCK_SEGMAP:
+        if (blk->index < get_segmap_blocks(&img->meta) &&
+            img->segmap_daddrs[blk->index] == daddr) {
+            img->segmap_dirty[blk->index] = true;
+            ++img->stats.copied;
+        }
+        return 0;
+
+    default:
+        return 0;
+    }
+}
+
+int get_dir (struct wlfs_image *img, __u64 dir, struct image_file **file) {
+    int const ret = get_file(img, dir, false, file);
+    if (ret) {
+        return ret;
+    }
+    struct wlfs_inode *inode =
+        (struct wlfs_inode *) get_block_data((*file)->iblk);
+    return S_ISDIR(inode->mode) ? 0 : -ENOTDIR;
+}
+
+int check_name (char const *name, __u8 *len) {
+    size_t const n = strlen(name);
+    if (n > WLFS_NAME_LEN) {
+        return -ENAMETOOLONG;
+    }
+    if (n == 0 || strchr(name, '/') || !strcmp(name, ".") ||
+        !strcmp(name, "..")) {
+        return -EINVAL;
+    }
+    *len = n;
+    return 0;
+}
+
+// Files being written have their inodes in memory; any other is read
+int get_type (struct wlfs_image *img, __u64 ino, __u8 *type) {
+    if (ino >= img->meta.inodes) {
+        return -EINVAL;
+    }
+    struct block *iblk = img->files[ino] ? img->files[ino]->iblk : NULL;
+    struct block *blk = NULL;
+    if (!iblk) {
+        blk = (struct block *) malloc(img->meta.block_size);
+        if (!blk) {
+            return -ENOMEM;
+        }
+        int const ret = wlfs_image_read_inode(img, ino, blk);
+        if (ret) {
+            free(blk);
+            return ret;
+        }
+        iblk = blk;
+    }
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(iblk);
+    *type = (inode->mode & S_IFMT) >> 12;
+    free(blk);
+    return 0;
+}
+
+void put_entry (__u8 *entries, __u32 *bytes, __u32 hash, char const *name,
+                __u8 len, __u64 ino, __u8 type) {
+    struct dir_entry *entry = (struct dir_entry *) (entries + *bytes);
+    memset(entry, 0, DIR_ENTRY_SIZE(len));
+    entry->ino = ino;
+    entry->hash = hash;
+    entry->len = len;
+    entry->type = type;
+    memcpy(entry->name, name, len);
+    *bytes += DIR_ENTRY_SIZE(len);
+}
+
+void drop_entry (__u8 *entries, __u32 *bytes, struct dir_entry *entry) {
+    __u32 const pos = (__u8 *) entry - entries;
+    __u32 const size = DIR_ENTRY_SIZE(entry->len);
+    memmove(entries + pos, entries + pos + size, *bytes - pos - size);
+    *bytes -= size;
+    memset(entries + *bytes, 0, size);
+}
+
+// The inline entries always fit in one bucket, as a bucket holds a whole
+// block's data
+int index_dir (struct wlfs_image *img, __u64 dir, struct image_file *file) {
+    __u16 const bytes = get_block_bytes(&img->meta);
+    struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(file->iblk);
+
+    __u8 *buf = (__u8 *) calloc(1, bytes);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    struct dir_bucket *bucket = (struct dir_bucket *) buf;
+    bucket->depth = 0;
+    bucket->bytes = inode->size;
+    memcpy(bucket + 1, inode->data, inode->size);
+    inode->flags &= ~WLFS_INODE_INLINE;
+    memset(inode->data, 0, get_inline_bytes(&img->meta));
+    inode->size = 0;
+
+    int ret = wlfs_image_write_data(img, dir, DIR_INDEX_BLOCKS, buf);
+    if (!ret) {
+        memset(buf, 0, bytes);
+        struct dir_header *head = (struct dir_header *) buf;
+        head->depth = 0;
+        head->nbuckets = 1;
+        head->index[0] = 0;
+        ret = wlfs_image_write_data(img, dir, 0, buf);
+    }
+    free(buf);
+    return ret;
+}
+
+int add_indexed (struct wlfs_image *img, __u64 dir, __u32 hash,
+                 char const *name, __u8 len, __u64 ino, __u8 type) {
+    __u16 const bytes = get_block_bytes(&img->meta);
+    struct dir_index idx;
+
+    int ret = open_index(img, dir, &idx);
+    if (ret) {
+        return ret;
+    }
+    struct dir_bucket *bucket = (struct dir_bucket *) malloc(bytes);
+    if (!bucket) {
+        close_index(&idx);
+        return -ENOMEM;
+    }
+    for (;;) {
+        __u32 slot;
+        __u32 nr;
+        ret = read_bucket(img, &idx, hash, &slot, &nr, bucket);
+        if (ret) {
+            break;
+        }
+        __u8 *entries = (__u8 *) (bucket + 1);
+        if (find_dir_entry(entries, bucket->bytes, hash, name, len)) {
+            ret = -EEXIST;
+            break;
+        }
+        if (sizeof(struct dir_bucket) + bucket->bytes + DIR_ENTRY_SIZE(len) <=
+            bytes) {
+            put_entry(entries, &bucket->bytes, hash, name, len, ino, type);
+            ret = wlfs_image_write_data(img, dir, DIR_INDEX_BLOCKS + nr,
+                                        bucket);
+            break;
+        }
+        ret = split_bucket(img, &idx, slot, nr, bucket);
+        if (ret) {
+            break;
+        }
+    }
+    if (!ret || ret == -EEXIST) {
+        int const err = flush_index(img, &idx, true);
+        ret = ret ? ret : err;
+    }
+    free(bucket);
+    close_index(&idx);
+    return ret;
+}
+
+int open_index (struct wlfs_image *img, __u64 dir, struct dir_index *idx) {
+    __u16 const bytes = get_block_bytes(&img->meta);
+
+    idx->dir = dir;
+    idx->head = (struct dir_header *) malloc(bytes);
+    idx->buf = (__u8 *) malloc(bytes);
+    idx->iblock = 0;
+    idx->head_dirty = idx->dirty = false;
+    int ret = idx->head && idx->buf ?
+        wlfs_image_read_data(img, dir, 0, idx->head) : -ENOMEM;
+    if (!ret && (idx->head->depth > get_dir_max_depth(&img->meta) ||
+                 idx->head->nbuckets == 0)) {
+        ret = -EUCLEAN;
+    }
+    if (ret) {
+        close_index(idx);
+    }
+    return ret;
+}
+
+void close_index (struct dir_index *idx) {
+    free(idx->head);
+    free(idx->buf);
+    idx->head = NULL;
+    idx->buf = NULL;
+}
+
+int flush_index (struct wlfs_image *img, struct dir_index *idx, bool head) {
+    if (idx->dirty) {
+        int const ret =
+            wlfs_image_write_data(img, idx->dir, idx->iblock, idx->buf);
+        if (ret) {
+            return ret;
+        }
+        idx->dirty = false;
+    }
+    if (head && idx->head_dirty) {
+        int const ret = wlfs_image_write_data(img, idx->dir, 0, idx->head);
+        if (ret) {
+            return ret;
+        }
+        idx->head_dirty = false;
+    }
+    return 0;
+}
+
+int get_index_slot (struct wlfs_image *img, struct dir_index *idx,
+                    __u32 slot, bool write, __u32 **entry) {
+    __u32 iblock;
+    __u16 offset;
+
+    get_dir_slot(&img->meta, slot, &iblock, &offset);
+    if (iblock == 0) {
+        *entry = (__u32 *) ((__u8 *) idx->head + offset);
+        idx->head_dirty |= write;
+        return 0;
+    }
+    if (iblock != idx->iblock) {
+        int ret = flush_index(img, idx, false);
+        if (!ret) {
+            ret = wlfs_image_read_data(img, idx->dir, iblock, idx->buf);
+        }
+        if (ret) {
+            return ret;
+        }
+        idx->iblock = iblock;
+    }
+    *entry = (__u32 *) (idx->buf + offset);
+    idx->dirty |= write;
+    return 0;
+}
+
+int read_bucket (struct wlfs_image *img, struct dir_index *idx, __u32 hash,
+                 __u32 *slot, __u32 *nr, struct dir_bucket *bucket) {
+    __u32 *entry;
+
+    *slot = hash & ((1U << idx->head->depth) - 1);
+    int const ret = get_index_slot(img, idx, *slot, false, &entry);
+    if (ret) {
+        return ret;
+    }
+    *nr = *entry;
+    if (*nr >= idx->head->nbuckets) {
+        return -EUCLEAN;
+    }
+    int const err =
+        wlfs_image_read_data(img, idx->dir, DIR_INDEX_BLOCKS + *nr, bucket);
+    if (err) {
+        return err;
+    }
+    if (bucket->depth > idx->head->depth ||
+        bucket->bytes > get_block_bytes(&img->meta) - sizeof(*bucket)) {
+        return -EUCLEAN;
+    }
+    return 0;
+}
+
+// Once the index can't double again, a bucket which can't split fails the
+// insert; with 32-bit hashes, that takes more names than the index can
+// address
+int split_bucket (struct wlfs_image *img, struct dir_index *idx, __u32 slot,
+                  __u32 nr, struct dir_bucket *bucket) {
+    __u16 const bytes = get_block_bytes(&img->meta);
+    __u32 const depth = bucket->depth;
+    int ret;
+
+    if (depth == idx->head->depth) {
+        if (depth == get_dir_max_depth(&img->meta)) {
+            return -ENOSPC;
+        }
+        ret = double_index(img, idx);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    struct dir_bucket *other = (struct dir_bucket *) calloc(1, bytes);
+    if (!other) {
+        return -ENOMEM;
+    }
+    __u8 *entries = (__u8 *) (bucket + 1);
+    __u32 kept = 0;
+    __u32 pos = 0;
+    while (pos < bucket->bytes) {
+        struct dir_entry *entry = (struct dir_entry *) (entries + pos);
+        __u32 const size = DIR_ENTRY_SIZE(entry->len);
+        if (entry->hash >> depth & 1) {
+            memcpy((__u8 *) (other + 1) + other->bytes, entry, size);
+            other->bytes += size;
+        } else {
+            memmove(entries + kept, entry, size);
+            kept += size;
+        }
+        pos += size;
+    }
+    memset(entries + kept, 0, pos - kept);
+    bucket->bytes = kept;
+    bucket->depth = other->depth = depth + 1;
+
+    __u32 const fresh = idx->head->nbuckets;
+    ret = wlfs_image_write_data(img, idx->dir, DIR_INDEX_BLOCKS + nr, bucket);
+    if (!ret) {
+        ret = wlfs_image_write_data(img, idx->dir, DIR_INDEX_BLOCKS + fresh,
+                                    other);
+    }
+    free(other);
+    if (ret) {
+        return ret;
+    }
+    ++idx->head->nbuckets;
+    idx->head_dirty = true;
+
+    // The slots which pointed at the bucket share its low <depth> bits; those
+    // with the next bit set now point at the new one
+    __u32 s = (slot & ((1U << depth) - 1)) | 1U << depth;
+    for (; s < 1U << idx->head->depth; s += 2U << depth) {
+        __u32 *entry;
+        ret = get_index_slot(img, idx, s, true, &entry);
+        if (ret) {
+            return ret;
+        }
+        *entry = fresh;
+    }
+    return 0;
+}
+
+// The new slots are read through a second cursor, so both halves can be
+// in different blocks; blocks changed earlier are written first, so it
+// reads them as they are now
+int double_index (struct wlfs_image *img, struct dir_index *idx) {
+    __u32 const n = 1U << idx->head->depth;
+    struct dir_index src = *idx;
+
+    int ret = flush_index(img, idx, false);
+    if (ret) {
+        return ret;
+    }
+    src.buf = (__u8 *) malloc(get_block_bytes(&img->meta));
+    if (!src.buf) {
+        return -ENOMEM;
+    }
+    src.iblock = 0;
+    src.head_dirty = src.dirty = false;
+
+    __u32 i = 0;
+    for (; i < n; ++i) {
+        __u32 *from;
+        __u32 *to;
+        ret = get_index_slot(img, &src, i, false, &from);
+        if (!ret) {
+            ret = get_index_slot(img, idx, n + i, true, &to);
+        }
+        if (ret) {
+            break;
+        }
+        *to = *from;
+    }
+    free(src.buf);
+    if (ret) {
+        return ret;
+    }
+    ++idx->head->depth;
+    idx->head_dirty = true;
+    return 0;
+}
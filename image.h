@@ -0,0 +1,202 @@
+/*
+ * Userspace access to a wlfs image: loads the maps a checkpoint points at,
+ * appends to the log the way a mount does, & commits with a checkpoint
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <linux/types.h>
+
+#include "wlfs.h"
+
+// Head of one log stream, buffering the segment it fills
+struct image_head {
+    // Blocks of the segment; only those from start on are unwritten
+    struct block *buf;
+    // Segment being filled, & the clean segment reserved to follow it
+    __u32 segment;
+    __u32 next;
+    // Slot of the open partial segment's summary, & the next free slot
+    __u32 start;
+    __u32 fill;
+};
+
+// A file being written block by block: its inode block & data block
+// addresses are kept in memory, & the mapping & inode are written back by a
+// sync, followed by commit blocks listing the blocks the mapping changed
+struct image_file {
+    // Mapping fields still describe the mapping last written
+    struct block *iblk;
+    // Address of each data block, 0 for holes; every block of a compressed
+    // cluster has the cluster's address
+    wlfs_daddr_t *map;
+    // Blocks the compressed cluster holding each data block is stored in, 0
+    // for blocks which aren't compressed
+    __u16 *stored;
+    __u32 nblocks;
+    __u32 cap;
+    // Changed since last written back, & whether the inode number is in the
+    // image's queue of dirty files
+    bool dirty;
+    bool queued;
+};
+
+// Work done since the image was opened
+struct image_stats {
+    // Blocks written, by type, counting summaries & checkpoint regions
+    __u64 written[BLOCK_COMMIT + 1];
+    __u64 read;
+    __u64 checkpoints;
+    // Cleaner work: blocks relocated or rewritten, segments cleaned, & time
+    // spent (ns)
+    __u64 copied;
+    __u64 cleaned;
+    __u64 clean_ns;
+};
+
+struct wlfs_image {
+    int fd;
+    bool writable;
+    struct wlfs_super_meta meta;
+    // Most recent checkpoint read or written, & the region holding it
+    struct checkpoint checkpoint;
+    unsigned region;
+    // Map blocks as in the kernel: imap blocks are NULL until an inode in
+    // them is written, segmap blocks are always present
+    struct block **imap;
+    wlfs_daddr_t *imap_daddrs;
+    struct block **segmap;
+    wlfs_daddr_t *segmap_daddrs;
+    // Map blocks changed since the last checkpoint
+    bool *imap_dirty;
+    bool *segmap_dirty;
+    // Live blocks per segment, & whether a segment was emptied since the
+    // last checkpoint, which may still refer to it
+    __u16 *live;
+    bool *pinned;
+    // Where to resume looking for a clean segment
+    __u32 cursor;
+    struct image_head heads[LOG_STREAMS];
+    // Sequence number of the next partial segment, & the mount number
+    // stamped into summaries; opening an image for writing counts as a mount
+    __u64 seq;
+    __u32 mount;
+    // Sequence number right after the last checkpoint's own blocks; if the
+    // log hasn't moved since, there's nothing to checkpoint
+    __u64 synced;
+    // Set when a file's changes outgrew the commit blocks a segment holds,
+    // so only a checkpoint commits them
+    bool uncommitted;
+    // Sequence number of the last partial segment written into each
+    // segment, so the cleaner can weigh how long data has stayed put
+    __u64 *wseq;
+    // Files written block by block, by inode number, & the inode numbers of
+    // those changed since they were last written back
+    struct image_file **files;
+    __u64 *dirty;
+    __u32 ndirty;
+    __u32 dirty_cap;
+    // Write counts classifying data blocks as hot or cold, as in the kernel
+    __u8 *heat;
+    struct image_stats stats;
+};
+
+// Open an image (or device), load its most recent checkpoint & roll
+// forward through the log written after it.  Opening for writing counts as
+// a mount, & commits the recovered state with a checkpoint
+int wlfs_image_open (struct wlfs_image *img, char const *path, bool writable);
+// Write a checkpoint if anything changed, then release the image
+int wlfs_image_close (struct wlfs_image *img);
+// Flush the log & commit the maps with a checkpoint
+int wlfs_image_checkpoint (struct wlfs_image *img);
+
+// Read a block from the log, whether it is on disk or still buffered
+int wlfs_image_read_block (struct wlfs_image *img, wlfs_daddr_t daddr,
+                           struct block *blk);
+// Append a block to a log stream; on entry *daddr is the block's old
+// address (0 if none), which is marked dead, & on exit its new address
+int wlfs_image_append (struct wlfs_image *img, enum log_stream stream,
+                       struct block *blk, wlfs_daddr_t *daddr);
+
+// Disk address of an inode's block, 0 if it has none
+wlfs_daddr_t wlfs_image_lookup (struct wlfs_image *img, __u64 ino);
+// Read an inode's block; returns -ENOENT if it has none
+int wlfs_image_read_inode (struct wlfs_image *img, __u64 ino,
+                           struct block *blk);
+// Append an inode's block to the log & point the inode map at it
+int wlfs_image_write_inode (struct wlfs_image *img, struct block *blk);
+
+// Call fn for each run of a file's data blocks stored at consecutive
+// addresses, in file order, & for each indirect or extent block after the
+// blocks it maps; stops at the first nonzero return.  A compressed cluster
+// is reported as a run of its count blocks, stored in <stored> blocks from
+// daddr on; stored is 0 for every other run.  Inline files have no blocks
+typedef int (*wlfs_run_fn) (struct wlfs_image *img, __u32 iblock,
+                            wlfs_daddr_t daddr, __u32 count,
+                            __u16 stored, enum block_type type, void *arg);
+int wlfs_image_walk (struct wlfs_image *img, struct block *iblk,
+                     wlfs_run_fn fn, void *arg);
+
+// Copy a file's contents to a file descriptor
+int wlfs_image_read_file (struct wlfs_image *img, __u64 ino, int fd);
+// Replace a file's contents with everything read from a file descriptor,
+// creating the inode if it has none; contents small enough are stored
+// inline in the inode's block, & if the image compresses data, the rest is
+// compressed a cluster at a time
+int wlfs_image_write_file (struct wlfs_image *img, __u64 ino, int fd);
+// Delete a file, freeing its blocks
+int wlfs_image_remove (struct wlfs_image *img, __u64 ino);
+
+// Overwrite one block of a file with a block's worth of data, creating the
+// inode if it has none & growing the file to cover the block.  Data goes to
+// the hot or cold stream as the kernel would send it; the mapping & inode
+// are written by the next sync
+int wlfs_image_write_data (struct wlfs_image *img, __u64 ino, __u32 iblock,
+                           void const *data);
+// Read one block of a file's data; holes read as zeros
+int wlfs_image_read_data (struct wlfs_image *img, __u64 ino, __u32 iblock,
+                          void *data);
+// Write back the mapping & inode of every file changed block by block
+int wlfs_image_sync (struct wlfs_image *img);
+// Make n files stable without a checkpoint, the way fsync would: write back
+// any of them changed, then write the open partial segments & flush the
+// device once for all of them.  Recovery rolls forward to them through
+// their commit blocks
+int wlfs_image_fsync (struct wlfs_image *img, __u64 const *inos, __u32 n);
+
+// Create an empty directory; returns -EEXIST if the inode has a block.  A
+// directory keeps its entries inline in its inode's block until they
+// outgrow it, then indexes them with a hash table in its file blocks, so
+// every operation reads a bounded number of blocks however many entries it
+// holds.  Names aren't counted in their inodes' link counts
+int wlfs_image_mkdir (struct wlfs_image *img, __u64 ino);
+// Find the inode a name in a directory refers to; returns -ENOENT if the
+// name isn't there
+int wlfs_image_dir_lookup (struct wlfs_image *img, __u64 dir,
+                           char const *name, __u64 *ino);
+// Add a name for an inode to a directory; returns -EEXIST if the name is
+// taken.  The directory's blocks are written like any file's data, & its
+// mapping & inode by the next sync
+int wlfs_image_link (struct wlfs_image *img, __u64 dir, char const *name,
+                     __u64 ino);
+// Remove a name from a directory, leaving the inode it refers to
+int wlfs_image_unlink (struct wlfs_image *img, __u64 dir, char const *name);
+// Call fn for each entry of a directory, in no particular order; stops at
+// the first nonzero return
+typedef int (*wlfs_dirent_fn) (struct wlfs_image *img,
+                               struct dir_entry const *entry, void *arg);
+int wlfs_image_readdir (struct wlfs_image *img, __u64 dir,
+                        wlfs_dirent_fn fn, void *arg);
+
+// Number of clean segments the log can move into
+__u32 wlfs_image_clean_segments (struct wlfs_image *img);
+// Clean segments with the kernel cleaner's policy until the target number
+// are clean or no more can be gained, then commit with a checkpoint;
+// returns the number of segments cleaned.  If the image compresses data,
+// the cold data blocks relocated are compressed a cluster at a time
+int wlfs_image_clean (struct wlfs_image *img);
+// Discard every clean segment, merging neighbours into one range: with
+// BLKDISCARD on a device, or by punching a hole in an image file; sets
+// *bytes to the bytes discarded
+int wlfs_image_trim (struct wlfs_image *img, __u64 *bytes);
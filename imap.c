@@ -0,0 +1,311 @@
+#include <linux/bitops.h>
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/mutex.h>
+#include <linux/printk.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "imap.h"
+#include "io.h"
+#include "super.h"
+#include "trace.h"
+#include "util.h"
+
+// Most map blocks evicted by one call of the shrinker
+#define IMAP_SHRINK_BATCH 64
+
+// Shard covering an inode's map block
+static struct imap_shard *get_shard (struct wlfs_super *wlfs_sb, __u64 ino);
+// Get a map block, reading it back in if it was evicted or allocating it
+// empty if it was never written; the caller holds the block's shard lock.
+// Returns NULL on failure
+static struct block *get_block_locked (struct wlfs_super *wlfs_sb,
+                                       __u32 index);
+// Note that a map block was looked up, for the shrinker's sweep
+static void mark_referenced (struct wlfs_super *wlfs_sb, __u32 index);
+
+int wlfs_imap_alloc (struct wlfs_super *wlfs_sb) {
+    struct inode_map *imap = &wlfs_sb->imap;
+    imap->nblocks = get_imap_blocks(&wlfs_sb->meta);
+    imap->entries = get_imap_entries(&wlfs_sb->meta);
+
+    imap->blocks = (struct block **) kcalloc(
+        imap->nblocks, sizeof(struct block *), GFP_NOFS);
+    imap->daddrs = (wlfs_daddr_t *) kcalloc(
+        imap->nblocks, sizeof(wlfs_daddr_t), GFP_NOFS);
+    imap->shards = (struct imap_shard *) kcalloc(
+        IMAP_SHARDS, sizeof(struct imap_shard), GFP_NOFS);
+    wlfs_sb->imap_dirty = (unsigned long *) kcalloc(
+        BITS_TO_LONGS(imap->nblocks), sizeof(unsigned long), GFP_NOFS);
+    wlfs_sb->imap_unstable = (unsigned long *) kcalloc(
+        BITS_TO_LONGS(imap->nblocks), sizeof(unsigned long), GFP_NOFS);
+    wlfs_sb->imap_referenced = (unsigned long *) kcalloc(
+        BITS_TO_LONGS(imap->nblocks), sizeof(unsigned long), GFP_NOFS);
+    atomic_set(&wlfs_sb->imap_cached, 0);
+    wlfs_sb->imap_hand = 0;
+    if (unlikely(!imap->blocks || !imap->daddrs || !imap->shards ||
+                 !wlfs_sb->imap_dirty || !wlfs_sb->imap_unstable ||
+                 !wlfs_sb->imap_referenced)) {
+        wlfs_imap_free(wlfs_sb);
+        return -ENOMEM;
+    }
+
+    unsigned i = 0;
+    for (; i < IMAP_SHARDS; ++i) {
+        mutex_init(&imap->shards[i].lock);
+    }
+
+    return 0;
+}
+
+// Lookups only run while the filesystem is mounted, so blocks can be freed
+// without waiting for a grace period
+void wlfs_imap_free (struct wlfs_super *wlfs_sb) {
+    struct inode_map *imap = &wlfs_sb->imap;
+
+    if (imap->blocks) {
+        __u32 i = 0;
+        for (; i < imap->nblocks; ++i) {
+            if (imap->blocks[i]) {
+                kmem_cache_free(wlfs_sb->imap_cache, imap->blocks[i]);
+            }
+        }
+    }
+    kfree(imap->blocks);
+    kfree(imap->daddrs);
+    kfree(imap->shards);
+    kfree(wlfs_sb->imap_dirty);
+    kfree(wlfs_sb->imap_unstable);
+    kfree(wlfs_sb->imap_referenced);
+    imap->blocks = NULL;
+    imap->daddrs = NULL;
+    imap->shards = NULL;
+    wlfs_sb->imap_dirty = NULL;
+    wlfs_sb->imap_unstable = NULL;
+    wlfs_sb->imap_referenced = NULL;
+}
+
+int wlfs_imap_populate (struct wlfs_super *wlfs_sb, __u32 index) {
+    struct inode_map *imap = &wlfs_sb->imap;
+
+    if (likely(ACCESS_ONCE(imap->blocks[index]))) {
+        return 0;
+    }
+
+    // Allocate outside the lock; if another thread publishes the block
+    // first, drop this one
+    struct block *blk = (struct block *) kmem_cache_zalloc(
+        wlfs_sb->imap_cache, GFP_NOFS);
+    if (unlikely(!blk)) {
+        printk(KERN_ERR "Failed to allocate inode map block %u\n", index);
+        return -ENOMEM;
+    }
+    blk->index = index;
+    blk->type = BLOCK_IMAP;
+
+    struct imap_shard *shard = &imap->shards[index % IMAP_SHARDS];
+    mutex_lock(&shard->lock);
+    if (!imap->blocks[index]) {
+        rcu_assign_pointer(imap->blocks[index], blk);
+        atomic_inc(&wlfs_sb->imap_cached);
+        blk = NULL;
+    }
+    mutex_unlock(&shard->lock);
+
+    if (blk) {
+        kmem_cache_free(wlfs_sb->imap_cache, blk);
+    }
+    return 0;
+}
+
+wlfs_daddr_t wlfs_imap_lookup (struct wlfs_super *wlfs_sb, __u64 ino) {
+    struct inode_map *imap = &wlfs_sb->imap;
+    wlfs_daddr_t daddr = 0;
+
+    if (unlikely(ino >= wlfs_sb->meta.inodes)) {
+        return 0;
+    }
+
+    wlfs_stat_add(wlfs_sb, STAT_IMAP_LOOKUPS, 1);
+    __u32 const index = ino / imap->entries;
+    rcu_read_lock();
+    struct block *blk = rcu_dereference(imap->blocks[index]);
+    if (blk) {
+        daddr = READ_ONCE(((wlfs_daddr_t *) get_block_data(blk))
+                          [ino % imap->entries]);
+    }
+    rcu_read_unlock();
+    if (blk) {
+        mark_referenced(wlfs_sb, index);
+        trace_wlfs_imap_lookup(wlfs_sb->sb, ino, daddr, true);
+        return daddr;
+    }
+
+    // A block which was never written is all zeros; one which was evicted
+    // is on disk unchanged.  Nothing can update it without reading it back
+    // in under the shard lock first
+    if (!ACCESS_ONCE(imap->daddrs[index])) {
+        trace_wlfs_imap_lookup(wlfs_sb->sb, ino, 0, true);
+        return 0;
+    }
+    wlfs_stat_add(wlfs_sb, STAT_IMAP_MISSES, 1);
+    struct imap_shard *shard = &imap->shards[index % IMAP_SHARDS];
+    mutex_lock(&shard->lock);
+    blk = get_block_locked(wlfs_sb, index);
+    if (likely(blk)) {
+        daddr = ((wlfs_daddr_t *) get_block_data(blk))
+            [ino % imap->entries];
+    }
+    mutex_unlock(&shard->lock);
+    trace_wlfs_imap_lookup(wlfs_sb->sb, ino, daddr, false);
+
+    return daddr;
+}
+
+void wlfs_imap_lock (struct wlfs_super *wlfs_sb, __u64 ino) {
+    mutex_lock(&get_shard(wlfs_sb, ino)->lock);
+}
+
+void wlfs_imap_unlock (struct wlfs_super *wlfs_sb, __u64 ino) {
+    mutex_unlock(&get_shard(wlfs_sb, ino)->lock);
+}
+
+wlfs_daddr_t *wlfs_imap_entry (struct wlfs_super *wlfs_sb, __u64 ino) {
+    struct inode_map *imap = &wlfs_sb->imap;
+
+    if (unlikely(!imap->blocks || ino >= wlfs_sb->meta.inodes)) {
+        return NULL;
+    }
+    __u32 const index = ino / imap->entries;
+    struct block *blk = get_block_locked(wlfs_sb, index);
+    if (unlikely(!blk)) {
+        return NULL;
+    }
+    mark_referenced(wlfs_sb, index);
+    return (wlfs_daddr_t *) get_block_data(blk) + ino % imap->entries;
+}
+
+void wlfs_imap_mark_dirty (struct wlfs_super *wlfs_sb, __u64 ino) {
+    if (likely(ino < wlfs_sb->meta.inodes)) {
+        set_bit(ino / wlfs_sb->imap.entries, wlfs_sb->imap_dirty);
+    }
+}
+
+// The shard lock keeps the shrinker off the block while it is copied
+bool wlfs_imap_copy (struct wlfs_super *wlfs_sb, __u32 index, 
+                     struct block *dst) {
+    struct imap_shard *shard = &wlfs_sb->imap.shards[index % IMAP_SHARDS];
+    bool copied = false;
+
+    mutex_lock(&shard->lock);
+    // Clear the dirty bit first, so an update racing with the copy leaves
+    // the block dirty for the next checkpoint
+    if (test_and_clear_bit(index, wlfs_sb->imap_dirty)) {
+        // The cleaner dirties blocks to move them, which may be evicted
+        struct block *blk = get_block_locked(wlfs_sb, index);
+        if (likely(blk)) {
+            set_bit(index, wlfs_sb->imap_unstable);
+            memcpy(dst, blk, wlfs_sb->meta.block_size);
+            copied = true;
+        }
+    }
+    mutex_unlock(&shard->lock);
+    return copied;
+}
+
+// Checkpoints are serialized, & copies are only taken by them
+void wlfs_imap_settle (struct wlfs_super *wlfs_sb) {
+    bitmap_zero(wlfs_sb->imap_unstable, wlfs_sb->imap.nblocks);
+}
+
+// A clock sweep: blocks looked up since the hand last passed them get a
+// second chance.  Only blocks unchanged since their latest copy reached the
+// disk are evicted, under their shard lock so no update is using them, &
+// freed once lookups in flight are done with them.  Sweeps may race on the
+// hand, which only costs fairness
+unsigned long wlfs_imap_shrink (struct wlfs_super *wlfs_sb,
+                                unsigned long nr) {
+    struct inode_map *imap = &wlfs_sb->imap;
+    struct block *victims[IMAP_SHRINK_BATCH];
+    unsigned long n = 0;
+
+    nr = min_t(unsigned long, nr, IMAP_SHRINK_BATCH);
+    __u32 scanned = 0;
+    for (; n < nr && scanned < 2 * imap->nblocks; ++scanned) {
+        __u32 const i = ACCESS_ONCE(wlfs_sb->imap_hand);
+        WRITE_ONCE(wlfs_sb->imap_hand, (i + 1) % imap->nblocks);
+        if (!ACCESS_ONCE(imap->blocks[i]) ||
+            test_and_clear_bit(i, wlfs_sb->imap_referenced)) {
+            continue;
+        }
+        struct imap_shard *shard = &imap->shards[i % IMAP_SHARDS];
+        if (!mutex_trylock(&shard->lock)) {
+            continue;
+        }
+        struct block *blk = imap->blocks[i];
+        if (blk && !test_bit(i, wlfs_sb->imap_dirty) &&
+            !test_bit(i, wlfs_sb->imap_unstable)) {
+            RCU_INIT_POINTER(imap->blocks[i], NULL);
+            atomic_dec(&wlfs_sb->imap_cached);
+            victims[n++] = blk;
+        }
+        mutex_unlock(&shard->lock);
+    }
+
+    if (n) {
+        synchronize_rcu();
+        unsigned long i = 0;
+        for (; i < n; ++i) {
+            kmem_cache_free(wlfs_sb->imap_cache, victims[i]);
+        }
+    }
+    return n;
+}
+
+/*
+ * Helper functions
+ */
+
+struct imap_shard *get_shard (struct wlfs_super *wlfs_sb, __u64 ino) {
+    return &wlfs_sb->imap.shards[
+        (ino / wlfs_sb->imap.entries) % IMAP_SHARDS];
+}
+
+struct block *get_block_locked (struct wlfs_super *wlfs_sb, __u32 index) {
+    struct inode_map *imap = &wlfs_sb->imap;
+    struct block *blk = imap->blocks[index];
+    if (likely(blk)) {
+        return blk;
+    }
+
+    blk = (struct block *) kmem_cache_zalloc(wlfs_sb->imap_cache, GFP_NOFS);
+    if (unlikely(!blk)) {
+        printk(KERN_ERR "Failed to allocate inode map block %u\n", index);
+        return NULL;
+    }
+    if (imap->daddrs[index]) {
+        struct block_read read = {imap->daddrs[index], blk};
+        if (unlikely(wlfs_read_scattered(wlfs_sb->sb, &read, 1) ||
+                     blk->type != BLOCK_IMAP || blk->index != index)) {
+            printk(KERN_ERR "Error reading inode map block %u\n", index);
+            kmem_cache_free(wlfs_sb->imap_cache, blk);
+            return NULL;
+        }
+    } else {
+        blk->index = index;
+        blk->type = BLOCK_IMAP;
+    }
+    rcu_assign_pointer(imap->blocks[index], blk);
+    atomic_inc(&wlfs_sb->imap_cached);
+    return blk;
+}
+
+// Test first, so lookups of blocks already marked don't write to the
+// shared bitmap
+void mark_referenced (struct wlfs_super *wlfs_sb, __u32 index) {
+    if (!test_bit(index, wlfs_sb->imap_referenced)) {
+        set_bit(index, wlfs_sb->imap_referenced);
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * In-memory inode map
+ */
+
+#pragma once
+
+#include <linux/cache.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/types.h>
+
+#include "wlfs.h"
+
+// Number of update locks; map block n is covered by shard n % IMAP_SHARDS
+#define IMAP_SHARDS 64
+
+// Each shard sits on its own cache line, so updates to different shards
+// don't contend
+struct imap_shard {
+    struct mutex lock;
+} ____cacheline_aligned_in_smp;
+
+struct wlfs_super;
+
+// Allocate an empty inode map (no inodes written)
+int wlfs_imap_alloc (struct wlfs_super *wlfs_sb);
+// Free the inode map blocks
+void wlfs_imap_free (struct wlfs_super *wlfs_sb);
+
+// Make sure a map block is allocated, without reading it; blocks are
+// allocated when first needed, so a sparse inode space costs no memory
+int wlfs_imap_populate (struct wlfs_super *wlfs_sb, __u32 index);
+
+// Disk address of an inode's block, 0 if it has none.  Takes no lock unless
+// the map block was evicted, in which case it is read back in
+wlfs_daddr_t wlfs_imap_lookup (struct wlfs_super *wlfs_sb, __u64 ino);
+
+// Serialize updates to an inode's map entry against other updates to the
+// same shard; lookups aren't blocked
+void wlfs_imap_lock (struct wlfs_super *wlfs_sb, __u64 ino);
+void wlfs_imap_unlock (struct wlfs_super *wlfs_sb, __u64 ino);
+
+// Inode map entry (disk address of the inode's block) for an inode number,
+// reading its map block back in or allocating it if needed; NULL if the
+// inode number is out of range or the block can't be loaded.  The caller
+// holds the inode's shard lock, which keeps the map block from being
+// evicted, for as long as it uses the entry (recovery runs before eviction
+// starts); stores to it use WRITE_ONCE, as the segment buffer does
+wlfs_daddr_t *wlfs_imap_entry (struct wlfs_super *wlfs_sb, __u64 ino);
+
+// Note that an inode's map entry changed, so its map block is rewritten by
+// the next checkpoint
+void wlfs_imap_mark_dirty (struct wlfs_super *wlfs_sb, __u64 ino);
+// Copy an imap block if it is dirty, marking it clean; returns whether it was
+// copied.  The block can't be evicted until the copy is settled
+bool wlfs_imap_copy (struct wlfs_super *wlfs_sb, __u32 index, 
+                     struct block *dst);
+// Note that every copy taken so far is on disk
+void wlfs_imap_settle (struct wlfs_super *wlfs_sb);
+// Evict up to nr clean map blocks not looked up recently; returns the
+// number evicted
+unsigned long wlfs_imap_shrink (struct wlfs_super *wlfs_sb, unsigned long nr);
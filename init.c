@@ -3,11 +3,14 @@
  */
 
 #include <linux/compiler.h>
+#include <linux/errno.h>
 #include <linux/module.h>
 #include <linux/printk.h>
 
-#include "wlfs.h"
+#include "inode.h"
+#include "stats.h"
 #include "super.h"
+#include "wlfs.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Walker Mills");
@@ -25,8 +28,19 @@ static int __init wlfs_init (void) {
 #ifndef NDEBUG
     printk(KERN_DEBUG "Loading wlfs\n");
 #endif
+    if (unlikely(wlfs_inode_cache_create())) {
+        printk(KERN_ERR "Failed to create inode cache");
+        return -ENOMEM;
+    }
+    if (unlikely(wlfs_stats_init())) {
+        printk(KERN_ERR "Failed to create /sys/fs/wlfs");
+        wlfs_inode_cache_destroy();
+        return -ENOMEM;
+    }
     if (unlikely(register_filesystem(&wlfs_type))) {
         printk(KERN_ERR "Failed to register filesystem");
+        wlfs_stats_exit();
+        wlfs_inode_cache_destroy();
         return -1;
     }
 
@@ -41,6 +55,8 @@ static void __exit wlfs_exit (void) {
     if (unlikely(unregister_filesystem(&wlfs_type))) {
         printk(KERN_ERR "Failed to unregister filesystem");
     }
+    wlfs_stats_exit();
+    wlfs_inode_cache_destroy();
 
     printk(KERN_INFO "Unloaded wlfs\n");
 }
@@ -0,0 +1,141 @@
+#include <linux/compiler.h>
+#include <linux/err.h>
+#include <linux/errno.h>
+#include <linux/printk.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "dir.h"
+#include "file.h"
+#include "imap.h"
+#include "inode.h"
+#include "io.h"
+#include "super.h"
+#include "util.h"
+
+static struct kmem_cache *wlfs_inode_cache;
+
+// Initialize the VFS part of an inode once, when its slab is allocated
+static void init_once (void *ptr);
+// Free an inode after an RCU grace period, as path walks may still see it
+static void free_inode (struct rcu_head *head);
+// Fill in a new inode from its block in the log
+static int read_inode (struct super_block *sb, struct inode *inode);
+
+int wlfs_inode_cache_create (void) {
+    wlfs_inode_cache = kmem_cache_create(
+        "wlfs_inode_info", sizeof(struct wlfs_inode_info), 0,
+        SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD, init_once);
+    return wlfs_inode_cache ? 0 : -ENOMEM;
+}
+
+void wlfs_inode_cache_destroy (void) {
+    // Wait for inodes freed after a grace period
+    rcu_barrier();
+    kmem_cache_destroy(wlfs_inode_cache);
+}
+
+struct inode *wlfs_alloc_inode (struct super_block *sb) {
+    struct wlfs_inode_info *info = (struct wlfs_inode_info *)
+        kmem_cache_alloc(wlfs_inode_cache, GFP_NOFS);
+    if (unlikely(!info)) {
+        return NULL;
+    }
+    info->iblk = NULL;
+    info->ra_gap = 0;
+    return &info->vfs_inode;
+}
+
+void wlfs_destroy_inode (struct inode *inode) {
+    call_rcu(&inode->i_rcu, free_inode);
+}
+
+struct inode *wlfs_iget (struct super_block *sb, __u64 ino) {
+    struct inode *inode = iget_locked(sb, ino);
+    if (unlikely(!inode)) {
+        return ERR_PTR(-ENOMEM);
+    }
+    if (!(inode->i_state & I_NEW)) {
+        return inode;
+    }
+
+    int const ret = read_inode(sb, inode);
+    if (unlikely(ret)) {
+        iget_failed(inode);
+        return ERR_PTR(ret);
+    }
+    unlock_new_inode(inode);
+    return inode;
+}
+
+/*
+ * Helper functions
+ */
+
+void init_once (void *ptr) {
+    struct wlfs_inode_info *info = (struct wlfs_inode_info *) ptr;
+    inode_init_once(&info->vfs_inode);
+}
+
+void free_inode (struct rcu_head *head) {
+    struct inode *inode = container_of(head, struct inode, i_rcu);
+    struct wlfs_inode_info *info = WLFS_I(inode);
+    kfree(info->iblk);
+    kmem_cache_free(wlfs_inode_cache, info);
+}
+
+// The cleaner sets aside segments holding data, indirect & extent blocks
+// rather than moving them, so the copy of the inode block maps the file for
+// as long as the inode is cached; relocating them would have to refresh it
+int read_inode (struct super_block *sb, struct inode *inode) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    __u32 const block_size = wlfs_sb->meta.block_size;
+    int ret = 0;
+
+    wlfs_daddr_t const daddr = wlfs_imap_lookup(wlfs_sb, inode->i_ino);
+    if (!daddr) {
+        return -ENOENT;
+    }
+    struct block *iblk = (struct block *) kmalloc(block_size, GFP_NOFS);
+    if (unlikely(!iblk)) {
+        return -ENOMEM;
+    }
+    // Blocks may be larger than the buffer heads sb_bread deals in
+    struct block_read read = {daddr, iblk};
+    ret = wlfs_read_scattered(sb, &read, 1);
+    if (unlikely(ret)) {
+        goto fail;
+    }
+    if (unlikely(iblk->type != BLOCK_INODE || iblk->index != inode->i_ino)) {
+        printk(KERN_ERR "Block %llu doesn't hold inode %lu\n", daddr,
+               inode->i_ino);
+        ret = -EIO;
+        goto fail;
+    }
+
+    struct wlfs_inode *winode = (struct wlfs_inode *) get_block_data(iblk);
+    inode->i_mode = winode->mode;
+    i_uid_write(inode, winode->uid);
+    i_gid_write(inode, winode->gid);
+    set_nlink(inode, winode->nlink);
+    i_size_write(inode, winode->size);
+    inode->i_atime.tv_sec = winode->atime;
+    inode->i_mtime.tv_sec = winode->mtime;
+    inode->i_ctime.tv_sec = winode->ctime;
+    inode->i_atime.tv_nsec = inode->i_mtime.tv_nsec =
+        inode->i_ctime.tv_nsec = 0;
+    if (S_ISREG(inode->i_mode)) {
+        inode->i_fop = &wlfs_file_ops;
+        inode->i_mapping->a_ops = &wlfs_aops;
+    } else if (S_ISDIR(inode->i_mode)) {
+        inode->i_op = &wlfs_dir_inode_ops;
+        inode->i_fop = &wlfs_dir_ops;
+    }
+    WLFS_I(inode)->iblk = iblk;
+    return 0;
+
+fail:
+    kfree(iblk);
+    return ret;
+}
@@ -0,0 +1,35 @@
+/*
+ * In-memory inodes, loaded from their blocks in the log
+ */
+
+#pragma once
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/types.h>
+
+#include "wlfs.h"
+
+struct wlfs_inode_info {
+    // Copy of the inode's block, through which its data blocks are mapped;
+    // NULL for inodes which have never been written, e.g., the root
+    struct block *iblk;
+    // Largest gap on disk, in blocks, bridged to merge runs into one read;
+    // adapted to how many of the blocks read are wanted
+    __u32 ra_gap;
+    struct inode vfs_inode;
+};
+
+#define WLFS_I(inode) container_of(inode, struct wlfs_inode_info, vfs_inode)
+
+// Create & destroy the slab cache inodes are allocated from
+int wlfs_inode_cache_create (void);
+void wlfs_inode_cache_destroy (void);
+
+// Allocate & free inodes for the VFS (super_operations)
+struct inode *wlfs_alloc_inode (struct super_block *sb);
+void wlfs_destroy_inode (struct inode *inode);
+
+// Get an inode, reading its block from the log if it isn't cached; returns
+// ERR_PTR(-ENOENT) if the inode has no block
+struct inode *wlfs_iget (struct super_block *sb, __u64 ino);
@@ -0,0 +1,284 @@
+#include <linux/atomic.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#include "io.h"
+#include "super.h"
+#include "util.h"
+
+// Tracks the bios making up a synchronous multi-bio read or write
+struct sync_io {
+    atomic_t pending;
+    int error;
+    struct completion done;
+};
+
+// Completion handler for synchronous multi-bio reads & writes
+static void wlfs_sync_end_io (struct bio *bio);
+// Order block reads by ascending disk address
+static int compare_reads (void const *a, void const *b);
+// Add a physically contiguous buffer to a bio a page at a time; returns
+// false if the bio filled up first
+static bool add_buffer (struct bio *bio, void *buf, __u32 len);
+// Transfer a run of contiguous blocks to or from an array of pages
+static int rw_blocks (struct super_block *sb, int rw, __u64 daddr,
+                      struct page **pages, __u32 nblocks);
+// Submit bios transferring a run of contiguous blocks to or from the block
+// slots of an array of pages starting at slot, without waiting
+static void submit_run (struct super_block *sb, struct sync_io *ctx, int rw,
+                        __u64 daddr, struct page **pages, __u32 slot,
+                        __u32 nblocks);
+// Initialize a synchronous I/O holding a reference for the submitter
+static void init_sync_io (struct sync_io *ctx);
+// Submit a bio tracked by a synchronous I/O
+static void submit_sync_io (struct sync_io *ctx, int rw, struct bio *bio);
+// Drop the submitter's reference & wait for all bios to complete
+static int wait_sync_io (struct sync_io *ctx);
+
+// Blocks are addressed through the page they start in, so a block larger
+// than a page is backed by a compound page of its own, whose pages are
+// contiguous in the kernel's address space.  Freeing goes by each run's
+// head page, which records the run's order
+struct page **wlfs_alloc_pages (__u32 npages, __u32 block_size) {
+    unsigned const order = block_size > PAGE_SIZE ? get_order(block_size) : 0;
+    struct page **pages = (struct page **) kcalloc(
+        npages, sizeof(struct page *), GFP_KERNEL);
+    if (unlikely(!pages)) {
+        return NULL;
+    }
+
+    __u32 i = 0;
+    while (i < npages) {
+        struct page *page = alloc_pages(GFP_KERNEL | __GFP_COMP, order);
+        if (unlikely(!page)) {
+            wlfs_free_pages(pages, i);
+            return NULL;
+        }
+        unsigned j = 0;
+        for (; j < 1U << order && i < npages; ++j) {
+            pages[i++] = page + j;
+        }
+    }
+    return pages;
+}
+
+void wlfs_free_pages (struct page **pages, __u32 npages) {
+    __u32 i = 0;
+    while (i < npages) {
+        unsigned const order = compound_order(pages[i]);
+        __free_pages(pages[i], order);
+        i += 1U << order;
+    }
+    kfree(pages);
+}
+
+struct block *wlfs_get_block (struct page **pages, __u32 block_size, 
+                              __u32 n) {
+    unsigned long const pos = (unsigned long) n * block_size;
+    return (struct block *) ((char *) page_address(pages[pos / PAGE_SIZE]) +
+                             pos % PAGE_SIZE);
+}
+
+int wlfs_read_blocks (struct super_block *sb, __u64 daddr, 
+                      struct page **pages, __u32 nblocks) {
+    return rw_blocks(sb, READ, daddr, pages, nblocks);
+}
+
+int wlfs_write_blocks (struct super_block *sb, int rw, __u64 daddr,
+                       struct page **pages, __u32 nblocks) {
+    return rw_blocks(sb, rw, daddr, pages, nblocks);
+}
+
+int wlfs_read_scattered (struct super_block *sb, struct block_read *reads,
+                         __u32 n) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    __u32 const block_size = wlfs_sb->meta.block_size;
+    // A buffer may start partway into a page
+    __u32 const vecs = DIV_ROUND_UP(block_size, PAGE_SIZE) + 1;
+
+    sort(reads, n, sizeof(struct block_read), compare_reads, NULL);
+
+    struct sync_io ctx;
+    init_sync_io(&ctx);
+
+    struct bio *bio = NULL;
+    struct blk_plug plug;
+    blk_start_plug(&plug);
+    __u32 i = 0;
+    while (i < n) {
+        // Start a new bio at a discontinuity in the disk addresses
+        if (bio && reads[i].daddr != reads[i - 1].daddr + 1) {
+            submit_sync_io(&ctx, READ, bio);
+            bio = NULL;
+        }
+        if (!bio) {
+            bio = bio_alloc(GFP_NOFS,
+                            min_t(__u32, BIO_MAX_PAGES, (n - i) * vecs));
+            bio->bi_bdev = sb->s_bdev;
+            bio->bi_iter.bi_sector = reads[i].daddr * (block_size >> 9);
+            bio->bi_end_io = wlfs_sync_end_io;
+            bio->bi_private = &ctx;
+        }
+
+        // If the bio fills up partway through a block, the next bio reads
+        // the whole block again
+        if (!add_buffer(bio, reads[i].buf, block_size)) {
+            submit_sync_io(&ctx, READ, bio);
+            bio = NULL;
+            continue;
+        }
+        ++i;
+    }
+    if (bio) {
+        submit_sync_io(&ctx, READ, bio);
+    }
+    blk_finish_plug(&plug);
+
+    int const ret = wait_sync_io(&ctx);
+    if (unlikely(ret)) {
+        return ret;
+    }
+    for (i = 0; i < n; ++i) {
+        if (unlikely(!check_block_csum(&wlfs_sb->meta,
+                                       (struct block *) reads[i].buf))) {
+            printk(KERN_ERR "Block %llu failed its checksum\n",
+                   reads[i].daddr);
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+int wlfs_read_runs (struct super_block *sb, struct block_run *runs, __u32 n) {
+    struct sync_io ctx;
+    init_sync_io(&ctx);
+
+    struct blk_plug plug;
+    blk_start_plug(&plug);
+    __u32 i = 0;
+    for (; i < n; ++i) {
+        if (runs[i].daddr) {
+            submit_run(sb, &ctx, READ, runs[i].daddr, runs[i].pages,
+                       runs[i].slot, runs[i].nblocks);
+        }
+    }
+    blk_finish_plug(&plug);
+
+    return wait_sync_io(&ctx);
+}
+
+/*
+ * Helper functions
+ */
+
+int rw_blocks (struct super_block *sb, int rw, __u64 daddr,
+               struct page **pages, __u32 nblocks) {
+    struct sync_io ctx;
+    init_sync_io(&ctx);
+
+    struct blk_plug plug;
+    blk_start_plug(&plug);
+    submit_run(sb, &ctx, rw, daddr, pages, 0, nblocks);
+    blk_finish_plug(&plug);
+
+    return wait_sync_io(&ctx);
+}
+
+void submit_run (struct super_block *sb, struct sync_io *ctx, int rw,
+                 __u64 daddr, struct page **pages, __u32 slot,
+                 __u32 nblocks) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    __u32 const block_size = wlfs_sb->meta.block_size;
+    unsigned long const first = (unsigned long) slot * block_size;
+    unsigned long const last = first + (unsigned long) nblocks * block_size;
+    unsigned long pos = first;
+
+    struct bio *bio = NULL;
+    while (pos < last) {
+        if (!bio) {
+            unsigned const npages = min_t(unsigned long, BIO_MAX_PAGES,
+                DIV_ROUND_UP(last, PAGE_SIZE) - pos / PAGE_SIZE);
+            bio = bio_alloc(GFP_NOFS, npages);
+            bio->bi_bdev = sb->s_bdev;
+            bio->bi_iter.bi_sector = 
+                (daddr * block_size + pos - first) >> 9;
+            bio->bi_end_io = wlfs_sync_end_io;
+            bio->bi_private = ctx;
+        }
+
+        unsigned const offset = pos % PAGE_SIZE;
+        unsigned const len = min_t(unsigned long, PAGE_SIZE - offset,
+                                   last - pos);
+        if (bio_add_page(bio, pages[pos / PAGE_SIZE], len, offset) < len) {
+            submit_sync_io(ctx, rw, bio);
+            bio = NULL;
+            continue;
+        }
+        pos += len;
+    }
+    if (bio) {
+        submit_sync_io(ctx, rw, bio);
+    }
+}
+
+int compare_reads (void const *a, void const *b) {
+    __u64 const lhs = ((struct block_read const *) a)->daddr;
+    __u64 const rhs = ((struct block_read const *) b)->daddr;
+    return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+
+bool add_buffer (struct bio *bio, void *buf, __u32 len) {
+    char *pos = (char *) buf;
+    while (len > 0) {
+        unsigned const offset = offset_in_page(pos);
+        unsigned const chunk = min_t(unsigned long, len, PAGE_SIZE - offset);
+        if (bio_add_page(bio, virt_to_page(pos), chunk, offset) < chunk) {
+            return false;
+        }
+        pos += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+// Hold a reference until every bio is submitted, so completion can't be
+// signalled early
+void init_sync_io (struct sync_io *ctx) {
+    atomic_set(&ctx->pending, 1);
+    ctx->error = 0;
+    init_completion(&ctx->done);
+}
+
+void submit_sync_io (struct sync_io *ctx, int rw, struct bio *bio) {
+    atomic_inc(&ctx->pending);
+    submit_bio(rw, bio);
+}
+
+int wait_sync_io (struct sync_io *ctx) {
+    if (!atomic_dec_and_test(&ctx->pending)) {
+        wait_for_completion(&ctx->done);
+    }
+    return ctx->error;
+}
+
+void wlfs_sync_end_io (struct bio *bio) {
+    struct sync_io *ctx = (struct sync_io *) bio->bi_private;
+
+    if (unlikely(bio->bi_error)) {
+        printk(KERN_ERR "Block I/O failed with error %d\n", bio->bi_error);
+        ctx->error = bio->bi_error;
+    }
+    bio_put(bio);
+
+    if (atomic_dec_and_test(&ctx->pending)) {
+        complete(&ctx->done);
+    }
+}
@@ -0,0 +1,58 @@
+/*
+ * Block I/O helpers shared by the log writer, cleaner, recovery & file reads
+ */
+
+#pragma once
+
+#include <linux/fs.h>
+#include <linux/mm_types.h>
+#include <linux/types.h>
+
+#include "wlfs.h"
+
+// A block to be read into a block-sized buffer in physically contiguous
+// memory, e.g., from kmalloc or a slab cache
+struct block_read {
+    __u64 daddr;
+    void *buf;
+};
+
+// A run of blocks contiguous on disk, to be read into consecutive block slots
+// of an array of pages; a run with no disk address is a hole & isn't read
+struct block_run {
+    struct page **pages;
+    __u64 daddr;
+    __u32 slot;
+    __u32 nblocks;
+};
+
+// Allocate an array of npages pages to hold blocks of block_size, a whole
+// number of them; returns NULL on failure
+struct page **wlfs_alloc_pages (__u32 npages, __u32 block_size);
+// Free an array of pages allocated by wlfs_alloc_pages
+void wlfs_free_pages (struct page **pages, __u32 npages);
+
+// Address of the n-th block stored in an array of pages
+struct block *wlfs_get_block (struct page **pages, __u32 block_size, __u32 n);
+
+// Read a run of contiguous blocks into an array of pages, using as few bios
+// as possible & waiting for them to complete
+int wlfs_read_blocks (struct super_block *sb, __u64 daddr, 
+                      struct page **pages, __u32 nblocks);
+
+// Write a run of contiguous blocks from an array of pages with the given
+// request flags (e.g., WRITE_FUA), waiting for the writes to complete
+int wlfs_write_blocks (struct super_block *sb, int rw, __u64 daddr,
+                       struct page **pages, __u32 nblocks);
+
+// Read scattered blocks into their buffers & check them against their
+// checksums; reads are sorted by address (in place), merged into multi-block
+// bios where addresses are contiguous, and all submitted under one plug
+// before waiting for any of them
+int wlfs_read_scattered (struct super_block *sb, struct block_read *reads,
+                         __u32 n);
+
+// Read runs of contiguous blocks into their slots of their arrays of pages,
+// using as few bios per run as possible; all runs are submitted under one
+// plug before waiting for any of them
+int wlfs_read_runs (struct super_block *sb, struct block_run *runs, __u32 n);
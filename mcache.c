@@ -0,0 +1,293 @@
+#include <linux/compiler.h>
+#include <linux/err.h>
+#include <linux/errno.h>
+#include <linux/hash.h>
+#include <linux/moduleparam.h>
+#include <linux/printk.h>
+
+#include "imap.h"
+#include "io.h"
+#include "mcache.h"
+#include "super.h"
+
+// Log2 of the number of hash buckets
+#define MCACHE_HASH_BITS 12
+
+// Most indirect, extent & directory blocks cached per mount
+static unsigned meta_cache_blocks = 4096;
+module_param(meta_cache_blocks, uint, 0444);
+MODULE_PARM_DESC(meta_cache_blocks,
+                 "Indirect, extent & directory blocks cached per mount");
+
+// Hash bucket of a disk address
+static struct hlist_head *get_bucket (struct meta_cache *mc, __u64 daddr);
+// Find a cached block & take a reference to it, marking it most recently
+// used; the caller holds the lock
+static struct meta_entry *find_entry (struct meta_cache *mc, __u64 daddr);
+// Move up to nr unreferenced entries, least recently used first, onto a
+// list to be freed; the caller holds the lock
+static unsigned long evict_entries (struct meta_cache *mc, unsigned long nr,
+                                    struct list_head *victims);
+// Free evicted entries
+static void free_entries (struct meta_cache *mc, struct list_head *victims);
+// Number of objects the shrinker could free
+static unsigned long count_objects (struct shrinker *shrinker,
+                                    struct shrink_control *sc);
+// Free clean metadata: unused cached blocks first, then clean
+// inode map blocks
+static unsigned long scan_objects (struct shrinker *shrinker,
+                                   struct shrink_control *sc);
+
+int wlfs_mcache_init (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct meta_cache *mc = &wlfs_sb->mcache;
+
+    spin_lock_init(&mc->lock);
+    INIT_LIST_HEAD(&mc->lru);
+    mc->count = 0;
+    mc->limit = meta_cache_blocks;
+    mc->hash = (struct hlist_head *) kcalloc(
+        1 << MCACHE_HASH_BITS, sizeof(struct hlist_head), GFP_KERNEL);
+    mc->block_cache = kmem_cache_create(
+        "wlfs_meta_block", wlfs_sb->meta.block_size,
+        wlfs_sb->meta.block_size, SLAB_RECLAIM_ACCOUNT, NULL);
+    if (unlikely(!mc->hash || !mc->block_cache)) {
+        goto fail;
+    }
+
+    mc->shrinker.count_objects = count_objects;
+    mc->shrinker.scan_objects = scan_objects;
+    mc->shrinker.seeks = DEFAULT_SEEKS;
+    mc->shrinker.batch = 0;
+    mc->shrinker.flags = 0;
+    if (unlikely(register_shrinker(&mc->shrinker))) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (mc->block_cache) {
+        kmem_cache_destroy(mc->block_cache);
+    }
+    kfree(mc->hash);
+    mc->block_cache = NULL;
+    mc->hash = NULL;
+    return -ENOMEM;
+}
+
+void wlfs_mcache_destroy (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct meta_cache *mc = &wlfs_sb->mcache;
+    LIST_HEAD(victims);
+
+    if (!mc->hash) {
+        return;
+    }
+    unregister_shrinker(&mc->shrinker);
+    spin_lock(&mc->lock);
+    evict_entries(mc, mc->count, &victims);
+    spin_unlock(&mc->lock);
+    free_entries(mc, &victims);
+    if (unlikely(mc->count)) {
+        printk(KERN_ERR "%lu metadata blocks still in use at unmount\n",
+               mc->count);
+    }
+    printk(KERN_INFO "Metadata cache: %lld hits, %lld misses\n",
+           (long long) wlfs_stat_read(wlfs_sb, STAT_MCACHE_HITS),
+           (long long) wlfs_stat_read(wlfs_sb, STAT_MCACHE_MISSES));
+    kmem_cache_destroy(mc->block_cache);
+    kfree(mc->hash);
+    mc->hash = NULL;
+}
+
+struct meta_entry *wlfs_mcache_get (struct super_block *sb,
+                                    wlfs_daddr_t daddr, __u64 ino,
+                                    enum block_type type) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct meta_cache *mc = &wlfs_sb->mcache;
+    struct meta_entry *fresh = NULL;
+    LIST_HEAD(victims);
+
+    spin_lock(&mc->lock);
+    struct meta_entry *entry = find_entry(mc, daddr);
+    spin_unlock(&mc->lock);
+    if (entry) {
+        wlfs_stat_add(wlfs_sb, STAT_MCACHE_HITS, 1);
+        goto check;
+    }
+
+    // Read outside the lock; if another lookup caches the block first, its
+    // copy is used
+    wlfs_stat_add(wlfs_sb, STAT_MCACHE_MISSES, 1);
+    fresh = (struct meta_entry *) kmalloc(sizeof(struct meta_entry),
+                                          GFP_NOFS);
+    if (unlikely(!fresh)) {
+        return ERR_PTR(-ENOMEM);
+    }
+    fresh->blk = (struct block *) kmem_cache_alloc(mc->block_cache, GFP_NOFS);
+    if (unlikely(!fresh->blk)) {
+        kfree(fresh);
+        return ERR_PTR(-ENOMEM);
+    }
+    struct block_read read = {daddr, fresh->blk};
+    int const ret = wlfs_read_scattered(sb, &read, 1);
+    if (unlikely(ret)) {
+        kmem_cache_free(mc->block_cache, fresh->blk);
+        kfree(fresh);
+        return ERR_PTR(ret);
+    }
+
+    spin_lock(&mc->lock);
+    entry = find_entry(mc, daddr);
+    if (!entry) {
+        fresh->daddr = daddr;
+        fresh->refs = 1;
+        hlist_add_head(&fresh->hash, get_bucket(mc, daddr));
+        list_add_tail(&fresh->lru, &mc->lru);
+        entry = fresh;
+        fresh = NULL;
+        if (++mc->count > mc->limit) {
+            evict_entries(mc, mc->count - mc->limit, &victims);
+        }
+    }
+    spin_unlock(&mc->lock);
+    if (fresh) {
+        list_add(&fresh->lru, &victims);
+    }
+    free_entries(mc, &victims);
+
+check:
+    if (unlikely(entry->blk->type != type || entry->blk->index != ino)) {
+        printk(KERN_ERR "Block %llu is not a block of type %u of inode %llu\n",
+               daddr, type, ino);
+        wlfs_mcache_put(sb, entry);
+        return ERR_PTR(-EIO);
+    }
+    return entry;
+}
+
+// Invalidated entries are off the hash table & the LRU list, so the last
+// reference frees them
+void wlfs_mcache_put (struct super_block *sb, struct meta_entry *entry) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct meta_cache *mc = &wlfs_sb->mcache;
+
+    spin_lock(&mc->lock);
+    bool const stale = --entry->refs == 0 && hlist_unhashed(&entry->hash);
+    spin_unlock(&mc->lock);
+    if (stale) {
+        kmem_cache_free(mc->block_cache, entry->blk);
+        kfree(entry);
+    }
+}
+
+// The cache is bounded far below a segment's worth of addresses, so every
+// entry is checked rather than every address looked up
+void wlfs_mcache_invalidate (struct super_block *sb, __u64 daddr,
+                             __u32 count) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct meta_cache *mc = &wlfs_sb->mcache;
+    struct meta_entry *entry;
+    struct meta_entry *next;
+    LIST_HEAD(victims);
+
+    if (!mc->hash) {
+        return;
+    }
+    spin_lock(&mc->lock);
+    list_for_each_entry_safe(entry, next, &mc->lru, lru) {
+        if (entry->daddr < daddr || entry->daddr - daddr >= count) {
+            continue;
+        }
+        hlist_del_init(&entry->hash);
+        if (entry->refs) {
+            list_del_init(&entry->lru);
+        } else {
+            list_move(&entry->lru, &victims);
+        }
+        --mc->count;
+    }
+    spin_unlock(&mc->lock);
+    free_entries(mc, &victims);
+}
+
+/*
+ * Helper functions
+ */
+
+struct hlist_head *get_bucket (struct meta_cache *mc, __u64 daddr) {
+    return &mc->hash[hash_64(daddr, MCACHE_HASH_BITS)];
+}
+
+struct meta_entry *find_entry (struct meta_cache *mc, __u64 daddr) {
+    struct meta_entry *entry;
+
+    hlist_for_each_entry(entry, get_bucket(mc, daddr), hash) {
+        if (entry->daddr == daddr) {
+            ++entry->refs;
+            list_move_tail(&entry->lru, &mc->lru);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+unsigned long evict_entries (struct meta_cache *mc, unsigned long nr,
+                             struct list_head *victims) {
+    struct meta_entry *entry;
+    struct meta_entry *next;
+    unsigned long evicted = 0;
+
+    list_for_each_entry_safe(entry, next, &mc->lru, lru) {
+        if (evicted == nr) {
+            break;
+        }
+        if (entry->refs) {
+            continue;
+        }
+        hlist_del(&entry->hash);
+        list_move(&entry->lru, victims);
+        --mc->count;
+        ++evicted;
+    }
+    return evicted;
+}
+
+void free_entries (struct meta_cache *mc, struct list_head *victims) {
+    struct meta_entry *entry;
+    struct meta_entry *next;
+
+    list_for_each_entry_safe(entry, next, victims, lru) {
+        kmem_cache_free(mc->block_cache, entry->blk);
+        kfree(entry);
+    }
+}
+
+unsigned long count_objects (struct shrinker *shrinker,
+                             struct shrink_control *sc) {
+    struct meta_cache *mc = container_of(shrinker, struct meta_cache,
+                                         shrinker);
+    struct wlfs_super *wlfs_sb = container_of(mc, struct wlfs_super, mcache);
+
+    return ACCESS_ONCE(mc->count) + atomic_read(&wlfs_sb->imap_cached);
+}
+
+// Inode map blocks are only evicted when reclaim may wait on filesystem
+// locks, as evicting one takes the lock of its shard
+unsigned long scan_objects (struct shrinker *shrinker,
+                            struct shrink_control *sc) {
+    struct meta_cache *mc = container_of(shrinker, struct meta_cache,
+                                         shrinker);
+    struct wlfs_super *wlfs_sb = container_of(mc, struct wlfs_super, mcache);
+    LIST_HEAD(victims);
+
+    spin_lock(&mc->lock);
+    unsigned long freed = evict_entries(mc, sc->nr_to_scan, &victims);
+    spin_unlock(&mc->lock);
+    free_entries(mc, &victims);
+
+    if (freed < sc->nr_to_scan && (sc->gfp_mask & __GFP_FS)) {
+        freed += wlfs_imap_shrink(wlfs_sb, sc->nr_to_scan - freed);
+    }
+    return freed ? freed : SHRINK_STOP;
+}
@@ -0,0 +1,62 @@
+/*
+ * Metadata block cache: indirect & extent blocks read to map file blocks &
+ * directory blocks read to look names up, kept in LRU order up to a bound,
+ * & a shrinker which evicts them & clean inode map blocks under memory
+ * pressure
+ */
+
+#pragma once
+
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#include "wlfs.h"
+
+// A cached block, keyed by the address it was read from.  Entries are
+// dropped when their segment is reused, so an address never maps to the
+// copy of a block which has since moved
+struct meta_entry {
+    struct hlist_node hash;
+    struct list_head lru;
+    __u64 daddr;
+    // References held by lookups; entries in use aren't evicted
+    unsigned refs;
+    // Aligned to its size, so it never crosses a page & can be read into
+    struct block *blk;
+};
+
+struct meta_cache {
+    // Protects the hash table, the LRU list & reference counts
+    spinlock_t lock;
+    struct hlist_head *hash;
+    // Every entry, least recently used first
+    struct list_head lru;
+    unsigned long count;
+    // Entries kept before the least recently used are evicted
+    unsigned long limit;
+    struct kmem_cache *block_cache;
+    struct shrinker shrinker;
+};
+
+// Allocate the cache & register its shrinker; call once the maps are
+// loaded & recovered, as the shrinker may evict inode map blocks from then on
+int wlfs_mcache_init (struct super_block *sb);
+// Unregister the shrinker & free every cached block
+void wlfs_mcache_destroy (struct super_block *sb);
+
+// Get a block of an inode of the given type (an indirect or extent block,
+// or a directory's data block), reading it if it isn't cached; returns
+// ERR_PTR(-EIO) if the block isn't one.  The block stays cached until put
+struct meta_entry *wlfs_mcache_get (struct super_block *sb,
+                                    wlfs_daddr_t daddr, __u64 ino,
+                                    enum block_type type);
+void wlfs_mcache_put (struct super_block *sb, struct meta_entry *entry);
+// Drop the cached blocks read from count blocks at daddr on, e.g., a segment
+// about to be rewritten.  Blocks still in use are freed when last put
+void wlfs_mcache_invalidate (struct super_block *sb, __u64 daddr,
+                             __u32 count);
@@ -1,12 +1,17 @@
+#define _GNU_SOURCE
 #include <argp.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/fs.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "util.h"
@@ -15,9 +20,16 @@
 // Data structure for holding parsed argp parameters
 struct arguments {
     char *device;
+    // Erase block size segments are aligned to; 0 to probe the device
+    __u64 erase_size;
+    bool discard;
     bool round;
     struct wlfs_super_meta sb;
 };
+// Largest single write; the metadata area is written sequentially in chunks
+// of this size
+#define WRITE_CHUNK (1 << 20)
+
 // Return codes
 enum return_code {
     SUCCESS,
@@ -29,7 +41,15 @@ enum return_code {
 // Compute derived filesystem parameters (e.g., segment count) and either
 // round or reject misaligned block/segment sizes
 static enum return_code build_super (int fd, struct wlfs_super_meta *sb, 
-                                     bool round);
+                                     bool round, __u64 erase_size);
+// Size & align segments to whole erase blocks, so discarding a segment
+// frees erase blocks the device can reclaim without copying
+static enum return_code align_segments (struct wlfs_super_meta *sb,
+                                        bool round, __u64 erase_size,
+                                        bool probed);
+// Probe a block device's erase block size: the larger of its optimal I/O
+// size & discard granularity, or 0 if it reports neither or isn't a device
+static __u64 get_erase_size (int fd);
 // Check if the named value's highest set bit is within the lowest <bits> bits
 static bool check_overflow (__u64 value, unsigned bits);
 // Calculate the number of segments in the block device; may return -1 if an
@@ -39,21 +59,43 @@ static __u32 get_segments (struct wlfs_super_meta *sb, __u64 size);
 static __u16 get_checkpoint_blocks (struct wlfs_super_meta *sb);
 // Argp argument parser
 static error_t parse_opt (int key, char *arg, struct argp_state *state);
-// Persist the superblock to the block device
-static enum return_code write_super (int fd, struct wlfs_super_meta *sb);
+// Write the superblock & both checkpoint regions in one sequential write:
+// region 0 holds an empty checkpoint & region 1 is zeroed, so stale data on
+// the device can't be mistaken for a checkpoint
+static enum return_code write_metadata (int fd, struct wlfs_super_meta *sb);
+// Fill a checkpoint region with generation 0, empty log heads & no map
+// blocks; maps which were never written load as empty
+static void fill_checkpoint (struct wlfs_super_meta *sb, __u8 *region);
+// Discard every segment, so the device can reclaim the old data
+static enum return_code discard_segments (int fd, struct wlfs_super_meta *sb);
+// pwrite all of a buffer, in chunks of at most WRITE_CHUNK bytes
+static bool write_all (int fd, void const *buf, size_t len, off_t offset);
+// Monotonic time in seconds
+static double get_time (void);
 
 // Description of argp keyword parameters
 static struct argp_option options[] = {
     {"block-size", 'b', "size", 0, "Block size (bytes)"},
     {"buffer-period", 'w', "period", 0, "Write-back period (seconds)"},
     {"checkpoint-period", 'c', "period", 0, "Checkpoint period (seconds)"},
-    {"indirection", 'i', "depth", 0, "Indirect block tree depth"},
+    {"extents", 'e', 0, 0, 
+     "Map file blocks with extents instead of an indirect block tree"},
+    {"indirection", 'i', "depth", 0, 
+     "Indirect block tree depth, or maximum extent tree depth"},
     {"inodes", 'n', "num", 0, "Maximum number of inodes"},
+    {"no-checksums", 'k', 0, 0,
+     "Don't checksum blocks, e.g., to measure what checksums cost"},
     {"min-clean", 'm', "num", 0, 
      "Clean when the number of clean segments drops below this value"},
     {"segment-size", 's', "size", 0, "Segment size (bytes)"},
+    {"discard", 'd', 0, 0,
+     "Discard the data area, so the device can reclaim it"},
+    {"compress", 'z', "codec", 0,
+     "Compress cold file data with this codec (lz4 or none); needs extents"},
     {"target-clean", 't', "num", 0, 
      "Stop cleaning when the number of clean segments rises above this value"},
+    {"erase-size", 'a', "size", 0,
+     "Align segments to erase blocks of this size (default: probed)"},
     {"round", 'r', 0, 0, 
      "Round block/segment size up to the nearest sector/block boundary"},
     {0}
@@ -66,9 +108,12 @@ int main (int argc, char **argv) {
     struct argp argp = {options, parse_opt, args_doc};
     struct arguments arguments;
     // Set default argument values
+    memset(&arguments, 0, sizeof(arguments));
     arguments.sb.block_size = WLFS_BLOCK_SIZE;
     arguments.sb.buffer_period = BUFFER_PERIOD;
     arguments.sb.checkpoint_period = CHECKPOINT_PERIOD;
+    arguments.sb.compression = COMPRESS_NONE;
+    arguments.sb.flags = WLFS_FORMAT_CHECKSUMS;
     arguments.sb.indirection = INDIRECTION;
     arguments.sb.magic = (__u32) WLFS_MAGIC;
     arguments.sb.inodes = MAX_INODES;
@@ -78,41 +123,57 @@ int main (int argc, char **argv) {
     // Parse commandline arguments
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
-    int fd = open(arguments.device, O_RDWR | O_DSYNC);
+    // Writes are buffered & synced once at the end, so formatting runs at
+    // the device's sequential bandwidth rather than its sync latency
+    int fd = open(arguments.device, O_RDWR);
     if (fd < 0) {
         fprintf(stderr, "Opening %s failed\n", arguments.device);
         return -DEVICE_ERROR;
     }
 
     // Sanitize input and compute derived values
-    int ret = build_super(fd, &arguments.sb, arguments.round);
+    int ret = build_super(fd, &arguments.sb, arguments.round,
+                          arguments.erase_size);
     if (ret != SUCCESS) {
         fprintf(stderr, "Failed to compute filesystem parameters for %s\n",
                 arguments.device);
         goto exit;
     }
 #ifndef NDEBUG
-    printf("Block size: %hu\n"
+    printf("Block size: %u\n"
            "Buffer period: %hhu\n"
            "Checkpoint blocks: %hu\n"
            "Checkpoint period: %hhu\n"
+           "Block mapping: %s\n"
+           "Checksums: %s\n"
+           "Compression: %s\n"
            "Indirection: %hhu\n"
            "Max inodes: %u\n"
            "Minimum clean segments: %hhu\n"
            "Segments: %u\n"
+           "Segment padding: %u\n"
            "Segment size: %u\n"
            "Target clean segments: %hhu\n",
            arguments.sb.block_size, arguments.sb.buffer_period, 
            arguments.sb.checkpoint_blocks, arguments.sb.checkpoint_period,
+           arguments.sb.flags & WLFS_FORMAT_EXTENTS ? "extents" : "tree",
+           arguments.sb.flags & WLFS_FORMAT_CHECKSUMS ? "crc32c" : "none",
+           arguments.sb.compression == COMPRESS_LZ4 ? "lz4" : "none",
            arguments.sb.indirection, arguments.sb.inodes,
            arguments.sb.min_clean_segs, arguments.sb.segments,
-           arguments.sb.segment_size, arguments.sb.target_clean_segs);
+           arguments.sb.segment_pad, arguments.sb.segment_size,
+           arguments.sb.target_clean_segs);
 #endif
 
-    // Write super block to disk
-    ret = write_super(fd, &arguments.sb);
+    if (arguments.discard) {
+        ret = discard_segments(fd, &arguments.sb);
+        if (ret != SUCCESS) {
+            goto exit;
+        }
+    }
+    ret = write_metadata(fd, &arguments.sb);
     if (ret != SUCCESS) {
-        fprintf(stderr, "Failed to write superblock to %s\n", 
+        fprintf(stderr, "Failed to write metadata to %s\n", 
                 arguments.device);
     }
 
@@ -125,7 +186,8 @@ exit:
  * Helper functions
  */
 
-enum return_code build_super (int fd, struct wlfs_super_meta *sb, bool round) {
+enum return_code build_super (int fd, struct wlfs_super_meta *sb, bool round,
+                              __u64 erase_size) {
     __u64 block_size;
     __u64 size;
     struct stat buf;
@@ -148,26 +210,49 @@ enum return_code build_super (int fd, struct wlfs_super_meta *sb, bool round) {
 
     if (round) {
         // Round the block & segment sizes up
-        sb->block_size += sb->block_size % ((__u16) block_size);
+        sb->block_size += sb->block_size % block_size;
         sb->segment_size += sb->segment_size % sb->block_size;
     } else {
         // Reject incorrect sizes            
-        if (sb->block_size % ((__u16) block_size) != 0) {
+        if (sb->block_size % block_size != 0) {
             fprintf(stderr, 
-                    "%huB (block size) %% %lluB (physical) != 0, consider "
+                    "%uB (block size) %% %lluB (physical) != 0, consider "
                     "using -r\n",
                     sb->block_size,
                     block_size);
             return -INVALID_ARGUMENT;
         } else if (sb->segment_size % sb->block_size != 0) {
             fprintf(stderr, 
-                    "%uB (segment size) %% %huB (block size) != 0, consider "
+                    "%uB (segment size) %% %uB (block size) != 0, consider "
                     "using -r\n", 
                     sb->segment_size, 
                     sb->block_size);
             return -INVALID_ARGUMENT;
         }
     }
+    bool const probed = erase_size == 0;
+    if (probed) {
+        erase_size = get_erase_size(fd);
+    }
+    int const ret = align_segments(sb, round, erase_size, probed);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+    if (!check_segment_blocks(sb)) {
+        __u32 const max = 8 * get_block_bytes(sb) < MAX_SEGMENT_BLOCKS ?
+            8 * get_block_bytes(sb) : MAX_SEGMENT_BLOCKS;
+        fprintf(stderr, "%uB (segment size) / %uB (block size) must be a "
+                "multiple of 8 from 8 to %u\n", sb->segment_size,
+                sb->block_size, max);
+        return -ILLEGAL_CONFIG;
+    }
+
+    // The segment map is sized by the number of segments, which in turn
+    // depends on the size of the checkpoint region; size the segment map for
+    // a checkpoint region of 0 blocks, which over-estimates the segments
+    sb->checkpoint_blocks = 0;
+    sb->segment_pad = 0;
+    sb->segments = get_segments(sb, size);
 
     // Set the number of checkpoint blocks
     __u16 checkpoint_blocks = get_checkpoint_blocks(sb);
@@ -177,6 +262,13 @@ enum return_code build_super (int fd, struct wlfs_super_meta *sb, bool round) {
     }
     sb->checkpoint_blocks = checkpoint_blocks;
 
+    // Pad the checkpoint regions out to an erase block boundary
+    __u64 const erase_blocks = erase_size / sb->block_size;
+    if (erase_blocks > 1 && sb->segment_size % erase_size == 0) {
+        __u64 const end = get_checkpoint_daddr(sb, CHECKPOINT_REGIONS);
+        sb->segment_pad = (erase_blocks - end % erase_blocks) % erase_blocks;
+    }
+
     // Set total number of segments
     __u32 segments = get_segments(sb, size);
     if (segments == 0) {
@@ -192,6 +284,76 @@ enum return_code build_super (int fd, struct wlfs_super_meta *sb, bool round) {
 }
 
 
+// Only an explicit erase size is enforced; a probed one is a hint, & rounding
+// the default segment size up to it needs -r like any other misalignment
+enum return_code align_segments (struct wlfs_super_meta *sb, bool round,
+                                 __u64 erase_size, bool probed) {
+    if (erase_size <= sb->block_size) {
+        return SUCCESS;
+    }
+    if (erase_size % sb->block_size != 0) {
+        fprintf(stderr, "%lluB (erase size) %% %uB (block size) != 0, "
+                "not aligning segments\n", erase_size, sb->block_size);
+        return probed ? SUCCESS : -INVALID_ARGUMENT;
+    }
+    if (sb->segment_size % erase_size == 0) {
+        printf("Aligned segments to %lluKiB erase blocks\n", erase_size >> 10);
+        return SUCCESS;
+    }
+
+    __u64 const size = (sb->segment_size + erase_size - 1) / erase_size *
+        erase_size;
+    if (round && check_overflow(size / sb->block_size, 16)) {
+        sb->segment_size = size;
+        printf("Rounded segments up to %lluKiB erase blocks\n",
+               erase_size >> 10);
+        return SUCCESS;
+    }
+    fprintf(stderr, "%uB (segment size) %% %lluB (erase size) != 0, %s\n",
+            sb->segment_size, erase_size,
+            round ? "too many blocks per segment" : "consider using -r");
+    return probed ? SUCCESS : -INVALID_ARGUMENT;
+}
+
+// Partitions have no queue of their own in sysfs; their disk's is one
+// directory up
+__u64 get_erase_size (int fd) {
+    static char const *const paths[] = {
+        "/sys/dev/block/%u:%u/queue/discard_granularity",
+        "/sys/dev/block/%u:%u/../queue/discard_granularity",
+    };
+    struct stat buf;
+    unsigned io_opt = 0;
+    unsigned long long granularity = 0;
+    char path[64];
+
+    if (fstat(fd, &buf) < 0 || !S_ISBLK(buf.st_mode)) {
+        return 0;
+    }
+    if (ioctl(fd, BLKIOOPT, &io_opt) < 0) {
+        io_opt = 0;
+    }
+    unsigned i = 0;
+    for (; i < sizeof(paths) / sizeof(paths[0]); ++i) {
+        snprintf(path, sizeof(path), paths[i], major(buf.st_rdev),
+                 minor(buf.st_rdev));
+        FILE *file = fopen(path, "r");
+        if (!file) {
+            continue;
+        }
+        if (fscanf(file, "%llu", &granularity) != 1) {
+            granularity = 0;
+        }
+        fclose(file);
+        break;
+    }
+#ifndef NDEBUG
+    printf("Device reports %uB optimal I/O & %lluB discard granularity\n",
+           io_opt, granularity);
+#endif
+    return io_opt > granularity ? io_opt : granularity;
+}
+
 bool check_overflow (__u64 value, unsigned bits) {
     return (value & ((1ULL << bits) - 1)) == value;
 }
@@ -199,7 +361,9 @@ bool check_overflow (__u64 value, unsigned bits) {
 // get_checkpoint_blocks must be called first
 __u32 get_segments (struct wlfs_super_meta *sb, __u64 size) {
     __u64 segments = 
-        (size - WLFS_OFFSET - (sb->checkpoint_blocks + 1) * sb->block_size) / 
+        (size - WLFS_OFFSET - 
+         (CHECKPOINT_REGIONS * sb->checkpoint_blocks + 1 + sb->segment_pad) *
+         sb->block_size) / 
         sb->segment_size;
     if (!check_overflow(segments, 32)) {
         fprintf(stderr, "Number of segments doesn't fit into 32 bits\n");
@@ -209,23 +373,17 @@ __u32 get_segments (struct wlfs_super_meta *sb, __u64 size) {
 }
 
 __u16 get_checkpoint_blocks (struct wlfs_super_meta *sb) {
-    // Number of disk addresses that fit in a block (imap entries are disk
-    // addresses)
-    __u32 entries = get_daddr_entries(sb);
-    // Total number of imap blocks
-    __u32 imap_blocks = get_imap_blocks(sb);
-    // Total number of segment usage bitmap blocks
-    __u32 segmap_blocks = get_segmap_blocks(sb);
 #ifndef NDEBUG
-    printf("%u imap blocks, %u segmap blocks\n", imap_blocks, segmap_blocks);
+    printf("%u imap blocks, %u segmap blocks\n", 
+           get_imap_blocks(sb), get_segmap_blocks(sb));
 #endif
 
-    // Checkpoint blocks store disk addresses of imap & segmap blocks; if the
-    // number of map blocks is not a multiple of the entries per block, pad
-    // the last block instead of mixing imap & segmap addresses
-    __u32 checkpoint_blocks = 
-        imap_blocks / entries + (imap_blocks % entries != 0) +
-        segmap_blocks / entries + (segmap_blocks % entries != 0);
+    // A header block holding the log heads, followed by blocks storing disk
+    // addresses of imap & segmap blocks; if the number of map blocks is not a
+    // multiple of the entries per block, the last block is padded instead of
+    // mixing imap & segmap addresses
+    __u32 checkpoint_blocks = 1 + 
+        get_checkpoint_imap_blocks(sb) + get_checkpoint_segmap_blocks(sb);
     if (!check_overflow(checkpoint_blocks, 16)) {
         fprintf(stderr, 
                 "Number of checkpoint blocks doesn't fit into 16 bits\n");
@@ -243,10 +401,15 @@ error_t parse_opt (int key, char *arg, struct argp_state *state) {
 
     switch (key) {
     case 'b':
-        if (value < 1) {
+        // Blocks larger than a page are backed by runs of contiguous pages
+        // in the kernel, so the page size is no limit
+        if (value < 512) {
             argp_error(state, "Block size of %lluB is too small\n", value);
-        } else if (value > (__u64) getpagesize()){
-            argp_error(state, "Block size must be <= %dB\n", getpagesize());
+        } else if (value > WLFS_MAX_BLOCK_SIZE) {
+            argp_error(state, "Block size must be <= %dB\n",
+                       WLFS_MAX_BLOCK_SIZE);
+        } else if (value & (value - 1)) {
+            argp_error(state, "Block size must be a power of 2\n");
         }
         arguments->sb.block_size = value;
         break;
@@ -273,12 +436,21 @@ error_t parse_opt (int key, char *arg, struct argp_state *state) {
         arguments->sb.checkpoint_period = value;
         break;
 
+    case 'e':
+        arguments->sb.flags |= WLFS_FORMAT_EXTENTS;
+        break;
+
+    case 'k':
+        arguments->sb.flags &= ~WLFS_FORMAT_CHECKSUMS;
+        break;
+
     case 'i':
         if (value == 0) {
             argp_error(state, "Indirection depth of %llu is too small\n", 
                        value);
-        } else if (!check_overflow(value, 8)) {
-            argp_error(state, "Indirection doesn't fit into 8 bits");
+        } else if (value >= NBLOCK_PTR) {
+            argp_error(state, "Indirection depth must be < %d\n", 
+                       NBLOCK_PTR);
         }
         arguments->sb.indirection = value;
         break;
@@ -321,13 +493,36 @@ error_t parse_opt (int key, char *arg, struct argp_state *state) {
         } else if (!check_overflow(value, 8)) {
             argp_error(state, "Target clean segments doesn't fit into 8 bits");
         }
-        arguments->sb.buffer_period = value;
+        arguments->sb.target_clean_segs = value;
+        break;
+
+    case 'd':
+        arguments->discard = true;
         break;
 
     case 'r':
         arguments->round = true;
         break;
 
+    case 'a':
+        if (value < 1) {
+            argp_error(state, "Erase size of %lluB is too small\n", value);
+        } else if (!check_overflow(value, 32)) {
+            argp_error(state, "Erase size doesn't fit into 32 bits");
+        }
+        arguments->erase_size = value;
+        break;
+
+    case 'z':
+        if (strcmp(arg, "lz4") == 0) {
+            arguments->sb.compression = COMPRESS_LZ4;
+        } else if (strcmp(arg, "none") == 0) {
+            arguments->sb.compression = COMPRESS_NONE;
+        } else {
+            argp_error(state, "Unknown compression codec %s\n", arg);
+        }
+        break;
+
     case ARGP_KEY_ARG:
         if (state->arg_num > 1) {
             argp_usage(state);
@@ -339,6 +534,11 @@ error_t parse_opt (int key, char *arg, struct argp_state *state) {
         if (state->arg_num < 1) {
             argp_usage(state);
         }
+        // Indirect block trees map every block to its own address
+        if (arguments->sb.compression != COMPRESS_NONE &&
+            !(arguments->sb.flags & WLFS_FORMAT_EXTENTS)) {
+            argp_error(state, "Compression requires extents\n");
+        }
         break;
 
     default:
@@ -348,16 +548,114 @@ error_t parse_opt (int key, char *arg, struct argp_state *state) {
     return 0;
 }
 
-enum return_code write_super (int fd, struct wlfs_super_meta *sb) {
-    // Write super block to the correct sector of the block device
-    ssize_t ret = pwrite(fd, sb, sizeof(struct wlfs_super_meta), WLFS_OFFSET);
-    if (ret < 0) {
-        fprintf(stderr, "pwrite failed with error code %zd\n", ret);
+enum return_code write_metadata (int fd, struct wlfs_super_meta *sb) {
+    __u64 const first = get_super_daddr(sb);
+    size_t const len = (size_t) (get_segment_daddr(sb, 0) - first) *
+        sb->block_size;
+    __u8 *buf = (__u8 *) calloc(1, len);
+    if (!buf) {
+        fprintf(stderr, "Failed to allocate %zuB of metadata\n", len);
         return -DEVICE_ERROR;
     }
-#ifndef NDEBUG
-    printf("Sucessfully wrote wlfs super block\n");
-#endif
 
+    // With blocks larger than WLFS_OFFSET's alignment, the superblock's block
+    // starts below WLFS_OFFSET, in space which isn't ours to overwrite
+    size_t const skip = WLFS_OFFSET - first * sb->block_size;
+    memcpy(buf + skip, sb, sizeof(struct wlfs_super_meta));
+    fill_checkpoint(sb, buf + 
+                    (get_checkpoint_daddr(sb, 0) - first) * sb->block_size);
+
+    enum return_code ret = SUCCESS;
+    double const start = get_time();
+    if (!write_all(fd, buf + skip, len - skip, WLFS_OFFSET) ||
+        fsync(fd) < 0) {
+        fprintf(stderr, "Writing metadata failed: %s\n", strerror(errno));
+        ret = -DEVICE_ERROR;
+        goto exit;
+    }
+    double const elapsed = get_time() - start;
+    printf("Wrote %zuKiB of metadata in %.3fms (%.1fMiB/s)\n",
+           (len - skip) >> 10, elapsed * 1e3,
+           (len - skip) / elapsed / (1 << 20));
+
+exit:
+    free(buf);
+    return ret;
+}
+
+void fill_checkpoint (struct wlfs_super_meta *sb, __u8 *region) {
+    __kernel_time_t const now = time(NULL);
+
+    __u32 i = 0;
+    for (; i < sb->checkpoint_blocks; ++i) {
+        struct block *blk = 
+            (struct block *) (region + (size_t) i * sb->block_size);
+        blk->h0.wtime = blk->h1.wtime = now;
+        blk->index = i;
+        blk->type = BLOCK_CHECKPOINT;
+    }
+
+    struct checkpoint *cp = 
+        (struct checkpoint *) get_block_data((struct block *) region);
+    for (i = 0; i < LOG_STREAMS; ++i) {
+        cp->heads[i].segment = NO_SEGMENT;
+        cp->heads[i].next = NO_SEGMENT;
+    }
+    for (i = 0; i < sb->checkpoint_blocks; ++i) {
+        set_block_csum(sb, (struct block *) (region + 
+                                             (size_t) i * sb->block_size));
+    }
+}
+
+// Block devices take BLKDISCARD; image files have the range punched out
+enum return_code discard_segments (int fd, struct wlfs_super_meta *sb) {
+    __u64 range[2] = {
+        get_segment_daddr(sb, 0) * sb->block_size,
+        (__u64) sb->segments * sb->segment_size,
+    };
+    struct stat buf;
+    if (fstat(fd, &buf) < 0) {
+        fprintf(stderr, "fstat failed\n");
+        return -DEVICE_ERROR;
+    }
+
+    double const start = get_time();
+    int const ret = S_ISBLK(buf.st_mode) ?
+        ioctl(fd, BLKDISCARD, range) :
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  range[0], range[1]);
+    if (ret < 0) {
+        // Not every device can discard; the data area is never read before
+        // it is written, so formatting goes on without it
+        fprintf(stderr, "Discarding the data area failed: %s\n",
+                strerror(errno));
+        return SUCCESS;
+    }
+    double const elapsed = get_time() - start;
+    printf("Discarded %lluMiB in %.3fms (%.1fGiB/s)\n", range[1] >> 20,
+           elapsed * 1e3, range[1] / elapsed / (1 << 30));
     return SUCCESS;
 }
+
+bool write_all (int fd, void const *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        size_t const chunk =
+            len - done < WRITE_CHUNK ? len - done : WRITE_CHUNK;
+        ssize_t const n = pwrite(fd, (__u8 const *) buf + done, chunk,
+                                 offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+double get_time (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
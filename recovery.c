@@ -0,0 +1,340 @@
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/ktime.h>
+#include <linux/printk.h>
+#include <linux/vmalloc.h>
+
+#include "imap.h"
+#include "io.h"
+#include "recovery.h"
+#include "segmap.h"
+#include "super.h"
+#include "trace.h"
+#include "util.h"
+
+// Replay state of one log stream
+struct stream_cursor {
+    // Holds the segment being scanned
+    struct page **pages;
+    __u32 loaded;
+    // Position being scanned, & the position after the last partial segment
+    // replayed from the stream
+    struct log_position pos;
+    struct log_position head;
+    // Summary of the next partial segment in the stream, or NULL if the
+    // stream has ended
+    struct segment_summary *summary;
+};
+
+// Stamps of the newest copy replayed so far of each inode & map block
+struct replay_stamps {
+    __u64 *inodes;
+    __u64 *imap;
+    __u64 *segmap;
+};
+
+// Find the next partial segment of a stream with a sequence number of at
+// least seq, reading in the next segment if needed
+static int peek_partial (struct super_block *sb, struct stream_cursor *cur,
+                         unsigned stream, __u64 seq, __u32 *scanned);
+// Summary of the partial segment at an offset within a segment, or NULL if
+// there is no complete partial segment of the stream written by this mount
+// with a sequence number of at least seq
+static struct segment_summary *check_partial (struct wlfs_super *wlfs_sb,
+                                              struct page **pages,
+                                              __u32 offset, unsigned stream,
+                                              __u64 seq);
+// Point the in-memory maps at a block found in the log, unless a newer copy
+// of it was already replayed
+static void replay_block (struct wlfs_super *wlfs_sb, 
+                          struct replay_stamps *stamps, struct block *blk,
+                          __u64 daddr);
+// Apply the segment usage changes a commit block lists
+static void apply_commit (struct wlfs_super *wlfs_sb, struct block *blk);
+// Move a map entry to a new address, updating the segment usage
+static void move_entry (struct wlfs_super *wlfs_sb, wlfs_daddr_t *entry,
+                        __u64 daddr);
+
+int wlfs_recover (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    struct checkpoint *cp = &wlfs_sb->checkpoint;
+    __u32 const npages = DIV_ROUND_UP(meta->segment_size, PAGE_SIZE);
+    struct stream_cursor cursors[LOG_STREAMS] = {};
+    struct replay_stamps stamps;
+    ktime_t const start = ktime_get();
+    __u32 scanned = 0;
+    __u32 partials = 0;
+    __u64 replayed = 0;
+    int ret = 0;
+
+    // Every mount writes a checkpoint before anything else, so without one
+    // there is nothing to replay
+    if (cp->generation == 0) {
+        return 0;
+    }
+
+    stamps.inodes = (__u64 *) vzalloc(meta->inodes * sizeof(__u64));
+    stamps.imap = (__u64 *) vzalloc(wlfs_sb->imap.nblocks * sizeof(__u64));
+    stamps.segmap = 
+        (__u64 *) vzalloc(wlfs_sb->segmap.nblocks * sizeof(__u64));
+    if (unlikely(!stamps.inodes || !stamps.imap || !stamps.segmap)) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+    unsigned s = 0;
+    for (; s < LOG_STREAMS; ++s) {
+        cursors[s].pages = wlfs_alloc_pages(npages, meta->block_size);
+        if (unlikely(!cursors[s].pages)) {
+            ret = -ENOMEM;
+            goto exit;
+        }
+        cursors[s].loaded = NO_SEGMENT;
+        cursors[s].pos = cursors[s].head = cp->heads[s];
+    }
+
+    // Merge the streams by sequence number, reading each segment whole.
+    // Partial segments of different streams are written concurrently, so
+    // the first sequence number missing from every stream ends the log;
+    // anything after it may depend on what was lost
+    __u64 seq = cp->seq;
+    for (s = 0; s < LOG_STREAMS; ++s) {
+        ret = peek_partial(sb, &cursors[s], s, seq, &scanned);
+        if (unlikely(ret)) {
+            goto exit;
+        }
+    }
+    while (true) {
+        struct stream_cursor *cur = NULL;
+        for (s = 0; s < LOG_STREAMS; ++s) {
+            if (cursors[s].summary && cursors[s].summary->seq == seq) {
+                cur = &cursors[s];
+                break;
+            }
+        }
+        if (!cur) {
+            break;
+        }
+
+        __u32 const nblocks = cur->summary->nblocks;
+        __u64 const base = 
+            get_segment_daddr(meta, cur->pos.segment) + cur->pos.offset;
+        __u32 i = 1;
+        for (; i <= nblocks; ++i) {
+            replay_block(wlfs_sb, &stamps,
+                         wlfs_get_block(cur->pages, meta->block_size, 
+                                        cur->pos.offset + i), 
+                         base + i);
+        }
+        replayed += nblocks;
+        ++partials;
+
+        cur->pos.offset += 1 + nblocks;
+        cur->pos.next = cur->summary->next;
+        cur->head = cur->pos;
+        ++seq;
+        ret = peek_partial(sb, cur, s, seq, &scanned);
+        if (unlikely(ret)) {
+            goto exit;
+        }
+    }
+
+    // Resume each stream after its last replayed partial segment; the
+    // checkpoint written at mount makes the replayed state durable
+    cp->seq = seq;
+    for (s = 0; s < LOG_STREAMS; ++s) {
+        cp->heads[s] = cursors[s].head;
+    }
+    __s64 const ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    wlfs_stat_add(wlfs_sb, STAT_RECOVERED_PARTIALS, partials);
+    wlfs_stat_add(wlfs_sb, STAT_RECOVERED_BLOCKS, replayed);
+    wlfs_stat_add(wlfs_sb, STAT_RECOVERY_NS, ns);
+    trace_wlfs_recovery(sb, partials, replayed, scanned, ns);
+    printk(KERN_INFO "Recovery replayed %llu blocks in %u partial segments, "
+           "scanning %u segments in %lld us\n", replayed, partials, scanned,
+           (long long) div_s64(ns, NSEC_PER_USEC));
+
+exit:
+    for (s = 0; s < LOG_STREAMS; ++s) {
+        if (cursors[s].pages) {
+            wlfs_free_pages(cursors[s].pages, npages);
+        }
+    }
+    vfree(stamps.segmap);
+    vfree(stamps.imap);
+    vfree(stamps.inodes);
+    return ret;
+}
+
+/*
+ * Helper functions
+ */
+
+int peek_partial (struct super_block *sb, struct stream_cursor *cur,
+                  unsigned stream, __u64 seq, __u32 *scanned) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    __u32 const blocks = get_segmap_bits(meta);
+
+    cur->summary = NULL;
+    if (cur->pos.segment == NO_SEGMENT) {
+        return 0;
+    }
+    // The segment buffer moves on when a partial segment wouldn't fit
+    if (blocks - cur->pos.offset < 2) {
+        if (cur->pos.next == NO_SEGMENT) {
+            return 0;
+        }
+        cur->pos.segment = cur->pos.next;
+        cur->pos.offset = 0;
+        cur->pos.next = NO_SEGMENT;
+    }
+    if (cur->pos.segment != cur->loaded) {
+        int ret = wlfs_read_blocks(
+            sb, get_segment_daddr(meta, cur->pos.segment), cur->pages, blocks);
+        if (unlikely(ret)) {
+            printk(KERN_ERR "Error reading segment %u during recovery\n",
+                   cur->pos.segment);
+            return ret;
+        }
+        cur->loaded = cur->pos.segment;
+        ++*scanned;
+    }
+
+    cur->summary = check_partial(wlfs_sb, cur->pages, cur->pos.offset, 
+                                 stream, seq);
+    return 0;
+}
+
+// A partial segment is written by one flush, so every block in it carries
+// headers stamped no later than its summary; torn headers, a block or
+// summary failing its checksum, blocks other than those the summary's
+// checksum covers, or a summary left by an earlier mount or an earlier pass
+// of the log over this segment, end the stream
+struct segment_summary *check_partial (struct wlfs_super *wlfs_sb,
+                                       struct page **pages, __u32 offset,
+                                       unsigned stream, __u64 seq) {
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    __u32 const block_size = meta->block_size;
+    __u32 const blocks = get_segmap_bits(meta);
+    struct block *head = wlfs_get_block(pages, block_size, offset);
+    struct segment_summary *summary = 
+        (struct segment_summary *) get_block_data(head);
+
+    if (head->type != BLOCK_SUMMARY || head->h0.wtime != head->h1.wtime || 
+        summary->seq < seq || head->index != summary->seq || 
+        summary->mount != wlfs_sb->checkpoint.mount ||
+        summary->stream != stream || summary->nblocks == 0 || 
+        summary->nblocks > blocks - offset - 1 ||
+        !check_block_csum(meta, head)) {
+        return NULL;
+    }
+
+    __u32 csum = WLFS_CSUM_SEED;
+    __u32 i = 1;
+    for (; i <= summary->nblocks; ++i) {
+        struct block *blk = wlfs_get_block(pages, block_size, offset + i);
+        if (blk->h0.wtime != blk->h1.wtime || 
+            blk->h0.version != blk->h1.version ||
+            blk->h0.wtime > head->h0.wtime ||
+            blk->type == BLOCK_FREE || blk->type > BLOCK_COMMIT ||
+            !check_block_csum(meta, blk)) {
+#ifndef NDEBUG
+            printk(KERN_DEBUG "Partial segment %llu is torn at block %u\n",
+                   summary->seq, i);
+#endif
+            return NULL;
+        }
+        csum = wlfs_crc32c(csum, &blk->h0.csum, sizeof(__u32));
+    }
+    if ((meta->flags & WLFS_FORMAT_CHECKSUMS) && csum != summary->csum) {
+#ifndef NDEBUG
+        printk(KERN_DEBUG "Partial segment %llu holds stale blocks\n",
+               summary->seq);
+#endif
+        return NULL;
+    }
+
+    return summary;
+}
+
+// Partial segments are replayed in log order, but streams fill them
+// concurrently, so copies of a block are ordered by their stamps; of equal
+// stamps, the later one in the log wins.  Data & indirect blocks are reached
+// through their inode, so there is nothing to do for them here, but the
+// commit blocks written with the inode mark them live
+void replay_block (struct wlfs_super *wlfs_sb, struct replay_stamps *stamps,
+                   struct block *blk, __u64 daddr) {
+    wlfs_daddr_t *entry = NULL;
+    __u64 *stamp = NULL;
+
+    switch (blk->type) {
+    case BLOCK_COMMIT:
+        apply_commit(wlfs_sb, blk);
+        return;
+
+    case BLOCK_INODE:
+        entry = wlfs_imap_entry(wlfs_sb, blk->index);
+        if (entry) {
+            stamp = &stamps->inodes[blk->index];
+        }
+        break;
+
+    case BLOCK_IMAP:
+        // In-memory map contents are rebuilt from the inode blocks; only
+        // the location of the map block itself matters
+        if (blk->index < wlfs_sb->imap.nblocks) {
+            entry = &wlfs_sb->imap.daddrs[blk->index];
+            stamp = &stamps->imap[blk->index];
+        }
+        break;
+
+    case BLOCK_SEGMAP:
+        entry = wlfs_segmap_daddr(wlfs_sb, blk->index);
+        if (entry) {
+            stamp = &stamps->segmap[blk->index];
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    if (!entry || blk->stamp < *stamp) {
+        return;
+    }
+    *stamp = blk->stamp;
+    if (blk->type == BLOCK_INODE) {
+        wlfs_imap_mark_dirty(wlfs_sb, blk->index);
+    }
+    move_entry(wlfs_sb, entry, daddr);
+}
+
+// Commit blocks are only written by one stream, so applying them in log
+// order leaves each block as the latest one listing it says
+void apply_commit (struct wlfs_super *wlfs_sb, struct block *blk) {
+    struct commit_record *record =
+        (struct commit_record *) get_block_data(blk);
+
+    if (unlikely((__u64) record->nlive + record->ndead >
+                 get_commit_entries(&wlfs_sb->meta))) {
+        printk(KERN_ERR "Commit block lists %u blocks, more than fit\n",
+               record->nlive + record->ndead);
+        return;
+    }
+    __u32 i = 0;
+    for (; i < record->nlive + record->ndead; ++i) {
+        wlfs_segmap_mark(wlfs_sb, record->daddrs[i], i < record->nlive);
+    }
+}
+
+void move_entry (struct wlfs_super *wlfs_sb, wlfs_daddr_t *entry,
+                 __u64 daddr) {
+    wlfs_daddr_t const old = *entry;
+
+    WRITE_ONCE(*entry, daddr);
+    wlfs_segmap_mark(wlfs_sb, daddr, true);
+    if (old && old != daddr) {
+        wlfs_segmap_mark(wlfs_sb, old, false);
+    }
+}
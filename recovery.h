@@ -0,0 +1,13 @@
+/*
+ * Roll-forward recovery: replaying the log written after the last checkpoint
+ */
+
+#pragma once
+
+#include <linux/fs.h>
+
+// Scan the partial segments written after the loaded checkpoint, in log
+// order across all streams, updating the in-memory maps from their block
+// headers & moving the log heads past them; must run after the checkpoint is
+// loaded & before the segment buffer is opened
+int wlfs_recover (struct super_block *sb);
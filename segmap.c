@@ -0,0 +1,458 @@
+#include <linux/bitops.h>
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/time.h>
+#include <linux/vmalloc.h>
+
+#include "segmap.h"
+#include "super.h"
+#include "util.h"
+
+// Usage bitmap for a segment
+static __u8 *get_bitmap (struct segment_map *segmap, __u32 segment);
+// List holding pinned segments of an epoch
+static __u16 get_pin_list (struct segment_map *segmap, __u8 epoch);
+// Append a segment to the tail of a list; caller holds the segmap lock
+static void list_push (struct segment_index *index, __u32 segment, 
+                       __u16 list);
+// Remove a segment from its list; caller holds the segmap lock
+static void list_remove (struct segment_index *index, __u32 segment);
+// Move a segment to the tail of the list for its live count, or pin it if
+// it just became clean; caller holds the segmap lock
+static void requeue (struct wlfs_super *wlfs_sb, __u32 segment);
+// Mark the block at a disk address as live or dead; caller holds the segmap
+// lock
+static void mark_locked (struct wlfs_super *wlfs_sb, __u64 daddr, bool live);
+
+int wlfs_segmap_alloc (struct wlfs_super *wlfs_sb) {
+    struct segment_map *segmap = &wlfs_sb->segmap;
+    struct segment_index *index = &wlfs_sb->segindex;
+    __u32 const segments = wlfs_sb->meta.segments;
+    segmap->nblocks = get_segmap_blocks(&wlfs_sb->meta);
+    segmap->entries = get_segmap_entries(&wlfs_sb->meta);
+    segmap->bits = get_segmap_bits(&wlfs_sb->meta);
+    spin_lock_init(&wlfs_sb->segmap_lock);
+    wlfs_sb->clean_segments = segments;
+    wlfs_sb->pin_epoch = 0;
+
+    // Per-segment arrays scale with the device, so they come from vmalloc
+    __u32 const lists = segmap->bits + 1 + 2;
+    segmap->blocks = (struct segment *) vzalloc(
+        segmap->nblocks * sizeof(struct segment));
+    segmap->live = (__u16 *) vzalloc(segments * sizeof(__u16));
+    segmap->wtime = (__u32 *) vzalloc(segments * sizeof(__u32));
+    index->head = (__u32 *) kmalloc(lists * sizeof(__u32), GFP_NOFS);
+    index->tail = (__u32 *) kmalloc(lists * sizeof(__u32), GFP_NOFS);
+    index->next = (__u32 *) vmalloc(segments * sizeof(__u32));
+    index->prev = (__u32 *) vmalloc(segments * sizeof(__u32));
+    index->list = (__u16 *) vmalloc(segments * sizeof(__u16));
+    wlfs_sb->segmap_dirty = (unsigned long *) kcalloc(
+        BITS_TO_LONGS(segmap->nblocks), sizeof(unsigned long), GFP_NOFS);
+    if (unlikely(!segmap->blocks || !segmap->live || !segmap->wtime ||
+                 !index->head || !index->tail || !index->next || 
+                 !index->prev || !index->list || !wlfs_sb->segmap_dirty)) {
+        goto fail;
+    }
+
+    __u32 i = 0;
+    for (; i < segmap->nblocks; ++i) {
+        struct block *blk = (struct block *) kmem_cache_zalloc(
+            wlfs_sb->segmap_cache, GFP_NOFS);
+        if (unlikely(!blk)) {
+            printk(KERN_ERR "Failed to allocate segment map block %u\n", i);
+            goto fail;
+        }
+        blk->index = i;
+        blk->type = BLOCK_SEGMAP;
+        segmap->blocks[i].block = blk;
+    }
+
+    // Every segment starts out clean, in segment order
+    for (i = 0; i < lists; ++i) {
+        index->head[i] = index->tail[i] = NO_SEGMENT;
+    }
+    for (i = 0; i < segments; ++i) {
+        list_push(index, i, 0);
+    }
+
+    return 0;
+fail:
+    wlfs_segmap_free(wlfs_sb);
+    return -ENOMEM;
+}
+
+void wlfs_segmap_free (struct wlfs_super *wlfs_sb) {
+    struct segment_map *segmap = &wlfs_sb->segmap;
+    struct segment_index *index = &wlfs_sb->segindex;
+
+    if (segmap->blocks) {
+        __u32 i = 0;
+        for (; i < segmap->nblocks; ++i) {
+            if (segmap->blocks[i].block) {
+                kmem_cache_free(wlfs_sb->segmap_cache, 
+                                segmap->blocks[i].block);
+            }
+        }
+    }
+    vfree(segmap->blocks);
+    vfree(segmap->live);
+    vfree(segmap->wtime);
+    kfree(index->head);
+    kfree(index->tail);
+    vfree(index->next);
+    vfree(index->prev);
+    vfree(index->list);
+    kfree(wlfs_sb->segmap_dirty);
+    segmap->blocks = NULL;
+    segmap->live = NULL;
+    segmap->wtime = NULL;
+    memset(index, 0, sizeof(struct segment_index));
+    wlfs_sb->segmap_dirty = NULL;
+}
+
+// Only run while the map is loaded, before the log heads are reserved
+void wlfs_segmap_recount (struct wlfs_super *wlfs_sb) {
+    struct segment_map *segmap = &wlfs_sb->segmap;
+    struct segment_index *index = &wlfs_sb->segindex;
+    __u32 const bytes = segmap->bits >> 3;
+    __u32 clean = 0;
+
+    spin_lock(&wlfs_sb->segmap_lock);
+    __u32 i = 0;
+    for (; i < segmap->bits + 1 + 2; ++i) {
+        index->head[i] = index->tail[i] = NO_SEGMENT;
+    }
+    for (i = 0; i < wlfs_sb->meta.segments; ++i) {
+        segmap->live[i] = memweight(get_bitmap(segmap, i), bytes);
+        clean += segmap->live[i] == 0;
+        list_push(index, i, segmap->live[i]);
+    }
+    wlfs_sb->clean_segments = clean;
+    spin_unlock(&wlfs_sb->segmap_lock);
+}
+
+void wlfs_segmap_mark (struct wlfs_super *wlfs_sb, __u64 daddr, bool live) {
+    spin_lock(&wlfs_sb->segmap_lock);
+    mark_locked(wlfs_sb, daddr, live);
+    spin_unlock(&wlfs_sb->segmap_lock);
+}
+
+void wlfs_segmap_move (struct wlfs_super *wlfs_sb, __u64 old, __u64 new) {
+    spin_lock(&wlfs_sb->segmap_lock);
+    mark_locked(wlfs_sb, new, true);
+    mark_locked(wlfs_sb, old, false);
+    spin_unlock(&wlfs_sb->segmap_lock);
+}
+
+void wlfs_segmap_move_run (struct wlfs_super *wlfs_sb, __u64 daddr,
+                           struct segmap_move *moves, __u32 n) {
+    spin_lock(&wlfs_sb->segmap_lock);
+    __u32 i = 0;
+    for (; i < n; ++i) {
+        wlfs_daddr_t *const owner = moves[i].owner;
+        if (!owner) {
+            continue;
+        }
+        // A rewrite sealed in another stream first already marked this copy
+        // dead, so only a copy still referenced becomes live
+        if (READ_ONCE(*owner) == daddr + i) {
+            mark_locked(wlfs_sb, daddr + i, true);
+        }
+        mark_locked(wlfs_sb, moves[i].old, false);
+        moves[i].owner = NULL;
+    }
+    spin_unlock(&wlfs_sb->segmap_lock);
+}
+
+bool wlfs_segmap_test (struct wlfs_super *wlfs_sb, __u64 daddr) {
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+
+    if (daddr < get_segment_daddr(meta, 0) || 
+        daddr >= get_segment_daddr(meta, meta->segments)) {
+        return false;
+    }
+    __u32 segment = get_daddr_segment(meta, daddr);
+    __u32 bit = daddr - get_segment_daddr(meta, segment);
+
+    spin_lock(&wlfs_sb->segmap_lock);
+    bool live = get_bitmap(&wlfs_sb->segmap, segment)[bit >> 3] & 
+        (1 << (bit & 7));
+    spin_unlock(&wlfs_sb->segmap_lock);
+
+    return live;
+}
+
+__u32 wlfs_segmap_live (struct wlfs_super *wlfs_sb, __u32 segment) {
+    return ACCESS_ONCE(wlfs_sb->segmap.live[segment]);
+}
+
+__u32 wlfs_segmap_wtime (struct wlfs_super *wlfs_sb, __u32 segment) {
+    return ACCESS_ONCE(wlfs_sb->segmap.wtime[segment]);
+}
+
+void wlfs_segmap_set_wtime (struct wlfs_super *wlfs_sb, __u32 segment,
+                            __u32 wtime) {
+    spin_lock(&wlfs_sb->segmap_lock);
+    // Don't overwrite a time recorded by a write since
+    if (wlfs_sb->segmap.wtime[segment] == 0) {
+        wlfs_sb->segmap.wtime[segment] = wtime;
+    }
+    spin_unlock(&wlfs_sb->segmap_lock);
+}
+
+__u32 wlfs_segmap_least_used (struct wlfs_super *wlfs_sb, __u32 *segments,
+                              __u32 max) {
+    struct segment_index *index = &wlfs_sb->segindex;
+    __u32 n = 0;
+
+    spin_lock(&wlfs_sb->segmap_lock);
+    __u32 live = 1;
+    for (; live < wlfs_sb->segmap.bits && n < max; ++live) {
+        __u32 segment = index->head[live];
+        for (; segment != NO_SEGMENT && n < max; 
+             segment = index->next[segment]) {
+            segments[n++] = segment;
+        }
+    }
+    spin_unlock(&wlfs_sb->segmap_lock);
+
+    return n;
+}
+
+__u32 wlfs_segmap_take_clean (struct wlfs_super *wlfs_sb) {
+    struct segment_index *index = &wlfs_sb->segindex;
+
+    spin_lock(&wlfs_sb->segmap_lock);
+    __u32 const segment = index->head[0];
+    if (segment != NO_SEGMENT) {
+        list_remove(index, segment);
+        // Rewriting the segment makes discarding it pointless
+        if (wlfs_sb->discard.pending) {
+            __clear_bit(segment, wlfs_sb->discard.pending);
+        }
+    }
+    spin_unlock(&wlfs_sb->segmap_lock);
+
+    return segment;
+}
+
+void wlfs_segmap_reserve (struct wlfs_super *wlfs_sb, __u32 segment) {
+    struct segment_index *index = &wlfs_sb->segindex;
+
+    if (segment >= wlfs_sb->meta.segments) {
+        return;
+    }
+    spin_lock(&wlfs_sb->segmap_lock);
+    if (index->list[segment] != NO_LIST) {
+        list_remove(index, segment);
+    }
+    spin_unlock(&wlfs_sb->segmap_lock);
+}
+
+void wlfs_segmap_release (struct wlfs_super *wlfs_sb, __u32 segment) {
+    struct segment_map *segmap = &wlfs_sb->segmap;
+    struct segment_index *index = &wlfs_sb->segindex;
+
+    if (segment >= wlfs_sb->meta.segments) {
+        return;
+    }
+    spin_lock(&wlfs_sb->segmap_lock);
+    if (index->list[segment] == NO_LIST) {
+        // Blocks of an emptied log segment may still be in the checkpoint
+        list_push(index, segment, segmap->live[segment] ? 
+                  segmap->live[segment] : 
+                  get_pin_list(segmap, wlfs_sb->pin_epoch));
+    }
+    spin_unlock(&wlfs_sb->segmap_lock);
+}
+
+__u8 wlfs_segmap_pin_epoch (struct wlfs_super *wlfs_sb) {
+    spin_lock(&wlfs_sb->segmap_lock);
+    __u8 const epoch = wlfs_sb->pin_epoch;
+    wlfs_sb->pin_epoch = !epoch;
+    spin_unlock(&wlfs_sb->segmap_lock);
+
+    return epoch;
+}
+
+void wlfs_segmap_unpin (struct wlfs_super *wlfs_sb, __u8 epoch) {
+    struct segment_map *segmap = &wlfs_sb->segmap;
+    struct segment_index *index = &wlfs_sb->segindex;
+    __u16 const pins = get_pin_list(segmap, epoch);
+
+    spin_lock(&wlfs_sb->segmap_lock);
+    while (index->head[pins] != NO_SEGMENT) {
+        __u32 const segment = index->head[pins];
+        list_remove(index, segment);
+        list_push(index, segment, segmap->live[segment]);
+        if (wlfs_sb->discard.pending) {
+            __set_bit(segment, wlfs_sb->discard.pending);
+        }
+    }
+    spin_unlock(&wlfs_sb->segmap_lock);
+}
+
+// Segments being discarded are off the index, so a log head can't start
+// writing to one before its discard is issued
+__u32 wlfs_segmap_take_unused (struct wlfs_super *wlfs_sb, bool pending,
+                               __u32 *next, __u32 end, __u32 *segments,
+                               __u32 max) {
+    struct segment_index *index = &wlfs_sb->segindex;
+    unsigned long *marks = wlfs_sb->discard.pending;
+    __u32 n = 0;
+
+    spin_lock(&wlfs_sb->segmap_lock);
+    __u32 segment = *next;
+    for (; segment < end && n < max; ++segment) {
+        if (pending) {
+            segment = find_next_bit(marks, end, segment);
+            if (segment >= end) {
+                break;
+            }
+        }
+        if (marks) {
+            __clear_bit(segment, marks);
+        }
+        if (index->list[segment] == 0) {
+            list_remove(index, segment);
+            segments[n++] = segment;
+        }
+    }
+    *next = segment;
+    spin_unlock(&wlfs_sb->segmap_lock);
+
+    return n;
+}
+
+void wlfs_segmap_put_unused (struct wlfs_super *wlfs_sb,
+                             __u32 const *segments, __u32 n) {
+    struct segment_index *index = &wlfs_sb->segindex;
+
+    spin_lock(&wlfs_sb->segmap_lock);
+    __u32 i = 0;
+    for (; i < n; ++i) {
+        list_push(index, segments[i], 0);
+    }
+    spin_unlock(&wlfs_sb->segmap_lock);
+}
+
+bool wlfs_segmap_copy (struct wlfs_super *wlfs_sb, __u32 index, 
+                       struct block *dst) {
+    bool dirty;
+
+    spin_lock(&wlfs_sb->segmap_lock);
+    dirty = test_and_clear_bit(index, wlfs_sb->segmap_dirty);
+    if (dirty) {
+        memcpy(dst, wlfs_sb->segmap.blocks[index].block, 
+               wlfs_sb->meta.block_size);
+    }
+    spin_unlock(&wlfs_sb->segmap_lock);
+
+    return dirty;
+}
+
+void wlfs_segmap_mark_dirty (struct wlfs_super *wlfs_sb, __u32 index) {
+    set_bit(index, wlfs_sb->segmap_dirty);
+}
+
+wlfs_daddr_t *wlfs_segmap_daddr (struct wlfs_super *wlfs_sb, 
+                                 __u32 index) {
+    if (unlikely(index >= wlfs_sb->segmap.nblocks)) {
+        return NULL;
+    }
+    return &wlfs_sb->segmap.blocks[index].daddr;
+}
+
+/*
+ * Helper functions
+ */
+
+__u8 *get_bitmap (struct segment_map *segmap, __u32 segment) {
+    return (__u8 *) get_block_data(
+        segmap->blocks[segment / segmap->entries].block) + 
+        (segment % segmap->entries) * (segmap->bits >> 3);
+}
+
+__u16 get_pin_list (struct segment_map *segmap, __u8 epoch) {
+    return segmap->bits + 1 + epoch;
+}
+
+void list_push (struct segment_index *index, __u32 segment, __u16 list) {
+    index->list[segment] = list;
+    index->next[segment] = NO_SEGMENT;
+    index->prev[segment] = index->tail[list];
+    if (index->tail[list] == NO_SEGMENT) {
+        index->head[list] = segment;
+    } else {
+        index->next[index->tail[list]] = segment;
+    }
+    index->tail[list] = segment;
+}
+
+void list_remove (struct segment_index *index, __u32 segment) {
+    __u16 const list = index->list[segment];
+    __u32 const prev = index->prev[segment];
+    __u32 const next = index->next[segment];
+
+    if (prev == NO_SEGMENT) {
+        index->head[list] = next;
+    } else {
+        index->next[prev] = next;
+    }
+    if (next == NO_SEGMENT) {
+        index->tail[list] = prev;
+    } else {
+        index->prev[next] = prev;
+    }
+    index->list[segment] = NO_LIST;
+}
+
+void requeue (struct wlfs_super *wlfs_sb, __u32 segment) {
+    struct segment_map *segmap = &wlfs_sb->segmap;
+    struct segment_index *index = &wlfs_sb->segindex;
+    __u16 const list = index->list[segment];
+
+    // Reserved segments are requeued when their log head releases them, and
+    // pinned ones when their epoch ends
+    if (list == NO_LIST || list > segmap->bits) {
+        return;
+    }
+    list_remove(index, segment);
+    list_push(index, segment, segmap->live[segment] ? segmap->live[segment] :
+              get_pin_list(segmap, wlfs_sb->pin_epoch));
+}
+
+void mark_locked (struct wlfs_super *wlfs_sb, __u64 daddr, bool live) {
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    struct segment_map *segmap = &wlfs_sb->segmap;
+
+    // Addresses outside the segments (e.g., 0 for "unallocated") carry no
+    // usage information
+    if (daddr < get_segment_daddr(meta, 0) || 
+        daddr >= get_segment_daddr(meta, meta->segments)) {
+        return;
+    }
+    __u32 segment = get_daddr_segment(meta, daddr);
+    __u32 bit = daddr - get_segment_daddr(meta, segment);
+
+    __u8 *bitmap = get_bitmap(segmap, segment);
+    bool const was = bitmap[bit >> 3] & (1 << (bit & 7));
+    if (live && !was) {
+        bitmap[bit >> 3] |= 1 << (bit & 7);
+        if (segmap->live[segment]++ == 0) {
+            --wlfs_sb->clean_segments;
+        }
+        segmap->wtime[segment] = get_seconds();
+        requeue(wlfs_sb, segment);
+    } else if (!live && was) {
+        bitmap[bit >> 3] &= ~(1 << (bit & 7));
+        if (--segmap->live[segment] == 0) {
+            ++wlfs_sb->clean_segments;
+        }
+        requeue(wlfs_sb, segment);
+    }
+    set_bit(segment / segmap->entries, wlfs_sb->segmap_dirty);
+}
@@ -0,0 +1,117 @@
+/*
+ * In-memory segment usage map
+ */
+
+#pragma once
+
+#include <linux/types.h>
+
+#include "wlfs.h"
+
+// List a segment is on when it's reserved for a log head
+#define NO_LIST ((__u16) -1)
+
+// Cleaning priority index.  Every segment which isn't reserved for the log
+// head is on exactly one list: segments with live blocks & unpinned clean
+// segments on the list for their live count, pinned clean segments on the
+// list for their pin epoch.  Each list is ordered from least to most
+// recently changed, & threaded through per-segment arrays, so every update
+// is O(1) & both the emptiest segments & a clean segment are found without
+// walking the segments
+struct segment_index {
+    // First & last segment on each list, NO_SEGMENT if empty; lists 0 to
+    // bits are by live count, followed by one per pin epoch
+    __u32 *head;
+    __u32 *tail;
+    // Neighbours of each segment on its list
+    __u32 *next;
+    __u32 *prev;
+    // List each segment is on, or NO_LIST
+    __u16 *list;
+};
+
+// Usage update for a block appended to the log, applied when the partial
+// segment holding it is sealed rather than by the append itself
+struct segmap_move {
+    // Reference the append updated, or NULL if there is nothing to apply
+    wlfs_daddr_t *owner;
+    // Address the block moved from, 0 if it was never written
+    wlfs_daddr_t old;
+};
+
+struct wlfs_super;
+
+// Allocate an empty segment map (every segment clean)
+int wlfs_segmap_alloc (struct wlfs_super *wlfs_sb);
+// Free the segment map blocks
+void wlfs_segmap_free (struct wlfs_super *wlfs_sb);
+
+// Recompute the live counts, clean segment count & index from the usage
+// bitmaps
+void wlfs_segmap_recount (struct wlfs_super *wlfs_sb);
+
+// Mark the block at a disk address as live or dead
+void wlfs_segmap_mark (struct wlfs_super *wlfs_sb, __u64 daddr, bool live);
+// Mark a block rewritten from old to new live at new & dead at old, under one
+// hold of the segmap lock; old may be 0 for a block never written
+void wlfs_segmap_move (struct wlfs_super *wlfs_sb, __u64 old, __u64 new);
+// Apply the usage updates of n blocks appended from daddr on, under one hold
+// of the segmap lock: each old address is marked dead, & each new one live
+// unless its owner has moved on again since
+void wlfs_segmap_move_run (struct wlfs_super *wlfs_sb, __u64 daddr,
+                           struct segmap_move *moves, __u32 n);
+// Check whether the block at a disk address is live
+bool wlfs_segmap_test (struct wlfs_super *wlfs_sb, __u64 daddr);
+// Number of live blocks in a segment
+__u32 wlfs_segmap_live (struct wlfs_super *wlfs_sb, __u32 segment);
+// Time a live block was last written to a segment, 0 if unknown
+__u32 wlfs_segmap_wtime (struct wlfs_super *wlfs_sb, __u32 segment);
+// Record when a segment was last written, e.g., as read from disk
+void wlfs_segmap_set_wtime (struct wlfs_super *wlfs_sb, __u32 segment,
+                            __u32 wtime);
+
+// Find up to max of the least utilized segments which aren't clean, full or
+// reserved, least recently changed first within each live count; returns
+// the number found.  Costs O(blocks per segment + max)
+__u32 wlfs_segmap_least_used (struct wlfs_super *wlfs_sb, __u32 *segments,
+                              __u32 max);
+
+// Take an unpinned clean segment off the index, reserving it for the log
+// head; returns NO_SEGMENT if there is none
+__u32 wlfs_segmap_take_clean (struct wlfs_super *wlfs_sb);
+// Reserve a particular segment for a log head, e.g., the one a checkpoint
+// left the log in
+void wlfs_segmap_reserve (struct wlfs_super *wlfs_sb, __u32 segment);
+// Return a segment a log head has left to the index; it is pinned if it
+// has no live blocks
+void wlfs_segmap_release (struct wlfs_super *wlfs_sb, __u32 segment);
+
+// Take up to max clean, unpinned segments in [*next, end) off the index so
+// they can be discarded, only those pending a discard if asked; *next moves
+// past the last segment looked at & each is no longer pending.  Returns the
+// number taken, in ascending order
+__u32 wlfs_segmap_take_unused (struct wlfs_super *wlfs_sb, bool pending,
+                               __u32 *next, __u32 end, __u32 *segments,
+                               __u32 max);
+// Return segments taken by wlfs_segmap_take_unused to the index
+void wlfs_segmap_put_unused (struct wlfs_super *wlfs_sb,
+                             __u32 const *segments, __u32 n);
+
+// Segments emptied since the last checkpoint are pinned: the last checkpoint
+// may still refer to blocks in them, so they can't be reused until the next
+// one is committed.  Pins are grouped into two epochs; a checkpoint starts a
+// new epoch & releases the previous one once it is committed.
+// Start a new pin epoch, returning the previous one
+__u8 wlfs_segmap_pin_epoch (struct wlfs_super *wlfs_sb);
+// Release every pin in an epoch, marking the segments pending a discard
+void wlfs_segmap_unpin (struct wlfs_super *wlfs_sb, __u8 epoch);
+
+// Copy a segmap block if it is dirty, marking it clean; returns whether it
+// was copied
+bool wlfs_segmap_copy (struct wlfs_super *wlfs_sb, __u32 index, 
+                       struct block *dst);
+// Mark a segmap block dirty, so the next checkpoint rewrites it
+void wlfs_segmap_mark_dirty (struct wlfs_super *wlfs_sb, __u32 index);
+// Disk address of a segmap block, or NULL if the index is out of range
+wlfs_daddr_t *wlfs_segmap_daddr (struct wlfs_super *wlfs_sb, 
+                                 __u32 index);
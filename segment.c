@@ -0,0 +1,620 @@
+#include <linux/bio.h>
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/blkdev.h>
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/gfp.h>
+#include <linux/hash.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/time.h>
+#include <linux/vmalloc.h>
+
+#include "checkpoint.h"
+#include "cleaner.h"
+#include "io.h"
+#include "mcache.h"
+#include "segmap.h"
+#include "segment.h"
+#include "super.h"
+#include "trace.h"
+#include "util.h"
+
+// Pick the log stream for a block by its type & write frequency
+static enum log_stream classify (struct segment_buffer *buf,
+                                 struct block *blk);
+// Append a block to a given log head, reserving its slot without the lock;
+// its usage update is deferred until the slot is sealed, or applied now
+static int append_to (struct log_head *head, struct block *blk,
+                      wlfs_daddr_t *daddr, bool defer);
+// Move a log head into its reserved next segment, unless the segment of
+// generation gen was already left; caller holds the head's lock
+static int advance_segment (struct log_head *head, __u32 gen);
+// Address of the n-th block slot in a log head's pages
+static struct block *get_slot (struct log_head *head, __u32 n);
+// Close the open partial segment of a log head at the last reserved slot,
+// wait for its blocks to be copied in & submit it; caller holds the lock
+static void seal_partial (struct log_head *head, int rw);
+// Write the blocks of a log head from its start slot up to end, headed by
+// their summary block, to the device as one sequential run of bios
+static void submit_partial (struct log_head *head, __u32 end, int rw);
+// Seal the open partial segments of every log head
+static void seal_all (struct segment_buffer *buf, int rw);
+// Check that no log head has bios in flight
+static bool heads_idle (struct segment_buffer *buf);
+// Flush the device's write cache, unless a flush started since the caller's
+// blocks completed already did
+static int flush_cache (struct segment_buffer *buf);
+// Check that every slot of a log head in [first, end) has been filled
+static bool slots_filled (struct log_head *head, __u32 first, __u32 end);
+// Completion handler for segment bios
+static void wlfs_segbuf_end_io (struct bio *bio);
+// Periodic write-back of the open partial segments
+static void wlfs_segbuf_flush_work (struct work_struct *work);
+// Free the pages & workqueue of a segment buffer with no bios in flight
+static void release_buffer (struct segment_buffer *buf);
+
+int wlfs_segbuf_init (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct segment_buffer *buf = &wlfs_sb->segbuf;
+    struct checkpoint *cp = &wlfs_sb->checkpoint;
+    __u32 const blocks = get_segmap_bits(&wlfs_sb->meta);
+
+    buf->sb = sb;
+    buf->error = 0;
+    mutex_init(&buf->flush_lock);
+    buf->flush_started = buf->flush_done = 0;
+    buf->flush_error = 0;
+    init_waitqueue_head(&buf->wait);
+    INIT_DELAYED_WORK(&buf->flush_work, wlfs_segbuf_flush_work);
+    atomic64_set(&buf->seq, cp->seq);
+    buf->mount = cp->mount + 1;
+
+    buf->npages = DIV_ROUND_UP(wlfs_sb->meta.segment_size, PAGE_SIZE);
+    buf->heat = (__u8 *) kzalloc(1 << HEAT_BITS, GFP_KERNEL);
+    if (unlikely(!buf->heat)) {
+        return -ENOMEM;
+    }
+    unsigned s = 0;
+    for (; s < LOG_STREAMS; ++s) {
+        struct log_head *head = &buf->heads[s];
+        head->pages = wlfs_alloc_pages(buf->npages,
+                                       wlfs_sb->meta.block_size);
+        head->filled = (unsigned long *) kcalloc(
+            BITS_TO_LONGS(blocks), sizeof(unsigned long), GFP_KERNEL);
+        head->moves = (struct segmap_move *) vzalloc(
+            blocks * sizeof(struct segmap_move));
+        if (unlikely(!head->pages || !head->filled || !head->moves)) {
+            if (head->pages) {
+                wlfs_free_pages(head->pages, buf->npages);
+            }
+            kfree(head->filled);
+            vfree(head->moves);
+            goto fail;
+        }
+    }
+
+    buf->wq = alloc_workqueue("wlfs-flush", WQ_MEM_RECLAIM | WQ_FREEZABLE, 1);
+    if (unlikely(!buf->wq)) {
+        goto fail;
+    }
+
+    // Resume each stream where the last checkpoint left it
+    for (s = 0; s < LOG_STREAMS; ++s) {
+        struct log_head *head = &buf->heads[s];
+        struct log_position *pos = &cp->heads[s];
+        head->buf = buf;
+        head->stream = s;
+        mutex_init(&head->lock);
+        atomic_set(&head->inflight, 0);
+        head->blocks = head->segments = 0;
+        head->segment = pos->segment;
+        head->next = pos->next;
+        head->start = pos->offset;
+        if (head->segment != NO_SEGMENT) {
+            wlfs_segmap_reserve(wlfs_sb, head->segment);
+            wlfs_segmap_reserve(wlfs_sb, head->next);
+        } else {
+            // Otherwise open the stream on a clean segment; if there is
+            // none, appends fail until the cleaner frees one
+            head->start = 0;
+            head->segment = wlfs_segmap_take_clean(wlfs_sb);
+            head->next = wlfs_segmap_take_clean(wlfs_sb);
+        }
+        // Reserve the summary slot of the first partial segment; if it
+        // wouldn't fit, the first append moves on to the next segment
+        if (head->segment == NO_SEGMENT || blocks - head->start < 2) {
+            head->start = blocks;
+        }
+        atomic64_set(&head->slots, min(head->start + 1, blocks));
+#ifndef NDEBUG
+        printk(KERN_DEBUG "Log stream %u at segment %u, next segment %u\n",
+               s, head->segment, head->next);
+#endif
+    }
+
+    return 0;
+fail:
+    while (s--) {
+        wlfs_free_pages(buf->heads[s].pages, buf->npages);
+        kfree(buf->heads[s].filled);
+        vfree(buf->heads[s].moves);
+    }
+    kfree(buf->heat);
+    return -ENOMEM;
+}
+
+// Writable mounts stop the periodic flush & sync the buffer before this
+void wlfs_segbuf_destroy (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct segment_buffer *buf = &wlfs_sb->segbuf;
+
+    printk(KERN_INFO "wlfs log streams wrote blocks/segments: hot %llu/%llu, "
+           "cold %llu/%llu, meta %llu/%llu\n",
+           buf->heads[STREAM_HOT].blocks, buf->heads[STREAM_HOT].segments,
+           buf->heads[STREAM_COLD].blocks, buf->heads[STREAM_COLD].segments,
+           buf->heads[STREAM_META].blocks, buf->heads[STREAM_META].segments);
+    release_buffer(buf);
+}
+
+// A mount which fails has written nothing worth keeping, & if its checkpoint
+// failed, writing the buffered blocks could clobber log which the next
+// recovery still needs
+void wlfs_segbuf_abort (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct segment_buffer *buf = &wlfs_sb->segbuf;
+
+    wait_event(buf->wait, heads_idle(buf));
+    release_buffer(buf);
+}
+
+void wlfs_segbuf_start (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct segment_buffer *buf = &wlfs_sb->segbuf;
+
+    queue_delayed_work(buf->wq, &buf->flush_work,
+                       READ_ONCE(wlfs_sb->opts.buffer_period) * HZ);
+}
+
+void wlfs_segbuf_stop (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+
+    cancel_delayed_work_sync(&wlfs_sb->segbuf.flush_work);
+}
+
+int wlfs_segbuf_append (struct super_block *sb, struct block *blk,
+                        wlfs_daddr_t *daddr) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct segment_buffer *buf = &wlfs_sb->segbuf;
+
+    wlfs_stat_add(wlfs_sb, STAT_BLOCKS_APPENDED, 1);
+    return append_to(&buf->heads[classify(buf, blk)], blk, daddr, true);
+}
+
+int wlfs_segbuf_relocate (struct super_block *sb, struct block *blk,
+                          wlfs_daddr_t *daddr, wlfs_daddr_t old) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct segment_buffer *buf = &wlfs_sb->segbuf;
+
+    // The owner's lock keeps the block from being rewritten until it's
+    // copied.  Blocks which survived until cleaning are likely to live on
+    if (READ_ONCE(*daddr) != old) {
+        return -ESTALE;
+    }
+    return append_to(&buf->heads[STREAM_COLD], blk, daddr, false);
+}
+
+int wlfs_segbuf_flush (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct segment_buffer *buf = &wlfs_sb->segbuf;
+
+    seal_all(buf, WRITE);
+    return buf->error;
+}
+
+void wlfs_segbuf_reschedule (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct segment_buffer *buf = &wlfs_sb->segbuf;
+
+    mod_delayed_work(buf->wq, &buf->flush_work,
+                     READ_ONCE(wlfs_sb->opts.buffer_period) * HZ);
+}
+
+int wlfs_segbuf_sync (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+
+    seal_all(&wlfs_sb->segbuf, WRITE_SYNC);
+    return wlfs_segbuf_wait(sb);
+}
+
+// Waiting outside the locks lets appends continue into the next partial
+// segments while earlier ones are written
+int wlfs_segbuf_wait (struct super_block *sb) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct segment_buffer *buf = &wlfs_sb->segbuf;
+
+    wait_event(buf->wait, heads_idle(buf));
+    int const ret = xchg(&buf->error, 0);
+    if (unlikely(ret)) {
+        return ret;
+    }
+    return flush_cache(buf);
+}
+
+// Holding every head's lock keeps partial segments from being submitted
+// elsewhere, so the sequence number read is the first one after the cut
+void wlfs_segbuf_cut (struct super_block *sb, struct checkpoint *cp) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct segment_buffer *buf = &wlfs_sb->segbuf;
+
+    unsigned s = 0;
+    for (; s < LOG_STREAMS; ++s) {
+        mutex_lock(&buf->heads[s].lock);
+        seal_partial(&buf->heads[s], WRITE);
+    }
+    cp->seq = atomic64_read(&buf->seq);
+    cp->mount = buf->mount;
+    for (s = 0; s < LOG_STREAMS; ++s) {
+        cp->heads[s].segment = buf->heads[s].segment;
+        cp->heads[s].offset = buf->heads[s].start;
+        cp->heads[s].next = buf->heads[s].next;
+    }
+    while (s--) {
+        mutex_unlock(&buf->heads[s].lock);
+    }
+}
+
+/*
+ * Helper functions
+ */
+
+// Metadata gets a stream of its own; a data block is hot once it has been
+// rewritten within the decay window.  Racing updates of the counts only
+// make them approximate
+enum log_stream classify (struct segment_buffer *buf, struct block *blk) {
+    if (blk->type != BLOCK_DATA) {
+        return STREAM_META;
+    }
+
+    __u8 *heat = &buf->heat[hash_64(blk->index << 32 | blk->offset,
+                                    HEAT_BITS)];
+    __u8 const count = READ_ONCE(*heat);
+    if (count < U8_MAX) {
+        WRITE_ONCE(*heat, count + 1);
+    }
+    return count + 1 >= HOT_WRITES ? STREAM_HOT : STREAM_COLD;
+}
+
+int append_to (struct log_head *head, struct block *blk,
+               wlfs_daddr_t *daddr, bool defer) {
+    struct segment_buffer *buf = head->buf;
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) buf->sb->s_fs_info;
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    __u32 const blocks = get_segmap_bits(meta);
+    __u32 slot;
+
+    // Reserve a slot; whoever overflows the segment first moves the head on,
+    // & the rest retry in the next segment
+    while (true) {
+        __s64 const slots = atomic64_add_return(1, &head->slots);
+        slot = (__u32) slots - 1;
+        if (likely(slot < blocks)) {
+            break;
+        }
+        mutex_lock(&head->lock);
+        int ret = advance_segment(head, slots >> 32);
+        mutex_unlock(&head->lock);
+        if (unlikely(ret)) {
+            return ret;
+        }
+    }
+
+    // The head can't leave the segment until the slot is marked filled.
+    // Stamp both headers, then copy the block into the segment; the copy is
+    // checksummed here, so appenders checksum in parallel
+    __u64 const new = get_segment_daddr(meta, head->segment) + slot;
+    blk->h0.wtime = blk->h1.wtime = get_seconds();
+    blk->h1.version = blk->h0.version;
+    blk->stamp = ktime_get_ns();
+    struct block *copy = get_slot(head, slot);
+    memcpy(copy, blk, meta->block_size);
+    set_block_csum(meta, copy);
+
+    wlfs_daddr_t const old = *daddr;
+    // Owners may be read without locks, e.g., by inode map lookups
+    WRITE_ONCE(*daddr, new);
+    // The segmap lock is global, so appends leave their usage updates in
+    // the slot to be applied a partial segment at a time.  Relocations
+    // apply theirs at once, since the cleaner counts what it freed
+    if (defer) {
+        head->moves[slot].owner = daddr;
+        head->moves[slot].old = old;
+    } else {
+        head->moves[slot].owner = NULL;
+        wlfs_segmap_move(wlfs_sb, old, new);
+    }
+
+    // Publish the slot, & everything written to it, to whoever is waiting to
+    // submit it
+    smp_mb__before_atomic();
+    set_bit(slot, head->filled);
+    smp_mb__after_atomic();
+    if (waitqueue_active(&buf->wait)) {
+        wake_up(&buf->wait);
+    }
+
+    // Write the segment as soon as it fills
+    if (slot == blocks - 1) {
+        mutex_lock(&head->lock);
+        seal_partial(head, WRITE);
+        mutex_unlock(&head->lock);
+    }
+
+    return 0;
+}
+
+int advance_segment (struct log_head *head, __u32 gen) {
+    struct segment_buffer *buf = head->buf;
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) buf->sb->s_fs_info;
+    __u32 const blocks = get_segmap_bits(&wlfs_sb->meta);
+
+    if ((__u32) (atomic64_read(&head->slots) >> 32) != gen) {
+        return 0;
+    }
+
+    // Submit whatever is left of the full segment
+    seal_partial(head, WRITE);
+
+    // The next segment may have been unavailable when this one was opened
+    if (head->next == NO_SEGMENT) {
+        head->next = wlfs_segmap_take_clean(wlfs_sb);
+        if (head->next == NO_SEGMENT) {
+            // Segments emptied since the last checkpoint stay pinned until
+            // the next one, so checkpointing may free space too
+            wlfs_cleaner_kick(buf->sb);
+            wlfs_checkpoint_kick(buf->sb);
+            return -ENOSPC;
+        }
+    }
+
+    // Buffered blocks must reach the device before their pages are reused
+    wait_event(buf->wait, atomic_read(&head->inflight) == 0);
+    if (head->segment != NO_SEGMENT) {
+        ++head->segments;
+        wlfs_stat_add(wlfs_sb, STAT_SEGMENTS_WRITTEN, 1);
+    }
+    wlfs_segmap_release(wlfs_sb, head->segment);
+    head->segment = head->next;
+    head->next = wlfs_segmap_take_clean(wlfs_sb);
+    head->start = 0;
+    // Blocks cached from the segment's last use are about to be overwritten
+    wlfs_mcache_invalidate(buf->sb,
+                           get_segment_daddr(&wlfs_sb->meta, head->segment),
+                           blocks);
+    bitmap_zero(head->filled, blocks);
+
+    // Age the write counts, so data which stops being rewritten turns cold
+    if (head->stream != STREAM_META) {
+        __u32 i = 0;
+        for (; i < 1 << HEAT_BITS; ++i) {
+            buf->heat[i] >>= 1;
+        }
+    }
+
+    // Open the segment with its first summary slot reserved; appenders which
+    // see the new generation see the new segment
+    smp_wmb();
+    atomic64_set(&head->slots, ((__s64) gen + 1) << 32 | 1);
+
+    // Consuming a clean segment may push the cleaner over its threshold
+    wlfs_cleaner_kick(buf->sb);
+    return 0;
+}
+
+struct block *get_slot (struct log_head *head, __u32 n) {
+    struct wlfs_super *wlfs_sb =
+        (struct wlfs_super *) head->buf->sb->s_fs_info;
+    return wlfs_get_block(head->pages, wlfs_sb->meta.block_size, n);
+}
+
+// Unless the segment is full, the slot after the partial segment is reserved
+// for the summary of the next one in the same atomic step, so later appends
+// land after it
+void seal_partial (struct log_head *head, int rw) {
+    struct wlfs_super *wlfs_sb =
+        (struct wlfs_super *) head->buf->sb->s_fs_info;
+    __u32 const blocks = get_segmap_bits(&wlfs_sb->meta);
+    __s64 slots = atomic64_read(&head->slots);
+    __u32 end;
+
+    while (true) {
+        end = min((__u32) slots, blocks);
+        if (end <= head->start + 1) {
+            return;
+        }
+        if (end == blocks) {
+            break;
+        }
+        __s64 const old = atomic64_cmpxchg(&head->slots, slots, slots + 1);
+        if (old == slots) {
+            break;
+        }
+        slots = old;
+    }
+
+    wait_event(head->buf->wait, slots_filled(head, head->start + 1, end));
+    smp_rmb();
+    // Blocks in the partial segment become live before it can be released
+    wlfs_segmap_move_run(wlfs_sb,
+                         get_segment_daddr(&wlfs_sb->meta, head->segment) +
+                         head->start + 1,
+                         &head->moves[head->start + 1],
+                         end - head->start - 1);
+    submit_partial(head, end, rw);
+    head->start = end;
+}
+
+void submit_partial (struct log_head *head, __u32 end, int rw) {
+    struct segment_buffer *buf = head->buf;
+    struct super_block *sb = buf->sb;
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+
+    // Fill in the summary block heading the partial segment
+    __u64 const seq = atomic64_inc_return(&buf->seq) - 1;
+    struct block *blk = get_slot(head, head->start);
+    memset(blk, 0, meta->block_size);
+    blk->h0.wtime = blk->h1.wtime = get_seconds();
+    blk->index = seq;
+    blk->type = BLOCK_SUMMARY;
+    struct segment_summary *summary =
+        (struct segment_summary *) get_block_data(blk);
+    summary->seq = seq;
+    summary->mount = buf->mount;
+    summary->next = head->next;
+    summary->nblocks = end - head->start - 1;
+    summary->stream = head->stream;
+    head->blocks += summary->nblocks;
+    // Chain the checksums of the blocks, which are already filled in
+    __u32 csum = WLFS_CSUM_SEED;
+    __u32 i = head->start + 1;
+    for (; i < end; ++i) {
+        csum = wlfs_crc32c(csum, &get_slot(head, i)->h0.csum, sizeof(__u32));
+    }
+    summary->csum = csum;
+    set_block_csum(meta, blk);
+    wlfs_stat_add(wlfs_sb, STAT_BLOCKS_WRITTEN, end - head->start);
+    wlfs_stat_add(wlfs_sb, STAT_PARTIALS_WRITTEN, 1);
+    trace_wlfs_segment_flush(sb, head->stream, head->segment, head->start,
+                             summary->nblocks, seq);
+
+    // Map the byte range of the partial segment onto as few bios as possible;
+    // with the default geometry the whole segment fits in one
+    sector_t const sector =
+        (get_segment_daddr(meta, head->segment) + head->start) *
+        (meta->block_size >> 9);
+    unsigned long const first = (unsigned long) head->start * meta->block_size;
+    unsigned long const last = (unsigned long) end * meta->block_size;
+    unsigned long pos = first;
+    struct bio *bio = NULL;
+    struct blk_plug plug;
+    blk_start_plug(&plug);
+    while (pos < last) {
+        if (!bio) {
+            unsigned const pages = min_t(unsigned long, BIO_MAX_PAGES,
+                DIV_ROUND_UP(last, PAGE_SIZE) - pos / PAGE_SIZE);
+            bio = bio_alloc(GFP_NOFS, pages);
+            bio->bi_bdev = sb->s_bdev;
+            bio->bi_iter.bi_sector = sector + ((pos - first) >> 9);
+            bio->bi_end_io = wlfs_segbuf_end_io;
+            bio->bi_private = head;
+        }
+
+        unsigned const offset = pos % PAGE_SIZE;
+        unsigned const len = min_t(unsigned long, PAGE_SIZE - offset,
+                                   last - pos);
+        if (bio_add_page(bio, head->pages[pos / PAGE_SIZE], len, offset) <
+            len) {
+            // The bio is full; submit it & continue in a new one
+            atomic_inc(&head->inflight);
+            submit_bio(rw, bio);
+            bio = NULL;
+            continue;
+        }
+        pos += len;
+    }
+    atomic_inc(&head->inflight);
+    submit_bio(rw, bio);
+    blk_finish_plug(&plug);
+}
+
+// Data streams go first, so their partial segments get lower sequence
+// numbers than the metadata flushed with them
+void seal_all (struct segment_buffer *buf, int rw) {
+    unsigned s = 0;
+    for (; s < LOG_STREAMS; ++s) {
+        mutex_lock(&buf->heads[s].lock);
+        seal_partial(&buf->heads[s], rw);
+        mutex_unlock(&buf->heads[s].lock);
+    }
+}
+
+bool heads_idle (struct segment_buffer *buf) {
+    unsigned s = 0;
+    for (; s < LOG_STREAMS; ++s) {
+        if (atomic_read(&buf->heads[s].inflight)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Callers arriving while a flush is in progress wait for the lock, & the
+// first to get it issues one flush for all of them
+int flush_cache (struct segment_buffer *buf) {
+    smp_mb();
+    __u64 const ticket = READ_ONCE(buf->flush_started);
+    int ret;
+
+    mutex_lock(&buf->flush_lock);
+    if (buf->flush_done > ticket) {
+        ret = buf->flush_error;
+        goto exit;
+    }
+    __u64 const flush = buf->flush_started + 1;
+    WRITE_ONCE(buf->flush_started, flush);
+    ret = blkdev_issue_flush(buf->sb->s_bdev, GFP_KERNEL, NULL);
+    buf->flush_error = ret;
+    buf->flush_done = flush;
+
+exit:
+    mutex_unlock(&buf->flush_lock);
+    return ret;
+}
+
+bool slots_filled (struct log_head *head, __u32 first, __u32 end) {
+    return find_next_zero_bit(head->filled, end, first) >= end;
+}
+
+void wlfs_segbuf_end_io (struct bio *bio) {
+    struct log_head *head = (struct log_head *) bio->bi_private;
+
+    if (unlikely(bio->bi_error)) {
+        printk(KERN_ERR "Segment write failed with error %d\n",
+               bio->bi_error);
+        head->buf->error = bio->bi_error;
+    }
+    bio_put(bio);
+
+    if (atomic_dec_and_test(&head->inflight)) {
+        wake_up(&head->buf->wait);
+    }
+}
+
+void release_buffer (struct segment_buffer *buf) {
+    destroy_workqueue(buf->wq);
+    unsigned s = 0;
+    for (; s < LOG_STREAMS; ++s) {
+        wlfs_free_pages(buf->heads[s].pages, buf->npages);
+        kfree(buf->heads[s].filled);
+        vfree(buf->heads[s].moves);
+    }
+    kfree(buf->heat);
+}
+
+void wlfs_segbuf_flush_work (struct work_struct *work) {
+    struct segment_buffer *buf = container_of(
+        to_delayed_work(work), struct segment_buffer, flush_work);
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) buf->sb->s_fs_info;
+
+    if (unlikely(wlfs_segbuf_flush(buf->sb))) {
+        printk(KERN_ERR "Periodic segment flush failed\n");
+    }
+    queue_delayed_work(buf->wq, &buf->flush_work,
+                       READ_ONCE(wlfs_sb->opts.buffer_period) * HZ);
+}
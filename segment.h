@@ -0,0 +1,124 @@
+/*
+ * Segment write buffer: gathers blocks bound for the log into whole-segment,
+ * sequential writes, with one log head per stream
+ */
+
+#pragma once
+
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "segmap.h"
+#include "wlfs.h"
+
+// Log2 of the number of write counters for classifying data blocks
+#define HEAT_BITS 12
+// Writes within the decay window after which a data block is hot
+#define HOT_WRITES 2
+
+struct segment_buffer;
+
+// Head of one log stream, filling its own segment.  Appenders reserve slots
+// in the segment with an atomic add & copy their blocks in concurrently; the
+// lock is only taken to submit partial segments & to move to the next segment
+struct log_head {
+    struct segment_buffer *buf;
+    enum log_stream stream;
+    // Serializes flushes & moving to the next segment
+    struct mutex lock;
+    // Pages backing one segment worth of blocks
+    struct page **pages;
+    // Generation of the segment in the upper 32 bits, incremented whenever
+    // the head moves on, & the number of slots reserved in it in the lower
+    atomic64_t slots;
+    // Slots whose blocks have been copied in
+    unsigned long *filled;
+    // Usage updates of the blocks appended to each slot, applied to the
+    // segment map when their partial segment is sealed
+    struct segmap_move *moves;
+    // Segment being filled, and the clean segment reserved to follow it
+    __u32 segment;
+    __u32 next;
+    // First slot of the open partial segment, reserved for its summary block
+    __u32 start;
+    // Number of bios in flight; pages may not be reused until they complete
+    atomic_t inflight;
+    // Blocks submitted & segments filled by this stream
+    __u64 blocks;
+    __u64 segments;
+};
+
+struct segment_buffer {
+    struct super_block *sb;
+    struct log_head heads[LOG_STREAMS];
+    // Pages per log head
+    __u32 npages;
+    // Sequence number of the next partial segment, in any stream
+    atomic64_t seq;
+    // Mount number stamped into every summary block
+    __u32 mount;
+    // Approximate, saturating write counts of data blocks, hashed by inode &
+    // offset, & halved whenever a data segment fills
+    __u8 *heat;
+    // Writes back partially filled segments every buffer_period seconds
+    struct workqueue_struct *wq;
+    struct delayed_work flush_work;
+    // Woken when a log head has no bios in flight, or a slot is filled
+    wait_queue_head_t wait;
+    // Error reported by the last failed bio
+    int error;
+    // Device cache flushes started & completed, & the result of the last.
+    // A flush started after a caller's blocks were written covers them, so
+    // concurrent syncs share flushes rather than queueing one each
+    struct mutex flush_lock;
+    __u64 flush_started;
+    __u64 flush_done;
+    int flush_error;
+};
+
+// Allocate the segment buffer & position each log head where the checkpoint
+// left it, or on a clean segment
+int wlfs_segbuf_init (struct super_block *sb);
+// Free the segment buffer, once the blocks it holds are written
+void wlfs_segbuf_destroy (struct super_block *sb);
+// Free the segment buffer without writing the blocks it holds; for a mount
+// which fails
+void wlfs_segbuf_abort (struct super_block *sb);
+// Start writing the open partial segments every buffer_period seconds; only
+// writable mounts do
+void wlfs_segbuf_start (struct super_block *sb);
+// Stop the periodic write-back, without writing what is buffered
+void wlfs_segbuf_stop (struct super_block *sb);
+
+// Append a copy of a block to the log stream matching its type & write
+// frequency; on entry *daddr is the block's old address (0 if none), and on
+// exit its new address.  The segment map learns of the move when the partial
+// segment holding the copy is sealed, so *daddr must stay valid until then.
+// Callers appending the same block must be serialized by its owner, e.g., by
+// the inode's shard lock
+int wlfs_segbuf_append (struct super_block *sb, struct block *blk, 
+                        wlfs_daddr_t *daddr);
+// Relocate a block to the cold stream only if it is still live at its old
+// address, i.e., *daddr == old; used by the cleaner, which holds the owner's
+// lock.  Returns -ESTALE if the owner has moved the block since
+int wlfs_segbuf_relocate (struct super_block *sb, struct block *blk,
+                          wlfs_daddr_t *daddr, wlfs_daddr_t old);
+// Submit the open partial segments without waiting for them to complete
+int wlfs_segbuf_flush (struct super_block *sb);
+// Restart the periodic flush timer after buffer_period changed
+void wlfs_segbuf_reschedule (struct super_block *sb);
+// Flush & wait until all buffered blocks are stable on the device; this
+// commits them without a checkpoint, as recovery rolls forward through them
+int wlfs_segbuf_sync (struct super_block *sb);
+// Wait until all submitted blocks are stable on the device, without
+// submitting the open partial segments.  Concurrent callers are group
+// committed by one device cache flush
+int wlfs_segbuf_wait (struct super_block *sb);
+// Submit the open partial segments of all streams at once, recording the
+// position of each head & the next sequence number in a checkpoint; every
+// block appended before the cut is in a submitted partial segment
+void wlfs_segbuf_cut (struct super_block *sb, struct checkpoint *cp);
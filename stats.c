@@ -0,0 +1,319 @@
+#include <linux/compiler.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/kobject.h>
+#include <linux/percpu.h>
+#include <linux/printk.h>
+#include <linux/sysfs.h>
+
+#include "stats.h"
+#include "super.h"
+
+// Every tracepoint is defined here, once for the whole module
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+// A file under /sys/fs/wlfs/<dev>/: either a counter, shown as its sum, or
+// a value derived from the counters & the superblock
+struct stat_attr {
+    struct attribute attr;
+    ssize_t (*show) (struct wlfs_super *wlfs_sb, struct stat_attr *sa,
+                     char *buf);
+    enum wlfs_stat stat;
+};
+
+#define COUNTER_ATTR(_name, _stat)                                       \
+    static struct stat_attr stat_attr_##_name = {                        \
+        .attr = {.name = #_name, .mode = S_IRUGO},                       \
+        .show = show_counter,                                            \
+        .stat = _stat,                                                   \
+    }
+#define DERIVED_ATTR(_name)                                              \
+    static struct stat_attr stat_attr_##_name = {                        \
+        .attr = {.name = #_name, .mode = S_IRUGO},                       \
+        .show = show_##_name,                                            \
+    }
+
+// Parent of every mounted filesystem's directory
+static struct kset *wlfs_kset;
+
+// Show a counter
+static ssize_t show_counter (struct wlfs_super *wlfs_sb, struct stat_attr *sa,
+                             char *buf);
+// Show a counter of nanoseconds in milliseconds
+static ssize_t show_ms (struct wlfs_super *wlfs_sb, struct stat_attr *sa,
+                        char *buf);
+// Show the mean of a counter of nanoseconds per event in microseconds
+static ssize_t show_mean_us (struct wlfs_super *wlfs_sb,
+                             enum wlfs_stat ns, enum wlfs_stat events,
+                             char *buf);
+static ssize_t show_bytes_written (struct wlfs_super *wlfs_sb,
+                                   struct stat_attr *sa, char *buf);
+static ssize_t show_write_amplification (struct wlfs_super *wlfs_sb,
+                                         struct stat_attr *sa, char *buf);
+static ssize_t show_checkpoint_latency_us (struct wlfs_super *wlfs_sb,
+                                           struct stat_attr *sa, char *buf);
+static ssize_t show_fsync_latency_us (struct wlfs_super *wlfs_sb,
+                                      struct stat_attr *sa, char *buf);
+static ssize_t show_imap_hit_rate (struct wlfs_super *wlfs_sb,
+                                   struct stat_attr *sa, char *buf);
+static ssize_t show_clean_segments (struct wlfs_super *wlfs_sb,
+                                    struct stat_attr *sa, char *buf);
+static ssize_t show_min_clean_segs (struct wlfs_super *wlfs_sb,
+                                    struct stat_attr *sa, char *buf);
+static ssize_t show_target_clean_segs (struct wlfs_super *wlfs_sb,
+                                       struct stat_attr *sa, char *buf);
+// Print a ratio with three decimal places
+static ssize_t show_ratio (__u64 num, __u64 den, char *buf);
+// sysfs entry point, dispatching to the attribute's show function
+static ssize_t stats_show (struct kobject *kobj, struct attribute *attr,
+                           char *buf);
+// Called once the last reference to the directory is dropped
+static void stats_release (struct kobject *kobj);
+
+COUNTER_ATTR(blocks_appended, STAT_BLOCKS_APPENDED);
+COUNTER_ATTR(blocks_relocated, STAT_BLOCKS_RELOCATED);
+COUNTER_ATTR(blocks_written, STAT_BLOCKS_WRITTEN);
+COUNTER_ATTR(partials_written, STAT_PARTIALS_WRITTEN);
+COUNTER_ATTR(segments_written, STAT_SEGMENTS_WRITTEN);
+COUNTER_ATTR(segments_cleaned, STAT_SEGMENTS_CLEANED);
+COUNTER_ATTR(cleaner_passes, STAT_CLEANER_PASSES);
+COUNTER_ATTR(checkpoints, STAT_CHECKPOINTS);
+COUNTER_ATTR(fsyncs, STAT_FSYNCS);
+COUNTER_ATTR(imap_lookups, STAT_IMAP_LOOKUPS);
+COUNTER_ATTR(imap_misses, STAT_IMAP_MISSES);
+COUNTER_ATTR(mcache_hits, STAT_MCACHE_HITS);
+COUNTER_ATTR(mcache_misses, STAT_MCACHE_MISSES);
+COUNTER_ATTR(segments_discarded, STAT_SEGMENTS_DISCARDED);
+COUNTER_ATTR(discard_ranges, STAT_DISCARD_RANGES);
+COUNTER_ATTR(recovered_partials, STAT_RECOVERED_PARTIALS);
+COUNTER_ATTR(recovered_blocks, STAT_RECOVERED_BLOCKS);
+static struct stat_attr stat_attr_cleaner_ms = {
+    .attr = {.name = "cleaner_ms", .mode = S_IRUGO},
+    .show = show_ms,
+    .stat = STAT_CLEANER_NS,
+};
+static struct stat_attr stat_attr_cleaner_cpu_ms = {
+    .attr = {.name = "cleaner_cpu_ms", .mode = S_IRUGO},
+    .show = show_ms,
+    .stat = STAT_CLEANER_CPU_NS,
+};
+static struct stat_attr stat_attr_recovery_ms = {
+    .attr = {.name = "recovery_ms", .mode = S_IRUGO},
+    .show = show_ms,
+    .stat = STAT_RECOVERY_NS,
+};
+DERIVED_ATTR(bytes_written);
+DERIVED_ATTR(write_amplification);
+DERIVED_ATTR(checkpoint_latency_us);
+DERIVED_ATTR(fsync_latency_us);
+DERIVED_ATTR(imap_hit_rate);
+DERIVED_ATTR(clean_segments);
+DERIVED_ATTR(min_clean_segs);
+DERIVED_ATTR(target_clean_segs);
+
+static struct attribute *stats_attrs[] = {
+    &stat_attr_blocks_appended.attr,
+    &stat_attr_blocks_relocated.attr,
+    &stat_attr_blocks_written.attr,
+    &stat_attr_bytes_written.attr,
+    &stat_attr_partials_written.attr,
+    &stat_attr_segments_written.attr,
+    &stat_attr_write_amplification.attr,
+    &stat_attr_segments_cleaned.attr,
+    &stat_attr_cleaner_passes.attr,
+    &stat_attr_cleaner_ms.attr,
+    &stat_attr_cleaner_cpu_ms.attr,
+    &stat_attr_clean_segments.attr,
+    &stat_attr_min_clean_segs.attr,
+    &stat_attr_target_clean_segs.attr,
+    &stat_attr_checkpoints.attr,
+    &stat_attr_checkpoint_latency_us.attr,
+    &stat_attr_fsyncs.attr,
+    &stat_attr_fsync_latency_us.attr,
+    &stat_attr_imap_lookups.attr,
+    &stat_attr_imap_misses.attr,
+    &stat_attr_imap_hit_rate.attr,
+    &stat_attr_mcache_hits.attr,
+    &stat_attr_mcache_misses.attr,
+    &stat_attr_segments_discarded.attr,
+    &stat_attr_discard_ranges.attr,
+    &stat_attr_recovered_partials.attr,
+    &stat_attr_recovered_blocks.attr,
+    &stat_attr_recovery_ms.attr,
+    NULL,
+};
+
+static struct sysfs_ops const stats_sysfs_ops = {
+    .show = stats_show,
+};
+
+static struct kobj_type stats_ktype = {
+    .default_attrs = stats_attrs,
+    .sysfs_ops = &stats_sysfs_ops,
+    .release = stats_release,
+};
+
+int wlfs_stats_init (void) {
+    wlfs_kset = kset_create_and_add("wlfs", NULL, fs_kobj);
+    return wlfs_kset ? 0 : -ENOMEM;
+}
+
+void wlfs_stats_exit (void) {
+    kset_unregister(wlfs_kset);
+}
+
+int wlfs_stats_alloc (struct wlfs_super *wlfs_sb) {
+    struct wlfs_stats *stats = &wlfs_sb->stats;
+
+    stats->counters = (__u64 __percpu *) __alloc_percpu(
+        STAT_COUNT * sizeof(__u64), __alignof__(__u64));
+    return stats->counters ? 0 : -ENOMEM;
+}
+
+void wlfs_stats_free (struct wlfs_super *wlfs_sb) {
+    free_percpu(wlfs_sb->stats.counters);
+    wlfs_sb->stats.counters = NULL;
+}
+
+int wlfs_stats_register (struct wlfs_super *wlfs_sb) {
+    struct wlfs_stats *stats = &wlfs_sb->stats;
+
+    init_completion(&stats->released);
+    stats->kobj.kset = wlfs_kset;
+    int const ret = kobject_init_and_add(&stats->kobj, &stats_ktype, NULL,
+                                         "%s", wlfs_sb->sb->s_id);
+    if (unlikely(ret)) {
+        kobject_put(&stats->kobj);
+        wait_for_completion(&stats->released);
+        return ret;
+    }
+    stats->registered = true;
+    return 0;
+}
+
+void wlfs_stats_unregister (struct wlfs_super *wlfs_sb) {
+    struct wlfs_stats *stats = &wlfs_sb->stats;
+
+    if (!stats->registered) {
+        return;
+    }
+    kobject_put(&stats->kobj);
+    wait_for_completion(&stats->released);
+    stats->registered = false;
+}
+
+// Counters are only ever added to, so a sum racing with updates is at
+// worst slightly behind
+__u64 wlfs_stat_read (struct wlfs_super *wlfs_sb, enum wlfs_stat stat) {
+    __u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        sum += per_cpu_ptr(wlfs_sb->stats.counters, cpu)[stat];
+    }
+    return sum;
+}
+
+/*
+ * Helper functions
+ */
+
+ssize_t show_counter (struct wlfs_super *wlfs_sb, struct stat_attr *sa,
+                      char *buf) {
+    return snprintf(buf, PAGE_SIZE, "%llu\n",
+                    (unsigned long long) wlfs_stat_read(wlfs_sb, sa->stat));
+}
+
+ssize_t show_ms (struct wlfs_super *wlfs_sb, struct stat_attr *sa,
+                 char *buf) {
+    return snprintf(buf, PAGE_SIZE, "%llu\n", (unsigned long long)
+                    div_u64(wlfs_stat_read(wlfs_sb, sa->stat),
+                            NSEC_PER_MSEC));
+}
+
+ssize_t show_mean_us (struct wlfs_super *wlfs_sb, enum wlfs_stat ns,
+                      enum wlfs_stat events, char *buf) {
+    __u64 const n = wlfs_stat_read(wlfs_sb, events);
+    __u64 const total = wlfs_stat_read(wlfs_sb, ns);
+    return snprintf(buf, PAGE_SIZE, "%llu\n", (unsigned long long)
+                    (n ? div64_u64(total, n * NSEC_PER_USEC) : 0));
+}
+
+ssize_t show_bytes_written (struct wlfs_super *wlfs_sb, struct stat_attr *sa,
+                            char *buf) {
+    return snprintf(buf, PAGE_SIZE, "%llu\n", (unsigned long long)
+                    wlfs_stat_read(wlfs_sb, STAT_BLOCKS_WRITTEN) *
+                    wlfs_sb->meta.block_size);
+}
+
+// Everything written to the device per block its owners appended: the
+// cleaner's copies, summaries & checkpoints are the overhead
+ssize_t show_write_amplification (struct wlfs_super *wlfs_sb,
+                                  struct stat_attr *sa, char *buf) {
+    return show_ratio(wlfs_stat_read(wlfs_sb, STAT_BLOCKS_WRITTEN),
+                      wlfs_stat_read(wlfs_sb, STAT_BLOCKS_APPENDED), buf);
+}
+
+ssize_t show_checkpoint_latency_us (struct wlfs_super *wlfs_sb,
+                                    struct stat_attr *sa, char *buf) {
+    return show_mean_us(wlfs_sb, STAT_CHECKPOINT_NS, STAT_CHECKPOINTS, buf);
+}
+
+ssize_t show_fsync_latency_us (struct wlfs_super *wlfs_sb,
+                               struct stat_attr *sa, char *buf) {
+    return show_mean_us(wlfs_sb, STAT_FSYNC_NS, STAT_FSYNCS, buf);
+}
+
+ssize_t show_imap_hit_rate (struct wlfs_super *wlfs_sb, struct stat_attr *sa,
+                            char *buf) {
+    __u64 const lookups = wlfs_stat_read(wlfs_sb, STAT_IMAP_LOOKUPS);
+    __u64 const misses = wlfs_stat_read(wlfs_sb, STAT_IMAP_MISSES);
+    return show_ratio(lookups - min(misses, lookups), lookups, buf);
+}
+
+ssize_t show_clean_segments (struct wlfs_super *wlfs_sb, struct stat_attr *sa,
+                             char *buf) {
+    return snprintf(buf, PAGE_SIZE, "%u\n",
+                    ACCESS_ONCE(wlfs_sb->clean_segments));
+}
+
+ssize_t show_min_clean_segs (struct wlfs_super *wlfs_sb, struct stat_attr *sa,
+                             char *buf) {
+    return snprintf(buf, PAGE_SIZE, "%u\n",
+                    READ_ONCE(wlfs_sb->opts.min_clean_segs));
+}
+
+ssize_t show_target_clean_segs (struct wlfs_super *wlfs_sb,
+                                struct stat_attr *sa, char *buf) {
+    return snprintf(buf, PAGE_SIZE, "%u\n",
+                    READ_ONCE(wlfs_sb->opts.target_clean_segs));
+}
+
+ssize_t show_ratio (__u64 num, __u64 den, char *buf) {
+    if (!den) {
+        return snprintf(buf, PAGE_SIZE, "0.000\n");
+    }
+    __u32 frac;
+    __u64 const whole = div_u64_rem(div64_u64(num * 1000, den), 1000, &frac);
+    return snprintf(buf, PAGE_SIZE, "%llu.%03u\n", (unsigned long long) whole,
+                    frac);
+}
+
+ssize_t stats_show (struct kobject *kobj, struct attribute *attr,
+                    char *buf) {
+    struct wlfs_super *wlfs_sb =
+        container_of(kobj, struct wlfs_super, stats.kobj);
+    struct stat_attr *sa = container_of(attr, struct stat_attr, attr);
+
+    return sa->show(wlfs_sb, sa, buf);
+}
+
+void stats_release (struct kobject *kobj) {
+    struct wlfs_super *wlfs_sb =
+        container_of(kobj, struct wlfs_super, stats.kobj);
+
+    complete(&wlfs_sb->stats.released);
+}
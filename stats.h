@@ -0,0 +1,76 @@
+/*
+ * Per-superblock statistics: counters kept per CPU & summed when read
+ * through /sys/fs/wlfs/<dev>/
+ */
+
+#pragma once
+
+#include <linux/completion.h>
+#include <linux/kobject.h>
+#include <linux/percpu.h>
+#include <linux/types.h>
+
+enum wlfs_stat {
+    // Blocks appended to the log by their owners, & copied by the cleaner
+    STAT_BLOCKS_APPENDED,
+    STAT_BLOCKS_RELOCATED,
+    // Blocks written to the device, summaries & checkpoint regions
+    // included, & the partial segments & whole segments of the log
+    STAT_BLOCKS_WRITTEN,
+    STAT_PARTIALS_WRITTEN,
+    STAT_SEGMENTS_WRITTEN,
+    // Segments the cleaner emptied, its passes, & the wall-clock & CPU time
+    // (ns) they took
+    STAT_SEGMENTS_CLEANED,
+    STAT_CLEANER_PASSES,
+    STAT_CLEANER_NS,
+    STAT_CLEANER_CPU_NS,
+    // Checkpoints committed & time (ns) spent writing them
+    STAT_CHECKPOINTS,
+    STAT_CHECKPOINT_NS,
+    STAT_FSYNCS,
+    STAT_FSYNC_NS,
+    // Inode map lookups, & those which had to read the map block
+    STAT_IMAP_LOOKUPS,
+    STAT_IMAP_MISSES,
+    STAT_MCACHE_HITS,
+    STAT_MCACHE_MISSES,
+    STAT_SEGMENTS_DISCARDED,
+    STAT_DISCARD_RANGES,
+    // Partial segments & blocks replayed at mount, & time (ns) it took
+    STAT_RECOVERED_PARTIALS,
+    STAT_RECOVERED_BLOCKS,
+    STAT_RECOVERY_NS,
+    STAT_COUNT
+};
+
+struct wlfs_stats {
+    // STAT_COUNT counters per CPU
+    __u64 __percpu *counters;
+    // Directory under /sys/fs/wlfs, & completed once sysfs lets go of it
+    struct kobject kobj;
+    struct completion released;
+    bool registered;
+};
+
+// Add to a counter on the current CPU; callers hold a struct wlfs_super
+#define wlfs_stat_add(wlfs_sb, stat, n) \
+    this_cpu_add((wlfs_sb)->stats.counters[stat], (n))
+
+struct wlfs_super;
+
+// Create & remove /sys/fs/wlfs when the module is loaded & unloaded
+int wlfs_stats_init (void);
+void wlfs_stats_exit (void);
+
+// Allocate zeroed counters; call before anything is counted
+int wlfs_stats_alloc (struct wlfs_super *wlfs_sb);
+// Free the counters
+void wlfs_stats_free (struct wlfs_super *wlfs_sb);
+// Publish the counters under /sys/fs/wlfs/<dev>/
+int wlfs_stats_register (struct wlfs_super *wlfs_sb);
+// Remove the sysfs directory, waiting until no reader holds it
+void wlfs_stats_unregister (struct wlfs_super *wlfs_sb);
+
+// Sum a counter over every CPU
+__u64 wlfs_stat_read (struct wlfs_super *wlfs_sb, enum wlfs_stat stat);
@@ -5,10 +5,24 @@
 #include <linux/err.h>
 #include <linux/errno.h>
 #include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/parser.h>
 #include <linux/printk.h>
+#include <linux/seq_file.h>
 #include <linux/string.h>
 #include <linux/time.h>
 
+#include "checkpoint.h"
+#include "cleaner.h"
+#include "dir.h"
+#include "discard.h"
+#include "imap.h"
+#include "inode.h"
+#include "recovery.h"
+#include "segmap.h"
+#include "segment.h"
+#include "stats.h"
 #include "super.h"
 #include "util.h"
 
@@ -16,9 +30,51 @@
 static void wlfs_put_super (struct super_block *sb);
 // Populate the in-memory superblock with data from disk & computed fields
 static int wlfs_fill_super (struct super_block *sb, void *data, int silent);
+// Write buffered log blocks to disk; when waiting, also checkpoint them
+static int wlfs_sync_fs (struct super_block *sb, int wait);
+// Apply the mount options given to remount; those not given keep their
+// current values.  Remounting read-only stops the writers after a final
+// checkpoint, & remounting read-write starts them again
+static int wlfs_remount_fs (struct super_block *sb, int *flags, char *data);
+// List the mount options which differ from the on-disk superblock
+static int wlfs_show_options (struct seq_file *seq, struct dentry *root);
+// Parse comma-separated mount options into opts, which holds the values they
+// override; fails with -EINVAL on unknown options or out of range values
+static int parse_options (struct wlfs_super *wlfs_sb, char *data,
+                          struct wlfs_mount_opts *opts);
+// Commit the recovered state with a checkpoint & start everything which
+// writes to the device: discards, checkpoints, the cleaner & the periodic
+// flush.  Read-only mounts run none of them
+static int start_writers (struct super_block *sb);
+// Write everything buffered & a final checkpoint, then stop the writers
+static void stop_writers (struct super_block *sb);
 
 static struct super_operations const wlfs_super_ops = {
+    .alloc_inode = wlfs_alloc_inode,
+    .destroy_inode = wlfs_destroy_inode,
     .put_super = wlfs_put_super,
+    .sync_fs = wlfs_sync_fs,
+    .remount_fs = wlfs_remount_fs,
+    .show_options = wlfs_show_options,
+};
+
+// Longest flush or checkpoint period a mount option may set, in seconds
+#define MAX_PERIOD (24 * 60 * 60)
+
+enum {
+    OPT_BUFFER_PERIOD,
+    OPT_CHECKPOINT_PERIOD,
+    OPT_MIN_CLEAN_SEGS,
+    OPT_TARGET_CLEAN_SEGS,
+    OPT_ERR
+};
+
+static match_table_t const tokens = {
+    {OPT_BUFFER_PERIOD, "buffer_period=%u"},
+    {OPT_CHECKPOINT_PERIOD, "checkpoint_period=%u"},
+    {OPT_MIN_CLEAN_SEGS, "min_clean_segs=%u"},
+    {OPT_TARGET_CLEAN_SEGS, "target_clean_segs=%u"},
+    {OPT_ERR, NULL}
 };
 
 struct dentry *wlfs_mount (struct file_system_type *type, int flags,
@@ -50,9 +106,17 @@ void wlfs_put_super (struct super_block *sb) {
     printk(KERN_DEBUG "Destroying superblock members\n");
 #endif
     struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    wlfs_stats_unregister(wlfs_sb);
+    if (!(sb->s_flags & MS_RDONLY)) {
+        stop_writers(sb);
+    }
+    wlfs_mcache_destroy(sb);
+    wlfs_segbuf_destroy(sb);
+    wlfs_segmap_free(wlfs_sb);
+    wlfs_imap_free(wlfs_sb);
     kmem_cache_destroy(wlfs_sb->imap_cache);
     kmem_cache_destroy(wlfs_sb->segmap_cache);
-    kmem_cache_destroy(wlfs_sb->segment_cache);
+    wlfs_stats_free(wlfs_sb);
     kfree(wlfs_sb);
 }
 
@@ -70,6 +134,11 @@ int wlfs_fill_super (struct super_block *sb, void *data, int silent) {
     BUG_ON(!bh);
     struct wlfs_super *wlfs_sb = 
         (struct wlfs_super *) kzalloc(sizeof(struct wlfs_super), GFP_NOFS);
+    if (unlikely(!wlfs_sb)) {
+        brelse(bh);
+        ret = -ENOMEM;
+        goto exit;
+    }
     memcpy(&wlfs_sb->meta, bh->b_data, sizeof(struct wlfs_super_meta));
     brelse(bh);
     // Check that the data was read & copied correctly
@@ -77,41 +146,349 @@ int wlfs_fill_super (struct super_block *sb, void *data, int silent) {
 #ifndef NDEBUG
     printk(KERN_DEBUG "Read superblock metadata\n");
 #endif
-    
-    // TODO: read imap, segmap from disk
+    if (unlikely(wlfs_sb->meta.compression >= COMPRESS_CODECS)) {
+        printk(KERN_ERR "Unknown compression codec %u\n",
+               wlfs_sb->meta.compression);
+        ret = -EINVAL;
+        goto fail_caches;
+    }
+    // The workers started below read the tunables, so they're settled first
+    wlfs_sb->opts.buffer_period = wlfs_sb->meta.buffer_period;
+    wlfs_sb->opts.checkpoint_period = wlfs_sb->meta.checkpoint_period;
+    wlfs_sb->opts.min_clean_segs = wlfs_sb->meta.min_clean_segs;
+    wlfs_sb->opts.target_clean_segs = wlfs_sb->meta.target_clean_segs;
+    ret = parse_options(wlfs_sb, (char *) data, &wlfs_sb->opts);
+    if (unlikely(ret)) {
+        goto fail_caches;
+    }
+
+    // Buffer heads can't be larger than a page, so blocks which are larger
+    // are read & written with bios of their own, & buffer heads are only
+    // used to peek at block headers
+    if (unlikely(wlfs_sb->meta.block_size > WLFS_MAX_BLOCK_SIZE ||
+                 !is_power_of_2(wlfs_sb->meta.block_size) ||
+                 !sb_set_blocksize(sb, min_t(__u32, wlfs_sb->meta.block_size,
+                                             PAGE_SIZE)))) {
+        printk(KERN_ERR "Error setting block size to %u\n", 
+               wlfs_sb->meta.block_size);
+        ret = -EINVAL;
+        goto fail_caches;
+    }
+    // Every size derived from the segment map divides by these
+    if (unlikely(!check_segment_blocks(&wlfs_sb->meta))) {
+        printk(KERN_ERR "Invalid segment size %u for %uB blocks\n",
+               wlfs_sb->meta.segment_size, wlfs_sb->meta.block_size);
+        ret = -EINVAL;
+        goto fail_caches;
+    }
+
+    // Map blocks are aligned to their size, so blocks up to a page never
+    // cross one, & larger ones lie in physically contiguous slabs; either
+    // way they can be read directly into
     wlfs_sb->imap_cache = kmem_cache_create(
-        "wlfs_imap_block", wlfs_sb->meta.block_size, 0, 0, NULL);
+        "wlfs_imap_block", wlfs_sb->meta.block_size, 
+        wlfs_sb->meta.block_size, 0, NULL);
     wlfs_sb->segmap_cache = kmem_cache_create(
-        "wlfs_segments_block", wlfs_sb->meta.block_size, 0, 0, NULL);
-    wlfs_sb->segment_cache = kmem_cache_create(
-        "wlfs_segment", sizeof(struct segment), 0, 0, NULL);
+        "wlfs_segments_block", wlfs_sb->meta.block_size, 
+        wlfs_sb->meta.block_size, 0, NULL);
+    if (unlikely(!wlfs_sb->imap_cache || !wlfs_sb->segmap_cache)) {
+        ret = -ENOMEM;
+        goto fail_caches;
+    }
     sb->s_fs_info = wlfs_sb;
+    wlfs_sb->sb = sb;
+    // Recovery is the first thing counted
+    ret = wlfs_stats_alloc(wlfs_sb);
+    if (unlikely(ret)) {
+        printk(KERN_ERR "Error allocating statistics counters\n");
+        goto fail_maps;
+    }
+
+    // Read imap, segmap from disk
+    ret = wlfs_checkpoint_load(sb);
+    if (unlikely(ret)) {
+        printk(KERN_ERR "Error loading inode & segment maps\n");
+        goto fail_maps;
+    }
+    // Replay whatever was written after the checkpoint
+    ret = wlfs_recover(sb);
+    if (unlikely(ret)) {
+        printk(KERN_ERR "Error recovering the log\n");
+        goto fail_maps;
+    }
+    ret = wlfs_mcache_init(sb);
+    if (unlikely(ret)) {
+        printk(KERN_ERR "Error allocating the metadata cache\n");
+        goto fail_maps;
+    }
 
-    // Intialize root inode
-    struct inode *root = new_inode(sb);
-    root->i_ino = ROOT_INODE_INDEX;
-    inode_init_owner(root, NULL, S_IFDIR);
-    root->i_sb = sb;
-    root->i_ctime = root->i_atime = root->i_mtime = CURRENT_TIME;
+    // Open the log for writing
+    ret = wlfs_segbuf_init(sb);
+    if (unlikely(ret)) {
+        printk(KERN_ERR "Error allocating segment buffer\n");
+        goto fail_maps;
+    }
+    // A read-only mount writes nothing, so it also mounts read-only devices
+    if (!(sb->s_flags & MS_RDONLY)) {
+        ret = start_writers(sb);
+        if (unlikely(ret)) {
+            goto fail_segbuf;
+        }
+    }
+
+    // Inodes are allocated through the superblock operations, so they must
+    // be set before the root inode is created
+    sb->s_op = &wlfs_super_ops;
+
+    // Read the root directory, or start with an empty one if no block has
+    // been written for it yet
+    struct inode *root = wlfs_iget(sb, ROOT_INODE_INDEX);
+    if (PTR_ERR(root) == -ENOENT) {
+        root = new_inode(sb);
+        if (unlikely(!root)) {
+            ret = -ENOMEM;
+            goto fail_writers;
+        }
+        root->i_ino = ROOT_INODE_INDEX;
+        inode_init_owner(root, NULL, S_IFDIR);
+        root->i_sb = sb;
+        root->i_ctime = root->i_atime = root->i_mtime = CURRENT_TIME;
+        root->i_op = &wlfs_dir_inode_ops;
+        root->i_fop = &wlfs_dir_ops;
+    } else if (IS_ERR(root)) {
+        printk(KERN_ERR "Error reading the root directory\n");
+        ret = PTR_ERR(root);
+        goto fail_writers;
+    } else if (unlikely(!S_ISDIR(root->i_mode))) {
+        printk(KERN_ERR "Root inode is not a directory\n");
+        iput(root);
+        ret = -EUCLEAN;
+        goto fail_writers;
+    }
     sb->s_root = d_make_root(root);
     if (unlikely(!sb->s_root)) {
         printk(KERN_ERR "Error allocating root inode\n");
         ret = -ENOMEM;
-        goto exit;
+        goto fail_writers;
     }
 
     // Set remaining superblock fields
     sb->s_magic = wlfs_sb->meta.magic;
-    sb->s_op = &wlfs_super_ops;
-    if (unlikely(sb_set_blocksize(sb, wlfs_sb->meta.block_size)) == 0) {
-        printk(KERN_ERR "Error setting block size to %u\n", 
-               wlfs_sb->meta.block_size);
-        ret = -EINVAL;
-        goto exit;
-    }
     sb->s_maxbytes = get_max_bytes(&wlfs_sb->meta);
 
-    ret = 0;
+    // Statistics are best effort; the filesystem works without them
+    if (unlikely(wlfs_stats_register(wlfs_sb))) {
+        printk(KERN_WARNING "Error publishing statistics under sysfs\n");
+    }
+
+    return 0;
+
+    // The superblock is only put once it has a root, so a mount which fails
+    // tears down what it started itself, in reverse
+fail_writers:
+    if (!(sb->s_flags & MS_RDONLY)) {
+        wlfs_cleaner_stop(sb);
+        wlfs_segbuf_stop(sb);
+        wlfs_checkpoint_cancel(sb);
+        wlfs_discard_stop(sb);
+    }
+fail_segbuf:
+    wlfs_segbuf_abort(sb);
+fail_maps:
+    wlfs_mcache_destroy(sb);
+    wlfs_segmap_free(wlfs_sb);
+    wlfs_imap_free(wlfs_sb);
+    wlfs_stats_free(wlfs_sb);
+    sb->s_fs_info = NULL;
+fail_caches:
+    if (wlfs_sb->imap_cache) {
+        kmem_cache_destroy(wlfs_sb->imap_cache);
+    }
+    if (wlfs_sb->segmap_cache) {
+        kmem_cache_destroy(wlfs_sb->segmap_cache);
+    }
+    kfree(wlfs_sb);
 exit:
     return ret;
 }
+
+int wlfs_sync_fs (struct super_block *sb, int wait) {
+    if (wait) {
+        return wlfs_checkpoint_write(sb);
+    }
+    return wlfs_segbuf_flush(sb);
+}
+
+// Each tunable is read on its own, so they are published one at a time; a
+// reader may briefly pair a new min_clean_segs with the old target, which
+// only makes one cleaner pass stop early or late
+int wlfs_remount_fs (struct super_block *sb, int *flags, char *data) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) sb->s_fs_info;
+    struct wlfs_mount_opts opts = wlfs_sb->opts;
+    bool const was_rdonly = sb->s_flags & MS_RDONLY;
+    bool const rdonly = *flags & MS_RDONLY;
+
+    int const ret = parse_options(wlfs_sb, data, &opts);
+    if (unlikely(ret)) {
+        return ret;
+    }
+    bool const buffer_changed =
+        opts.buffer_period != wlfs_sb->opts.buffer_period;
+    bool const checkpoint_changed =
+        opts.checkpoint_period != wlfs_sb->opts.checkpoint_period;
+    WRITE_ONCE(wlfs_sb->opts.buffer_period, opts.buffer_period);
+    WRITE_ONCE(wlfs_sb->opts.checkpoint_period, opts.checkpoint_period);
+    WRITE_ONCE(wlfs_sb->opts.min_clean_segs, opts.min_clean_segs);
+    WRITE_ONCE(wlfs_sb->opts.target_clean_segs, opts.target_clean_segs);
+
+    // The VFS has synced the filesystem & checked that nothing is open for
+    // writing before a remount read-only
+    if (rdonly && !was_rdonly) {
+        stop_writers(sb);
+        return 0;
+    } else if (!rdonly && was_rdonly) {
+        return start_writers(sb);
+    } else if (rdonly) {
+        return 0;
+    }
+
+    // A timer armed with the old period is restarted, so a long period
+    // shortened takes effect now rather than when it next fires
+    if (buffer_changed) {
+        wlfs_segbuf_reschedule(sb);
+    }
+    if (checkpoint_changed) {
+        wlfs_checkpoint_reschedule(sb);
+    }
+    wlfs_cleaner_kick(sb);
+    return 0;
+}
+
+int wlfs_show_options (struct seq_file *seq, struct dentry *root) {
+    struct wlfs_super *wlfs_sb = (struct wlfs_super *) root->d_sb->s_fs_info;
+    struct wlfs_super_meta *meta = &wlfs_sb->meta;
+    struct wlfs_mount_opts opts = {
+        .buffer_period = READ_ONCE(wlfs_sb->opts.buffer_period),
+        .checkpoint_period = READ_ONCE(wlfs_sb->opts.checkpoint_period),
+        .min_clean_segs = READ_ONCE(wlfs_sb->opts.min_clean_segs),
+        .target_clean_segs = READ_ONCE(wlfs_sb->opts.target_clean_segs),
+    };
+
+    if (opts.buffer_period != meta->buffer_period) {
+        seq_printf(seq, ",buffer_period=%u", opts.buffer_period);
+    }
+    if (opts.checkpoint_period != meta->checkpoint_period) {
+        seq_printf(seq, ",checkpoint_period=%u", opts.checkpoint_period);
+    }
+    if (opts.min_clean_segs != meta->min_clean_segs) {
+        seq_printf(seq, ",min_clean_segs=%u", opts.min_clean_segs);
+    }
+    if (opts.target_clean_segs != meta->target_clean_segs) {
+        seq_printf(seq, ",target_clean_segs=%u", opts.target_clean_segs);
+    }
+    return 0;
+}
+
+/*
+ * Helper functions
+ */
+
+int parse_options (struct wlfs_super *wlfs_sb, char *data,
+                   struct wlfs_mount_opts *opts) {
+    substring_t args[MAX_OPT_ARGS];
+    bool cleaning = false;
+    char *p;
+
+    while (data && (p = strsep(&data, ",")) != NULL) {
+        if (!*p) {
+            continue;
+        }
+        int const token = match_token(p, tokens, args);
+        int value;
+        if (token == OPT_ERR || match_int(&args[0], &value) || value < 1) {
+            printk(KERN_ERR "Bad wlfs mount option %s\n", p);
+            return -EINVAL;
+        }
+        switch (token) {
+        case OPT_BUFFER_PERIOD:
+            opts->buffer_period = value;
+            break;
+        case OPT_CHECKPOINT_PERIOD:
+            opts->checkpoint_period = value;
+            break;
+        case OPT_MIN_CLEAN_SEGS:
+            opts->min_clean_segs = value;
+            cleaning = true;
+            break;
+        case OPT_TARGET_CLEAN_SEGS:
+            opts->target_clean_segs = value;
+            cleaning = true;
+            break;
+        }
+    }
+
+    if (opts->buffer_period > MAX_PERIOD ||
+        opts->checkpoint_period > MAX_PERIOD) {
+        printk(KERN_ERR "wlfs periods can be at most %u seconds\n",
+               MAX_PERIOD);
+        return -EINVAL;
+    }
+    // The cleaner must be able to reach its target, & stop once it has.
+    // mkfs-wlfs doesn't check the values it formats with, so they're only
+    // checked when an option changes them
+    if (cleaning && (opts->target_clean_segs < opts->min_clean_segs ||
+                     opts->target_clean_segs >= wlfs_sb->meta.segments)) {
+        printk(KERN_ERR "wlfs needs min_clean_segs (%u) <= target_clean_segs "
+               "(%u) < segments (%u)\n", opts->min_clean_segs,
+               opts->target_clean_segs, wlfs_sb->meta.segments);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int start_writers (struct super_block *sb) {
+    // Checkpoints release segments to the discarder, so it starts first
+    int ret = wlfs_discard_start(sb);
+    if (unlikely(ret)) {
+        printk(KERN_ERR "Error starting the discarder\n");
+        return ret;
+    }
+    ret = wlfs_checkpoint_start(sb);
+    if (unlikely(ret)) {
+        printk(KERN_ERR "Error starting the checkpoint writer\n");
+        goto fail_discard;
+    }
+    // Commit the recovered state under a new mount number before anything
+    // is written, so partial segments left over from earlier mounts can
+    // never be mistaken for new ones
+    ret = wlfs_checkpoint_write(sb);
+    if (unlikely(ret)) {
+        printk(KERN_ERR "Error writing the mount checkpoint\n");
+        goto fail_checkpoint;
+    }
+    ret = wlfs_cleaner_start(sb);
+    if (unlikely(ret)) {
+        printk(KERN_ERR "Error starting the cleaner\n");
+        goto fail_checkpoint;
+    }
+    wlfs_segbuf_start(sb);
+    return 0;
+
+fail_checkpoint:
+    wlfs_checkpoint_cancel(sb);
+fail_discard:
+    wlfs_discard_stop(sb);
+    return ret;
+}
+
+// The cleaner stops first, as it appends; the final checkpoint then covers
+// everything written
+void stop_writers (struct super_block *sb) {
+    wlfs_cleaner_stop(sb);
+    wlfs_segbuf_stop(sb);
+    if (unlikely(wlfs_segbuf_sync(sb))) {
+        printk(KERN_ERR "Failed to flush the segment buffer\n");
+    }
+    wlfs_checkpoint_stop(sb);
+    wlfs_discard_stop(sb);
+}
@@ -6,7 +6,15 @@
 
 #include <linux/fs.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 
+#include "checkpoint.h"
+#include "cleaner.h"
+#include "discard.h"
+#include "mcache.h"
+#include "segmap.h"
+#include "segment.h"
+#include "stats.h"
 #include "wlfs.h"
 
 // Intialize the superblock
@@ -15,11 +23,48 @@ struct dentry *wlfs_mount (struct file_system_type *type, int flags,
 // Free the superblock
 void wlfs_kill_sb (struct super_block *sb);
 
+// Tunables read from the on-disk superblock at mount, overridden by mount
+// options & changeable by remount, so readers use READ_ONCE
+struct wlfs_mount_opts {
+    // Seconds between periodic flushes of the segment buffer & checkpoints
+    unsigned buffer_period;
+    unsigned checkpoint_period;
+    // The cleaner starts below min_clean_segs & stops at target_clean_segs
+    __u32 min_clean_segs;
+    __u32 target_clean_segs;
+};
+
 struct wlfs_super {
+    struct super_block *sb;
     struct wlfs_super_meta meta;
+    struct wlfs_mount_opts opts;
+    // Most recent checkpoint read or written
+    struct checkpoint checkpoint;
     struct inode_map imap;
     struct segment_map segmap;
+    // Map blocks changed since they were last written to the log
+    unsigned long *imap_dirty;
+    unsigned long *segmap_dirty;
+    // Map blocks copied by a checkpoint which may not be on disk yet, & map
+    // blocks looked up since the shrinker's hand last passed them
+    unsigned long *imap_unstable;
+    unsigned long *imap_referenced;
+    // Map blocks in memory, & where the shrinker resumes its sweep
+    atomic_t imap_cached;
+    __u32 imap_hand;
+    // Protects the segment map, segmap_dirty & the segment index
+    spinlock_t segmap_lock;
+    // Number of segments with no live blocks
+    __u32 clean_segments;
+    struct segment_index segindex;
+    // Epoch which newly emptied segments are pinned in
+    __u8 pin_epoch;
+    struct segment_buffer segbuf;
+    struct cleaner cleaner;
+    struct checkpointer checkpointer;
+    struct discarder discard;
     struct kmem_cache *imap_cache;
     struct kmem_cache *segmap_cache;
-    struct kmem_cache *segment_cache;
+    struct meta_cache mcache;
+    struct wlfs_stats stats;
 };
@@ -0,0 +1,176 @@
+/*
+ * Tracepoints for the log, checkpoints, the cleaner, recovery, inode map
+ * lookups & fsync; enable them under /sys/kernel/debug/tracing/events/wlfs.
+ * The tracing machinery reads this header several times, so it's guarded
+ * by hand rather than with #pragma once
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM wlfs
+
+#if !defined(_WLFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _WLFS_TRACE_H
+
+#include <linux/fs.h>
+#include <linux/kdev_t.h>
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+
+// A partial segment was submitted to the device
+TRACE_EVENT(wlfs_segment_flush,
+    TP_PROTO(struct super_block *sb, unsigned stream, __u32 segment,
+             __u32 offset, __u32 nblocks, __u64 seq),
+    TP_ARGS(sb, stream, segment, offset, nblocks, seq),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned, stream)
+        __field(__u32, segment)
+        __field(__u32, offset)
+        __field(__u32, nblocks)
+        __field(__u64, seq)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->stream = stream;
+        __entry->segment = segment;
+        __entry->offset = offset;
+        __entry->nblocks = nblocks;
+        __entry->seq = seq;
+    ),
+    TP_printk("dev %d,%d stream %u segment %u offset %u blocks %u seq %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->stream,
+              __entry->segment, __entry->offset, __entry->nblocks,
+              (unsigned long long) __entry->seq)
+);
+
+// A checkpoint was committed
+TRACE_EVENT(wlfs_checkpoint,
+    TP_PROTO(struct super_block *sb, __u64 generation, unsigned region,
+             __u64 seq, __s64 ns),
+    TP_ARGS(sb, generation, region, seq, ns),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(__u64, generation)
+        __field(unsigned, region)
+        __field(__u64, seq)
+        __field(__s64, ns)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->generation = generation;
+        __entry->region = region;
+        __entry->seq = seq;
+        __entry->ns = ns;
+    ),
+    TP_printk("dev %d,%d generation %llu region %u seq %llu took %lld ns",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              (unsigned long long) __entry->generation, __entry->region,
+              (unsigned long long) __entry->seq, (long long) __entry->ns)
+);
+
+// The cleaner finished a pass
+TRACE_EVENT(wlfs_cleaner_pass,
+    TP_PROTO(struct super_block *sb, __u32 cleaned, __u64 copied,
+             __u32 clean_segments, __s64 ns),
+    TP_ARGS(sb, cleaned, copied, clean_segments, ns),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(__u32, cleaned)
+        __field(__u64, copied)
+        __field(__u32, clean_segments)
+        __field(__s64, ns)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->cleaned = cleaned;
+        __entry->copied = copied;
+        __entry->clean_segments = clean_segments;
+        __entry->ns = ns;
+    ),
+    TP_printk("dev %d,%d cleaned %u segments copying %llu blocks, %u clean, "
+              "took %lld ns", MAJOR(__entry->dev), MINOR(__entry->dev),
+              __entry->cleaned, (unsigned long long) __entry->copied,
+              __entry->clean_segments, (long long) __entry->ns)
+);
+
+// Recovery rolled the log forward from the checkpoint
+TRACE_EVENT(wlfs_recovery,
+    TP_PROTO(struct super_block *sb, __u32 partials, __u64 blocks,
+             __u32 scanned, __s64 ns),
+    TP_ARGS(sb, partials, blocks, scanned, ns),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(__u32, partials)
+        __field(__u64, blocks)
+        __field(__u32, scanned)
+        __field(__s64, ns)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->partials = partials;
+        __entry->blocks = blocks;
+        __entry->scanned = scanned;
+        __entry->ns = ns;
+    ),
+    TP_printk("dev %d,%d replayed %llu blocks in %u partial segments, "
+              "scanning %u segments, took %lld ns",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              (unsigned long long) __entry->blocks, __entry->partials,
+              __entry->scanned, (long long) __entry->ns)
+);
+
+// An inode's block address was looked up; cached is false if the map
+// block had to be read
+TRACE_EVENT(wlfs_imap_lookup,
+    TP_PROTO(struct super_block *sb, __u64 ino, __u64 daddr, bool cached),
+    TP_ARGS(sb, ino, daddr, cached),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(__u64, ino)
+        __field(__u64, daddr)
+        __field(bool, cached)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->ino = ino;
+        __entry->daddr = daddr;
+        __entry->cached = cached;
+    ),
+    TP_printk("dev %d,%d ino %llu daddr %llu %s",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              (unsigned long long) __entry->ino,
+              (unsigned long long) __entry->daddr,
+              __entry->cached ? "cached" : "read")
+);
+
+// An fsync committed the log
+TRACE_EVENT(wlfs_fsync,
+    TP_PROTO(struct super_block *sb, __u64 ino, int ret, __s64 ns),
+    TP_ARGS(sb, ino, ret, ns),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(__u64, ino)
+        __field(int, ret)
+        __field(__s64, ns)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->ino = ino;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+    TP_printk("dev %d,%d ino %llu ret %d took %lld ns",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              (unsigned long long) __entry->ino, __entry->ret,
+              (long long) __entry->ns)
+);
+
+#endif
+
+// The module is built out of tree, so the tracing machinery finds this
+// header through the -I$(src) the Makefile adds for stats.o
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
@@ -1,49 +1,155 @@
+#ifdef __KERNEL__
+#include <linux/crc32c.h>
+#include <linux/stddef.h>
+#include <linux/string.h>
+#else
+#include <stddef.h>
+#include <string.h>
+#endif
+
 #include "util.h"
 
+#ifndef __KERNEL__
+// Castagnoli polynomial, bit-reflected
+#define CRC32C_POLY 0x82f63b78
+// Bytes in each of the three streams checksummed side by side; a power of 2
+#define CRC32C_STRIDE 256
+
+// crc32c a byte at a time through a table, for CPUs without the instruction
+static __u32 crc32c_table (__u32 crc, __u8 const *buf, __u32 len);
+#if defined(__x86_64__)
+// crc32c with the SSE 4.2 crc32 instruction, running three independent
+// streams at once to hide its latency
+static __u32 crc32c_sse42 (__u32 crc, __u8 const *buf, __u32 len);
+#endif
+// Advance a crc over CRC32C_STRIDE zero bytes
+static __u32 crc32c_shift (__u32 crc);
+// Multiply a vector by a matrix over GF(2)
+static __u32 gf2_times (__u32 const *mat, __u32 vec);
+// Square a matrix over GF(2)
+static void gf2_square (__u32 *square, __u32 const *mat);
+#endif
+
 __u16 get_block_bytes (struct wlfs_super_meta *meta) {
     return meta->block_size - sizeof(struct block);
 }
 
 __u16 get_imap_entries (struct wlfs_super_meta *meta) {
-    return get_block_bytes(meta) / sizeof(__kernel_daddr_t);
+    return get_block_bytes(meta) / sizeof(wlfs_daddr_t);
 }
 
 
 __u32 get_imap_blocks (struct wlfs_super_meta *meta) {
-    return meta->inodes / get_imap_entries(meta);
+    __u16 entries = get_imap_entries(meta);
+    return (meta->inodes + entries - 1) / entries;
+}
+
+__u16 get_inode_extents (struct wlfs_super_meta *meta) {
+    return (get_block_bytes(meta) - offsetof(struct wlfs_inode, extents)) / 
+        sizeof(struct extent);
+}
+
+__u16 get_inline_bytes (struct wlfs_super_meta *meta) {
+    return get_block_bytes(meta) - offsetof(struct wlfs_inode, data);
+}
+
+__u16 get_extent_entries (struct wlfs_super_meta *meta) {
+    return get_block_bytes(meta) / sizeof(struct extent);
+}
+
+__u16 get_commit_entries (struct wlfs_super_meta *meta) {
+    return (get_block_bytes(meta) - sizeof(struct commit_record)) /
+        sizeof(wlfs_daddr_t);
+}
+
+// crc32c mixes every byte of the name into the low bits the index uses
+__u32 get_dir_hash (char const *name, __u8 len) {
+    return wlfs_crc32c(0, name, len);
+}
+
+// Hashes are compared first, so most entries are passed over without
+// comparing names
+struct dir_entry *find_dir_entry (void *entries, __u32 bytes, __u32 hash,
+                                  char const *name, __u8 len) {
+    __u32 pos = 0;
+    while (pos < bytes) {
+        struct dir_entry *entry = 
+            (struct dir_entry *) ((__u8 *) entries + pos);
+        if (entry->hash == hash && entry->len == len &&
+            !memcmp(entry->name, name, len)) {
+            return entry;
+        }
+        pos += DIR_ENTRY_SIZE(entry->len);
+    }
+    return NULL;
+}
+
+__u8 get_dir_max_depth (struct wlfs_super_meta *meta) {
+    __u64 const slots = ((__u64) DIR_INDEX_BLOCKS * get_block_bytes(meta) -
+                         sizeof(struct dir_header)) / sizeof(__u32);
+    __u8 depth = 0;
+    while (depth < 31 && (2ULL << depth) <= slots) {
+        ++depth;
+    }
+    return depth;
+}
+
+// Block data is a multiple of the slot size, so slots never straddle blocks
+void get_dir_slot (struct wlfs_super_meta *meta, __u32 slot, __u32 *iblock,
+                   __u16 *offset) {
+    __u64 const pos = sizeof(struct dir_header) + (__u64) slot * sizeof(__u32);
+    *iblock = pos / get_block_bytes(meta);
+    *offset = pos % get_block_bytes(meta);
 }
 
 /*
- * Max file size = block size * (
- *      local block pointers per inode - 
+ * Max blocks = local block pointers per inode - 
  *      indirection +
- *      sum_{i=0}^{indirection} (entries per indirect block)^i)
+ *      sum_{i=1}^{indirection} (entries per indirect block)^i
  */
+__u64 get_tree_max_blocks (struct wlfs_super_meta *meta) {
+    __u64 const block_entries = get_daddr_entries(meta);
+    __u64 blocks = NBLOCK_PTR - meta->indirection;
+    __u64 level = 1;
+
+    int i = 1;
+    for (; i <= meta->indirection && blocks < MAX_FILE_BLOCKS; ++i) {
+        level *= block_entries;
+        blocks += level;
+    }
+
+    return blocks < MAX_FILE_BLOCKS ? blocks : MAX_FILE_BLOCKS;
+}
+
+// Even if every extent holds a single block, the inode's extents fanned out
+// through <indirection> levels of extent blocks map this many blocks
+__u64 get_extent_max_blocks (struct wlfs_super_meta *meta) {
+    __u64 const block_entries = get_extent_entries(meta);
+    __u64 blocks = get_inode_extents(meta);
+
+    int i = 1;
+    for (; i <= meta->indirection && blocks < MAX_FILE_BLOCKS; ++i) {
+        blocks *= block_entries;
+    }
+
+    return blocks < MAX_FILE_BLOCKS ? blocks : MAX_FILE_BLOCKS;
+}
+
+// Each file block holds a block's worth of data after its header
 __u64 get_max_bytes (struct wlfs_super_meta *meta) {
-    __u64 size = NBLOCK_PTR;
-
-    if (meta->indirection < 1) {
-        return size;
-    }
-
-    __u64 block_entries = get_daddr_entries(meta);
-    size = size - meta->indirection + block_entries;
-    int i = 2;
-    for (; i <= meta->indirection; ++i) {
-        __u64 base = block_entries;
-        __u8 exp = i;
-        __u64 result = 1;
-        while (exp)
-        {
-            if (exp & 1)
-                result *= base;
-            exp >>= 1;
-            base *= base;
-        }
+    if (meta->flags & WLFS_FORMAT_EXTENTS) {
+        return get_extent_max_blocks(meta) * get_block_bytes(meta);
     }
-    size *= meta->block_size;
+    return get_tree_max_blocks(meta) * get_block_bytes(meta);
+}
 
-    return size;
+bool check_segment_blocks (struct wlfs_super_meta *meta) {
+    if (meta->block_size == 0 || meta->segment_size % meta->block_size != 0) {
+        return false;
+    }
+    __u32 const blocks = meta->segment_size / meta->block_size;
+    return blocks >= 8 && blocks <= MAX_SEGMENT_BLOCKS && blocks % 8 == 0 &&
+        blocks / 8 <= get_block_bytes(meta);
 }
 
 __u16 get_segmap_bits (struct wlfs_super_meta *meta) {
@@ -55,5 +161,196 @@ __u16 get_segmap_entries (struct wlfs_super_meta *meta) {
 }
 
 __u32 get_segmap_blocks (struct wlfs_super_meta *meta) {
-    return meta->segments / get_segmap_entries(meta);
-}
\ No newline at end of file
+    __u16 entries = get_segmap_entries(meta);
+    return (meta->segments + entries - 1) / entries;
+}
+
+__u64 get_super_daddr (struct wlfs_super_meta *meta) {
+    return WLFS_OFFSET / meta->block_size;
+}
+
+// The two checkpoint regions lie back to back after the superblock
+__u64 get_checkpoint_daddr (struct wlfs_super_meta *meta, unsigned region) {
+    return get_super_daddr(meta) + 1 + region * meta->checkpoint_blocks;
+}
+
+// Addresses of imap & segmap blocks aren't mixed within a checkpoint block
+__u32 get_checkpoint_imap_blocks (struct wlfs_super_meta *meta) {
+    __u16 entries = get_daddr_entries(meta);
+    return (get_imap_blocks(meta) + entries - 1) / entries;
+}
+
+__u32 get_checkpoint_segmap_blocks (struct wlfs_super_meta *meta) {
+    __u16 entries = get_daddr_entries(meta);
+    return (get_segmap_blocks(meta) + entries - 1) / entries;
+}
+
+// The superblock is followed by the checkpoint regions, then the segments
+__u64 get_segment_daddr (struct wlfs_super_meta *meta, __u32 segment) {
+    return get_checkpoint_daddr(meta, CHECKPOINT_REGIONS) + meta->segment_pad +
+        (__u64) segment * get_segmap_bits(meta);
+}
+
+__u32 get_daddr_segment (struct wlfs_super_meta *meta, __u64 daddr) {
+    return (daddr - get_segment_daddr(meta, 0)) / get_segmap_bits(meta);
+}
+
+/*
+ * benefit / cost = (1 - u) * age / (1 + u), where u = live / blocks is the
+ * segment's utilization: cleaning reads the whole segment & writes back the
+ * live fraction to reclaim the dead fraction, and older data is less likely
+ * to die soon on its own.  Scaled by 2^10 to keep precision in integers.
+ */
+__u64 get_clean_score (__u32 live, __u32 blocks, __u64 age) {
+    return ((__u64) (blocks - live) * (age + 1) << 10) / (blocks + live);
+}
+
+#ifdef __KERNEL__
+__u32 wlfs_crc32c (__u32 crc, void const *buf, __u32 len) {
+    return crc32c(crc, buf, len);
+}
+#else
+__u32 wlfs_crc32c (__u32 crc, void const *buf, __u32 len) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_sse42(crc, (__u8 const *) buf, len);
+    }
+#endif
+    return crc32c_table(crc, (__u8 const *) buf, len);
+}
+#endif
+
+__u32 get_block_csum (struct wlfs_super_meta *meta, struct block *blk) {
+    __u32 const h0 = blk->h0.csum;
+    __u32 const h1 = blk->h1.csum;
+
+    blk->h0.csum = blk->h1.csum = 0;
+    __u32 const csum = wlfs_crc32c(WLFS_CSUM_SEED, blk, meta->block_size);
+    blk->h0.csum = h0;
+    blk->h1.csum = h1;
+    return csum;
+}
+
+void set_block_csum (struct wlfs_super_meta *meta, struct block *blk) {
+    if (meta->flags & WLFS_FORMAT_CHECKSUMS) {
+        blk->h0.csum = blk->h1.csum = get_block_csum(meta, blk);
+    }
+}
+
+bool check_block_csum (struct wlfs_super_meta *meta, struct block *blk) {
+    return !(meta->flags & WLFS_FORMAT_CHECKSUMS) ||
+        blk->h0.csum == get_block_csum(meta, blk);
+}
+
+#ifndef __KERNEL__
+/*
+ * Helper functions
+ */
+
+__u32 crc32c_table (__u32 crc, __u8 const *buf, __u32 len) {
+    static __u32 table[256];
+
+    if (!table[1]) {
+        __u32 i = 0;
+        for (; i < 256; ++i) {
+            __u32 entry = i;
+            int bit = 0;
+            for (; bit < 8; ++bit) {
+                entry = entry >> 1 ^ (entry & 1 ? CRC32C_POLY : 0);
+            }
+            table[i] = entry;
+        }
+    }
+    for (; len > 0; --len, ++buf) {
+        crc = crc >> 8 ^ table[(crc ^ *buf) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// crc32c is linear, so the crc of a run is the crc of its first part
+// shifted over the rest, xored with the crc of the rest taken from 0
+__attribute__((target("sse4.2")))
+__u32 crc32c_sse42 (__u32 crc, __u8 const *buf, __u32 len) {
+    __u64 value = crc;
+
+    for (; len >= 3 * CRC32C_STRIDE; len -= 3 * CRC32C_STRIDE) {
+        __u64 second = 0;
+        __u64 third = 0;
+        __u8 const *const end = buf + CRC32C_STRIDE;
+        for (; buf < end; buf += sizeof(__u64)) {
+            __u64 words[3];
+            memcpy(&words[0], buf, sizeof(__u64));
+            memcpy(&words[1], buf + CRC32C_STRIDE, sizeof(__u64));
+            memcpy(&words[2], buf + 2 * CRC32C_STRIDE, sizeof(__u64));
+            value = __builtin_ia32_crc32di(value, words[0]);
+            second = __builtin_ia32_crc32di(second, words[1]);
+            third = __builtin_ia32_crc32di(third, words[2]);
+        }
+        value = crc32c_shift((__u32) value) ^ (__u32) second;
+        value = crc32c_shift((__u32) value) ^ (__u32) third;
+        buf += 2 * CRC32C_STRIDE;
+    }
+    for (; len >= sizeof(__u64); len -= sizeof(__u64)) {
+        __u64 word;
+        memcpy(&word, buf, sizeof(word));
+        value = __builtin_ia32_crc32di(value, word);
+        buf += sizeof(word);
+    }
+    for (; len > 0; --len, ++buf) {
+        value = __builtin_ia32_crc32qi((__u32) value, *buf);
+    }
+    return (__u32) value;
+}
+#endif
+
+// The operator for one zero bit is squared into the one for a byte, then
+// for CRC32C_STRIDE bytes, & tabulated a byte of the crc at a time
+__u32 crc32c_shift (__u32 crc) {
+    static __u32 table[4][256];
+
+    if (!table[0][1]) {
+        __u32 odd[32];
+        __u32 even[32];
+        odd[0] = CRC32C_POLY;
+        unsigned n = 1;
+        for (; n < 32; ++n) {
+            odd[n] = 1U << (n - 1);
+        }
+        // Shifting by 2, 4, then 8 bits is a byte
+        gf2_square(even, odd);
+        gf2_square(odd, even);
+        gf2_square(even, odd);
+        __u32 bytes = 1;
+        for (; bytes < CRC32C_STRIDE; bytes <<= 1) {
+            gf2_square(odd, even);
+            memcpy(even, odd, sizeof(even));
+        }
+        for (n = 0; n < 256; ++n) {
+            unsigned k = 0;
+            for (; k < 4; ++k) {
+                table[k][n] = gf2_times(even, n << (8 * k));
+            }
+        }
+    }
+    return table[0][crc & 0xff] ^ table[1][crc >> 8 & 0xff] ^
+        table[2][crc >> 16 & 0xff] ^ table[3][crc >> 24];
+}
+
+__u32 gf2_times (__u32 const *mat, __u32 vec) {
+    __u32 sum = 0;
+    for (; vec; vec >>= 1, ++mat) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+    }
+    return sum;
+}
+
+void gf2_square (__u32 *square, __u32 const *mat) {
+    unsigned n = 0;
+    for (; n < 32; ++n) {
+        square[n] = gf2_times(mat, mat[n]);
+    }
+}
+#endif
@@ -4,11 +4,21 @@
 
 #pragma once
 
+#ifndef __KERNEL__
+#include <stdbool.h>
+#endif
+
 #include "wlfs.h"
 
+// Initial value of every checksum
+#define WLFS_CSUM_SEED (~0U)
+
 // Number of bytes of data in each block (not including header)
 __u16 get_block_bytes (struct wlfs_super_meta *meta);
 
+// Data following a block's header
+#define get_block_data(blk) ((void *) ((struct block *) (blk) + 1))
+
 // Number of entries (disk addresses) per block
 __u16 get_imap_entries (struct wlfs_super_meta *meta);
 #define get_daddr_entries(m) get_imap_entries(m)
@@ -16,9 +26,55 @@ __u16 get_imap_entries (struct wlfs_super_meta *meta);
 // Number of inode map blocks
 __u32 get_imap_blocks (struct wlfs_super_meta *meta);
 
-// Maximum number of bytes in a file
+// Logical block numbers are 32 bits wide
+#define MAX_FILE_BLOCKS (1ULL << 32)
+
+// Number of extents stored in an inode block
+__u16 get_inode_extents (struct wlfs_super_meta *meta);
+
+// Number of bytes of file data which can be stored inline in an inode block
+__u16 get_inline_bytes (struct wlfs_super_meta *meta);
+
+// Number of extents per extent block
+__u16 get_extent_entries (struct wlfs_super_meta *meta);
+
+// Number of addresses per commit block
+__u16 get_commit_entries (struct wlfs_super_meta *meta);
+
+// Hash of a directory entry's name
+__u32 get_dir_hash (char const *name, __u8 len);
+
+// Find a name among packed directory entries; returns NULL if it isn't there
+struct dir_entry *find_dir_entry (void *entries, __u32 bytes, __u32 hash,
+                                  char const *name, __u8 len);
+
+// Most index bits an indexed directory's hash table can have
+__u8 get_dir_max_depth (struct wlfs_super_meta *meta);
+
+// File block & byte offset within its data of an indexed directory's index
+// slot
+void get_dir_slot (struct wlfs_super_meta *meta, __u32 slot, __u32 *iblock,
+                   __u16 *offset);
+
+// Maximum number of blocks in a file mapped by an indirect block tree
+__u64 get_tree_max_blocks (struct wlfs_super_meta *meta);
+
+// Maximum number of blocks in a file mapped by extents
+__u64 get_extent_max_blocks (struct wlfs_super_meta *meta);
+
+// Maximum number of bytes in a file mapped the way the filesystem was
+// formatted to map new inodes
 __u64 get_max_bytes (struct wlfs_super_meta *meta);
 
+// Most blocks in a segment: live counts are 16 bits wide, & usage bitmaps
+// are whole bytes
+#define MAX_SEGMENT_BLOCKS 65528
+
+// Check that segments hold a whole number of blocks, at least 8 & at most
+// MAX_SEGMENT_BLOCKS & a multiple of 8, & that a segmap block holds at least
+// one usage bitmap; every segmap size is derived from these
+bool check_segment_blocks (struct wlfs_super_meta *meta);
+
 // Number of bits in a segment usage bitmap
 __u16 get_segmap_bits (struct wlfs_super_meta *meta);
 
@@ -27,3 +83,40 @@ __u16 get_segmap_entries (struct wlfs_super_meta *meta);
 
 // Number of segmap blocks
 __u32 get_segmap_blocks (struct wlfs_super_meta *meta);
+
+// Block address of the on-disk superblock
+__u64 get_super_daddr (struct wlfs_super_meta *meta);
+
+// Block address of a checkpoint region (0 or 1)
+__u64 get_checkpoint_daddr (struct wlfs_super_meta *meta, unsigned region);
+
+// Number of checkpoint blocks holding imap block addresses
+__u32 get_checkpoint_imap_blocks (struct wlfs_super_meta *meta);
+
+// Number of checkpoint blocks holding segmap block addresses
+__u32 get_checkpoint_segmap_blocks (struct wlfs_super_meta *meta);
+
+// Block address of the first block in a segment
+__u64 get_segment_daddr (struct wlfs_super_meta *meta, __u32 segment);
+
+// Segment containing a block address; the address must lie within a segment
+__u32 get_daddr_segment (struct wlfs_super_meta *meta, __u64 daddr);
+
+// Cost-benefit cleaning priority of a segment with <live> of its <blocks>
+// blocks live, last written <age> seconds ago; higher is a better victim
+__u64 get_clean_score (__u32 live, __u32 blocks, __u64 age);
+
+// crc32c of len bytes, continuing from crc.  The kernel's implementation &
+// the userspace one both use the CPU's crc32 instruction where there is one
+__u32 wlfs_crc32c (__u32 crc, void const *buf, __u32 len);
+
+// Checksum of a block, taken with the checksums in its headers zeroed
+__u32 get_block_csum (struct wlfs_super_meta *meta, struct block *blk);
+
+// Stamp both headers of a block with its checksum, if the filesystem keeps
+// checksums; the rest of the block must not change afterwards
+void set_block_csum (struct wlfs_super_meta *meta, struct block *blk);
+
+// Check a block against the checksum in its headers; always true if the
+// filesystem doesn't keep checksums
+bool check_block_csum (struct wlfs_super_meta *meta, struct block *blk);
@@ -0,0 +1,1210 @@
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "util.h"
+
+// First inode number used by the workloads
+#define FIRST_INO (ROOT_INODE_INDEX + 1)
+// Blocks per file of the uniform & skewed workloads
+#define FILE_BLOCKS 256
+// Blocks a log file of the append workload grows to before the next starts
+#define LOG_BLOCKS 1024
+// Largest file of the churn workload (blocks)
+#define CHURN_BLOCKS 8
+// Share of the skewed workload's writes (percent) going to the hottest
+// HOT_SHARE percent of its blocks
+#define HOT_WRITES_PCT 90
+#define HOT_SHARE 10
+// Upper bound on the size of a parameter list
+#define MAX_LIST 16
+
+enum workload_kind {
+    WORKLOAD_UNIFORM,
+    WORKLOAD_SKEWED,
+    WORKLOAD_APPEND,
+    WORKLOAD_CHURN,
+    WORKLOAD_TRACE,
+};
+
+enum op_type {
+    OP_WRITE,
+    OP_READ,
+    OP_DELETE,
+    OP_SYNC,
+    OP_FSYNC,
+    // Everything before this is setup, & isn't measured
+    OP_MEASURE,
+    OP_END,
+};
+
+// One step of a workload: a block written or read, a file deleted or made
+// stable, or a write-back of everything buffered
+struct op {
+    enum op_type type;
+    __u64 ino;
+    __u32 block;
+};
+
+// Produces the ops of a workload, deterministically for a given seed
+struct generator {
+    enum workload_kind kind;
+    __u64 rng;
+    unsigned read_pct;
+    __u64 ops;
+    __u64 emitted;
+    // Data blocks the working set may grow to, until it has been set up;
+    // then the data blocks it was set up with
+    __u64 target;
+    __u64 live;
+    bool measuring;
+    // Files of the working set; the churn & append workloads track each
+    // one's size
+    __u32 nfiles;
+    __u32 *sizes;
+    // Setup position
+    __u32 file;
+    __u32 block;
+    // Append workload: ring of log files, oldest to newest
+    __u32 oldest;
+    __u32 newest;
+    // Churn workload: file being rewritten, & the blocks left to write
+    __u32 pending_file;
+    __u32 pending;
+    // Synthetic writes between fsyncs of the file last written, the writes
+    // since the last one, & whether one is due
+    __u64 fsync_ops;
+    __u64 since_fsync;
+    bool fsync_due;
+    __u64 fsync_ino;
+    // Recorded trace, its line number, & whether it has a measure op
+    FILE *trace;
+    unsigned long line;
+    bool marked;
+};
+
+// Latencies (ns) of one kind of op
+struct latencies {
+    __u64 *ns;
+    __u64 n;
+    __u64 cap;
+};
+
+// Outcome of one workload at one fill level
+struct result {
+    char const *workload;
+    unsigned fill;
+    __u64 ops;
+    __u64 user_blocks;
+    __u64 errors;
+    // Error which ended the run early, if any
+    int error;
+    double seconds;
+    struct latencies writes;
+    struct latencies reads;
+    struct latencies fsyncs;
+    // Image parameters, & the image counters over the measured ops
+    struct wlfs_super_meta meta;
+    struct image_stats stats;
+};
+
+// Data structure for holding parsed argp parameters
+struct arguments {
+    char *image;
+    enum workload_kind workloads[MAX_LIST];
+    unsigned nworkloads;
+    unsigned fills[MAX_LIST];
+    unsigned nfills;
+    char *trace;
+    char *record;
+    char *output;
+    bool csv;
+    __u64 ops;
+    __u64 seed;
+    unsigned read_pct;
+    __u64 sync_ops;
+    __u64 fsync_ops;
+    __u64 checkpoint_ops;
+    __u8 min_clean;
+    __u8 target_clean;
+};
+// Return codes
+enum return_code {
+    SUCCESS,
+    IMAGE_ERROR,        // The image couldn't be opened, reset or written
+    INVALID_ARGUMENT,   // An invalid argument was supplied
+    FILE_ERROR,         // Reading a trace or writing results failed
+};
+
+static char const *const workload_names[] = {
+    "uniform", "skewed", "append", "churn", "trace",
+};
+
+// Run one workload at one fill level on a freshly emptied image
+static enum return_code run (struct arguments *arguments,
+                             enum workload_kind kind, unsigned fill,
+                             FILE *record, struct result *result);
+// Empty an image file, keeping everything up to & including its superblock
+static int reset_image (char const *path);
+// Fill an image with files no trace touches, up to a number of live blocks
+static int write_ballast (struct wlfs_image *img, __u64 target, char *buf);
+// Live blocks in an image, metadata included
+static __u64 get_live (struct wlfs_image *img);
+// Carry out one op
+static int do_op (struct wlfs_image *img, struct op *op, char *buf,
+                  struct result *result);
+// Set up a workload's generator for a number of live data blocks
+static int gen_init (struct generator *gen, struct arguments *arguments,
+                     enum workload_kind kind, __u64 target);
+// Produce a workload's next op, ending setup once the image is full enough;
+// returns -EINVAL for a malformed trace
+static int gen_next (struct generator *gen, bool full, struct op *op);
+// Synthetic workloads' steady state
+static void gen_uniform (struct generator *gen, struct op *op);
+static void gen_append (struct generator *gen, struct op *op);
+static void gen_churn (struct generator *gen, struct op *op);
+// Read the next op of a recorded trace
+static int gen_trace (struct generator *gen, struct op *op);
+// Pseudorandom number below n (xorshift64*)
+static __u64 gen_rand (struct generator *gen, __u64 n);
+// Record an op in trace format
+static void record_op (FILE *record, struct op *op);
+// Stamp a data block with what it is, & check a stamp read back
+static void fill_block (char *buf, __u16 bytes, struct op *op);
+static bool check_block (char const *buf, struct op *op);
+// Add a latency
+static int push_latency (struct latencies *lat, __u64 ns);
+// Print a result as a JSON object or a CSV row, on one line
+static void print_json (FILE *out, struct arguments *arguments,
+                        struct result *result);
+static void print_csv (FILE *out, struct arguments *arguments,
+                       struct result *result, bool header);
+// Latency at a percentile (tenths of a percent), in us; sorts the latencies
+static double get_percentile (struct latencies *lat, unsigned permille);
+// Monotonic time (ns)
+static __u64 get_time (void);
+// Parse a comma-separated list of workloads or fill levels
+static bool parse_workloads (char *arg, struct arguments *arguments);
+static bool parse_fills (char *arg, struct arguments *arguments);
+// Argp argument parser
+static error_t parse_opt (int key, char *arg, struct argp_state *state);
+
+// Description of argp keyword parameters
+static struct argp_option options[] = {
+    {"workload", 'w', "list", 0,
+     "Comma-separated synthetic workloads: uniform, skewed, append, churn "
+     "(default: all)"},
+    {"trace", 'T', "file", 0,
+     "Replay a recorded trace instead of synthetic workloads"},
+    {"record", 'R', "file", 0, "Record the ops of every run as a trace"},
+    {"fill", 'f', "list", 0,
+     "Comma-separated fill levels: the share (percent) of the log's blocks "
+     "live, metadata included, once setup is done (default: 50,70,85)"},
+    {"ops", 'n', "num", 0, "Measured ops per run (default: 100000)"},
+    {"seed", 'S', "num", 0, "Seed for the synthetic workloads (default: 1)"},
+    {"reads", 'r', "percent", 0,
+     "Share of synthetic ops which are reads (default: 0)"},
+    {"sync", 'y', "ops", 0,
+     "Write back buffered mappings & inodes every this many ops, standing "
+     "in for the write-back period (default: 1000)"},
+    {"fsync", 'F', "writes", 0,
+     "Sync the file written every this many synthetic writes, committing it "
+     "without a checkpoint (default: never)"},
+    {"checkpoint", 'c', "ops", 0,
+     "Checkpoint every this many ops (default: 10000)"},
+    {"min-clean", 'm', "num", 0,
+     "Override the superblock's clean segment threshold"},
+    {"target-clean", 't', "num", 0,
+     "Override the superblock's clean segment target"},
+    {"output", 'o', "file", 0, "Write results to a file (default: stdout)"},
+    {"csv", 'C', 0, 0, "Write results as CSV rather than JSON lines"},
+    {0},
+};
+// Description of argp positional parameters
+static char args_doc[] = "image";
+static char doc[] =
+    "Replay workloads against a wlfs image file & report throughput, "
+    "latency, write amplification & cleaner overhead.  Every run starts by "
+    "emptying the image, keeping its superblock.\v"
+    "A trace holds one op per line: \"w <inode> <block>\" writes a block, "
+    "\"r <inode> <block>\" reads one, \"d <inode>\" deletes a file, "
+    "\"f <inode>\" makes a file stable, \"s\" writes back everything "
+    "buffered, & \"m\" starts measuring, which "
+    "otherwise starts with the trace.  Lines starting with # are ignored.  "
+    "Before a trace is replayed, the image is filled to the fill level with "
+    "files from inode number inodes/2 up, which traces mustn't touch.";
+
+int main (int argc, char **argv) {
+    struct argp argp = {options, parse_opt, args_doc, doc};
+    struct arguments arguments;
+    memset(&arguments, 0, sizeof(struct arguments));
+    arguments.ops = 100000;
+    arguments.seed = 1;
+    arguments.sync_ops = 1000;
+    arguments.checkpoint_ops = 10000;
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    if (arguments.trace) {
+        arguments.workloads[0] = WORKLOAD_TRACE;
+        arguments.nworkloads = 1;
+    } else if (arguments.nworkloads == 0) {
+        for (; arguments.nworkloads < WORKLOAD_TRACE;
+             ++arguments.nworkloads) {
+            arguments.workloads[arguments.nworkloads] =
+                arguments.nworkloads;
+        }
+    }
+    if (arguments.nfills == 0) {
+        arguments.fills[0] = 50;
+        arguments.fills[1] = 70;
+        arguments.fills[2] = 85;
+        arguments.nfills = 3;
+    }
+
+    FILE *out = stdout;
+    FILE *record = NULL;
+    if (arguments.output && !(out = fopen(arguments.output, "w"))) {
+        perror(arguments.output);
+        return -FILE_ERROR;
+    }
+    if (arguments.record && !(record = fopen(arguments.record, "w"))) {
+        perror(arguments.record);
+        return -FILE_ERROR;
+    }
+
+    enum return_code ret = SUCCESS;
+    bool stop = false;
+    unsigned w = 0;
+    for (; w < arguments.nworkloads && !stop; ++w) {
+        unsigned f = 0;
+        for (; f < arguments.nfills && !stop; ++f) {
+            struct result result;
+            memset(&result, 0, sizeof(struct result));
+            result.workload = workload_names[arguments.workloads[w]];
+            result.fill = arguments.fills[f];
+            enum return_code const err =
+                run(&arguments, arguments.workloads[w], arguments.fills[f],
+                    record, &result);
+            // Running out of space is a result too, & the other runs go on
+            if (err != SUCCESS) {
+                ret = err;
+                stop = result.error != -ENOSPC;
+            }
+            if (err == SUCCESS || !stop) {
+                if (arguments.csv) {
+                    print_csv(out, &arguments, &result, w == 0 && f == 0);
+                } else {
+                    print_json(out, &arguments, &result);
+                }
+                fflush(out);
+            }
+            free(result.writes.ns);
+            free(result.reads.ns);
+            free(result.fsyncs.ns);
+        }
+    }
+
+    if (record) {
+        fclose(record);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    return ret;
+}
+
+/*
+ * Helper functions
+ */
+
+enum return_code run (struct arguments *arguments, enum workload_kind kind,
+                      unsigned fill, FILE *record, struct result *result) {
+    struct wlfs_image img;
+    struct generator gen;
+    struct image_stats start;
+    __u64 start_ns = 0;
+    enum return_code ret = SUCCESS;
+    memset(&start, 0, sizeof(struct image_stats));
+
+    int err = reset_image(arguments->image);
+    if (!err) {
+        err = wlfs_image_open(&img, arguments->image, true);
+    }
+    if (err) {
+        fprintf(stderr, "Resetting %s failed: %s\n", arguments->image,
+                strerror(-err));
+        return -IMAGE_ERROR;
+    }
+    // Cleaning thresholds are policy, so they can be tried out without
+    // reformatting
+    if (arguments->min_clean) {
+        img.meta.min_clean_segs = arguments->min_clean;
+    }
+    if (arguments->target_clean) {
+        img.meta.target_clean_segs = arguments->target_clean;
+    }
+    result->meta = img.meta;
+
+    __u16 const bytes = get_block_bytes(&img.meta);
+    // Live blocks after setup; summaries aren't counted
+    __u64 const target = (__u64) img.meta.segments *
+        (get_segmap_bits(&img.meta) - 1) * fill / 100;
+    char *buf = (char *) malloc(bytes);
+    if (!buf) {
+        ret = -IMAGE_ERROR;
+        goto close;
+    }
+    err = kind == WORKLOAD_TRACE ? write_ballast(&img, target, buf) : 0;
+    if (!err) {
+        err = gen_init(&gen, arguments, kind, target);
+    }
+    if (err) {
+        fprintf(stderr, "Setting up %s at %u%% failed: %s\n",
+                workload_names[kind], fill, strerror(-err));
+        ret = err == -ENOENT ? -FILE_ERROR : -IMAGE_ERROR;
+        goto free;
+    }
+    if (record) {
+        fprintf(record, "# %s at %u%%, seed %llu\n", workload_names[kind],
+                fill, (unsigned long long) arguments->seed);
+    }
+
+    __u64 since_sync = 0;
+    __u64 since_checkpoint = 0;
+    bool measuring = false;
+    while (true) {
+        struct op op;
+        err = gen_next(&gen, !measuring && get_live(&img) >= target, &op);
+        // Traces keep clear of the ballast
+        if (err || (kind == WORKLOAD_TRACE && op.type != OP_SYNC &&
+                    op.ino >= img.meta.inodes / 2)) {
+            fprintf(stderr, "Malformed trace at line %lu\n", gen.line);
+            ret = -FILE_ERROR;
+            err = 0;
+            break;
+        }
+        if (record && op.type != OP_END) {
+            record_op(record, &op);
+        }
+        if (op.type == OP_END) {
+            break;
+        }
+        if (op.type == OP_MEASURE) {
+            // Start from a clean slate
+            err = wlfs_image_checkpoint(&img);
+            if (err) {
+                break;
+            }
+            measuring = true;
+            start = img.stats;
+            start_ns = get_time();
+            since_sync = since_checkpoint = 0;
+            continue;
+        }
+
+        __u64 const op_start = get_time();
+        // The kernel cleans in the background; here the op that finds too
+        // few clean segments pays for it
+        if (wlfs_image_clean_segments(&img) < img.meta.min_clean_segs) {
+            err = wlfs_image_clean(&img);
+            err = err < 0 ? err : 0;
+        }
+        if (!err) {
+            err = do_op(&img, &op, buf, result);
+        }
+        if (!err && op.type != OP_SYNC && ++since_sync >= arguments->sync_ops) {
+            err = wlfs_image_sync(&img);
+            since_sync = 0;
+        }
+        if (!err && ++since_checkpoint >= arguments->checkpoint_ops) {
+            err = wlfs_image_checkpoint(&img);
+            since_checkpoint = 0;
+        }
+        if (err) {
+            break;
+        }
+        if (!measuring) {
+            continue;
+        }
+
+        __u64 const ns = get_time() - op_start;
+        ++result->ops;
+        if (op.type == OP_WRITE) {
+            ++result->user_blocks;
+        }
+        if (op.type == OP_READ) {
+            err = push_latency(&result->reads, ns);
+        } else if (op.type == OP_FSYNC) {
+            err = push_latency(&result->fsyncs, ns);
+        } else if (op.type != OP_SYNC) {
+            err = push_latency(&result->writes, ns);
+        }
+        if (err) {
+            break;
+        }
+    }
+    // Everything written must reach the disk for the counts to be complete
+    if (!err && ret == SUCCESS) {
+        err = wlfs_image_checkpoint(&img);
+    }
+    if (err) {
+        fprintf(stderr, "Running %s at %u%% failed: %s\n",
+                workload_names[kind], fill, strerror(-err));
+        result->error = err;
+        ret = -IMAGE_ERROR;
+    }
+    if (measuring && (ret == SUCCESS || err == -ENOSPC)) {
+        result->seconds = (get_time() - start_ns) / 1e9;
+        result->stats = img.stats;
+        unsigned t = 0;
+        for (; t <= BLOCK_COMMIT; ++t) {
+            result->stats.written[t] -= start.written[t];
+        }
+        result->stats.read -= start.read;
+        result->stats.checkpoints -= start.checkpoints;
+        result->stats.copied -= start.copied;
+        result->stats.cleaned -= start.cleaned;
+        result->stats.clean_ns -= start.clean_ns;
+    }
+
+    if (gen.trace) {
+        fclose(gen.trace);
+    }
+    free(gen.sizes);
+free:
+    free(buf);
+close:
+    err = wlfs_image_close(&img);
+    if (err && ret == SUCCESS) {
+        fprintf(stderr, "Closing %s failed: %s\n", arguments->image,
+                strerror(-err));
+        ret = -IMAGE_ERROR;
+    }
+    return ret;
+}
+
+// Zeroing the rest of the file also wipes stale summaries, so nothing left
+// by an earlier run can be mistaken for part of the log
+int reset_image (char const *path) {
+    size_t const keep = WLFS_OFFSET + sizeof(struct wlfs_super_meta);
+    struct stat st;
+    int ret = 0;
+
+    int const fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return -errno;
+    }
+    char *head = (char *) malloc(keep);
+    if (!head) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        goto exit;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        ret = -EINVAL;
+        goto exit;
+    }
+    if (pread(fd, head, keep, 0) != (ssize_t) keep) {
+        ret = -EIO;
+        goto exit;
+    }
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, st.st_size) < 0) {
+        ret = -errno;
+        goto exit;
+    }
+    if (pwrite(fd, head, keep, 0) != (ssize_t) keep) {
+        ret = -EIO;
+    }
+
+exit:
+    free(head);
+    if (close(fd) < 0 && !ret) {
+        ret = -errno;
+    }
+    return ret;
+}
+
+int write_ballast (struct wlfs_image *img, __u64 target, char *buf) {
+    struct op op = {OP_WRITE, img->meta.inodes / 2, 0};
+
+    while (get_live(img) < target) {
+        if (op.block == FILE_BLOCKS) {
+            ++op.ino;
+            op.block = 0;
+        }
+        if (op.ino >= img->meta.inodes) {
+            return -ENOSPC;
+        }
+        if (wlfs_image_clean_segments(img) < img->meta.min_clean_segs) {
+            int const ret = wlfs_image_clean(img);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        fill_block(buf, get_block_bytes(&img->meta), &op);
+        int const ret = wlfs_image_write_data(img, op.ino, op.block, buf);
+        if (ret) {
+            return ret;
+        }
+        ++op.block;
+    }
+    return wlfs_image_checkpoint(img);
+}
+
+__u64 get_live (struct wlfs_image *img) {
+    __u64 live = 0;
+
+    __u32 segment = 0;
+    for (; segment < img->meta.segments; ++segment) {
+        live += img->live[segment];
+    }
+    return live;
+}
+
+int do_op (struct wlfs_image *img, struct op *op, char *buf,
+           struct result *result) {
+    int ret;
+
+    switch (op->type) {
+    case OP_WRITE:
+        fill_block(buf, get_block_bytes(&img->meta), op);
+        return wlfs_image_write_data(img, op->ino, op->block, buf);
+
+    case OP_READ:
+        ret = wlfs_image_read_data(img, op->ino, op->block, buf);
+        // Reading what was never written is the trace's doing, not the
+        // image's
+        if (ret == -ENOENT) {
+            return 0;
+        }
+        if (!ret && !check_block(buf, op)) {
+            ++result->errors;
+        }
+        return ret;
+
+    case OP_DELETE:
+        ret = wlfs_image_remove(img, op->ino);
+        return ret == -ENOENT ? 0 : ret;
+
+    case OP_SYNC:
+        return wlfs_image_sync(img);
+
+    case OP_FSYNC:
+        return wlfs_image_fsync(img, &op->ino, 1);
+
+    default:
+        return 0;
+    }
+}
+
+int gen_init (struct generator *gen, struct arguments *arguments,
+              enum workload_kind kind, __u64 target) {
+    memset(gen, 0, sizeof(struct generator));
+    gen->kind = kind;
+    // xorshift can't start from 0
+    gen->rng = arguments->seed ^ 0x9e3779b97f4a7c15ULL;
+    gen->read_pct = arguments->read_pct;
+    gen->ops = arguments->ops;
+    gen->fsync_ops = arguments->fsync_ops;
+    gen->target = target ? target : 1;
+
+    switch (kind) {
+    case WORKLOAD_UNIFORM:
+    case WORKLOAD_SKEWED:
+        gen->nfiles = (gen->target + FILE_BLOCKS - 1) / FILE_BLOCKS;
+        break;
+
+    case WORKLOAD_APPEND:
+        // Logs are deleted once the newest pushes the total over the
+        // target, so this many are live at most
+        gen->nfiles = gen->target / LOG_BLOCKS + 2;
+        break;
+
+    case WORKLOAD_CHURN:
+        gen->nfiles = gen->target;
+        break;
+
+    case WORKLOAD_TRACE:
+        gen->trace = fopen(arguments->trace, "r");
+        if (!gen->trace) {
+            return -ENOENT;
+        }
+        char line[128];
+        while (!gen->marked && fgets(line, sizeof(line), gen->trace)) {
+            gen->marked = !strcmp(line, "m\n");
+        }
+        rewind(gen->trace);
+        return 0;
+    }
+    gen->sizes = (__u32 *) calloc(gen->nfiles, sizeof(__u32));
+    return gen->sizes ? 0 : -ENOMEM;
+}
+
+// Setup writes the working set block by block, then measuring starts
+int gen_next (struct generator *gen, bool full, struct op *op) {
+    op->ino = 0;
+    op->block = 0;
+    if (gen->kind == WORKLOAD_TRACE) {
+        return gen_trace(gen, op);
+    }
+
+    if (!gen->measuring) {
+        // Churn files are created whole, as many as it takes
+        if ((full || gen->live >= gen->target) && gen->block == 0) {
+            if (gen->kind == WORKLOAD_CHURN) {
+                gen->nfiles = gen->file;
+            }
+            gen->target = gen->live;
+            gen->measuring = true;
+            op->type = OP_MEASURE;
+            return 0;
+        }
+        op->type = OP_WRITE;
+        switch (gen->kind) {
+        case WORKLOAD_CHURN:
+            if (gen->block == 0) {
+                gen->sizes[gen->file] = 1 + gen_rand(gen, CHURN_BLOCKS);
+            }
+            op->ino = FIRST_INO + gen->file;
+            op->block = gen->block;
+            if (++gen->block == gen->sizes[gen->file]) {
+                ++gen->file;
+                gen->block = 0;
+            }
+            break;
+
+        case WORKLOAD_APPEND:
+            op->ino = FIRST_INO + gen->newest;
+            op->block = gen->sizes[gen->newest]++;
+            if (gen->sizes[gen->newest] == LOG_BLOCKS) {
+                gen->newest = (gen->newest + 1) % gen->nfiles;
+            }
+            break;
+
+        default:
+            op->ino = FIRST_INO + gen->live / FILE_BLOCKS;
+            op->block = gen->live % FILE_BLOCKS;
+            break;
+        }
+        ++gen->live;
+        return 0;
+    }
+
+    if (gen->fsync_due) {
+        gen->fsync_due = false;
+        op->type = OP_FSYNC;
+        op->ino = gen->fsync_ino;
+        return 0;
+    }
+    if (gen->emitted == gen->ops) {
+        op->type = OP_END;
+        return 0;
+    }
+    ++gen->emitted;
+    switch (gen->kind) {
+    case WORKLOAD_APPEND:
+        gen_append(gen, op);
+        break;
+    case WORKLOAD_CHURN:
+        gen_churn(gen, op);
+        break;
+    default:
+        gen_uniform(gen, op);
+        break;
+    }
+    // Fsyncs follow the writes they commit, on top of the measured ops
+    if (gen->fsync_ops && op->type == OP_WRITE &&
+        ++gen->since_fsync == gen->fsync_ops) {
+        gen->since_fsync = 0;
+        gen->fsync_due = true;
+        gen->fsync_ino = op->ino;
+    }
+    return 0;
+}
+
+// The skewed workload sends most writes to the blocks of the first files
+void gen_uniform (struct generator *gen, struct op *op) {
+    __u64 const hot = gen->target * HOT_SHARE / 100;
+    __u64 index;
+
+    op->type = gen_rand(gen, 100) < gen->read_pct ? OP_READ : OP_WRITE;
+    if (gen->kind == WORKLOAD_SKEWED && op->type == OP_WRITE && hot) {
+        index = gen_rand(gen, 100) < HOT_WRITES_PCT ? gen_rand(gen, hot) :
+            hot + gen_rand(gen, gen->target - hot);
+    } else {
+        index = gen_rand(gen, gen->target);
+    }
+    op->ino = FIRST_INO + index / FILE_BLOCKS;
+    op->block = index % FILE_BLOCKS;
+}
+
+// Writes append to the newest log; once the logs hold more than the
+// target, the oldest is deleted
+void gen_append (struct generator *gen, struct op *op) {
+    if (gen->live > gen->target && gen->oldest != gen->newest) {
+        op->type = OP_DELETE;
+        op->ino = FIRST_INO + gen->oldest;
+        gen->live -= gen->sizes[gen->oldest];
+        gen->sizes[gen->oldest] = 0;
+        gen->oldest = (gen->oldest + 1) % gen->nfiles;
+        return;
+    }
+
+    if (gen_rand(gen, 100) < gen->read_pct) {
+        __u32 const logs =
+            (gen->newest + gen->nfiles - gen->oldest) % gen->nfiles + 1;
+        __u32 const log = (gen->oldest + gen_rand(gen, logs)) % gen->nfiles;
+        if (gen->sizes[log]) {
+            op->type = OP_READ;
+            op->ino = FIRST_INO + log;
+            op->block = gen_rand(gen, gen->sizes[log]);
+            return;
+        }
+    }
+    op->type = OP_WRITE;
+    op->ino = FIRST_INO + gen->newest;
+    op->block = gen->sizes[gen->newest]++;
+    ++gen->live;
+    if (gen->sizes[gen->newest] == LOG_BLOCKS) {
+        gen->newest = (gen->newest + 1) % gen->nfiles;
+    }
+}
+
+// A file is deleted & written again from scratch with a new size; reads
+// pick any other file
+void gen_churn (struct generator *gen, struct op *op) {
+    if (gen->pending) {
+        op->type = OP_WRITE;
+        op->ino = FIRST_INO + gen->pending_file;
+        op->block = gen->sizes[gen->pending_file] - gen->pending--;
+        return;
+    }
+
+    __u32 const file = gen_rand(gen, gen->nfiles);
+    if (gen_rand(gen, 100) < gen->read_pct) {
+        op->type = OP_READ;
+        op->ino = FIRST_INO + file;
+        op->block = gen_rand(gen, gen->sizes[file]);
+        return;
+    }
+    op->type = OP_DELETE;
+    op->ino = FIRST_INO + file;
+    gen->pending_file = file;
+    gen->pending = gen->sizes[file] = 1 + gen_rand(gen, CHURN_BLOCKS);
+}
+
+int gen_trace (struct generator *gen, struct op *op) {
+    char line[128];
+
+    // A trace without a measure op is measured whole
+    if (!gen->measuring && !gen->marked) {
+        gen->measuring = true;
+        op->type = OP_MEASURE;
+        return 0;
+    }
+    while (fgets(line, sizeof(line), gen->trace)) {
+        unsigned long long ino;
+        unsigned block;
+        char c;
+
+        ++gen->line;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (sscanf(line, "w %llu %u %c", &ino, &block, &c) == 2) {
+            op->type = OP_WRITE;
+        } else if (sscanf(line, "r %llu %u %c", &ino, &block, &c) == 2) {
+            op->type = OP_READ;
+        } else if (sscanf(line, "d %llu %c", &ino, &c) == 1) {
+            op->type = OP_DELETE;
+            block = 0;
+        } else if (sscanf(line, "f %llu %c", &ino, &c) == 1) {
+            op->type = OP_FSYNC;
+            block = 0;
+        } else if (!strcmp(line, "s\n")) {
+            op->type = OP_SYNC;
+            ino = block = 0;
+        } else if (!strcmp(line, "m\n") && !gen->measuring) {
+            op->type = OP_MEASURE;
+            gen->measuring = true;
+            return 0;
+        } else {
+            return -EINVAL;
+        }
+        op->ino = ino;
+        op->block = block;
+        return 0;
+    }
+    op->type = OP_END;
+    return 0;
+}
+
+__u64 gen_rand (struct generator *gen, __u64 n) {
+    gen->rng ^= gen->rng >> 12;
+    gen->rng ^= gen->rng << 25;
+    gen->rng ^= gen->rng >> 27;
+    return n ? (gen->rng * 0x2545f4914f6cdd1dULL) % n : 0;
+}
+
+void record_op (FILE *record, struct op *op) {
+    switch (op->type) {
+    case OP_WRITE:
+        fprintf(record, "w %llu %u\n", (unsigned long long) op->ino,
+                op->block);
+        break;
+    case OP_READ:
+        fprintf(record, "r %llu %u\n", (unsigned long long) op->ino,
+                op->block);
+        break;
+    case OP_DELETE:
+        fprintf(record, "d %llu\n", (unsigned long long) op->ino);
+        break;
+    case OP_FSYNC:
+        fprintf(record, "f %llu\n", (unsigned long long) op->ino);
+        break;
+    case OP_SYNC:
+        fputs("s\n", record);
+        break;
+    case OP_MEASURE:
+        fputs("m\n", record);
+        break;
+    default:
+        break;
+    }
+}
+
+void fill_block (char *buf, __u16 bytes, struct op *op) {
+    memset(buf, (int) (op->ino + op->block), bytes);
+    memcpy(buf, &op->ino, sizeof(__u64));
+    memcpy(buf + sizeof(__u64), &op->block, sizeof(__u32));
+}
+
+// Holes read as zeros; anything else must carry the stamp of the block
+bool check_block (char const *buf, struct op *op) {
+    __u64 ino;
+    __u32 block;
+
+    memcpy(&ino, buf, sizeof(__u64));
+    memcpy(&block, buf + sizeof(__u64), sizeof(__u32));
+    return (ino == 0 && block == 0) || (ino == op->ino && block == op->block);
+}
+
+int push_latency (struct latencies *lat, __u64 ns) {
+    if (lat->n == lat->cap) {
+        __u64 const cap = lat->cap ? lat->cap * 2 : 4096;
+        __u64 *buf = (__u64 *) realloc(lat->ns, cap * sizeof(__u64));
+        if (!buf) {
+            return -ENOMEM;
+        }
+        lat->ns = buf;
+        lat->cap = cap;
+    }
+    lat->ns[lat->n++] = ns;
+    return 0;
+}
+
+void print_json (FILE *out, struct arguments *arguments,
+                 struct result *result) {
+    struct wlfs_super_meta *meta = &result->meta;
+    struct image_stats *stats = &result->stats;
+    static unsigned const permille[] = {500, 900, 990, 999, 1000};
+    static char const *const names[] = {"p50", "p90", "p99", "p999", "max"};
+    struct latencies *lats[] = {&result->writes, &result->reads,
+                                &result->fsyncs};
+    static char const *const lat_names[] = {"write_us", "read_us",
+                                            "fsync_us"};
+    __u16 const bytes = get_block_bytes(meta);
+
+    __u64 device = 0;
+    unsigned t = 0;
+    for (; t <= BLOCK_COMMIT; ++t) {
+        device += stats->written[t];
+    }
+    fprintf(out, "{\"workload\":\"%s\",\"fill\":%u,\"status\":\"%s\","
+            "\"seed\":%llu,"
+            "\"block_size\":%u,\"segment_size\":%u,\"segments\":%u,"
+            "\"mapping\":\"%s\",\"checksums\":\"%s\","
+            "\"compression\":\"%s\",\"ops\":%llu,\"seconds\":%.6f,"
+            "\"ops_per_sec\":%.1f,\"user_mib_per_sec\":%.3f,",
+            result->workload, result->fill,
+            result->error ? strerror(-result->error) : "ok",
+            (unsigned long long) arguments->seed, meta->block_size,
+            meta->segment_size, meta->segments,
+            meta->flags & WLFS_FORMAT_EXTENTS ? "extents" : "tree",
+            meta->flags & WLFS_FORMAT_CHECKSUMS ? "crc32c" : "none",
+            meta->compression == COMPRESS_LZ4 ? "lz4" : "none",
+            (unsigned long long) result->ops, result->seconds,
+            result->seconds ? result->ops / result->seconds : 0,
+            result->seconds ? result->user_blocks * bytes /
+            result->seconds / (1 << 20) : 0);
+    unsigned l = 0;
+    for (; l < 3; ++l) {
+        fprintf(out, "\"%s\":{\"count\":%llu", lat_names[l],
+                (unsigned long long) lats[l]->n);
+        unsigned p = 0;
+        for (; p < sizeof(permille) / sizeof(permille[0]); ++p) {
+            fprintf(out, ",\"%s\":%.3f", names[p],
+                    get_percentile(lats[l], permille[p]));
+        }
+        fputs("},", out);
+    }
+    fprintf(out, "\"user_blocks\":%llu,\"device_blocks\":%llu,"
+            "\"write_amplification\":%.4f,\"written\":{\"data\":%llu,"
+            "\"inode\":%llu,\"indirect\":%llu,\"imap\":%llu,\"segmap\":%llu,"
+            "\"summary\":%llu,\"checkpoint\":%llu,\"commit\":%llu},"
+            "\"read_blocks\":%llu,"
+            "\"checkpoints\":%llu,\"cleaner\":{\"segments\":%llu,"
+            "\"copied\":%llu,\"seconds\":%.6f,\"time_share\":%.4f},"
+            "\"errors\":%llu}\n",
+            (unsigned long long) result->user_blocks,
+            (unsigned long long) device,
+            result->user_blocks ? (double) device / result->user_blocks : 0,
+            (unsigned long long) stats->written[BLOCK_DATA],
+            (unsigned long long) stats->written[BLOCK_INODE],
+            (unsigned long long) stats->written[BLOCK_INDIRECT],
+            (unsigned long long) stats->written[BLOCK_IMAP],
+            (unsigned long long) stats->written[BLOCK_SEGMAP],
+            (unsigned long long) stats->written[BLOCK_SUMMARY],
+            (unsigned long long) stats->written[BLOCK_CHECKPOINT],
+            (unsigned long long) stats->written[BLOCK_COMMIT],
+            (unsigned long long) stats->read,
+            (unsigned long long) stats->checkpoints,
+            (unsigned long long) stats->cleaned,
+            (unsigned long long) stats->copied, stats->clean_ns / 1e9,
+            result->seconds ? stats->clean_ns / 1e9 / result->seconds : 0,
+            (unsigned long long) result->errors);
+}
+
+void print_csv (FILE *out, struct arguments *arguments,
+                struct result *result, bool header) {
+    struct wlfs_super_meta *meta = &result->meta;
+    struct image_stats *stats = &result->stats;
+    static unsigned const permille[] = {500, 900, 990, 999, 1000};
+    __u16 const bytes = get_block_bytes(meta);
+
+    if (header) {
+        fputs("workload,fill,status,seed,block_size,segment_size,segments,"
+              "mapping,checksums,compression,ops,seconds,ops_per_sec,"
+              "user_mib_per_sec,"
+              "write_count,write_p50_us,write_p90_us,write_p99_us,"
+              "write_p999_us,write_max_us,"
+              "read_count,read_p50_us,read_p90_us,read_p99_us,"
+              "read_p999_us,read_max_us,"
+              "fsync_count,fsync_p50_us,fsync_p90_us,fsync_p99_us,"
+              "fsync_p999_us,fsync_max_us,"
+              "user_blocks,device_blocks,write_amplification,"
+              "data,inode,indirect,imap,segmap,summary,checkpoint,commit,"
+              "read_blocks,checkpoints,cleaned_segments,cleaner_copied,"
+              "cleaner_seconds,cleaner_time_share,errors\n", out);
+    }
+
+    __u64 device = 0;
+    unsigned t = 0;
+    for (; t <= BLOCK_COMMIT; ++t) {
+        device += stats->written[t];
+    }
+    fprintf(out, "%s,%u,%s,%llu,%u,%u,%u,%s,%s,%s,%llu,%.6f,%.1f,%.3f",
+            result->workload, result->fill,
+            result->error ? strerror(-result->error) : "ok",
+            (unsigned long long) arguments->seed, meta->block_size,
+            meta->segment_size, meta->segments,
+            meta->flags & WLFS_FORMAT_EXTENTS ? "extents" : "tree",
+            meta->flags & WLFS_FORMAT_CHECKSUMS ? "crc32c" : "none",
+            meta->compression == COMPRESS_LZ4 ? "lz4" : "none",
+            (unsigned long long) result->ops, result->seconds,
+            result->seconds ? result->ops / result->seconds : 0,
+            result->seconds ? result->user_blocks * bytes /
+            result->seconds / (1 << 20) : 0);
+    struct latencies *lats[] = {&result->writes, &result->reads,
+                                &result->fsyncs};
+    unsigned l = 0;
+    for (; l < 3; ++l) {
+        fprintf(out, ",%llu", (unsigned long long) lats[l]->n);
+        unsigned p = 0;
+        for (; p < sizeof(permille) / sizeof(permille[0]); ++p) {
+            fprintf(out, ",%.3f", get_percentile(lats[l], permille[p]));
+        }
+    }
+    fprintf(out, ",%llu,%llu,%.4f", (unsigned long long) result->user_blocks,
+            (unsigned long long) device,
+            result->user_blocks ? (double) device / result->user_blocks : 0);
+    for (t = BLOCK_DATA; t <= BLOCK_COMMIT; ++t) {
+        fprintf(out, ",%llu", (unsigned long long) stats->written[t]);
+    }
+    fprintf(out, ",%llu,%llu,%llu,%llu,%.6f,%.4f,%llu\n",
+            (unsigned long long) stats->read,
+            (unsigned long long) stats->checkpoints,
+            (unsigned long long) stats->cleaned,
+            (unsigned long long) stats->copied, stats->clean_ns / 1e9,
+            result->seconds ? stats->clean_ns / 1e9 / result->seconds : 0,
+            (unsigned long long) result->errors);
+}
+
+static int compare_ns (void const *a, void const *b) {
+    __u64 const x = *(__u64 const *) a;
+    __u64 const y = *(__u64 const *) b;
+    return x < y ? -1 : x > y;
+}
+
+double get_percentile (struct latencies *lat, unsigned permille) {
+    if (lat->n == 0) {
+        return 0;
+    }
+    qsort(lat->ns, lat->n, sizeof(__u64), compare_ns);
+    return lat->ns[(lat->n - 1) * permille / 1000] / 1e3;
+}
+
+__u64 get_time (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool parse_workloads (char *arg, struct arguments *arguments) {
+    char *name = strtok(arg, ",");
+    for (; name; name = strtok(NULL, ",")) {
+        enum workload_kind kind = WORKLOAD_UNIFORM;
+        while (kind < WORKLOAD_TRACE && strcmp(name, workload_names[kind])) {
+            ++kind;
+        }
+        if (kind == WORKLOAD_TRACE || arguments->nworkloads == MAX_LIST) {
+            return false;
+        }
+        arguments->workloads[arguments->nworkloads++] = kind;
+    }
+    return arguments->nworkloads > 0;
+}
+
+bool parse_fills (char *arg, struct arguments *arguments) {
+    char *level = strtok(arg, ",");
+    for (; level; level = strtok(NULL, ",")) {
+        char *end;
+        unsigned long const value = strtoul(level, &end, 10);
+        if (*end || value >= 100 || arguments->nfills == MAX_LIST) {
+            return false;
+        }
+        arguments->fills[arguments->nfills++] = value;
+    }
+    return arguments->nfills > 0;
+}
+
+error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    struct arguments *arguments = (struct arguments *) state->input;
+    __u64 value = 0;
+    if (arg && key != ARGP_KEY_ARG && strchr("nSryFcmt", key)) {
+        char *end;
+        value = strtoull(arg, &end, 0);
+        if (*end) {
+            argp_error(state, "Invalid number %s", arg);
+        }
+    }
+
+    switch (key) {
+    case 'w':
+        if (!parse_workloads(arg, arguments)) {
+            argp_error(state, "Invalid workload list");
+        }
+        break;
+
+    case 'T':
+        arguments->trace = arg;
+        break;
+
+    case 'R':
+        arguments->record = arg;
+        break;
+
+    case 'f':
+        if (!parse_fills(arg, arguments)) {
+            argp_error(state, "Fill levels must be percentages below 100");
+        }
+        break;
+
+    case 'n':
+        arguments->ops = value;
+        break;
+
+    case 'S':
+        arguments->seed = value;
+        break;
+
+    case 'r':
+        if (value > 100) {
+            argp_error(state, "Read share of %llu%% is too large", value);
+        }
+        arguments->read_pct = value;
+        break;
+
+    case 'y':
+        if (value < 1) {
+            argp_error(state, "Sync interval must be at least one op");
+        }
+        arguments->sync_ops = value;
+        break;
+
+    case 'F':
+        arguments->fsync_ops = value;
+        break;
+
+    case 'c':
+        if (value < 1) {
+            argp_error(state, "Checkpoint interval must be at least one op");
+        }
+        arguments->checkpoint_ops = value;
+        break;
+
+    case 'm':
+        if (value < 1 || value > 0xff) {
+            argp_error(state, "Clean segment threshold must be 1-255");
+        }
+        arguments->min_clean = value;
+        break;
+
+    case 't':
+        if (value < 1 || value > 0xff) {
+            argp_error(state, "Clean segment target must be 1-255");
+        }
+        arguments->target_clean = value;
+        break;
+
+    case 'o':
+        arguments->output = arg;
+        break;
+
+    case 'C':
+        arguments->csv = true;
+        break;
+
+    case ARGP_KEY_ARG:
+        if (state->arg_num > 0) {
+            argp_usage(state);
+        }
+        arguments->image = arg;
+        break;
+
+    case ARGP_KEY_END:
+        if (state->arg_num < 1) {
+            argp_usage(state);
+        }
+        if (arguments->trace && arguments->nworkloads) {
+            argp_error(state, "A trace replaces the synthetic workloads");
+        }
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
@@ -0,0 +1,380 @@
+#include <argp.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "util.h"
+
+// Data structure for holding parsed argp parameters
+struct arguments {
+    char *image;
+    char *command;
+    __u64 ino;
+    bool has_ino;
+    // Directory entry name, & the inode a new entry refers to
+    char *name;
+    __u64 target;
+    bool has_target;
+};
+// Return codes
+enum return_code {
+    SUCCESS,
+    IMAGE_ERROR,        // The image couldn't be opened or is corrupt
+    INVALID_ARGUMENT,   // An invalid argument was supplied
+    FILE_ERROR,         // Reading or writing a file failed
+};
+
+// Print the superblock, checkpoint & log heads
+static enum return_code do_info (struct wlfs_image *img);
+// List every inode which has a block
+static enum return_code do_ls (struct wlfs_image *img);
+// Copy a file to stdout
+static enum return_code do_read (struct wlfs_image *img, __u64 ino);
+// Replace a file with stdin
+static enum return_code do_write (struct wlfs_image *img, __u64 ino);
+// Delete a file
+static enum return_code do_rm (struct wlfs_image *img, __u64 ino);
+// Create an empty directory
+static enum return_code do_mkdir (struct wlfs_image *img, __u64 ino);
+// List a directory's entries
+static enum return_code do_readdir (struct wlfs_image *img, __u64 dir);
+// Print the inode a name in a directory refers to
+static enum return_code do_lookup (struct wlfs_image *img, __u64 dir,
+                                   char const *name);
+// Add a name for an inode to a directory
+static enum return_code do_link (struct wlfs_image *img, __u64 dir,
+                                 char const *name, __u64 ino);
+// Remove a name from a directory
+static enum return_code do_unlink (struct wlfs_image *img, __u64 dir,
+                                   char const *name);
+// Discard the clean segments
+static enum return_code do_trim (struct wlfs_image *img);
+// Readdir callback printing an entry
+static int print_entry (struct wlfs_image *img, struct dir_entry const *entry,
+                        void *arg);
+// Parse an inode number argument
+static __u64 parse_ino (char *arg, struct argp_state *state);
+// Argp argument parser
+static error_t parse_opt (int key, char *arg, struct argp_state *state);
+
+// Description of argp positional parameters
+static char args_doc[] = "image info|ls|trim\n"
+                         "image read|write|rm|mkdir|readdir inode\n"
+                         "image lookup|unlink directory name\n"
+                         "image link directory name inode";
+static char doc[] =
+    "Inspect & modify a wlfs image without mounting it; write reads the new "
+    "contents from stdin, & read writes them to stdout";
+
+int main (int argc, char **argv) {
+    struct argp argp = {NULL, parse_opt, args_doc, doc};
+    struct arguments arguments;
+    memset(&arguments, 0, sizeof(struct arguments));
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    bool const writable = !strcmp(arguments.command, "write") ||
+        !strcmp(arguments.command, "rm") ||
+        !strcmp(arguments.command, "mkdir") ||
+        !strcmp(arguments.command, "link") ||
+        !strcmp(arguments.command, "unlink") ||
+        !strcmp(arguments.command, "trim");
+    struct wlfs_image img;
+    int err = wlfs_image_open(&img, arguments.image, writable);
+    if (err) {
+        fprintf(stderr, "Opening %s failed: %s\n", arguments.image,
+                strerror(-err));
+        return -IMAGE_ERROR;
+    }
+
+    enum return_code ret;
+    if (!strcmp(arguments.command, "info")) {
+        ret = do_info(&img);
+    } else if (!strcmp(arguments.command, "ls")) {
+        ret = do_ls(&img);
+    } else if (!strcmp(arguments.command, "read")) {
+        ret = do_read(&img, arguments.ino);
+    } else if (!strcmp(arguments.command, "write")) {
+        ret = do_write(&img, arguments.ino);
+    } else if (!strcmp(arguments.command, "mkdir")) {
+        ret = do_mkdir(&img, arguments.ino);
+    } else if (!strcmp(arguments.command, "readdir")) {
+        ret = do_readdir(&img, arguments.ino);
+    } else if (!strcmp(arguments.command, "lookup")) {
+        ret = do_lookup(&img, arguments.ino, arguments.name);
+    } else if (!strcmp(arguments.command, "link")) {
+        ret = do_link(&img, arguments.ino, arguments.name, arguments.target);
+    } else if (!strcmp(arguments.command, "unlink")) {
+        ret = do_unlink(&img, arguments.ino, arguments.name);
+    } else if (!strcmp(arguments.command, "trim")) {
+        ret = do_trim(&img);
+    } else {
+        ret = do_rm(&img, arguments.ino);
+    }
+
+    err = wlfs_image_close(&img);
+    if (err) {
+        fprintf(stderr, "Writing a checkpoint to %s failed: %s\n",
+                arguments.image, strerror(-err));
+        if (ret == SUCCESS) {
+            ret = -IMAGE_ERROR;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Helper functions
+ */
+
+enum return_code do_info (struct wlfs_image *img) {
+    struct wlfs_super_meta *meta = &img->meta;
+    struct checkpoint *cp = &img->checkpoint;
+    static char const *const streams[LOG_STREAMS] = {"hot", "cold", "meta"};
+
+    __u32 clean = 0;
+    __u32 i = 0;
+    for (; i < meta->segments; ++i) {
+        clean += img->live[i] == 0;
+    }
+    printf("Block size: %u\n"
+           "Segment size: %u\n"
+           "Segments: %u (%u clean)\n"
+           "Max inodes: %u\n"
+           "Block mapping: %s, depth %hhu\n"
+           "Checksums: %s\n"
+           "Compression: %s\n"
+           "Checkpoint: generation %llu in region %u, mount %u, seq %llu\n",
+           meta->block_size, meta->segment_size, meta->segments, clean,
+           meta->inodes,
+           meta->flags & WLFS_FORMAT_EXTENTS ? "extents" : "tree",
+           meta->indirection,
+           meta->flags & WLFS_FORMAT_CHECKSUMS ? "crc32c" : "none",
+           meta->compression == COMPRESS_LZ4 ? "lz4" : "none",
+           (unsigned long long) cp->generation,
+           img->region, cp->mount, (unsigned long long) cp->seq);
+    unsigned s = 0;
+    for (; s < LOG_STREAMS; ++s) {
+        printf("Log head %s: segment %d, offset %u, next %d\n", streams[s],
+               (int) cp->heads[s].segment, cp->heads[s].offset,
+               (int) cp->heads[s].next);
+    }
+    return SUCCESS;
+}
+
+enum return_code do_ls (struct wlfs_image *img) {
+    struct block *blk = (struct block *) malloc(img->meta.block_size);
+    if (!blk) {
+        return -FILE_ERROR;
+    }
+
+    enum return_code ret = SUCCESS;
+    __u64 ino = 0;
+    for (; ino < img->meta.inodes; ++ino) {
+        if (!wlfs_image_lookup(img, ino)) {
+            continue;
+        }
+        int const err = wlfs_image_read_inode(img, ino, blk);
+        if (err) {
+            fprintf(stderr, "Reading inode %llu failed: %s\n",
+                    (unsigned long long) ino, strerror(-err));
+            ret = -IMAGE_ERROR;
+            continue;
+        }
+        struct wlfs_inode *inode = (struct wlfs_inode *) get_block_data(blk);
+        if (inode->flags & WLFS_INODE_INLINE) {
+            printf("%llu\t%06o\t%llu\tinline\n", (unsigned long long) ino,
+                   inode->mode, (unsigned long long) inode->size);
+        } else if (inode->flags & WLFS_INODE_EXTENTS) {
+            printf("%llu\t%06o\t%llu\textents %hu, depth %hhu\n",
+                   (unsigned long long) ino, inode->mode,
+                   (unsigned long long) inode->size, inode->nextents,
+                   inode->depth);
+        } else {
+            printf("%llu\t%06o\t%llu\ttree\n", (unsigned long long) ino,
+                   inode->mode, (unsigned long long) inode->size);
+        }
+    }
+
+    free(blk);
+    return ret;
+}
+
+enum return_code do_read (struct wlfs_image *img, __u64 ino) {
+    int const err = wlfs_image_read_file(img, ino, STDOUT_FILENO);
+    if (err) {
+        fprintf(stderr, "Reading inode %llu failed: %s\n",
+                (unsigned long long) ino, strerror(-err));
+        return err == -EIO ? -FILE_ERROR : -IMAGE_ERROR;
+    }
+    return SUCCESS;
+}
+
+enum return_code do_write (struct wlfs_image *img, __u64 ino) {
+    int const err = wlfs_image_write_file(img, ino, STDIN_FILENO);
+    if (err) {
+        fprintf(stderr, "Writing inode %llu failed: %s\n",
+                (unsigned long long) ino, strerror(-err));
+        return -FILE_ERROR;
+    }
+    return SUCCESS;
+}
+
+enum return_code do_rm (struct wlfs_image *img, __u64 ino) {
+    int const err = wlfs_image_remove(img, ino);
+    if (err) {
+        fprintf(stderr, "Removing inode %llu failed: %s\n",
+                (unsigned long long) ino, strerror(-err));
+        return -IMAGE_ERROR;
+    }
+    return SUCCESS;
+}
+
+enum return_code do_mkdir (struct wlfs_image *img, __u64 ino) {
+    int const err = wlfs_image_mkdir(img, ino);
+    if (err) {
+        fprintf(stderr, "Creating directory %llu failed: %s\n",
+                (unsigned long long) ino, strerror(-err));
+        return -IMAGE_ERROR;
+    }
+    return SUCCESS;
+}
+
+enum return_code do_readdir (struct wlfs_image *img, __u64 dir) {
+    int const err = wlfs_image_readdir(img, dir, print_entry, NULL);
+    if (err) {
+        fprintf(stderr, "Listing directory %llu failed: %s\n",
+                (unsigned long long) dir, strerror(-err));
+        return -IMAGE_ERROR;
+    }
+    return SUCCESS;
+}
+
+enum return_code do_lookup (struct wlfs_image *img, __u64 dir,
+                            char const *name) {
+    __u64 ino;
+    int const err = wlfs_image_dir_lookup(img, dir, name, &ino);
+    if (err) {
+        fprintf(stderr, "Looking up %s in directory %llu failed: %s\n",
+                name, (unsigned long long) dir, strerror(-err));
+        return -IMAGE_ERROR;
+    }
+    printf("%llu\n", (unsigned long long) ino);
+    return SUCCESS;
+}
+
+enum return_code do_link (struct wlfs_image *img, __u64 dir,
+                          char const *name, __u64 ino) {
+    int const err = wlfs_image_link(img, dir, name, ino);
+    if (err) {
+        fprintf(stderr, "Linking %s in directory %llu failed: %s\n",
+                name, (unsigned long long) dir, strerror(-err));
+        return -IMAGE_ERROR;
+    }
+    return SUCCESS;
+}
+
+enum return_code do_unlink (struct wlfs_image *img, __u64 dir,
+                            char const *name) {
+    int const err = wlfs_image_unlink(img, dir, name);
+    if (err) {
+        fprintf(stderr, "Unlinking %s in directory %llu failed: %s\n",
+                name, (unsigned long long) dir, strerror(-err));
+        return -IMAGE_ERROR;
+    }
+    return SUCCESS;
+}
+
+enum return_code do_trim (struct wlfs_image *img) {
+    __u64 bytes;
+    int const err = wlfs_image_trim(img, &bytes);
+    if (err) {
+        fprintf(stderr, "Discarding clean segments failed: %s\n",
+                strerror(-err));
+        return -IMAGE_ERROR;
+    }
+    printf("Discarded %lluMiB\n", (unsigned long long) bytes >> 20);
+    return SUCCESS;
+}
+
+// Types are printed as the top bits of a mode, e.g. 04 for a directory
+int print_entry (struct wlfs_image *img, struct dir_entry const *entry,
+                 void *arg) {
+    printf("%llu\t%02o\t%.*s\n", (unsigned long long) entry->ino,
+           entry->type, entry->len, entry->name);
+    return 0;
+}
+
+__u64 parse_ino (char *arg, struct argp_state *state) {
+    char *end;
+    __u64 const ino = strtoull(arg, &end, 0);
+    if (*end) {
+        argp_error(state, "Invalid inode number %s", arg);
+    }
+    return ino;
+}
+
+error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    struct arguments *arguments = (struct arguments *) state->input;
+
+    switch (key) {
+    case ARGP_KEY_ARG:
+        if (state->arg_num == 0) {
+            arguments->image = arg;
+        } else if (state->arg_num == 1) {
+            arguments->command = arg;
+        } else if (state->arg_num == 2) {
+            arguments->ino = parse_ino(arg, state);
+            arguments->has_ino = true;
+        } else if (state->arg_num == 3) {
+            arguments->name = arg;
+        } else if (state->arg_num == 4) {
+            arguments->target = parse_ino(arg, state);
+            arguments->has_target = true;
+        } else {
+            argp_usage(state);
+        }
+        break;
+
+    case ARGP_KEY_END:
+        if (state->arg_num < 2) {
+            argp_usage(state);
+        }
+        if (!strcmp(arguments->command, "info") ||
+            !strcmp(arguments->command, "ls") ||
+            !strcmp(arguments->command, "trim")) {
+            if (arguments->has_ino) {
+                argp_usage(state);
+            }
+        } else if (!strcmp(arguments->command, "read") ||
+                   !strcmp(arguments->command, "write") ||
+                   !strcmp(arguments->command, "rm") ||
+                   !strcmp(arguments->command, "mkdir") ||
+                   !strcmp(arguments->command, "readdir")) {
+            if (!arguments->has_ino || arguments->name) {
+                argp_usage(state);
+            }
+        } else if (!strcmp(arguments->command, "lookup") ||
+                   !strcmp(arguments->command, "unlink")) {
+            if (!arguments->name || arguments->has_target) {
+                argp_usage(state);
+            }
+        } else if (!strcmp(arguments->command, "link")) {
+            if (!arguments->has_target) {
+                argp_usage(state);
+            }
+        } else {
+            argp_error(state, "Unknown command %s", arguments->command);
+        }
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
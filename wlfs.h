@@ -6,6 +6,10 @@
 
 #include <linux/types.h>
 
+// Disk address of a block, in blocks from the start of the device; 64 bits
+// wide so a volume's size isn't capped at 2^32 blocks
+typedef __u64 wlfs_daddr_t;
+
 // Fixed constants
 // Unique magic number for this filesystem
 #define WLFS_MAGIC 0x5CA1AB1EUL
@@ -17,6 +21,40 @@
 #define ROOT_INODE_INDEX 1
 // Number of block pointers locally stored in an inode
 #define NBLOCK_PTR (1 << 4)
+// Number of checkpoint regions, written alternately
+#define CHECKPOINT_REGIONS 2
+// Segment number denoting "no segment"
+#define NO_SEGMENT ((__u32) -1)
+// Most blocks an extent covers
+#define MAX_EXTENT_LENGTH ((__u16) -1)
+// Most file blocks compressed together into one cluster
+#define COMPRESS_CLUSTER (1 << 4)
+// Longest name a directory entry holds
+#define WLFS_NAME_LEN 255
+// File blocks of an indexed directory reserved for its header & hash index;
+// its buckets follow them
+#define DIR_INDEX_BLOCKS (1 << 10)
+
+// Format flags (wlfs_super_meta.flags)
+// New inodes map their blocks with extents instead of an indirect block tree
+#define WLFS_FORMAT_EXTENTS (1 << 0)
+// Blocks & segment summaries carry crc32c checksums, checked when read
+#define WLFS_FORMAT_CHECKSUMS (1 << 1)
+
+// Codecs cold file data may be compressed with (wlfs_super_meta.compression)
+enum wlfs_compression {
+    COMPRESS_NONE,
+    // LZ4 block format
+    COMPRESS_LZ4,
+    COMPRESS_CODECS,
+};
+
+// Inode flags (wlfs_inode.flags)
+// The inode maps its blocks with extents
+#define WLFS_INODE_EXTENTS (1 << 0)
+// The file's data is stored in the inode's block in place of a mapping; for
+// a directory, its entries are stored there unindexed
+#define WLFS_INODE_INLINE (1 << 1)
 
 // Default values for format-time adjustable constants
 // Period (seconds) between write buffer flushes
@@ -35,11 +73,41 @@
 #define SEGMENT_SIZE (1 << 20)
 // Default block size: 4 KiB (assumes advanced format block device)
 #define WLFS_BLOCK_SIZE (1 << 12)
+// Largest block size: 64 KiB, so the entries & bytes of a block still fit
+// into 16 bits
+#define WLFS_MAX_BLOCK_SIZE (1 << 16)
+
+// Kinds of blocks which may be written to the log
+enum block_type {
+    BLOCK_FREE,
+    BLOCK_DATA,
+    BLOCK_INODE,
+    BLOCK_INDIRECT,
+    BLOCK_IMAP,
+    BLOCK_SEGMAP,
+    BLOCK_SUMMARY,
+    BLOCK_CHECKPOINT,
+    BLOCK_COMMIT,
+};
+
+// Log streams, each with its own head filling its own segments, so blocks
+// with similar lifetimes end up in the same segments
+enum log_stream {
+    // Data blocks which are overwritten often
+    STREAM_HOT,
+    // Data blocks written once, & blocks relocated by the cleaner
+    STREAM_COLD,
+    // Inodes, indirect blocks & map blocks
+    STREAM_META,
+    LOG_STREAMS,
+};
 
 struct header {
     __kernel_time_t wtime;
     // Incremented when the file is deleted/trunctated
     __u8 version;
+    // crc32c of the whole block, taken with both headers' checksums zeroed
+    __u32 csum;
 };
 
 // This is basically a block header; there's always one at the head of a
@@ -48,24 +116,191 @@ struct block {
     // Two headers, in case of mid-update crashes
     struct header h0;
     struct header h1;
+    // Monotonic time (ns) the block was appended at; orders copies of a
+    // block appended concurrently to different streams by one mount
+    __u64 stamp;
     // Could be inode #, or map block #
     __u64 index;
+    // Logical block # within the owning inode (data & indirect blocks only)
+    __u32 offset;
+    // One of enum block_type
+    __u8 type;
+};
+
+// Payload of the summary block which heads every partial segment; a partial
+// segment is the run of blocks written by a single segment buffer flush
+struct segment_summary {
+    // Sequence number of this partial segment within the log; numbers are
+    // shared by all streams, so they order partial segments across streams
+    __u64 seq;
+    // Mount which wrote the partial segment
+    __u32 mount;
+    // Segment the stream continues into once this one is full
+    __u32 next;
+    // Number of blocks following the summary block
+    __u32 nblocks;
+    // One of enum log_stream
+    __u8 stream;
+    // crc32c of the checksums of the blocks following the summary, in
+    // order; catches blocks left over from an earlier pass of the log,
+    // which are intact on their own
+    __u32 csum;
+};
+
+// Payload of a commit block.  Whenever file mappings are written back,
+// commit blocks follow their inodes in the same partial segment, listing the
+// blocks the new mappings took up & released since the last ones were
+// written, so rolling forward keeps segment usage in step with the inodes
+// replayed.  Commit blocks are never live themselves; a checkpoint
+// supersedes them, & their offset numbers them within their batch
+struct commit_record {
+    // Of the addresses following, the first nlive became live & the next
+    // ndead died
+    __u32 nlive;
+    __u32 ndead;
+    wlfs_daddr_t daddrs[0];
+};
+
+// Position of a log head
+struct log_position {
+    // Segment being filled, its next free block, & the segment reserved to
+    // follow it
+    __u32 segment;
+    __u32 offset;
+    __u32 next;
 };
 
+// Payload of the first block of a checkpoint region; it's followed by blocks
+// of imap block addresses, then blocks of segmap block addresses.  Every
+// block of the region is stamped with the same headers, so a region is only
+// valid if all of its blocks were written by the same checkpoint
+struct checkpoint {
+    // Incremented by every checkpoint; the region holding the highest valid
+    // generation is the most recent
+    __u64 generation;
+    // Sequence number of the first partial segment written after it
+    __u64 seq;
+    // Incremented by every mount, which writes a checkpoint before anything
+    // else; only partial segments written by the same mount are replayed
+    __u32 mount;
+    // Head of each log stream
+    struct log_position heads[LOG_STREAMS];
+};
+
+// A run of file blocks stored at consecutive disk addresses.  The log
+// writes a file's blocks contiguously within a segment, so a large
+// sequential file needs about one extent per segment.  In an extent block,
+// or an inode whose extent tree is deeper than 0, each entry instead covers
+// the blocks from its offset up to the next entry's, & points at the extent
+// block below it holding <length> entries
+struct extent {
+    // Logical block # of the first block in the run
+    __u32 offset;
+    __u16 length;
+    // If nonzero, the run is a compressed cluster of at most
+    // COMPRESS_CLUSTER blocks, stored in this many consecutive blocks
+    __u16 stored;
+    // Disk address of the first block in the run
+    wlfs_daddr_t daddr;
+};
+
+// Payload of the blocks of a compressed cluster, taken together.  Each of
+// them is a data block whose offset is the cluster's first block, & the
+// cluster's blocks, zero-padded to whole blocks, decompress to exactly
+// <length> blocks' worth of data
+struct compressed_cluster {
+    // Bytes of compressed data following the header
+    __u32 bytes;
+    __u8 data[0];
+};
+
+// Payload of an inode block
+struct wlfs_inode {
+    __u64 size;
+    __kernel_time_t atime;
+    __kernel_time_t mtime;
+    __kernel_time_t ctime;
+    __u32 mode;
+    __u32 uid;
+    __u32 gid;
+    __u32 nlink;
+    // Any of WLFS_INODE_*
+    __u8 flags;
+    // Levels of extent blocks between the inode & its data blocks
+    __u8 depth;
+    // Number of extents in use in the inode
+    __u16 nextents;
+    union {
+        // Direct block pointers, followed by the root of each level of the
+        // indirect block tree
+        wlfs_daddr_t blocks[NBLOCK_PTR];
+        // Extents sorted by offset, filling the rest of the block
+        struct extent extents[0];
+        // Inline file data, filling the rest of the block
+        __u8 data[0];
+    };
+};
+
+// A directory entry.  Entries are packed one after another, each padded
+// to DIR_ENTRY_SIZE(len) bytes
+struct dir_entry {
+    __u64 ino;
+    // get_dir_hash of the name, so buckets split without rehashing
+    __u32 hash;
+    __u8 len;
+    // File type, as in the top bits of the inode's mode
+    __u8 type;
+    char name[0];
+};
+
+#define DIR_ENTRY_SIZE(len) \
+    ((sizeof(struct dir_entry) + (len) + 7) & ~(__u32) 7)
+
+// A directory starts out with its entries inline in its inode's block, &
+// is indexed once they outgrow it.  An indexed directory is an extendible
+// hash table: the low <depth> bits of a name's hash select a slot of the
+// index, which holds the number of the bucket the name is in.  The index
+// follows this header in the directory's first blocks, & bucket n is file
+// block DIR_INDEX_BLOCKS + n.  A full bucket is split in two, doubling the
+// index if it is the only bucket its slots point at, so a lookup reads the
+// header, at most one index block & one bucket however large the directory
+struct dir_header {
+    __u32 depth;
+    __u32 nbuckets;
+    __u32 index[0];
+};
+
+// Payload of a bucket: its entries follow this header
+struct dir_bucket {
+    // The bucket holds the names whose hashes' low <depth> bits match those
+    // of the slots pointing at it
+    __u32 depth;
+    // Bytes of entries
+    __u32 bytes;
+};
+
+struct imap_shard;
+
 struct inode_map {
+    // Map blocks, allocated when first needed & published with RCU, so
+    // lookups never take a lock; NULL if no inode in the block was written
     struct block **blocks;
+    // Disk address of each map block, 0 if never written
+    wlfs_daddr_t *daddrs;
+    // Locks serializing updates to the entries
+    struct imap_shard *shards;
     __u32 nblocks;
     __u16 entries;
 };
 
 struct segment {
-    struct segment *prev;
-    struct segment *next;
     struct block *block;
+    // Disk address of the map block, 0 if never written
+    wlfs_daddr_t daddr;
 };
 
 struct segment_map {
-    // Doubly linked list of segment map blocks
+    // Segment map blocks, indexed by block number
     struct segment *blocks;
     // Number of segment map blocks
     __u32 nblocks;
@@ -73,10 +308,15 @@ struct segment_map {
     __u16 entries;
     // Bits per segment usage bitmap = # blocks/segment
     __u32 bits;
+    // Number of live blocks in each segment, kept in step with the bitmaps
+    __u16 *live;
+    // Time (seconds) a live block was last written to each segment, 0 if
+    // unknown since mount
+    __u32 *wtime;
 };
 
 struct wlfs_super_meta {
-    __u16 block_size;
+    __u32 block_size;
     __u16 checkpoint_blocks;
     __u32 inodes;
     __u32 magic;
@@ -84,7 +324,16 @@ struct wlfs_super_meta {
     __u32 segments;
     __u8 buffer_period;
     __u8 checkpoint_period;
+    // Depth of the indirect block tree, or the maximum depth of an extent
+    // tree
     __u8 indirection;
     __u8 min_clean_segs;
     __u8 target_clean_segs;
+    // Any of WLFS_FORMAT_*
+    __u8 flags;
+    // One of enum wlfs_compression; only extent-mapped files are compressed
+    __u8 compression;
+    // Blocks left unused between the checkpoint regions & the first segment,
+    // so segments start on the device's erase block boundaries
+    __u32 segment_pad;
 };